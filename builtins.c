@@ -1,14 +1,56 @@
+#define _GNU_SOURCE  // pipe2()
 #include "object.h"
 #include "value.h"
 #include "builtins.h"
+#include "channel.h"
+#include "clone.h"
+#include "isolate.h"
+#include "loop.h"
+#include "memory.h"
+#include "vm.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
+
+/** Most bytes one read() returns */
+#define READ_MAX (1 << 20)
 
 static value native_abs(int argc, value *args)
 {
     (void)argc;
-    return NUMBER_VAL(fabs(AS_NUMBER(args[0])));
+    if (IS_INT(args[0]) && AS_INT(args[0]) != INT_VALUE_MIN) {
+        return INT_VAL(AS_INT(args[0]) < 0 ? -AS_INT(args[0]) : AS_INT(args[0]));
+    }
+    return NUMBER_VAL(fabs(AS_DOUBLE(args[0])));
+}
+
+/* Natives have no way to raise an error, so the concurrency ones below
+ * answer arguments they cannot use with nil or false
+ */
+
+/** channel(capacity): a channel holding up to @p capacity messages, 1 if left out */
+static value native_channel(int argc, value *args)
+{
+    int64_t capacity = 1;
+    if (argc > 0) {
+        if (!IS_INT(args[0]) || AS_INT(args[0]) < 1) {
+            return NIL_VAL;
+        }
+        capacity = AS_INT(args[0]);
+    }
+    struct channel *channel = channel_new((size_t)capacity);
+    if (channel == NULL) {
+        return NIL_VAL;
+    }
+    struct object_channel *object = object_channel_new(channel);
+    channel_release(channel);
+    return OBJECT_VAL(object);
 }
 
 static value native_clock(int argc, value *args)
@@ -18,47 +60,337 @@ static value native_clock(int argc, value *args)
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+/** close(channel) or close(fd): false if the argument is neither, or the descriptor won't close */
+static value native_close(int argc, value *args)
+{
+    if (argc == 1 && IS_INT(args[0])) {
+        if (AS_INT(args[0]) < 0 || AS_INT(args[0]) > INT_MAX) {
+            return BOOL_VAL(false);
+        }
+        int fd = (int)AS_INT(args[0]);
+        // Coroutines waiting on it are over; wait() hands them back
+        if (gc_vm->loop != NULL) {
+            loop_closing(gc_vm->loop, fd);
+        }
+        return BOOL_VAL(close(fd) == 0);
+    }
+    if (argc != 1 || !IS_CHANNEL(args[0])) {
+        return BOOL_VAL(false);
+    }
+    channel_close(AS_CHANNEL(args[0]));
+    return BOOL_VAL(true);
+}
+
+/** coroutine(f): a coroutine that calls @p f, a function of at most one argument, when first resumed */
+static value native_coroutine(int argc, value *args)
+{
+    if (argc != 1 || !IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+        return NIL_VAL;
+    }
+    return OBJECT_VAL(object_coroutine_new(AS_CLOSURE(args[0])));
+}
+
+/** done(co): true once @p co has returned, or was stopped by an error, and can't be resumed */
+static value native_done(int argc, value *args)
+{
+    if (argc != 1 || !IS_COROUTINE(args[0])) {
+        return NIL_VAL;
+    }
+    return BOOL_VAL(AS_COROUTINE(args[0])->state == COROUTINE_DONE);
+}
+
 static value native_max(int argc, value *args)
 {
-    double maximum = __DBL_MIN__;
+    value maximum = NUMBER_VAL(__DBL_MIN__);
     for (value *arg = args; argc-- > 0; arg++) {
-        double v = AS_NUMBER(*arg);
-        if (v > maximum) {
-            maximum = v;
+        if (AS_DOUBLE(*arg) > AS_DOUBLE(maximum)) {
+            maximum = *arg;
         }
     }
-    return NUMBER_VAL(maximum);
+    return maximum;
 }
 
 static value native_min(int argc, value *args)
 {
-    double minimum = __DBL_MAX__;
+    value minimum = NUMBER_VAL(__DBL_MAX__);
     for (value *arg = args; argc-- > 0; arg++) {
-        double v = AS_NUMBER(*arg);
-        if (v < minimum) {
-            minimum = v;
+        if (AS_DOUBLE(*arg) < AS_DOUBLE(minimum)) {
+            minimum = *arg;
         }
     }
-    return NUMBER_VAL(minimum);
+    return minimum;
+}
+
+/** recv(channel): the next value sent on @p channel, nil once it is closed and drained */
+static value native_recv(int argc, value *args)
+{
+    struct message message;
+    if (argc != 1 || !IS_CHANNEL(args[0]) || !channel_recv(AS_CHANNEL(args[0]), &message)) {
+        return NIL_VAL;
+    }
+    clone_read(gc_vm, &message);
+    message_free(&message);
+    return *--gc_vm->sp;
+}
+
+/* I/O on file descriptors.  Descriptors are plain integers and are
+ * non-blocking: read() and write() answer nil rather than wait, and
+ * readable(), writable() and sleep() do the waiting.  Inside a coroutine
+ * those register with the VM's event loop, see loop.h, and suspend the
+ * coroutine, so the script can go on with others; wait() hands back each
+ * one when its wait is over, for the script to resume.  Outside a
+ * coroutine there is nothing else to run, so they block.
+ */
+
+static bool get_fd(value v, int *fd)
+{
+    if (!IS_INT(v) || AS_INT(v) < 0 || AS_INT(v) > INT_MAX) {
+        return false;
+    }
+    *fd = (int)AS_INT(v);
+    return true;
+}
+
+/** A table holding the two ends of a pipe or socket pair at 0 and 1 */
+static value fd_pair(int fds[2])
+{
+    struct object_table *pair = object_table_new();
+    // Keep the table reachable while it grows and may collect
+    *gc_vm->sp++ = OBJECT_VAL(pair);
+    table_set(&pair->table, INT_VAL(0), INT_VAL(fds[0]));
+    table_set(&pair->table, INT_VAL(1), INT_VAL(fds[1]));
+    gc_vm->sp--;
+    return OBJECT_VAL(pair);
+}
+
+/** pipe(): a table with the read end of a new pipe at 0 and the write end at 1, nil if there is none */
+static value native_pipe(int argc, value *args)
+{
+    (void)argc;
+    (void)args;
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        return NIL_VAL;
+    }
+    return fd_pair(fds);
+}
+
+/** socketpair(): a table with the two ends of a new Unix stream socket pair at 0 and 1, nil if there is none */
+static value native_socketpair(int argc, value *args)
+{
+    (void)argc;
+    (void)args;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0) {
+        return NIL_VAL;
+    }
+    return fd_pair(fds);
+}
+
+/** read(fd, max): up to @p max bytes, 4096 if left out, from @p fd; "" at end of file, nil if there are none yet */
+static value native_read(int argc, value *args)
+{
+    int fd;
+    int64_t max = 4096;
+    if (argc < 1 || argc > 2 || !get_fd(args[0], &fd)) {
+        return NIL_VAL;
+    }
+    if (argc == 2) {
+        if (!IS_INT(args[1]) || AS_INT(args[1]) < 1) {
+            return NIL_VAL;
+        }
+        max = AS_INT(args[1]) < READ_MAX ? AS_INT(args[1]) : READ_MAX;
+    }
+    char *buffer = malloc((size_t)max);
+    if (buffer == NULL) {
+        return NIL_VAL;
+    }
+    ssize_t n;
+    do {
+        n = read(fd, buffer, (size_t)max);
+    } while (n < 0 && errno == EINTR);
+    value result = (n < 0) ? NIL_VAL : OBJECT_VAL(object_string_allocate(buffer, (size_t)n));
+    free(buffer);
+    return result;
+}
+
+/** write(fd, string): the number of bytes of @p string written to @p fd, nil if none could be */
+static value native_write(int argc, value *args)
+{
+    int fd;
+    if (argc != 2 || !get_fd(args[0], &fd) || !IS_STRING(args[1])) {
+        return NIL_VAL;
+    }
+    struct object_string *string = AS_STRING(args[1]);
+    ssize_t n;
+    do {
+        n = write(fd, string->data, string->length);
+    } while (n < 0 && errno == EINTR);
+    return (n < 0) ? NIL_VAL : INT_VAL(n);
+}
+
+/** The VM's event loop, made on first use */
+static struct loop *vm_loop(void)
+{
+    if (gc_vm->loop == NULL) {
+        gc_vm->loop = loop_new();
+    }
+    return gc_vm->loop;
+}
+
+/** Suspend the running coroutine, which has just been registered with the loop, until wait() hands it back */
+static value park(struct object_coroutine *coroutine)
+{
+    table_set(&gc_vm->waiting, OBJECT_VAL(coroutine), BOOL_VAL(true));
+    vm_suspend(gc_vm);
+    return NIL_VAL;
+}
+
+static value wait_fd(int argc, value *args, enum loop_event events)
+{
+    int fd;
+    if (argc != 1 || !get_fd(args[0], &fd)) {
+        return BOOL_VAL(false);
+    }
+    struct object_coroutine *coroutine = gc_vm->coroutine;
+    if (coroutine == NULL) {
+        struct pollfd p = {.fd = fd, .events = (events == LOOP_READABLE) ? POLLIN : POLLOUT};
+        while (poll(&p, 1, -1) < 0) {
+            if (errno != EINTR) {
+                return BOOL_VAL(false);
+            }
+        }
+        return BOOL_VAL(!(p.revents & POLLNVAL));
+    }
+    struct loop *loop = vm_loop();
+    if (loop == NULL || !loop_watch(loop, fd, events, coroutine)) {
+        return BOOL_VAL(false);
+    }
+    return park(coroutine);
+}
+
+/**
+ * readable(fd): wait until @p fd can be read without blocking, or is at its end
+ *
+ * False if it can't be waited on.  Otherwise true outside a coroutine, and
+ * inside one the value it is next resumed with.
+ */
+static value native_readable(int argc, value *args)
+{
+    return wait_fd(argc, args, LOOP_READABLE);
+}
+
+/** writable(fd): wait until @p fd can be written without blocking, like readable() */
+static value native_writable(int argc, value *args)
+{
+    return wait_fd(argc, args, LOOP_WRITABLE);
+}
+
+/** sleep(ms): wait for @p ms milliseconds, like readable() */
+static value native_sleep(int argc, value *args)
+{
+    if (argc != 1 || !IS_NUMERIC(args[0])) {
+        return BOOL_VAL(false);
+    }
+    double ms = AS_DOUBLE(args[0]);
+    ms = (ms > 0) ? ms : 0;
+    struct object_coroutine *coroutine = gc_vm->coroutine;
+    if (coroutine == NULL) {
+        struct timespec duration = {.tv_sec = (time_t)(ms / 1000), .tv_nsec = (long)(fmod(ms, 1000) * 1000000)};
+        while (nanosleep(&duration, &duration) != 0 && errno == EINTR) {
+        }
+        return BOOL_VAL(true);
+    }
+    struct loop *loop = vm_loop();
+    if (loop == NULL || !loop_after(loop, (int64_t)ceil(ms), coroutine)) {
+        return BOOL_VAL(false);
+    }
+    return park(coroutine);
+}
+
+/**
+ * wait(ms): the next coroutine whose wait is over, waiting up to @p ms
+ * milliseconds for one, or as long as it takes if left out
+ *
+ * Nil if none is ready in time or none is waiting.
+ */
+static value native_wait(int argc, value *args)
+{
+    int timeout = -1;
+    if (argc > 0) {
+        if (!IS_NUMERIC(args[0]) || AS_DOUBLE(args[0]) < 0) {
+            return NIL_VAL;
+        }
+        timeout = AS_DOUBLE(args[0]) < INT_MAX ? (int)ceil(AS_DOUBLE(args[0])) : INT_MAX;
+    }
+    if (gc_vm->loop == NULL) {
+        return NIL_VAL;
+    }
+    // Skipping a coroutine that is done doesn't start the timeout over
+    int64_t deadline = (timeout < 0) ? -1 : loop_now() + (int64_t)timeout * 1000;  // NOLINT(readability-magic-numbers)
+    struct object_coroutine *coroutine;
+    while ((coroutine = loop_next_until(gc_vm->loop, deadline)) != NULL) {
+        table_delete(&gc_vm->waiting, OBJECT_VAL(coroutine));
+        // One stopped by an error since it started waiting can't be resumed
+        if (coroutine->state != COROUTINE_DONE) {
+            return OBJECT_VAL(coroutine);
+        }
+    }
+    return NIL_VAL;
 }
 
 static value native_round(int argc, value *args)
 {
     (void)argc;
+    if (IS_INT(args[0])) {
+        return args[0];
+    }
     return NUMBER_VAL(round(AS_NUMBER(args[0])));
 }
 
+/** send(channel, value): send a clone of @p value, false if it cannot be cloned or @p channel is closed */
+static value native_send(int argc, value *args)
+{
+    if (argc != 2 || !IS_CHANNEL(args[0])) {
+        return BOOL_VAL(false);
+    }
+    struct message message;
+    message_init(&message);
+    if (!clone_write(&message, 1, &args[1]) || !channel_send(AS_CHANNEL(args[0]), &message)) {
+        message_free(&message);
+        return BOOL_VAL(false);
+    }
+    return BOOL_VAL(true);
+}
+
+/** spawn(function, args...): call @p function with @p args in an isolate, see isolate.h */
+static value native_spawn(int argc, value *args)
+{
+    if (argc < 1) {
+        return BOOL_VAL(false);
+    }
+    return BOOL_VAL(isolate_spawn(gc_vm, args[0], argc - 1, args + 1));
+}
+
 static value native_sqrt(int argc, value *args)
 {
     (void)argc;
-    return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+    return NUMBER_VAL(sqrt(AS_DOUBLE(args[0])));
 }
 
 static value native_sum(int argc, value *args)
 {
+    // Integer arguments sum to an integer, unless a double is involved or the total overflows
+    int64_t isum = 0;
     double sum = 0;
-    for (value *arg = args; argc-- > 0; arg++) { sum += AS_NUMBER(*arg); }
-    return NUMBER_VAL(sum);
+    bool integral = argc > 0;
+    for (value *arg = args; argc-- > 0; arg++) {
+        sum += AS_DOUBLE(*arg);
+        if (integral && (!IS_INT(*arg) || __builtin_add_overflow(isum, AS_INT(*arg), &isum) || !int_fits(isum))) {
+            integral = false;
+        }
+    }
+    return integral ? INT_VAL(isum) : NUMBER_VAL(sum);
 }
 
 static value native_table(int argc, value *args)
@@ -70,13 +402,28 @@ static value native_table(int argc, value *args)
 }
 
 struct builtin_function_info builtins[] = {
-    {"abs",   native_abs  },
-    {"clock", native_clock},
-    {"max",   native_max  },
-    {"min",   native_min  },
-    {"round", native_round},
-    {"sqrt",  native_sqrt },
-    {"sum",   native_sum  },
-    {"table", native_table},
-    {NULL,    NULL        },
+    {"abs",        native_abs       },
+    {"channel",    native_channel   },
+    {"clock",      native_clock     },
+    {"close",      native_close     },
+    {"coroutine",  native_coroutine },
+    {"done",       native_done      },
+    {"max",        native_max       },
+    {"min",        native_min       },
+    {"pipe",       native_pipe      },
+    {"read",       native_read      },
+    {"readable",   native_readable  },
+    {"recv",       native_recv      },
+    {"round",      native_round     },
+    {"send",       native_send      },
+    {"sleep",      native_sleep     },
+    {"socketpair", native_socketpair},
+    {"spawn",      native_spawn     },
+    {"sqrt",       native_sqrt      },
+    {"sum",        native_sum       },
+    {"table",      native_table     },
+    {"wait",       native_wait      },
+    {"writable",   native_writable  },
+    {"write",      native_write     },
+    {NULL,         NULL             },
 };
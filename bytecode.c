@@ -0,0 +1,800 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "util.h"
+#include "value.h"
+#include "vm.h"
+
+/** Name length written for the unnamed top-level function */
+#define NO_NAME UINT32_MAX
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/** Bytes in the header this version writes, and in the fixed part every version starts with */
+#define HEADER_SIZE       24
+#define HEADER_FIXED_SIZE 8
+
+/** Offset of the source hash, for headers at least this long */
+#define HEADER_SOURCE_HASH 16
+
+#define WRITE_BUFFER_MIN_SIZE 4096
+
+enum constant_tag {
+    TAG_NIL,
+    TAG_FALSE,
+    TAG_TRUE,
+    TAG_NUMBER,
+    TAG_INT,
+    TAG_STRING,
+    TAG_FUNCTION,
+};
+
+/* The whole file is built in memory, so function sizes can be filled in
+ * after their bodies are written
+ */
+struct writer {
+    struct vm *vm;
+    uint8_t *data;
+    size_t used;
+    size_t capacity;
+    bool error;
+};
+
+struct reader {
+    const uint8_t *p;
+    const uint8_t *end;
+    const char *error;  // first problem found, NULL while the input is good
+};
+
+/*
+ * A loaded bytecode file
+ *
+ * Function code and line tables point into data, so it lives as long as
+ * the VM.  Mapped files are private and writable: pages are shared with
+ * every other process running the same file until quickening or global
+ * rebinding writes to them.
+ */
+struct bytecode_image {
+    struct bytecode_image *next;
+    uint8_t *data;
+    size_t size;
+    bool mapped;   // data is an mmap() of the file rather than a copy
+    int *globals;  // VM slot for each global slot in the file
+    int nglobals;
+    bool rebind;  // some global slots differ from the VM's, so code using them is rewritten
+};
+
+static void put_bytes(struct writer *w, const void *bytes, size_t count)
+{
+    if (w->used + count > w->capacity) {
+        size_t capacity = MAX(w->capacity * 2, MAX(w->used + count, WRITE_BUFFER_MIN_SIZE));
+        // Plain realloc: a collection now could free the function being written
+        uint8_t *data = realloc(w->data, capacity);
+        if (data == NULL) {
+            w->error = true;
+            return;
+        }
+        w->data = data;
+        w->capacity = capacity;
+    }
+    memcpy(&w->data[w->used], bytes, count);
+    w->used += count;
+}
+
+static void put_u8(struct writer *w, uint8_t u)
+{
+    put_bytes(w, &u, 1);
+}
+
+static void put_u16(struct writer *w, uint16_t u)
+{
+    uint8_t bytes[] = {U16LSB(u), U16MSB(u)};
+    put_bytes(w, bytes, sizeof(bytes));
+}
+
+static void encode_u32(uint8_t *bytes, uint32_t u)
+{
+    for (size_t i = 0; i < sizeof(u); i++) { bytes[i] = (uint8_t)(u >> (8 * i)); }  // NOLINT(readability-magic-numbers)
+}
+
+static void put_u32(struct writer *w, uint32_t u)
+{
+    uint8_t bytes[sizeof(u)];
+    encode_u32(bytes, u);
+    put_bytes(w, bytes, sizeof(bytes));
+}
+
+static void put_u64(struct writer *w, uint64_t u)
+{
+    uint8_t bytes[sizeof(u)];
+    for (size_t i = 0; i < sizeof(u); i++) { bytes[i] = (uint8_t)(u >> (8 * i)); }  // NOLINT(readability-magic-numbers)
+    put_bytes(w, bytes, sizeof(bytes));
+}
+
+static void put_string(struct writer *w, struct object_string *s)
+{
+    if (s == NULL) {
+        put_u32(w, NO_NAME);
+        return;
+    }
+    put_u32(w, (uint32_t)s->length);
+    put_bytes(w, s->data, s->length);
+}
+
+static void put_lines(struct writer *w, struct chunk *chunk)
+{
+    if (chunk->borrowed) {
+        // Loaded from an image, so the table is already in the file's format
+        put_u32(w, (uint32_t)chunk->nline_runs);
+        put_bytes(w, chunk->line_runs, (size_t)chunk->nline_runs * 2 * sizeof(uint32_t));
+        return;
+    }
+
+    uint32_t nruns = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        if (i == 0 || chunk->lines[i] != chunk->lines[i - 1]) {
+            nruns++;
+        }
+    }
+    put_u32(w, nruns);
+
+    int start = 0;
+    for (int i = 1; i <= chunk->count; i++) {
+        if (i == chunk->count || chunk->lines[i] != chunk->lines[start]) {
+            put_u32(w, (uint32_t)chunk->lines[start]);
+            put_u32(w, (uint32_t)(i - start));
+            start = i;
+        }
+    }
+}
+
+static void write_function(struct writer *w, struct object_function *function);
+
+static void write_constant(struct writer *w, value v)
+{
+    switch (value_type(v)) {
+        case VAL_NIL:
+            put_u8(w, TAG_NIL);
+            break;
+        case VAL_BOOL:
+            put_u8(w, AS_BOOL(v) ? TAG_TRUE : TAG_FALSE);
+            break;
+        case VAL_NUMBER: {
+            double d = AS_NUMBER(v);
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            put_u8(w, TAG_NUMBER);
+            put_u64(w, bits);
+            break;
+        }
+        case VAL_INT:
+            put_u8(w, TAG_INT);
+            put_u64(w, (uint64_t)AS_INT(v));
+            break;
+        case VAL_OBJECT:
+            if (IS_STRING(v)) {
+                put_u8(w, TAG_STRING);
+                put_string(w, AS_STRING(v));
+            } else if (IS_FUNCTION(v)) {
+                put_u8(w, TAG_FUNCTION);
+                write_function(w, AS_FUNCTION(v));
+            } else {
+                // the compiler never puts any other object in a chunk
+                w->error = true;
+            }
+            break;
+        case VAL_EMPTY:
+            w->error = true;
+            break;
+    }
+}
+
+/*
+ * A function is written as
+ *
+ *   name:       u32 length (NO_NAME for the script), then the bytes
+ *   u32 arity, u32 upvalue count
+ *   u32 size of the rest of the function, so loading can skip it:
+ *   code:       u32 length, then the bytes
+ *   lines:      u32 run count, then a u32 line and u32 length for each run
+ *   constants:  u32 count, then a u8 tag and its payload for each
+ *   caches:     u32 count, then the u32 offset of each cached instruction
+ *
+ * Upvalue descriptors are part of the OP_CLOSURE instruction in the code.
+ */
+// NOLINTNEXTLINE(misc-no-recursion)
+static void write_function(struct writer *w, struct object_function *function)
+{
+    struct chunk *chunk = &function->chunk;
+    const char *error;
+    if (function->unloaded != NULL && !bytecode_materialize(w->vm, function, &error)) {
+        w->error = true;
+        return;
+    }
+
+    put_string(w, function->name);
+    put_u32(w, (uint32_t)function->arity);
+    put_u32(w, (uint32_t)function->nupvalues);
+    size_t size_offset = w->used;
+    put_u32(w, 0);
+
+    put_u32(w, (uint32_t)chunk->count);
+    put_bytes(w, chunk->code, chunk->count);
+    put_lines(w, chunk);
+
+    put_u32(w, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) { write_constant(w, chunk->constants.values[i]); }
+
+    put_u32(w, (uint32_t)chunk->ncaches);
+    for (int i = 0; i < chunk->ncaches; i++) { put_u32(w, (uint32_t)chunk->caches[i].offset); }
+
+    if (!w->error) {
+        encode_u32(&w->data[size_offset], (uint32_t)(w->used - size_offset - sizeof(uint32_t)));
+    }
+}
+
+int bytecode_write(struct vm *vm, struct object_function *function, uint64_t source_hash, FILE *f)
+{
+    struct writer w = {.vm = vm, .data = NULL, .used = 0, .capacity = 0, .error = false};
+
+    put_u32(&w, BYTECODE_MAGIC);
+    put_u8(&w, BYTECODE_VERSION_MAJOR);
+    put_u8(&w, BYTECODE_VERSION_MINOR);
+    put_u16(&w, HEADER_SIZE);
+    put_u64(&w, (uint64_t)time(NULL));
+    put_u64(&w, source_hash);
+
+    put_u32(&w, (uint32_t)vm->global_names.count);
+    for (int i = 0; i < vm->global_names.count; i++) { put_string(&w, AS_STRING(vm->global_names.values[i])); }
+
+    write_function(&w, function);
+    if (!w.error && fwrite(w.data, 1, w.used, f) != w.used) {
+        w.error = true;
+    }
+    free(w.data);
+    return w.error ? -1 : 0;
+}
+
+static bool fail(struct reader *r, const char *error)
+{
+    if (r->error == NULL) {
+        r->error = error;
+    }
+    return false;
+}
+
+static const uint8_t *get_bytes(struct reader *r, size_t count)
+{
+    if (r->error != NULL || (size_t)(r->end - r->p) < count) {
+        fail(r, "unexpected end of file");
+        return NULL;
+    }
+    const uint8_t *bytes = r->p;
+    r->p += count;
+    return bytes;
+}
+
+static uint8_t get_u8(struct reader *r)
+{
+    const uint8_t *b = get_bytes(r, 1);
+    return (b == NULL) ? 0 : b[0];
+}
+
+static uint16_t get_u16(struct reader *r)
+{
+    const uint8_t *b = get_bytes(r, 2);
+    return (b == NULL) ? 0 : (uint16_t)(b[0] | (b[1] << 8));  // NOLINT(readability-magic-numbers)
+}
+
+static uint32_t get_u32(struct reader *r)
+{
+    const uint8_t *b = get_bytes(r, sizeof(uint32_t));
+    uint32_t u = 0;
+    for (size_t i = 0; b != NULL && i < sizeof(u); i++) { u |= (uint32_t)b[i] << (8 * i); }  // NOLINT
+    return u;
+}
+
+static uint64_t get_u64(struct reader *r)
+{
+    const uint8_t *b = get_bytes(r, sizeof(uint64_t));
+    uint64_t u = 0;
+    for (size_t i = 0; b != NULL && i < sizeof(u); i++) { u |= (uint64_t)b[i] << (8 * i); }  // NOLINT
+    return u;
+}
+
+/**
+ * A count of items that are each at least @p item_size bytes, rejected if
+ * the rest of the file is too short to hold them
+ */
+static int get_count(struct reader *r, size_t item_size)
+{
+    uint32_t count = get_u32(r);
+    if (count > INT32_MAX || (size_t)(r->end - r->p) / item_size < count) {
+        fail(r, "unexpected end of file");
+        return 0;
+    }
+    return (int)count;
+}
+
+/** @return NULL for NO_NAME, and on error */
+static struct object_string *get_string(struct reader *r)
+{
+    uint32_t length = get_u32(r);
+    if (length == NO_NAME) {
+        return NULL;
+    }
+    const uint8_t *data = get_bytes(r, length);
+    return (data == NULL) ? NULL : object_string_allocate((const char *)data, length);
+}
+
+static bool is_string_constant(struct chunk *chunk, uint8_t index)
+{
+    return index < chunk->constants.count && IS_STRING(chunk->constants.values[index]);
+}
+
+static bool is_cache(struct chunk *chunk, size_t offset)
+{
+    return (chunk->code[offset] | (chunk->code[offset + 1] << 8)) < chunk->ncaches;  // NOLINT
+}
+
+/**
+ * Check the operands of every instruction in @p function, rebind its
+ * global slots to the VM's and work out the stack a call needs
+ */
+static bool link_function(struct reader *r, struct bytecode_image *image, struct object_function *function)
+{
+    struct chunk *chunk = &function->chunk;
+    size_t count = (size_t)chunk->count;
+    uint8_t *code = chunk->code;
+    int highest_slot = 0;  // highest local slot or captured local used
+    uint8_t last = OP_COUNT;
+
+    for (size_t offset = 0; offset < count;) {
+        uint8_t op = code[offset];
+        if (op >= OP_COUNT) {
+            return fail(r, "unknown opcode");
+        }
+        if (op == OP_CLOSURE) {
+            if (offset + 1 >= count || code[offset + 1] >= chunk->constants.count ||
+                !IS_FUNCTION(chunk->constants.values[code[offset + 1]])) {
+                return fail(r, "closure of a constant that is not a function");
+            }
+        }
+
+        size_t length = instruction_length(chunk, offset);
+        if (offset + length > count) {
+            return fail(r, "instruction runs past the end of its function");
+        }
+
+        bool ok = true;
+        switch (op) {
+            case OP_CONSTANT:
+                ok = code[offset + 1] < chunk->constants.count;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_CLASS:
+            case OP_METHOD:
+            case OP_GET_SUPER:
+                ok = is_string_constant(chunk, code[offset + 1]);
+                break;
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+                ok = is_string_constant(chunk, code[offset + 1]) && is_cache(chunk, offset + 2);
+                break;
+            case OP_INVOKE:
+            case OP_SUPER_INVOKE:
+                ok = is_string_constant(chunk, code[offset + 1]) && is_cache(chunk, offset + 3);
+                break;
+            case OP_GET_LOCAL_PROPERTY:
+                highest_slot = MAX(highest_slot, code[offset + 1]);
+                ok = is_string_constant(chunk, code[offset + 2]) && is_cache(chunk, offset + 3);
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_POP:
+                highest_slot = MAX(highest_slot, code[offset + 1]);
+                break;
+            case OP_GET_LOCAL_LOCAL:
+                highest_slot = MAX(highest_slot, MAX(code[offset + 1], code[offset + 2]));
+                break;
+            case OP_GET_LOCAL_CONSTANT:
+                highest_slot = MAX(highest_slot, code[offset + 1]);
+                ok = code[offset + 2] < chunk->constants.count;
+                break;
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+                ok = code[offset + 1] < function->nupvalues;
+                break;
+            case OP_DEFINE_GLOBAL_SLOT:
+            case OP_GET_GLOBAL_SLOT:
+            case OP_SET_GLOBAL_SLOT:
+            case OP_SET_GLOBAL_SLOT_POP: {
+                int slot = code[offset + 1] | (code[offset + 2] << 8);  // NOLINT(readability-magic-numbers)
+                ok = slot < image->nglobals;
+                if (ok && image->rebind) {
+                    code[offset + 1] = U16LSB(image->globals[slot]);
+                    code[offset + 2] = U16MSB(image->globals[slot]);
+                }
+                break;
+            }
+            case OP_CLOSURE: {
+                struct object_function *inner = AS_FUNCTION(chunk->constants.values[code[offset + 1]]);
+                for (int i = 0; ok && i < inner->nupvalues; i++) {
+                    uint8_t is_local = code[offset + 2 + 2 * i];
+                    uint8_t index = code[offset + 3 + 2 * i];
+                    if (is_local) {
+                        highest_slot = MAX(highest_slot, index);
+                    }
+                    ok = is_local ? is_local == 1 : index < function->nupvalues;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        if (ok && instruction_jump_direction(op) != 0) {
+            size_t jump = code[offset + length - 2] | (code[offset + length - 1] << 8);  // NOLINT
+            ok = (instruction_jump_direction(op) > 0) ? offset + length + jump < count : jump <= offset + length;
+        }
+        if (!ok) {
+            return fail(r, "instruction operand out of range");
+        }
+        offset += length;
+        last = op;
+    }
+    if (last != OP_RETURN) {
+        return fail(r, "function does not end with a return");
+    }
+
+    // Recomputed rather than trusted, since too small a value lets the code run off the stack
+    int max_stack = chunk_max_stack(chunk);
+    if (max_stack < 0) {
+        return fail(r, "code does not keep the stack balanced");
+    }
+    function->max_stack = 1 + function->arity + max_stack;
+    if (highest_slot >= function->max_stack) {
+        return fail(r, "local slot out of range");
+    }
+    return true;
+}
+
+/**
+ * Read a function's name, arity and upvalue count into a new function in
+ * @p slot of @p owner, leaving the rest of it in the image until it is
+ * first used
+ *
+ * @param owner the object @p slot belongs to, NULL for a root
+ */
+static bool read_stub(struct reader *r, struct bytecode_image *image, struct object *owner, value *slot)
+{
+    struct object_function *function = object_function_new(NULL);
+    *slot = OBJECT_VAL(function);
+    if (owner != NULL) {
+        gc_write_barrier(owner, *slot);
+    }
+
+    function->name = get_string(r);
+    gc_write_barrier(&function->object, OBJECT_VAL(function->name));
+    uint32_t arity = get_u32(r);
+    uint32_t nupvalues = get_u32(r);
+    uint32_t size = get_u32(r);
+    if (arity > UINT8_MAX || nupvalues > UINT8_MAX + 1) {
+        return fail(r, "function header out of range");
+    }
+    const uint8_t *body = get_bytes(r, size);
+    if (body == NULL) {
+        return false;
+    }
+
+    function->arity = (int)arity;
+    function->nupvalues = (int)nupvalues;
+    function->image = image;
+    function->unloaded = body;
+    function->unloaded_size = size;
+    return true;
+}
+
+/** Read a constant straight into @p slot of @p owner, where the collector can see it */
+static bool read_constant(struct reader *r, struct bytecode_image *image, struct object *owner, value *slot)
+{
+    switch (get_u8(r)) {
+        case TAG_NIL:
+            *slot = NIL_VAL;
+            break;
+        case TAG_FALSE:
+            *slot = BOOL_VAL(false);
+            break;
+        case TAG_TRUE:
+            *slot = BOOL_VAL(true);
+            break;
+        case TAG_NUMBER: {
+            uint64_t bits = get_u64(r);
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            // Some NaNs are boxed values under NaN boxing; the compiler only ever writes this one
+            *slot = NUMBER_VAL(isnan(d) ? NAN : d);
+            break;
+        }
+        case TAG_INT: {
+            // files written with a wider integer representation degrade like arithmetic does
+            int64_t i = (int64_t)get_u64(r);
+            *slot = int_fits(i) ? INT_VAL(i) : NUMBER_VAL((double)i);
+            break;
+        }
+        case TAG_STRING: {
+            struct object_string *s = get_string(r);
+            if (s == NULL) {
+                return fail(r, "string constant without a value");
+            }
+            *slot = OBJECT_VAL(s);
+            break;
+        }
+        case TAG_FUNCTION:
+            return read_stub(r, image, owner, slot);
+        default:
+            return fail(r, "unknown constant type");
+    }
+    gc_write_barrier(owner, *slot);
+    return r->error == NULL;
+}
+
+/** Point @p chunk at the code and line table in the image, and build everything else */
+static bool read_body(struct reader *r, struct bytecode_image *image, struct object_function *function)
+{
+    struct chunk *chunk = &function->chunk;
+
+    // Drop the empty buffers object_function_new() gave the chunk
+    chunk_free(chunk);
+
+    int count = get_count(r, 1);
+    uint8_t *code = (uint8_t *)get_bytes(r, count);
+    int nruns = get_count(r, 2 * sizeof(uint32_t));
+    const uint8_t *runs = get_bytes(r, (size_t)nruns * 2 * sizeof(uint32_t));
+    if (code == NULL || runs == NULL) {
+        return false;
+    }
+    // The image was loaded writable, so the code can still be quickened in place
+    chunk->borrowed = true;
+    chunk->code = code;
+    chunk->count = count;
+    chunk->line_runs = runs;
+    chunk->nline_runs = nruns;
+
+    int64_t covered = 0;
+    for (int i = 0; i < nruns; i++) {
+        struct reader run = {.p = runs + i * 2 * sizeof(uint32_t), .end = r->end, .error = NULL};
+        if (get_u32(&run) > INT32_MAX) {
+            return fail(r, "line table does not match the code");
+        }
+        covered += get_u32(&run);
+    }
+    if (covered != count) {
+        return fail(r, "line table does not match the code");
+    }
+
+    // Fill the constant table in place, so each object is reachable as soon as it exists
+    int nconstants = get_count(r, 1);
+    struct value_array *constants = &chunk->constants;
+    constants->values = reallocate(NULL, 0, nconstants * sizeof(value));
+    constants->capacity = nconstants;
+    for (int i = 0; i < nconstants; i++) { constants->values[i] = NIL_VAL; }
+    constants->count = nconstants;
+    for (int i = 0; i < nconstants; i++) {
+        if (!read_constant(r, image, &function->object, &constants->values[i])) {
+            return false;
+        }
+    }
+
+    int ncaches = get_count(r, sizeof(uint32_t));
+    for (int i = 0; i < ncaches; i++) {
+        uint32_t offset = get_u32(r);
+        if (offset >= (uint32_t)count) {
+            return fail(r, "inline cache outside the code");
+        }
+        int cache = chunk_add_cache(chunk);
+        chunk->caches[cache].offset = (int)offset;
+    }
+    if (r->error == NULL && r->p != r->end) {
+        return fail(r, "trailing data after a function");
+    }
+    return r->error == NULL && link_function(r, image, function);
+}
+
+bool bytecode_materialize(struct vm *vm, struct object_function *function, const char **error)
+{
+    (void)vm;
+    struct reader r = {.p = function->unloaded, .end = function->unloaded + function->unloaded_size, .error = NULL};
+    if (!read_body(&r, function->image, function)) {
+        // Leave it unloaded, so using it again fails the same way
+        chunk_free(&function->chunk);
+        chunk_init(&function->chunk);
+        *error = r.error;
+        return false;
+    }
+    function->unloaded = NULL;
+    return true;
+}
+
+static void free_image(struct bytecode_image *image)
+{
+    if (image->mapped) {
+        munmap(image->data, image->size);
+    } else {
+        free(image->data);
+    }
+    free(image->globals);
+    free(image);
+}
+
+/** Load the script in @p image and hand the image to the VM */
+static struct object_function *load_image(struct vm *vm, struct bytecode_image *image, const char **error)
+{
+    struct reader r = {.p = image->data, .end = image->data + image->size, .error = NULL};
+
+    if (get_u32(&r) != BYTECODE_MAGIC) {
+        fail(&r, "not a bytecode file");
+    }
+    uint8_t major = get_u8(&r);
+    uint8_t minor = get_u8(&r);
+    uint16_t header_size = get_u16(&r);
+    if (r.error == NULL && (major != BYTECODE_VERSION_MAJOR || minor > BYTECODE_VERSION_MINOR)) {
+        fail(&r, "unsupported bytecode version");
+    }
+    // Later minor versions may append header fields this loader skips
+    if (header_size < HEADER_FIXED_SIZE) {
+        fail(&r, "header too short");
+    }
+    get_bytes(&r, header_size - HEADER_FIXED_SIZE);
+
+    image->nglobals = get_count(&r, sizeof(uint32_t));
+    image->globals = calloc(image->nglobals + 1, sizeof(int));
+    for (int i = 0; i < image->nglobals && r.error == NULL; i++) {
+        uint32_t length = get_u32(&r);
+        const uint8_t *name = get_bytes(&r, length);
+        if (name != NULL) {
+            image->globals[i] = vm_global_slot(vm, (const char *)name, length);
+            image->rebind |= image->globals[i] != i;
+            if (image->globals[i] > UINT16_MAX) {
+                fail(&r, "too many globals");
+            }
+        }
+    }
+
+    struct object_function *function = NULL;
+    vm->loading = NIL_VAL;
+    if (r.error == NULL && read_stub(&r, image, NULL, &vm->loading)) {
+        if (r.p != r.end) {
+            fail(&r, "trailing data after the script");
+        } else if (bytecode_materialize(vm, AS_FUNCTION(vm->loading), &r.error)) {
+            function = AS_FUNCTION(vm->loading);
+        }
+    }
+    vm->loading = NIL_VAL;
+
+    if (function == NULL) {
+        // Nothing reachable refers to the image; unreachable functions never look at it
+        free_image(image);
+    } else {
+        image->next = vm->images;
+        vm->images = image;
+    }
+    if (error != NULL) {
+        *error = r.error;
+    }
+    return function;
+}
+
+static struct bytecode_image *new_image(uint8_t *data, size_t size, bool mapped)
+{
+    struct bytecode_image *image = calloc(1, sizeof(*image));
+    if (image == NULL) {
+        return NULL;
+    }
+    image->data = data;
+    image->size = size;
+    image->mapped = mapped;
+    return image;
+}
+
+bool bytecode_is_bytecode(const uint8_t *data, size_t size)
+{
+    struct reader r = {.p = data, .end = data + size, .error = NULL};
+    return size >= sizeof(uint32_t) && get_u32(&r) == BYTECODE_MAGIC;
+}
+
+struct object_function *bytecode_read(struct vm *vm, const uint8_t *data, size_t size, const char **error)
+{
+    uint8_t *copy = malloc(size + 1);
+    struct bytecode_image *image = (copy == NULL) ? NULL : new_image(copy, size, false);
+    if (image == NULL) {
+        free(copy);
+        if (error != NULL) {
+            *error = "out of memory";
+        }
+        return NULL;
+    }
+    memcpy(copy, data, size);
+    return load_image(vm, image, error);
+}
+
+struct object_function *bytecode_load_file(struct vm *vm, const char *path, uint64_t source_hash,
+                                           const char **error)
+{
+    const char *problem = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        problem = "could not open file";
+    } else if (st.st_size == 0) {
+        problem = "unexpected end of file";
+    }
+
+    void *data = MAP_FAILED;
+    if (problem == NULL) {
+        // Private and writable, so code can be quickened without touching the file
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            problem = "could not map file";
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (problem == NULL && source_hash != 0 && bytecode_source_hash(data, st.st_size) != source_hash) {
+        problem = "compiled from different source";
+    }
+
+    struct bytecode_image *image = (problem == NULL) ? new_image(data, st.st_size, true) : NULL;
+    if (image == NULL) {
+        if (data != MAP_FAILED) {
+            munmap(data, st.st_size);
+        }
+        if (error != NULL) {
+            *error = (problem == NULL) ? "out of memory" : problem;
+        }
+        return NULL;
+    }
+    return load_image(vm, image, error);
+}
+
+uint64_t bytecode_source_hash(const uint8_t *data, size_t size)
+{
+    struct reader r = {.p = data, .end = data + size, .error = NULL};
+    if (get_u32(&r) != BYTECODE_MAGIC) {
+        return 0;
+    }
+    get_u16(&r);  // version
+    uint16_t header_size = get_u16(&r);
+    if (header_size < HEADER_SOURCE_HASH + sizeof(uint64_t) || size < header_size) {
+        return 0;
+    }
+    r.p = data + HEADER_SOURCE_HASH;
+    return get_u64(&r);
+}
+
+void bytecode_free_images(struct vm *vm)
+{
+    while (vm->images != NULL) {
+        struct bytecode_image *image = vm->images;
+        vm->images = image->next;
+        free_image(image);
+    }
+}
+
+void bytecode_gc_roots(struct vm *vm)
+{
+    gc_mark_value(vm->loading);
+}
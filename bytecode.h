@@ -0,0 +1,99 @@
+#ifndef DPLANG_BYTECODE_H
+#define DPLANG_BYTECODE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct vm;
+struct object_function;
+
+/*
+ * Compiled bytecode (.dpc) files
+ *
+ * Every integer is little-endian and doubles are stored as their IEEE-754
+ * bit pattern, so a file can be loaded on any host.  The layout is
+ *
+ *   header:    u32 magic, u8 major, u8 minor, u16 header size, u64 timestamp,
+ *              u64 source hash (since 1.1)
+ *   globals:   u32 count, then that many strings
+ *   function:  the top-level script, see write_function()
+ *
+ * Each function records the size of its body, so loading reads only the
+ * script's own body and leaves nested functions as stubs.  A stub's code,
+ * line table and constants are set up the first time a closure is made from
+ * it.  Code and line tables are used in place in the loaded file, which
+ * bytecode_load_file() maps rather than reads.
+ *
+ * Global slot operands in the code index the file's global table and are
+ * rebound to the loading VM's slots.  Opcode numbers are part of the format:
+ * renumbering or changing the operands of an instruction needs a new major
+ * version, and adding one a new minor version (2.1 added OP_YIELD and
+ * OP_RESUME).
+ *
+ * The loader rejects truncated files and out-of-range operands, but it does
+ * not prove that the code uses its values with the right types, so only
+ * load files from a trusted compiler.
+ */
+#define BYTECODE_MAGIC         0xDEADBEEF
+#define BYTECODE_VERSION_MAJOR 2
+#define BYTECODE_VERSION_MINOR 1
+
+/** True if @p data starts like a bytecode file */
+bool bytecode_is_bytecode(const uint8_t *data, size_t size);
+
+/**
+ * Serialize the compiled script @p function to @p f
+ *
+ * Any function will do, as long as it captures no upvalues: it is loaded
+ * back as the top-level function.  Nested functions still left as stubs are
+ * loaded first.
+ *
+ * @param source_hash identifies the source it was compiled from, 0 if unknown
+ * @return 0 on success, -1 if the file could not be written
+ */
+int bytecode_write(struct vm *vm, struct object_function *function, uint64_t source_hash, FILE *f);
+
+/**
+ * Load a script written by bytecode_write()
+ *
+ * @p data is copied, so the buffer is only read during the call.
+ *
+ * @param error if not NULL, set to why @p data is not valid bytecode
+ * @return the top-level function, or NULL if @p data is not valid bytecode
+ */
+struct object_function *bytecode_read(struct vm *vm, const uint8_t *data, size_t size, const char **error);
+
+/**
+ * Map the bytecode file at @p path and load the script in it
+ *
+ * The mapping lasts until the VM is freed.  Pages are shared with other
+ * processes running the same file until the VM writes to them.  Function
+ * bodies are read from the mapping when first called, and unwritten pages
+ * of a private mapping still see changes to the file, so a file that may
+ * be running must never be rewritten in place: write a new one and
+ * rename() it over the old.
+ *
+ * @param source_hash the source hash the file must record, 0 to accept any
+ * @param error if not NULL, set to why the file could not be loaded
+ * @return the top-level function, or NULL if the file is missing or not valid bytecode
+ */
+struct object_function *bytecode_load_file(struct vm *vm, const char *path, uint64_t source_hash,
+                                           const char **error);
+
+/**
+ * Finish loading @p function, a stub left by loading its file
+ *
+ * @return false with @p error set if its body is not valid bytecode
+ */
+bool bytecode_materialize(struct vm *vm, struct object_function *function, const char **error);
+
+/** Release every file loaded into @p vm */
+void bytecode_free_images(struct vm *vm);
+
+/** The source hash recorded in a bytecode file's header, 0 if there is none */
+uint64_t bytecode_source_hash(const uint8_t *data, size_t size);
+
+/** Mark the function @p vm is in the middle of loading */
+void bytecode_gc_roots(struct vm *vm);
+#endif
@@ -0,0 +1,152 @@
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "cache.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "dplang.h"
+#include "hash.h"
+#include "vm.h"
+
+#define CACHE_EXTENSION ".dpc"
+
+/** Temporary files are the entry's path plus this, completed by mkstemp() */
+#define CACHE_TEMP_SUFFIX ".XXXXXX"
+
+static char default_dir[PATH_MAX];
+
+const char *cache_default_dir(void)
+{
+    const char *dir = getenv("DPLANG_CACHE_DIR");
+    if (dir != NULL && dir[0] != '\0') {
+        return dir;
+    }
+
+    int n = -1;
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir != NULL && dir[0] != '\0') {
+        n = snprintf(default_dir, sizeof(default_dir), "%s/dplang", dir);
+    } else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0') {
+        n = snprintf(default_dir, sizeof(default_dir), "%s/.cache/dplang", dir);
+    }
+    return (n < 0 || (size_t)n >= sizeof(default_dir)) ? NULL : default_dir;
+}
+
+/** Hash of everything that determines what compile() produces for @p source */
+static uint64_t cache_key(const char *source, size_t length, int flags)
+{
+    uint64_t hash = hash_bytes64(DPLANG_VERSION, strlen(DPLANG_VERSION), HASH64_SEED);
+    // OP_COUNT catches opcodes added during development without a format version bump
+    uint8_t build[] = {BYTECODE_VERSION_MAJOR, BYTECODE_VERSION_MINOR, OP_COUNT, (uint8_t)flags};
+    hash = hash_bytes64(build, sizeof(build), hash);
+    return hash_bytes64(source, length, hash);
+}
+
+/** Create @p dir and any missing parents */
+static int make_dirs(const char *dir)
+{
+    char path[PATH_MAX];
+    size_t length = strlen(dir);
+    if (length >= sizeof(path)) {
+        return -1;
+    }
+    memcpy(path, dir, length + 1);
+
+    for (size_t i = 1; i <= length; i++) {
+        if (path[i] == '/' || path[i] == '\0') {
+            path[i] = '\0';
+            if (mkdir(path, 0755) != 0 && errno != EEXIST) {  // NOLINT(readability-magic-numbers)
+                return -1;
+            }
+            path[i] = dir[i];
+        }
+    }
+    return 0;
+}
+
+/** Write @p function to @p path by way of a temporary file, so readers see all of it or none */
+static void write_entry(struct vm *vm, const char *dir, const char *path, struct object_function *function,
+                        uint64_t key)
+{
+    char temp[PATH_MAX];
+    int n = snprintf(temp, sizeof(temp), "%s" CACHE_TEMP_SUFFIX, path);
+    if (n < 0 || (size_t)n >= sizeof(temp) || make_dirs(dir) != 0) {
+        return;
+    }
+
+    int fd = mkstemp(temp);
+    if (fd < 0) {
+        return;
+    }
+    FILE *f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        unlink(temp);
+        return;
+    }
+    int ret = bytecode_write(vm, function, key, f);
+    if (fclose(f) != 0 || ret != 0 || rename(temp, path) != 0) {
+        unlink(temp);
+    }
+}
+
+struct object_function *cache_compile(struct vm *vm, const char *dir, const char *source, size_t length)
+{
+    uint64_t key = cache_key(source, length, vm->compile_flags);
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%016" PRIx64 CACHE_EXTENSION, dir, key);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        return compile(vm, source, vm->compile_flags);
+    }
+
+    // An entry that was written for another key or no longer loads is stale
+    struct object_function *function = bytecode_load_file(vm, path, key, NULL);
+    if (function != NULL) {
+        return function;
+    }
+
+    function = compile(vm, source, vm->compile_flags);
+    if (function != NULL) {
+        write_entry(vm, dir, path, function, key);
+    }
+    return function;
+}
+
+/** True for entries and for temporary files left behind by an interrupted write */
+static bool is_cache_file(const char *name)
+{
+    const char *ext = strstr(name, CACHE_EXTENSION);
+    if (ext == NULL) {
+        return false;
+    }
+    ext += strlen(CACHE_EXTENSION);
+    return ext[0] == '\0' || (ext[0] == '.' && strlen(ext) == strlen(CACHE_TEMP_SUFFIX));
+}
+
+int cache_clear(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    int removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        char path[PATH_MAX];
+        int n = snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (is_cache_file(entry->d_name) && n > 0 && (size_t)n < sizeof(path) && unlink(path) == 0) {
+            removed++;
+        }
+    }
+    closedir(d);
+    return removed;
+}
@@ -0,0 +1,44 @@
+#ifndef DPLANG_CACHE_H
+#define DPLANG_CACHE_H
+#include <stddef.h>
+
+struct vm;
+struct object_function;
+
+/*
+ * On-disk compile cache
+ *
+ * Compiled scripts are kept as bytecode files named after a hash of the
+ * source, the VM version and the compile flags, so an edited script or a
+ * new VM simply misses.  Entries are written to a temporary file and
+ * renamed into place, so concurrent runs never see a partial entry.
+ * Entries are loaded with bytecode_load_file(), so runs of the same script
+ * share its code pages.
+ */
+
+/**
+ * Directory the cache lives in
+ *
+ * $DPLANG_CACHE_DIR, else $XDG_CACHE_HOME/dplang, else $HOME/.cache/dplang.
+ *
+ * @return NULL if none of them is set
+ */
+const char *cache_default_dir(void);
+
+/**
+ * Compile @p source, reusing the cached result for it if there is one
+ *
+ * A missing, stale or unreadable entry is replaced with a fresh compile.
+ * Failing to write the cache is not an error.
+ *
+ * @return the script's top-level function, NULL if it did not compile
+ */
+struct object_function *cache_compile(struct vm *vm, const char *dir, const char *source, size_t length);
+
+/**
+ * Remove every entry from the cache in @p dir
+ *
+ * @return the number of entries removed, -1 if the directory could not be read
+ */
+int cache_clear(const char *dir);
+#endif
@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "channel.h"
+#include "isolate.h"
+
+/** Ids handed out so far, so no two channels in the process share one */
+static atomic_uint_least64_t channel_ids;
+
+struct channel {
+    atomic_size_t references;
+    uint64_t id;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct message *ring;
+    size_t capacity;
+    size_t head;   // oldest message
+    size_t count;  // messages queued
+    bool closed;
+};
+
+struct channel *channel_new(size_t capacity)
+{
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    struct channel *channel = malloc(sizeof(*channel));
+    struct message *ring = calloc(capacity, sizeof(*ring));
+    if (channel == NULL || ring == NULL) {
+        free(channel);
+        free(ring);
+        return NULL;
+    }
+    atomic_init(&channel->references, 1);
+    channel->id = atomic_fetch_add_explicit(&channel_ids, 1, memory_order_relaxed) + 1;
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->not_empty, NULL);
+    pthread_cond_init(&channel->not_full, NULL);
+    channel->ring = ring;
+    channel->capacity = capacity;
+    channel->head = 0;
+    channel->count = 0;
+    channel->closed = false;
+    return channel;
+}
+
+uint64_t channel_id(const struct channel *channel)
+{
+    return channel->id;
+}
+
+void channel_retain(struct channel *channel)
+{
+    atomic_fetch_add_explicit(&channel->references, 1, memory_order_relaxed);
+}
+
+void channel_release(struct channel *channel)
+{
+    if (atomic_fetch_sub_explicit(&channel->references, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    // A queued message may hold the last reference to another channel
+    for (size_t i = 0; i < channel->count; i++) {
+        message_free(&channel->ring[(channel->head + i) % channel->capacity]);
+    }
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->not_empty);
+    pthread_cond_destroy(&channel->not_full);
+    free(channel->ring);
+    free(channel);
+}
+
+bool channel_send(struct channel *channel, struct message *message)
+{
+    pthread_mutex_lock(&channel->lock);
+    bool waits = channel->count == channel->capacity && !channel->closed;
+    if (waits) {
+        isolate_block();
+    }
+    while (channel->count == channel->capacity && !channel->closed) {
+        pthread_cond_wait(&channel->not_full, &channel->lock);
+    }
+    bool sent = !channel->closed;
+    if (sent) {
+        channel->ring[(channel->head + channel->count) % channel->capacity] = *message;
+        channel->count++;
+        pthread_cond_signal(&channel->not_empty);
+    }
+    pthread_mutex_unlock(&channel->lock);
+    if (waits) {
+        isolate_unblock();
+    }
+    return sent;
+}
+
+bool channel_recv(struct channel *channel, struct message *message)
+{
+    pthread_mutex_lock(&channel->lock);
+    bool waits = channel->count == 0 && !channel->closed;
+    if (waits) {
+        isolate_block();
+    }
+    while (channel->count == 0 && !channel->closed) {
+        pthread_cond_wait(&channel->not_empty, &channel->lock);
+    }
+    bool received = channel->count > 0;
+    if (received) {
+        *message = channel->ring[channel->head];
+        channel->head = (channel->head + 1) % channel->capacity;
+        channel->count--;
+        pthread_cond_signal(&channel->not_full);
+    }
+    pthread_mutex_unlock(&channel->lock);
+    if (waits) {
+        isolate_unblock();
+    }
+    return received;
+}
+
+void channel_close(struct channel *channel)
+{
+    pthread_mutex_lock(&channel->lock);
+    channel->closed = true;
+    pthread_cond_broadcast(&channel->not_empty);
+    pthread_cond_broadcast(&channel->not_full);
+    pthread_mutex_unlock(&channel->lock);
+}
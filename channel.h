@@ -0,0 +1,55 @@
+#ifndef DPLANG_CHANNEL_H
+#define DPLANG_CHANNEL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clone.h"
+
+/*
+ * Bounded channels for passing messages between VMs.
+ *
+ * A channel is a queue of cloned values, see clone.h, that any number of
+ * threads send to and receive from.  Senders block while it is full and
+ * receivers while it is empty, so a slow consumer holds back its
+ * producers rather than letting the queue grow without bound.  Closing a
+ * channel wakes everyone: sends fail from then on, and receives fail
+ * once the messages already queued are taken.
+ *
+ * Channels live outside every VM's heap and are reference counted: each
+ * VM holding one has an object_channel with a reference of its own, and
+ * so does each queued message that carries one.
+ */
+
+struct channel;
+
+/**
+ * @param capacity most messages queued at once, at least 1
+ * @return a channel with one reference, or NULL if out of memory
+ */
+struct channel *channel_new(size_t capacity);
+
+/** @return a number above 0 that no other channel in the process has */
+uint64_t channel_id(const struct channel *channel);
+
+void channel_retain(struct channel *channel);
+
+/** Drop a reference, freeing @p channel and any messages still queued on it with the last */
+void channel_release(struct channel *channel);
+
+/**
+ * Queue @p message, waiting for room if @p channel is full
+ *
+ * @return true once @p channel owns the message, false if it is closed
+ */
+bool channel_send(struct channel *channel, struct message *message);
+
+/**
+ * Take the oldest message into @p message, waiting for one if there is none
+ *
+ * @return false if @p channel is closed and empty
+ */
+bool channel_recv(struct channel *channel, struct message *message);
+
+void channel_close(struct channel *channel);
+#endif
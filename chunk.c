@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -15,15 +16,51 @@ int chunk_init(struct chunk *chunk)
     chunk->lines = reallocate(NULL, 0, MIN_CHUNK_SIZE * sizeof(int));
     value_array_init(&chunk->constants);
     chunk->capacity = MIN_CHUNK_SIZE;
+    chunk->caches = NULL;
+    chunk->ncaches = chunk->cache_capacity = 0;
+    chunk->borrowed = false;
+    chunk->line_runs = NULL;
+    chunk->nline_runs = 0;
     return 0;
 }
 
 int chunk_free(struct chunk *chunk)
 {
-    chunk->code = reallocate(chunk->code, chunk->capacity * sizeof(uint8_t), 0);
-    chunk->lines = reallocate(chunk->lines, chunk->capacity * sizeof(int), 0);
+    if (chunk->borrowed) {
+        // the bytecode image owns the code and line table
+        chunk->code = NULL;
+        chunk->line_runs = NULL;
+        chunk->nline_runs = 0;
+        chunk->borrowed = false;
+    } else {
+        chunk->code = reallocate(chunk->code, chunk->capacity * sizeof(uint8_t), 0);
+        chunk->lines = reallocate(chunk->lines, chunk->capacity * sizeof(int), 0);
+    }
     chunk->capacity = chunk->count = 0;
     value_array_free(&chunk->constants);
+    chunk->caches = reallocate(chunk->caches, chunk->cache_capacity * sizeof(struct inline_cache), 0);
+    chunk->ncaches = chunk->cache_capacity = 0;
+    return 0;
+}
+
+static uint32_t line_run_field(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);  // NOLINT
+}
+
+int chunk_line(struct chunk *chunk, int offset)
+{
+    if (chunk->lines != NULL) {
+        return chunk->lines[offset];
+    }
+    // Only needed for errors and disassembly, so the runs are searched rather than expanded
+    const uint8_t *run = chunk->line_runs;
+    for (int i = 0; i < chunk->nline_runs; i++, run += 2 * sizeof(uint32_t)) {
+        offset -= (int)line_run_field(run + sizeof(uint32_t));
+        if (offset < 0) {
+            return (int)line_run_field(run);
+        }
+    }
     return 0;
 }
 
@@ -49,6 +86,18 @@ static size_t byte_instruction(const char *name, struct chunk *chunk, size_t off
     return offset + 2;
 }
 
+static inline uint16_t read_u16(struct chunk *chunk, size_t offset)
+{
+    return (uint16_t)(chunk->code[offset] | (chunk->code[offset + 1] << 8));  // NOLINT(readability-magic-numbers)
+}
+
+static size_t short_instruction(const char *name, struct chunk *chunk, size_t offset)
+{
+    uint16_t slot = read_u16(chunk, offset + 1);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static size_t jump_instruction(const char *name, struct chunk *chunk, size_t offset, int sign)
 {
     uint16_t target = (uint16_t)(chunk->code[offset + 1]);
@@ -59,14 +108,50 @@ static size_t jump_instruction(const char *name, struct chunk *chunk, size_t off
     return offset + 3;
 }
 
+static size_t property_instruction(const char *name, struct chunk *chunk, size_t offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = read_u16(chunk, offset + 2);
+    printf("%-16s %4d '", name, constant);
+    value_print(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 4;
+}
+
+static size_t local_local_instruction(const char *name, struct chunk *chunk, size_t offset)
+{
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+static size_t local_constant_instruction(const char *name, struct chunk *chunk, size_t offset)
+{
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, chunk->code[offset + 1], constant);
+    value_print(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static size_t local_property_instruction(const char *name, struct chunk *chunk, size_t offset)
+{
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t cache = read_u16(chunk, offset + 3);
+    printf("%-16s %4d %4d '", name, chunk->code[offset + 1], constant);
+    value_print(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 5;
+}
+
 static size_t invoke_instruction(const char *name, struct chunk *chunk, size_t offset)
 {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t arg_count = chunk->code[offset + 2];
+    uint16_t cache = read_u16(chunk, offset + 3);
     printf("%-16s (%d args) %4d '", name, arg_count, constant);
     value_print(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 3;
+    printf("' ic %d\n", cache);
+    return offset + 5;
 }
 
 static const char *opnames[] = {
@@ -85,11 +170,18 @@ static const char *opnames[] = {
     [OP_MOD] = "OP_MOD",
     [OP_SHL] = "OP_SHL",
     [OP_SHR] = "OP_SHR",
+    [OP_BIT_AND] = "OP_BIT_AND",
+    [OP_BIT_OR] = "OP_BIT_OR",
+    [OP_BIT_XOR] = "OP_BIT_XOR",
+    [OP_BIT_NOT] = "OP_BIT_NOT",
     [OP_NEGATE] = "OP_NEGATE",
     [OP_NOT] = "OP_NOT",
     [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
     [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
     [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_DEFINE_GLOBAL_SLOT] = "OP_DEFINE_GLOBAL_SLOT",
+    [OP_GET_GLOBAL_SLOT] = "OP_GET_GLOBAL_SLOT",
+    [OP_SET_GLOBAL_SLOT] = "OP_SET_GLOBAL_SLOT",
     [OP_GET_LOCAL] = "OP_GET_LOCAL",
     [OP_SET_LOCAL] = "OP_SET_LOCAL",
     [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
@@ -100,6 +192,7 @@ static const char *opnames[] = {
     [OP_LOOP] = "OP_LOOP",
     [OP_JUMP] = "OP_JUMP",
     [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
     [OP_CLOSURE] = "OP_CLOSURE",
     [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
     [OP_RETURN] = "OP_RETURN",
@@ -113,9 +206,30 @@ static const char *opnames[] = {
     [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
     [OP_TABLE_GET] = "OP_TABLE_GET",
     [OP_TABLE_SET] = "OP_TABLE_SET",
+    [OP_ADD_NUM_NUM] = "OP_ADD_NUM_NUM",
+    [OP_ADD_STR_STR] = "OP_ADD_STR_STR",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_ADD_INT_INT] = "OP_ADD_INT_INT",
+    [OP_SUBTRACT_INT] = "OP_SUBTRACT_INT",
+    [OP_MULTIPLY_INT] = "OP_MULTIPLY_INT",
+    [OP_GREATER_INT] = "OP_GREATER_INT",
+    [OP_LESS_INT] = "OP_LESS_INT",
+    [OP_GET_LOCAL_LOCAL] = "OP_GET_LOCAL_LOCAL",
+    [OP_GET_LOCAL_CONSTANT] = "OP_GET_LOCAL_CONSTANT",
+    [OP_GET_LOCAL_PROPERTY] = "OP_GET_LOCAL_PROPERTY",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_SET_GLOBAL_SLOT_POP] = "OP_SET_GLOBAL_SLOT_POP",
+    [OP_LESS_JUMP_IF_FALSE] = "OP_LESS_JUMP_IF_FALSE",
+    [OP_POP_LOOP] = "OP_POP_LOOP",
+    [OP_YIELD] = "OP_YIELD",
+    [OP_RESUME] = "OP_RESUME",
 };
 
-static const char *opcode_to_string(enum opcode op)
+const char *opcode_to_string(enum opcode op)
 {
     if (op >= ARRAY_SIZE(opnames)) {
         return "?";
@@ -129,10 +243,10 @@ size_t disassemble_instruction(struct chunk *chunk, size_t offset)
     uint8_t opcode = chunk->code[offset];
 
     const char *opname = opcode_to_string(opcode);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    if (offset > 0 && chunk_line(chunk, (int)offset) == chunk_line(chunk, (int)offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", chunk_line(chunk, (int)offset));
     }
     printf(" %02x ", opcode);
     switch (opcode) {
@@ -141,17 +255,23 @@ size_t disassemble_instruction(struct chunk *chunk, size_t offset)
         case OP_GET_GLOBAL:
         case OP_SET_GLOBAL:
         case OP_CLASS:
-        case OP_GET_PROPERTY:
-        case OP_SET_PROPERTY:
         case OP_METHOD:
         case OP_GET_SUPER:
             return constant_instruction(opname, chunk, offset);
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return property_instruction(opname, chunk, offset);
         case OP_GET_LOCAL:
         case OP_SET_LOCAL:
         case OP_GET_UPVALUE:
         case OP_SET_UPVALUE:
         case OP_CALL:
+        case OP_TAIL_CALL:
             return byte_instruction(opname, chunk, offset);
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+            return short_instruction(opname, chunk, offset);
         case OP_INVOKE:
         case OP_SUPER_INVOKE:
             return invoke_instruction(opname, chunk, offset);
@@ -176,7 +296,20 @@ size_t disassemble_instruction(struct chunk *chunk, size_t offset)
         case OP_JUMP:
             return jump_instruction(opname, chunk, offset, 1);
         case OP_LOOP:
+        case OP_POP_LOOP:
             return jump_instruction(opname, chunk, offset, -1);
+        case OP_LESS_JUMP_IF_FALSE:
+            return jump_instruction(opname, chunk, offset, 1);
+        case OP_GET_LOCAL_LOCAL:
+            return local_local_instruction(opname, chunk, offset);
+        case OP_GET_LOCAL_CONSTANT:
+            return local_constant_instruction(opname, chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return local_property_instruction(opname, chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byte_instruction(opname, chunk, offset);
+        case OP_SET_GLOBAL_SLOT_POP:
+            return short_instruction(opname, chunk, offset);
         case OP_RETURN:
         case OP_NEGATE:
         case OP_ADD:
@@ -193,12 +326,30 @@ size_t disassemble_instruction(struct chunk *chunk, size_t offset)
         case OP_MOD:
         case OP_SHL:
         case OP_SHR:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_BIT_NOT:
         case OP_PRINT:
         case OP_POP:
         case OP_CLOSE_UPVALUE:
         case OP_INHERIT:
         case OP_TABLE_GET:
         case OP_TABLE_SET:
+        case OP_ADD_NUM_NUM:
+        case OP_ADD_STR_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_ADD_INT_INT:
+        case OP_SUBTRACT_INT:
+        case OP_MULTIPLY_INT:
+        case OP_GREATER_INT:
+        case OP_LESS_INT:
+        case OP_YIELD:
+        case OP_RESUME:
             return simple_instruction(opname, offset);
 
         default:
@@ -207,6 +358,230 @@ size_t disassemble_instruction(struct chunk *chunk, size_t offset)
     }
 }
 
+/**
+ * Length in bytes of the instruction at offset, including its operands
+ */
+size_t instruction_length(struct chunk *chunk, size_t offset)
+{
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_SET_LOCAL_POP:
+            return 2;
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_GET_LOCAL_LOCAL:
+        case OP_GET_LOCAL_CONSTANT:
+        case OP_SET_GLOBAL_SLOT_POP:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_POP_LOOP:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_GET_LOCAL_PROPERTY:
+            return 5;
+        case OP_CLOSURE: {
+            struct object_function *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * (size_t)function->nupvalues;
+        }
+        default:
+            return 1;
+    }
+}
+
+/**
+ * 1 for forward jumps, -1 for backward jumps, 0 for anything else
+ *
+ * The 16-bit offset of a jump is always the last operand of the
+ * instruction and is relative to the end of the instruction.
+ */
+int instruction_jump_direction(uint8_t op)
+{
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LESS_JUMP_IF_FALSE:
+            return 1;
+        case OP_LOOP:
+        case OP_POP_LOOP:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+/* Entry depths in chunk_max_stack() that are not depths */
+#define DEPTH_UNREACHED (-1)
+#define DEPTH_INSIDE    (-2)  // inside an instruction, where no jump may land
+
+/**
+ * Net number of values the instruction at offset pushes (or pops, if negative)
+ */
+static int stack_effect(struct chunk *chunk, size_t offset)
+{
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_FALSE:
+        case OP_TRUE:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_GET_LOCAL_PROPERTY:
+            return 1;
+        case OP_GET_LOCAL_LOCAL:
+        case OP_GET_LOCAL_CONSTANT:
+            return 2;
+        case OP_POP:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MOD:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_TABLE_GET:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_ADD_NUM_NUM:
+        case OP_ADD_STR_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_ADD_INT_INT:
+        case OP_SUBTRACT_INT:
+        case OP_MULTIPLY_INT:
+        case OP_GREATER_INT:
+        case OP_LESS_INT:
+        case OP_SET_LOCAL_POP:
+        case OP_SET_GLOBAL_SLOT_POP:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_POP_LOOP:
+        case OP_RESUME:
+            return -1;
+        case OP_TABLE_SET:
+            return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -chunk->code[offset + 1];
+        case OP_INVOKE:
+            return -chunk->code[offset + 2];
+        case OP_SUPER_INVOKE:
+            return -chunk->code[offset + 2] - 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Give @p target the entry depth @p depth, queueing it if no path reached it before
+ *
+ * @return false if @p target is not the start of an instruction, or a path
+ *         reached it before with another depth
+ */
+static bool reach(int *depths, int *pending, int *npending, int count, int target, int depth)
+{
+    if (target < 0 || target > count || depths[target] == DEPTH_INSIDE) {
+        return false;
+    }
+    if (depths[target] == DEPTH_UNREACHED) {
+        depths[target] = depth;
+        // Running off the end isn't an instruction to follow; the loader insists on a final return
+        if (target < count) {
+            pending[(*npending)++] = target;
+        }
+        return true;
+    }
+    return depths[target] == depth;
+}
+
+int chunk_max_stack(struct chunk *chunk)
+{
+    // depth on entry to each instruction, or one of the DEPTH_ markers
+    int *depths = reallocate(NULL, 0, (chunk->count + 1) * sizeof(int));
+    // instructions reached but not followed yet; each is queued at most once
+    int *pending = reallocate(NULL, 0, (chunk->count + 1) * sizeof(int));
+    int npending = 0;
+    int max = 0;
+
+    for (int i = 0; i <= chunk->count; i++) {
+        depths[i] = DEPTH_INSIDE;
+    }
+    for (int offset = 0; offset < chunk->count; offset += (int)instruction_length(chunk, offset)) {
+        depths[offset] = DEPTH_UNREACHED;
+    }
+    depths[chunk->count] = DEPTH_UNREACHED;
+
+    /* Every path into an instruction must arrive with the same depth, or
+     * code run after a loop or a branch would find other values on the
+     * stack than it was compiled for, and could push past max_stack.
+     */
+    bool ok = reach(depths, pending, &npending, chunk->count, 0, 0);
+    while (ok && npending > 0) {
+        int offset = pending[--npending];
+        uint8_t op = chunk->code[offset];
+        int end = offset + (int)instruction_length(chunk, offset);
+        int depth = depths[offset] + stack_effect(chunk, offset);
+        if (depth < 0) {
+            ok = false;
+            break;
+        }
+        if (depth > max) {
+            max = depth;
+        }
+        int direction = instruction_jump_direction(op);
+        if (direction != 0) {
+            int jump = chunk->code[end - 2] | (chunk->code[end - 1] << 8);  // NOLINT(readability-magic-numbers)
+            ok = reach(depths, pending, &npending, chunk->count, end + direction * jump, depth);
+        }
+        if (ok && op != OP_JUMP && op != OP_LOOP && op != OP_POP_LOOP && op != OP_RETURN) {
+            ok = reach(depths, pending, &npending, chunk->count, end, depth);
+        }
+    }
+
+    depths = reallocate(depths, (chunk->count + 1) * sizeof(int), 0);
+    pending = reallocate(pending, (chunk->count + 1) * sizeof(int), 0);
+    return ok ? max : -1;
+}
+
 int chunk_disassemble(struct chunk *chunk, const char *name)
 {
     int count = 0;
@@ -219,6 +594,26 @@ int chunk_disassemble(struct chunk *chunk, const char *name)
     return count;
 }
 
+int chunk_dump_caches(struct chunk *chunk, const char *name)
+{
+    printf("=== %s === [%d inline caches]\n", name, chunk->ncaches);
+    for (int i = 0; i < chunk->ncaches; i++) {
+        struct inline_cache *cache = &chunk->caches[i];
+        // a fused GET_LOCAL_PROPERTY keeps its local slot ahead of the property name
+        uint8_t constant = chunk->code[cache->offset + ((chunk->code[cache->offset] == OP_GET_LOCAL_PROPERTY) ? 2 : 1)];
+        uint64_t total = cache->hits + cache->misses;
+        const char *state = cache->megamorphic ? "megamorphic"
+                            : (cache->count > 1) ? "polymorphic"
+                            : (cache->count == 1) ? "monomorphic"
+                                                  : "uninitialized";
+        printf("%04d %-16s %-12s '", cache->offset, opcode_to_string(chunk->code[cache->offset]), state);
+        value_print(chunk->constants.values[constant]);
+        printf("' hits %" PRIu64 " misses %" PRIu64 " (%.1f%%)\n", cache->hits, cache->misses,
+               (total == 0) ? 0.0 : 100.0 * (double)cache->hits / (double)total);  // NOLINT(readability-magic-numbers)
+    }
+    return chunk->ncaches;
+}
+
 int chunk_write_byte(struct chunk *chunk, uint8_t byte, int line)
 {
     return chunk_write_bytes(chunk, &byte, sizeof(byte), line);
@@ -269,3 +664,22 @@ int chunk_add_constant(struct chunk *chunk, value val)
     value_array_write(&chunk->constants, val);
     return chunk->constants.count - 1;
 }
+
+/**
+ * Allocate an empty inline cache for the instruction about to be written
+ *
+ * @return index of the new cache
+ */
+int chunk_add_cache(struct chunk *chunk)
+{
+    if (chunk->cache_capacity < chunk->ncaches + 1) {
+        int prev_cap = chunk->cache_capacity;
+        chunk->cache_capacity = (prev_cap < MIN_CHUNK_SIZE) ? MIN_CHUNK_SIZE : prev_cap * CHUNK_GROWTH_FACTOR;
+        chunk->caches = reallocate(chunk->caches, prev_cap * sizeof(struct inline_cache),
+                                   chunk->cache_capacity * sizeof(struct inline_cache));
+    }
+    struct inline_cache *cache = &chunk->caches[chunk->ncaches];
+    memset(cache, 0, sizeof(*cache));
+    cache->offset = chunk->count;
+    return chunk->ncaches++;
+}
@@ -1,6 +1,7 @@
 #ifndef DPLANG_CHUNK_H
 #define DPLANG_CHUNK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include "value.h"
@@ -27,11 +28,18 @@ enum opcode {
     OP_MOD,
     OP_SHL,
     OP_SHR,
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_BIT_NOT,
     OP_NEGATE,
     OP_NOT,
     OP_DEFINE_GLOBAL,
     OP_GET_GLOBAL,
     OP_SET_GLOBAL,
+    OP_DEFINE_GLOBAL_SLOT,
+    OP_GET_GLOBAL_SLOT,
+    OP_SET_GLOBAL_SLOT,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_GET_UPVALUE,
@@ -44,6 +52,7 @@ enum opcode {
     OP_LOOP,
     OP_PRINT,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_CLOSE_UPVALUE,
     OP_CLOSURE,
     OP_RETURN,
@@ -52,6 +61,69 @@ enum opcode {
     OP_INVOKE,
     OP_SUPER_INVOKE,
     OP_INHERIT,
+
+    /* Quickened forms.  The compiler never emits these; the interpreter
+     * rewrites a generic instruction into one of them after executing it
+     * with matching operand types, and rewrites it back when the guard fails.
+     */
+    OP_ADD_NUM_NUM,
+    OP_ADD_STR_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_ADD_INT_INT,
+    OP_SUBTRACT_INT,
+    OP_MULTIPLY_INT,
+    OP_GREATER_INT,
+    OP_LESS_INT,
+
+    /* Superinstructions, produced from adjacent pairs by peephole_fuse().
+     * Operands are those of the two original instructions, in order.
+     */
+    OP_GET_LOCAL_LOCAL,
+    OP_GET_LOCAL_CONSTANT,
+    OP_GET_LOCAL_PROPERTY,
+    OP_SET_LOCAL_POP,
+    OP_SET_GLOBAL_SLOT_POP,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_POP_LOOP,
+
+    /* Coroutines.  Numbered after the superinstructions so that the opcodes
+     * of bytecode format 2.0 keep their values.
+     */
+    OP_YIELD,
+    OP_RESUME,
+
+    OP_COUNT,  // number of opcodes, not an instruction
+};
+
+/** Receivers an inline cache remembers before the site goes megamorphic */
+#define IC_MAX_ENTRIES 4
+
+/*
+ * One remembered receiver at a property access or invoke site.
+ *
+ * Property sites key on the receiver's shape, super invokes on the
+ * superclass.  The class is kept alive through the cache so the shape
+ * pointers in it can never be reused by another class.
+ */
+struct inline_cache_entry {
+    struct object_class *klass;
+    struct shape *shape;
+    struct shape *transition;  // shape after OP_SET_PROPERTY adds the field, NULL if it already existed
+    int slot;                  // field slot, or -1 if method is the result
+    struct object_closure *method;
+};
+
+struct inline_cache {
+    struct inline_cache_entry entries[IC_MAX_ENTRIES];
+    int count;
+    bool megamorphic;
+    int offset;  // offset of the instruction using this cache
+    uint64_t hits;
+    uint64_t misses;
 };
 
 struct chunk {
@@ -60,6 +132,16 @@ struct chunk {
     int count;
     size_t capacity;
     struct value_array constants;
+    struct inline_cache *caches;
+    int ncaches;
+    int cache_capacity;
+
+    /* Chunks loaded from a bytecode image borrow their code from it and
+     * keep its run-length line table instead of lines; see chunk_line().
+     */
+    bool borrowed;
+    const uint8_t *line_runs;  // u32 line, u32 length pairs, little-endian
+    int nline_runs;
 };
 
 int chunk_init(struct chunk *chunk);
@@ -67,8 +149,29 @@ int chunk_write_byte(struct chunk *chunk, uint8_t byte, int line);
 int chunk_write_bytes(struct chunk *chunk, uint8_t *bytes, size_t count, int line);
 int chunk_write_opcode(struct chunk *chunk, enum opcode op, void *operands, size_t len, int line);
 int chunk_add_constant(struct chunk *chunk, value val);
+int chunk_add_cache(struct chunk *chunk);
 int chunk_free(struct chunk *chunk);
+
+/** Source line of the instruction at @p offset */
+int chunk_line(struct chunk *chunk, int offset);
 int chunk_disassemble(struct chunk *chunk, const char *name);
+int chunk_dump_caches(struct chunk *chunk, const char *name);
 
 size_t disassemble_instruction(struct chunk *chunk, size_t offset);
+size_t instruction_length(struct chunk *chunk, size_t offset);
+int instruction_jump_direction(uint8_t op);
+
+/**
+ * Deepest the value stack gets while running chunk, relative to the
+ * depth on entry
+ *
+ * Only code some path reaches is followed, and every path into an
+ * instruction must arrive with the same depth.
+ *
+ * @return -1 if an instruction would pop values from below the entry
+ *         depth, paths meet with different depths, or a jump lands
+ *         inside an instruction
+ */
+int chunk_max_stack(struct chunk *chunk);
+const char *opcode_to_string(enum opcode op);
 #endif
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "clone.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define MESSAGE_MIN_CAPACITY 64
+
+enum clone_tag {
+    TAG_NIL,
+    TAG_TRUE,
+    TAG_FALSE,
+    TAG_INT,
+    TAG_NUMBER,
+    TAG_STRING,
+    TAG_TABLE,
+    TAG_SEEN,
+    TAG_CHANNEL,
+};
+
+void message_init(struct message *message)
+{
+    memset(message, 0, sizeof(*message));
+}
+
+void message_free(struct message *message)
+{
+    for (size_t i = 0; i < message->nchannels; i++) { channel_release(message->channels[i]); }
+    free(message->channels);
+    free(message->data);
+    message_init(message);
+}
+
+static void put_bytes(struct message *message, const void *bytes, size_t count)
+{
+    if (message->size + count > message->capacity) {
+        size_t capacity = message->capacity < MESSAGE_MIN_CAPACITY ? MESSAGE_MIN_CAPACITY : message->capacity;
+        while (capacity < message->size + count) {
+            capacity *= 2;
+        }
+        uint8_t *data = realloc(message->data, capacity);
+        if (data == NULL) {
+            exit(1);
+        }
+        message->data = data;
+        message->capacity = capacity;
+    }
+    memcpy(&message->data[message->size], bytes, count);
+    message->size += count;
+}
+
+static void put_tag(struct message *message, enum clone_tag tag)
+{
+    uint8_t u = tag;
+    put_bytes(message, &u, sizeof(u));
+}
+
+static void put_size(struct message *message, size_t size)
+{
+    put_bytes(message, &size, sizeof(size));
+}
+
+static void put_channel(struct message *message, struct channel *channel)
+{
+    struct channel **channels = realloc(message->channels, (message->nchannels + 1) * sizeof(*channels));
+    if (channels == NULL) {
+        exit(1);
+    }
+    channel_retain(channel);
+    channels[message->nchannels] = channel;
+    message->channels = channels;
+    put_tag(message, TAG_CHANNEL);
+    put_size(message, message->nchannels++);
+}
+
+struct encoder {
+    struct message *message;
+    struct table seen;  // each string, table and channel encoded -> its object index
+    int64_t nobjects;
+};
+
+static bool write_value(struct encoder *e, value v, int depth);
+
+// NOLINTNEXTLINE(misc-no-recursion)
+static bool write_table(struct encoder *e, struct table *table, int depth)
+{
+    if (depth >= CLONE_MAX_DEPTH) {
+        return false;
+    }
+    put_tag(e->message, TAG_TABLE);
+    put_size(e->message, (size_t)table->count);
+    for (int i = 0; i < table->capacity; i++) {
+        struct entry *entry = &table->entries[i];
+        if (IS_EMPTY(entry->key)) {
+            continue;
+        }
+        if (!write_value(e, entry->key, depth + 1) || !write_value(e, entry->value, depth + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+static bool write_object(struct encoder *e, value v, int depth)
+{
+    value index;
+    if (table_get(&e->seen, v, &index)) {
+        put_tag(e->message, TAG_SEEN);
+        put_size(e->message, (size_t)AS_INT(index));
+        return true;
+    }
+
+    switch (OBJECT_TYPE(v)) {
+        case OBJECT_STRING:
+        case OBJECT_TABLE:
+        case OBJECT_CHANNEL:
+            table_set(&e->seen, v, INT_VAL(e->nobjects++));
+            break;
+        default:
+            return false;
+    }
+
+    switch (OBJECT_TYPE(v)) {
+        case OBJECT_STRING: {
+            struct object_string *s = AS_STRING(v);
+            put_tag(e->message, TAG_STRING);
+            put_size(e->message, s->length);
+            put_bytes(e->message, s->data, s->length);
+            return true;
+        }
+        case OBJECT_TABLE:
+            return write_table(e, &AS_TABLE(v), depth);
+        case OBJECT_CHANNEL:
+            put_channel(e->message, AS_CHANNEL(v));
+            return true;
+        default:
+            return false;
+    }
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+static bool write_value(struct encoder *e, value v, int depth)
+{
+    switch (value_type(v)) {
+        case VAL_NIL:
+            put_tag(e->message, TAG_NIL);
+            return true;
+        case VAL_BOOL:
+            put_tag(e->message, AS_BOOL(v) ? TAG_TRUE : TAG_FALSE);
+            return true;
+        case VAL_INT: {
+            int64_t i = AS_INT(v);
+            put_tag(e->message, TAG_INT);
+            put_bytes(e->message, &i, sizeof(i));
+            return true;
+        }
+        case VAL_NUMBER: {
+            double d = AS_NUMBER(v);
+            put_tag(e->message, TAG_NUMBER);
+            put_bytes(e->message, &d, sizeof(d));
+            return true;
+        }
+        case VAL_OBJECT:
+            return write_object(e, v, depth);
+        case VAL_EMPTY:
+            return false;
+    }
+    return false;
+}
+
+bool clone_write(struct message *message, int count, const value *values)
+{
+    struct encoder e = {.message = message, .nobjects = 0};
+    table_init(&e.seen);
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++) { ok = write_value(&e, values[i], 0); }
+    table_free(&e.seen);
+    return ok;
+}
+
+/*
+ * Every string, table and channel is entered in keep as soon as it
+ * exists, under its object index: that is what seen refers to, and it
+ * keeps what has been read alive while reading the rest allocates.
+ */
+struct decoder {
+    const struct message *message;
+    const uint8_t *p;
+    struct object_table *keep;
+    int64_t nobjects;
+    value *scratch;  // a stack slot rooting each new object until it is in keep
+};
+
+static size_t get_size(struct decoder *d)
+{
+    size_t size;
+    memcpy(&size, d->p, sizeof(size));
+    d->p += sizeof(size);
+    return size;
+}
+
+/** Give the new object @p v the next object index */
+static void keep(struct decoder *d, value v)
+{
+    *d->scratch = v;
+    table_set(&d->keep->table, INT_VAL(d->nobjects++), v);
+    gc_write_barrier(&d->keep->object, v);
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+static value read_value(struct decoder *d)
+{
+    enum clone_tag tag = *d->p++;
+    switch (tag) {
+        case TAG_NIL:
+            return NIL_VAL;
+        case TAG_TRUE:
+            return BOOL_VAL(true);
+        case TAG_FALSE:
+            return BOOL_VAL(false);
+        case TAG_INT: {
+            int64_t i;
+            memcpy(&i, d->p, sizeof(i));
+            d->p += sizeof(i);
+            return INT_VAL(i);
+        }
+        case TAG_NUMBER: {
+            double n;
+            memcpy(&n, d->p, sizeof(n));
+            d->p += sizeof(n);
+            return NUMBER_VAL(n);
+        }
+        case TAG_STRING: {
+            size_t length = get_size(d);
+            value s = OBJECT_VAL(object_string_allocate((const char *)d->p, length));
+            d->p += length;
+            keep(d, s);
+            return s;
+        }
+        case TAG_TABLE: {
+            size_t count = get_size(d);
+            struct object_table *t = object_table_new();
+            keep(d, OBJECT_VAL(t));
+            for (size_t i = 0; i < count; i++) {
+                value key = read_value(d);
+                value v = read_value(d);
+                table_set(&t->table, key, v);
+                gc_write_barrier(&t->object, key);
+                gc_write_barrier(&t->object, v);
+            }
+            return OBJECT_VAL(t);
+        }
+        case TAG_SEEN: {
+            value v = NIL_VAL;
+            table_get(&d->keep->table, INT_VAL((int64_t)get_size(d)), &v);
+            return v;
+        }
+        case TAG_CHANNEL: {
+            value c = OBJECT_VAL(object_channel_new(d->message->channels[get_size(d)]));
+            keep(d, c);
+            return c;
+        }
+    }
+    return NIL_VAL;
+}
+
+int clone_read(struct vm *vm, const struct message *message)
+{
+    struct decoder d = {.message = message, .p = message->data, .nobjects = 0};
+    value *base = vm->sp;
+    d.keep = object_table_new();
+    *vm->sp++ = OBJECT_VAL(d.keep);
+
+    while (d.p < message->data + message->size) {
+        d.scratch = vm->sp++;
+        *d.scratch = NIL_VAL;
+        *d.scratch = read_value(&d);
+    }
+
+    int count = (int)(vm->sp - base - 1);
+    memmove(base, base + 1, count * sizeof(value));
+    vm->sp--;
+    return count;
+}
@@ -0,0 +1,67 @@
+#ifndef DPLANG_CLONE_H
+#define DPLANG_CLONE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+struct vm;
+struct channel;
+
+/*
+ * Structured clone of values between VMs.
+ *
+ * VMs share no objects, so a value handed to another VM is flattened into
+ * a message and rebuilt from it in the receiving VM's heap.  Nil, booleans,
+ * numbers, strings and tables of them can be cloned, as can channels,
+ * which the receiver gets a handle on rather than a copy of.  A table,
+ * string or channel reached twice is encoded once and referred back to, so
+ * the clone keeps its sharing and cycles.  Functions, classes and instances
+ * cannot be cloned.
+ *
+ * Each value is a u8 tag and its payload, in host byte order since a
+ * message never leaves the process:
+ *
+ *   nil, true, false:  nothing
+ *   int, number:       the 8 bytes of the value
+ *   string:            size_t length, then the bytes
+ *   table:             size_t count, then each key followed by its value
+ *   seen:              size_t index of an earlier string, table or channel, counting from 0
+ *   channel:           size_t index into the message's channels
+ */
+
+/** Deepest nesting of tables clone_write() follows */
+#define CLONE_MAX_DEPTH 256
+
+struct message {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    struct channel **channels;  // each holds a reference of the message's own
+    size_t nchannels;
+};
+
+void message_init(struct message *message);
+
+/** Free @p message's buffers and drop its references to channels */
+void message_free(struct message *message);
+
+/**
+ * Encode @p count @p values into the empty @p message
+ *
+ * Exits if out of memory.
+ *
+ * @return false if a value holds something that cannot be cloned, leaving @p message unusable
+ */
+bool clone_write(struct message *message, int count, const value *values);
+
+/**
+ * Rebuild the values in @p message in @p vm and push them on its stack
+ *
+ * The stack must have room for one more value than the message holds.
+ *
+ * @return the number of values pushed
+ */
+int clone_read(struct vm *vm, const struct message *message);
+#endif
@@ -3,10 +3,13 @@
 #include "scanner.h"
 #include "object.h"
 #include "parser.h"
+#include "peephole.h"
 #include "memory.h"
 #include "util.h"
+#include "vm.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -36,8 +39,6 @@ static void *memmem(const void *haystack, size_t haystack_len, const void *needl
 #define SCRIPT_NAME        "<script>"
 #define SCRIPT_NAME_LENGTH strlen(SCRIPT_NAME)
 
-#define BINARY_LITERAL_MAX_LENGTH 32
-
 #define ARG_MAX UINT8_MAX
 
 #define DUMMY_JUMP_TARGET 0xFFFF
@@ -81,6 +82,8 @@ struct block {
 };
 
 struct compiler {
+    struct vm *vm;  // resolves global slots and roots objects while they are being made
+    int flags;      // enum compile_flags
     struct object_function *function;
     enum function_type type;
     struct local locals[UINT8_MAX + 1];
@@ -91,10 +94,9 @@ struct compiler {
     struct compiler *enclosing;
     struct class_compiler *current_class;
     struct block *block;
+    int last_call;  // offset of the most recent OP_CALL, -1 if none
 };
 
-static struct compiler *current = NULL;
-
 static void grouping(struct parser *parser, enum precedence precedence, void *userdata);
 static void binary(struct parser *parser, enum precedence precedence, void *userdata);
 static void unary(struct parser *parser, enum precedence precedence, void *userdata);
@@ -109,6 +111,8 @@ static void dot(struct parser *parser, enum precedence precedence, void *userdat
 static void this_(struct parser *parser, enum precedence precedence, void *userdata);
 static void super_(struct parser *parser, enum precedence precedence, void *userdata);
 static void index_(struct parser *parser, enum precedence precedence, void *userdata);
+static void yield_(struct parser *parser, enum precedence precedence, void *userdata);
+static void resume_(struct parser *parser, enum precedence precedence, void *userdata);
 
 struct parse_rule rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call,   PREC_CALL      },
@@ -126,15 +130,17 @@ struct parse_rule rules[] = {
     [TOKEN_STAR] = {NULL,     binary, PREC_FACTOR    },
     [TOKEN_PERCENT] = {NULL,     binary, PREC_FACTOR    },
     [TOKEN_TILDE] = {unary,    NULL,   PREC_NONE      },
+    [TOKEN_AMPERSAND] = {NULL,     binary, PREC_BIT_AND   },
+    [TOKEN_PIPE] = {NULL,     binary, PREC_BIT_OR    },
     [TOKEN_BANG] = {unary,    NULL,   PREC_NONE      },
     [TOKEN_BANG_EQUAL] = {NULL,     binary, PREC_EQUALITY  },
     [TOKEN_EQUAL] = {NULL,     NULL,   PREC_NONE      },
     [TOKEN_EQUAL_EQUAL] = {NULL,     binary, PREC_EQUALITY  },
     [TOKEN_GREATER] = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_GREATER_GREATER] = {NULL,     binary, PREC_TERM      },
+    [TOKEN_GREATER_GREATER] = {NULL,     binary, PREC_SHIFT     },
     [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_LESS] = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_LESS_LESS] = {NULL,     binary, PREC_TERM      },
+    [TOKEN_LESS_LESS] = {NULL,     binary, PREC_SHIFT     },
     [TOKEN_LESS_EQUAL] = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_IDENTIFIER] = {variable, NULL,   PREC_NONE      },
     [TOKEN_STRING] = {string,   NULL,   PREC_NONE      },
@@ -148,14 +154,16 @@ struct parse_rule rules[] = {
     [TOKEN_IF] = {NULL,     NULL,   PREC_NONE      },
     [TOKEN_NIL] = {literal,  NULL,   PREC_NONE      },
     [TOKEN_OR] = {NULL,     or_,    PREC_OR        },
-    [TOKEN_CARET] = {NULL,     binary, PREC_NONE      },
+    [TOKEN_CARET] = {NULL,     binary, PREC_BIT_XOR   },
     [TOKEN_PRINT] = {NULL,     NULL,   PREC_NONE      },
+    [TOKEN_RESUME] = {resume_,  NULL,   PREC_NONE      },
     [TOKEN_RETURN] = {NULL,     NULL,   PREC_NONE      },
     [TOKEN_SUPER] = {super_,   NULL,   PREC_NONE      },
     [TOKEN_THIS] = {this_,    NULL,   PREC_NONE      },
     [TOKEN_TRUE] = {literal,  NULL,   PREC_NONE      },
     [TOKEN_VAR] = {NULL,     NULL,   PREC_NONE      },
     [TOKEN_WHILE] = {NULL,     NULL,   PREC_NONE      },
+    [TOKEN_YIELD] = {yield_,   NULL,   PREC_NONE      },
     [TOKEN_ERROR] = {NULL,     NULL,   PREC_NONE      },
     [TOKEN_EOF] = {NULL,     NULL,   PREC_NONE      },
 };
@@ -190,6 +198,24 @@ static inline void emit_opcode_args(struct compiler *compiler, enum opcode op, v
     chunk_write_opcode(&compiler->function->chunk, op, operands, length, compiler->parser->previous.line);
 }
 
+/**
+ * Emit an instruction whose operands are followed by the 16-bit index of a
+ * new inline cache
+ */
+static void emit_cached_opcode(struct compiler *compiler, enum opcode op, uint8_t *operands, size_t length)
+{
+    uint8_t bytes[UINT8_MAX];
+    int cache = chunk_add_cache(&compiler->function->chunk);
+    if (cache > UINT16_MAX) {
+        parser_error(compiler->parser, "Too many property accesses in one chunk");
+        cache = 0;
+    }
+    memcpy(bytes, operands, length);
+    bytes[length] = (uint8_t)(cache & 0xFF);  // NOLINT(readability-magic-numbers)
+    bytes[length + 1] = (uint8_t)(cache >> 8);  // NOLINT(readability-magic-numbers)
+    emit_opcode_args(compiler, op, bytes, length + 2);
+}
+
 static inline void emit_opcode(struct compiler *compiler, enum opcode op)
 {
     chunk_write_byte(&compiler->function->chunk, op, compiler->parser->previous.line);
@@ -247,8 +273,12 @@ static void emit_return(struct compiler *compiler)
 
 static uint8_t make_constant(struct compiler *compiler, value value)
 {
-    gc_mark_value(value);
+    // Keep a new object reachable while the constant table grows
+    struct vm *vm = compiler->vm;
+    *vm->sp++ = value;
     int ret = chunk_add_constant(&compiler->function->chunk, value);
+    gc_write_barrier(&compiler->function->object, value);
+    vm->sp--;
     if (ret > UINT8_MAX) {
         parser_error(compiler->parser, "Too many constants in one chunk");
         return 0;
@@ -256,19 +286,25 @@ static uint8_t make_constant(struct compiler *compiler, value value)
     return (uint8_t)ret;
 }
 
-static void compiler_init(struct compiler *compiler, struct parser *parser, enum function_type type)
+static void compiler_init(struct compiler *compiler, struct compiler *enclosing, struct vm *vm, struct parser *parser,
+                          enum function_type type)
 {
+    compiler->vm = vm;
+    compiler->flags = (enclosing == NULL) ? COMPILE_DEFAULT : enclosing->flags;
     compiler->function = NULL;
     compiler->type = type;
     compiler->parser = parser;
-    compiler->enclosing = current;
+    compiler->enclosing = enclosing;
+    // Methods see the class they are declared in, for 'this' and 'super'
+    compiler->current_class = (type == TYPE_SCRIPT || enclosing == NULL) ? NULL : enclosing->current_class;
 
     compiler->nlocals = 0;
     compiler->scope_level = 0;
 
     compiler->block = NULL;
+    compiler->last_call = -1;
 
-    current = compiler;
+    vm->compiler = compiler;
 
     compiler->function = object_function_new(NULL);
     if (type != TYPE_SCRIPT) {
@@ -277,6 +313,7 @@ static void compiler_init(struct compiler *compiler, struct parser *parser, enum
     } else {
         compiler->function->name = object_string_allocate(SCRIPT_NAME, SCRIPT_NAME_LENGTH);
     }
+    gc_write_barrier(&compiler->function->object, OBJECT_VAL(compiler->function->name));
     memset(compiler->upvalues, 0x00, sizeof(compiler->upvalues));
 
     struct local *local = &compiler->locals[compiler->nlocals++];
@@ -297,6 +334,25 @@ static uint8_t identifier_constant(struct compiler *compiler, struct token *name
     return make_constant(compiler, OBJECT_VAL(s));
 }
 
+/**
+ * Emit a global variable access
+ *
+ * Globals are resolved to a slot in the VM's global array at compile time.
+ * Once there are more globals than a 16-bit operand can address, the
+ * name is looked up at runtime instead.
+ */
+static void emit_global(struct compiler *compiler, enum opcode by_slot, enum opcode by_name, struct token *name)
+{
+    int slot = vm_global_slot(compiler->vm, name->start, name->length);
+    if (slot >= 0 && slot <= UINT16_MAX) {
+        uint8_t bytes[] = {U16LSB(slot), U16MSB(slot)};
+        emit_opcode_args(compiler, by_slot, bytes, sizeof(bytes));
+    } else {
+        uint8_t constant = identifier_constant(compiler, name);
+        emit_opcode_args(compiler, by_name, &constant, sizeof(constant));
+    }
+}
+
 static void add_local(struct compiler *compiler, struct token name)
 {
     if (compiler->nlocals > UINT8_MAX) {
@@ -393,19 +449,11 @@ static void declare_variable(struct compiler *compiler)
     add_local(compiler, *name);
 }
 
-static uint8_t parse_variable(struct compiler *compiler, const char *errmsg)
+static struct token parse_variable(struct compiler *compiler, const char *errmsg)
 {
     parser_consume(compiler->parser, TOKEN_IDENTIFIER, errmsg);
     declare_variable(compiler);
-
-    /* Locals aren't looked up by name at runtime, so
-     * they don't need to be entered into the constant table
-     */
-    if (compiler->scope_level > 0) {
-        return 0;
-    }
-
-    return identifier_constant(compiler, &compiler->parser->previous);
+    return compiler->parser->previous;
 }
 
 static void mark_initialized(struct compiler *compiler)
@@ -416,14 +464,14 @@ static void mark_initialized(struct compiler *compiler)
     compiler->locals[compiler->nlocals - 1].level = compiler->scope_level;
 }
 
-static void define_variable(struct compiler *compiler, uint8_t global)
+static void define_variable(struct compiler *compiler, struct token name)
 {
     // Local variables don't have associated runtime code for declaration
     if (compiler->scope_level > 0) {
         mark_initialized(compiler);
         return;
     }
-    emit_opcode_args(compiler, OP_DEFINE_GLOBAL, &global, sizeof(global));
+    emit_global(compiler, OP_DEFINE_GLOBAL_SLOT, OP_DEFINE_GLOBAL, &name);
 }
 
 static uint8_t argument_list(struct compiler *compiler)
@@ -461,8 +509,7 @@ static void block(struct compiler *compiler)
 static void function(struct compiler *compiler, enum function_type type)
 {
     struct compiler inner;
-    compiler_init(&inner, compiler->parser, type);
-    current = &inner;
+    compiler_init(&inner, compiler, compiler->vm, compiler->parser, type);
     scope_enter(&inner);
 
     parser_consume(inner.parser, TOKEN_LEFT_PAREN, "Expect '(' after function name");
@@ -473,8 +520,8 @@ static void function(struct compiler *compiler, enum function_type type)
             if (inner.function->arity > ARG_MAX) {
                 parser_error_at_current(inner.parser, "Can't have more than 255 parameters");
             }
-            uint8_t constant = parse_variable(&inner, "Expect parameter name");
-            define_variable(&inner, constant);
+            struct token param = parse_variable(&inner, "Expect parameter name");
+            define_variable(&inner, param);
         } while (parser_match(inner.parser, TOKEN_COMMA));
     }
     parser_consume(inner.parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
@@ -514,7 +561,7 @@ static void class_declaration(struct compiler *compiler)
     declare_variable(compiler);
 
     emit_opcode_args(compiler, OP_CLASS, &name_constant, sizeof(name_constant));
-    define_variable(compiler, name_constant);
+    define_variable(compiler, class_name);
 
     struct class_compiler class_compiler = {
         .enclosing = compiler->current_class,
@@ -532,7 +579,7 @@ static void class_declaration(struct compiler *compiler)
 
         scope_enter(compiler);
         add_local(compiler, synthetic_token(compiler, "super"));
-        define_variable(compiler, 0);
+        define_variable(compiler, synthetic_token(compiler, "super"));
 
         named_variable(compiler, class_name, false);
         emit_opcode(compiler, OP_INHERIT);
@@ -559,15 +606,15 @@ static void class_declaration(struct compiler *compiler)
 // NOLINTNEXTLINE(misc-no-recursion)
 static void func_declaration(struct compiler *compiler)
 {
-    uint8_t global = parse_variable(compiler, "Expected function name");
+    struct token name = parse_variable(compiler, "Expected function name");
     mark_initialized(compiler);
     function(compiler, TYPE_FUNCTION);
-    define_variable(compiler, global);
+    define_variable(compiler, name);
 }
 
 static void var_declaration(struct compiler *compiler)
 {
-    uint8_t global = parse_variable(compiler, "Expect variable name");
+    struct token name = parse_variable(compiler, "Expect variable name");
 
     if (parser_match(compiler->parser, TOKEN_EQUAL)) {
         expression(compiler);
@@ -576,7 +623,7 @@ static void var_declaration(struct compiler *compiler)
     }
     parser_consume(compiler->parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration");
 
-    define_variable(compiler, global);
+    define_variable(compiler, name);
 }
 
 static void expression_statement(struct compiler *compiler)
@@ -745,6 +792,15 @@ static void return_statement(struct compiler *compiler)
         }
         expression(compiler);
         parser_consume(compiler->parser, TOKEN_SEMICOLON, "Expect ';' after return value");
+
+        /* A call that is the last thing the returned expression does can
+         * reuse this function's frame.  The OP_RETURN still follows, for
+         * callees (natives, classes) that don't replace the frame.
+         */
+        struct chunk *chunk = &compiler->function->chunk;
+        if (compiler->last_call >= 0 && compiler->last_call == chunk->count - 2) {
+            chunk->code[compiler->last_call] = OP_TAIL_CALL;
+        }
         emit_opcode(compiler, OP_RETURN);
     }
 }
@@ -880,10 +936,13 @@ static void named_variable(struct compiler *compiler, struct token name, bool as
             arg = (uint8_t)ret;
         } else {
             // Assume global will be available at runtime
-            ret = identifier_constant(compiler, &name);
-            op_get = OP_GET_GLOBAL;
-            op_set = OP_SET_GLOBAL;
-            arg = (uint8_t)ret;
+            if (assign_ok && parser_match(compiler->parser, TOKEN_EQUAL)) {
+                expression(compiler);
+                emit_global(compiler, OP_SET_GLOBAL_SLOT, OP_SET_GLOBAL, &name);
+            } else {
+                emit_global(compiler, OP_GET_GLOBAL_SLOT, OP_GET_GLOBAL, &name);
+            }
+            return;
         }
     }
 
@@ -976,6 +1035,15 @@ static void binary(struct parser *parser, enum precedence precedence, void *user
             emit_opcode(compiler, OP_GREATER);
             emit_opcode(compiler, OP_NOT);
             break;
+        case TOKEN_AMPERSAND:
+            emit_opcode(compiler, OP_BIT_AND);
+            break;
+        case TOKEN_PIPE:
+            emit_opcode(compiler, OP_BIT_OR);
+            break;
+        case TOKEN_CARET:
+            emit_opcode(compiler, OP_BIT_XOR);
+            break;
         default:
             return;
     }
@@ -988,6 +1056,7 @@ static void call(struct parser *parser, enum precedence precedence, void *userda
     struct compiler *compiler = (struct compiler *)userdata;
 
     uint8_t arg_count = argument_list(compiler);
+    compiler->last_call = compiler->function->chunk.count;
     emit_opcode_args(compiler, OP_CALL, &arg_count, sizeof(arg_count));
 }
 
@@ -1002,7 +1071,7 @@ static void dot(struct parser *parser, enum precedence precedence, void *userdat
 
     if (assign_ok && parser_match(parser, TOKEN_EQUAL)) {
         expression(compiler);
-        emit_opcode_args(compiler, OP_SET_PROPERTY, &name, sizeof(name));
+        emit_cached_opcode(compiler, OP_SET_PROPERTY, &name, sizeof(name));
     } else if (parser_match(parser, TOKEN_LEFT_PAREN)) {
         /*
          * Take advantage of an optimization opportunity.
@@ -1017,9 +1086,9 @@ static void dot(struct parser *parser, enum precedence precedence, void *userdat
             name,
             arg_count,
         };
-        emit_opcode_args(compiler, OP_INVOKE, args, sizeof(args));
+        emit_cached_opcode(compiler, OP_INVOKE, args, sizeof(args));
     } else {
-        emit_opcode_args(compiler, OP_GET_PROPERTY, &name, sizeof(name));
+        emit_cached_opcode(compiler, OP_GET_PROPERTY, &name, sizeof(name));
     }
 }
 
@@ -1038,6 +1107,9 @@ static void unary(struct parser *parser, enum precedence precedence, void *userd
         case TOKEN_BANG:
             emit_opcode(compiler, OP_NOT);
             break;
+        case TOKEN_TILDE:
+            emit_opcode(compiler, OP_BIT_NOT);
+            break;
         default:
             break;
     }
@@ -1047,22 +1119,33 @@ static void number(struct parser *parser, enum precedence precedence, void *user
 {
     (void)precedence;
     struct compiler *compiler = (struct compiler *)userdata;
-    double val;
-    if (parser->previous.start[0] == '0' && tolower(parser->previous.start[1]) == 'b') {
-        if (parser->previous.length > BINARY_LITERAL_MAX_LENGTH) {
-            parser_error_at(parser, &parser->previous, "Invalid binary literal");
+    const char *start = parser->previous.start;
+    value val;
+
+    if (start[0] == '0' && (tolower(start[1]) == 'b' || tolower(start[1]) == 'x')) {
+        // strtoull() doesn't understand the 0b prefix, so skip both kinds
+        int base = tolower(start[1]) == 'b' ? 2 : 16;  // NOLINT(readability-magic-numbers)
+        errno = 0;
+        unsigned long long u = strtoull(start + 2, NULL, base);
+        if (errno == ERANGE || u > (unsigned long long)INT_VALUE_MAX) {
+            parser_error_at(parser, &parser->previous, "Integer literal out of range");
+            u = 0;
         }
-        uint32_t u32 = 0;
-        for (uint32_t i = 0; i < parser->previous.length; i++) {
-            u32 <<= 1;
-            u32 |= (parser->previous.start[i] & 1);
+        val = INT_VAL((int64_t)u);
+    } else if (memchr(start, '.', parser->previous.length) == NULL &&
+               memchr(start, 'e', parser->previous.length) == NULL) {
+        // Decimal integers too large to be represented become doubles
+        errno = 0;
+        long long i = strtoll(start, NULL, 10);  // NOLINT(readability-magic-numbers)
+        if (errno == ERANGE || !int_fits(i)) {
+            val = NUMBER_VAL(strtod(start, NULL));
+        } else {
+            val = INT_VAL((int64_t)i);
         }
-        val = (double)u32;
-
     } else {
-        val = strtod(parser->previous.start, NULL);
+        val = NUMBER_VAL(strtod(start, NULL));
     }
-    uint8_t constant = make_constant(compiler, NUMBER_VAL(val));
+    uint8_t constant = make_constant(compiler, val);
 
     emit_opcode_args(compiler, OP_CONSTANT, &constant, sizeof(constant));
 }
@@ -1155,7 +1238,7 @@ static size_t string_escape(char *dst, const char *src, size_t escaped_length)
         }
     }
 
-    *d++ = '\0';
+    *d = '\0';
 
     return (size_t)(d - dst);
 }
@@ -1165,13 +1248,14 @@ static void string(struct parser *parser, enum precedence precedence, void *user
     (void)precedence;
     struct compiler *compiler = (struct compiler *)userdata;
 
-    // TODO: Handle escape sequences
+    // Unescaping never makes the string longer, so the quoted length is always enough
     size_t escaped_length = parser->previous.length - 2;
-    char *unescaped = reallocate(NULL, 0, escaped_length);
+    char *unescaped = reallocate(NULL, 0, escaped_length + 1);
 
     size_t unescaped_length = string_escape(unescaped, parser->previous.start + 1, escaped_length);
 
     struct object_string *s = object_string_allocate(unescaped, unescaped_length);
+    reallocate(unescaped, escaped_length + 1, 0);
     uint8_t constant = make_constant(compiler, OBJECT_VAL(s));
     emit_opcode_args(compiler, OP_CONSTANT, &constant, sizeof(constant));
 }
@@ -1218,7 +1302,7 @@ static void super_(struct parser *parser, enum precedence precedence, void *user
             arg_count,
         };
         named_variable(compiler, synthetic_token(compiler, "super"), false);
-        emit_opcode_args(compiler, OP_SUPER_INVOKE, args, sizeof(args));
+        emit_cached_opcode(compiler, OP_SUPER_INVOKE, args, sizeof(args));
     } else {
         named_variable(compiler, synthetic_token(compiler, "super"), false);
         emit_opcode_args(compiler, OP_GET_SUPER, &name, sizeof(name));
@@ -1236,6 +1320,53 @@ static void this_(struct parser *parser, enum precedence precedence, void *userd
     variable(parser, PREC_PRIMARY, userdata);
 }
 
+/*
+ * yield [value]
+ *
+ * Suspend the running coroutine, handing value (nil if there is none) to
+ * whatever resumed it.  Evaluates to the value it is next resumed with.
+ */
+// NOLINTNEXTLINE(misc-no-recursion)
+static void yield_(struct parser *parser, enum precedence precedence, void *userdata)
+{
+    (void)precedence;
+    struct compiler *compiler = (struct compiler *)userdata;
+    if (compiler->type == TYPE_SCRIPT) {
+        parser_error(parser, "Can't yield from top-level code");
+    }
+
+    if (parser_check(parser, TOKEN_SEMICOLON) || parser_check(parser, TOKEN_RIGHT_PAREN) ||
+        parser_check(parser, TOKEN_RIGHT_BRACKET) || parser_check(parser, TOKEN_COMMA)) {
+        emit_opcode(compiler, OP_NIL);
+    } else {
+        parser_precedence(parser, PREC_OR, compiler);
+    }
+    emit_opcode(compiler, OP_YIELD);
+}
+
+/*
+ * resume(coroutine[, value])
+ *
+ * Run the coroutine until it yields or returns, passing it value (nil if
+ * there is none), and evaluate to what it yielded or returned.
+ */
+// NOLINTNEXTLINE(misc-no-recursion)
+static void resume_(struct parser *parser, enum precedence precedence, void *userdata)
+{
+    (void)precedence;
+    struct compiler *compiler = (struct compiler *)userdata;
+
+    parser_consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'resume'");
+    expression(compiler);
+    if (parser_match(parser, TOKEN_COMMA)) {
+        expression(compiler);
+    } else {
+        emit_opcode(compiler, OP_NIL);
+    }
+    parser_consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after resume arguments");
+    emit_opcode(compiler, OP_RESUME);
+}
+
 static void and_(struct parser *parser, enum precedence precedence, void *userdata)
 {
     (void)precedence;
@@ -1262,13 +1393,18 @@ static struct object_function *end(struct compiler *compiler)
 {
     emit_return(compiler);
     struct object_function *func = compiler->function;
+    if (!compiler->parser->had_error && !(compiler->flags & COMPILE_NO_FUSION)) {
+        peephole_fuse(&func->chunk);
+    }
+    // slot 0 and the arguments are already on the stack when the call starts
+    func->max_stack = 1 + func->arity + chunk_max_stack(&func->chunk);
 #ifdef DEBUG_BYTECODE
     if (!compiler->parser->had_error) {
         chunk_disassemble(&compiler->function->chunk, func->name != NULL ? func->name->data : "<script>");
     }
 #endif
 
-    current = current->enclosing;
+    compiler->vm->compiler = compiler->enclosing;
 
     return func;
 }
@@ -1292,7 +1428,7 @@ static void scope_exit(struct compiler *compiler)
     }
 }
 
-struct object_function *compile(const char *source)
+struct object_function *compile(struct vm *vm, const char *source, int flags)
 {
     struct parser parser = {
         .had_error = false,
@@ -1302,7 +1438,8 @@ struct object_function *compile(const char *source)
 
     struct compiler compiler;
 
-    compiler_init(&compiler, &parser, TYPE_SCRIPT);
+    compiler_init(&compiler, NULL, vm, &parser, TYPE_SCRIPT);
+    compiler.flags = flags;
 
     while (!parser_match(&parser, TOKEN_EOF)) { declaration(&compiler); }
 
@@ -1311,11 +1448,11 @@ struct object_function *compile(const char *source)
     return parser.had_error ? NULL : func;
 }
 
-void compiler_gc_roots(void)
+void compiler_gc_roots(struct vm *vm)
 {
-    struct compiler *compiler = current;
+    struct compiler *compiler = vm->compiler;
     while (compiler != NULL) {
-        gc_mark_object(&compiler->function->object);
+        gc_mark_object((struct object *)compiler->function);
         compiler = compiler->enclosing;
     }
 }
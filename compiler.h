@@ -1,8 +1,25 @@
 #ifndef DPLANG_COMPILER_H
 #define DPLANG_COMPILER_H
 #include "chunk.h"
-struct object_function *compile(const char *source);
 
-void compiler_gc_roots(void);
+struct vm;
+
+/** Flags for compile() */
+enum compile_flags {
+    COMPILE_DEFAULT = 0,
+    COMPILE_NO_FUSION = 1 << 0,  // leave instruction pairs unfused, e.g. when reading disassembly
+};
+
+/**
+ * Compile a script to its top-level function
+ *
+ * @param vm the VM the script will run in, never NULL: its heap holds the
+ *           new objects and its globals are resolved to slots
+ * @return NULL if the script has errors
+ */
+struct object_function *compile(struct vm *vm, const char *source, int flags);
+
+/** Mark the functions @p vm is in the middle of compiling */
+void compiler_gc_roots(struct vm *vm);
 
 #endif
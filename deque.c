@@ -0,0 +1,126 @@
+#include <stdlib.h>
+
+#include "deque.h"
+#include "util.h"
+
+struct deque_ring {
+    int64_t capacity;  // a power of two
+    struct deque_ring *next;
+    _Atomic(void *) items[];
+};
+
+static struct deque_ring *ring_new(int64_t capacity)
+{
+    struct deque_ring *ring = malloc(sizeof(*ring) + (size_t)capacity * sizeof(ring->items[0]));
+    if (ring != NULL) {
+        ring->capacity = capacity;
+        ring->next = NULL;
+    }
+    return ring;
+}
+
+static _Atomic(void *) *ring_slot(struct deque_ring *ring, int64_t i)
+{
+    return &ring->items[i & (ring->capacity - 1)];
+}
+
+int deque_init(struct deque *deque)
+{
+    struct deque_ring *ring = ring_new(DEQUE_INITIAL_CAPACITY);
+    if (ring == NULL) {
+        return -1;
+    }
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->ring, ring);
+    deque->retired = NULL;
+    return 0;
+}
+
+void deque_free(struct deque *deque)
+{
+    free(atomic_load_explicit(&deque->ring, memory_order_relaxed));
+    while (deque->retired != NULL) {
+        struct deque_ring *next = deque->retired->next;
+        free(deque->retired);
+        deque->retired = next;
+    }
+}
+
+/** Move the items from @p top to @p bottom into a ring twice the size */
+static struct deque_ring *grow(struct deque *deque, struct deque_ring *ring, int64_t top, int64_t bottom)
+{
+    struct deque_ring *bigger = ring_new(ring->capacity * 2);
+    if (bigger == NULL) {
+        exit(1);
+    }
+    for (int64_t i = top; i < bottom; i++) {
+        void *item = atomic_load_explicit(ring_slot(ring, i), memory_order_relaxed);
+        atomic_store_explicit(ring_slot(bigger, i), item, memory_order_relaxed);
+    }
+    ring->next = deque->retired;
+    deque->retired = ring;
+    atomic_store_explicit(&deque->ring, bigger, memory_order_release);
+    return bigger;
+}
+
+void deque_push(struct deque *deque, void *item)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    struct deque_ring *ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    if (unlikely(bottom - top > ring->capacity - 1)) {
+        ring = grow(deque, ring, top, bottom);
+    }
+    atomic_store_explicit(ring_slot(ring, bottom), item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+void *deque_take(struct deque *deque)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    struct deque_ring *ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    void *item = atomic_load_explicit(ring_slot(ring, bottom), memory_order_relaxed);
+    if (top == bottom) {
+        // The last item: race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            item = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+void *deque_steal(struct deque *deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    struct deque_ring *ring = atomic_load_explicit(&deque->ring, memory_order_acquire);
+    void *item = atomic_load_explicit(ring_slot(ring, top), memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return item;
+}
+
+bool deque_empty(struct deque *deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    return top >= bottom;
+}
@@ -0,0 +1,45 @@
+#ifndef DPLANG_DEQUE_H
+#define DPLANG_DEQUE_H
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Work-stealing deque of pointers.
+ *
+ * One thread, the owner, pushes and takes at the bottom like a stack;
+ * any other thread may steal from the top.  This is the Chase-Lev deque
+ * as given for C11 atomics by Le et al., "Correct and Efficient
+ * Work-Stealing for Weak Memory Models".  The owner grows the ring by
+ * copying it into one twice the size; thieves may still be reading the
+ * old one, so it is only freed by deque_free().
+ */
+
+#define DEQUE_INITIAL_CAPACITY 1024
+
+struct deque_ring;
+
+struct deque {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(struct deque_ring *) ring;
+    struct deque_ring *retired;  // rings grown out of, linked through their next
+};
+
+/** @return 0, or -1 if out of memory */
+int deque_init(struct deque *deque);
+
+void deque_free(struct deque *deque);
+
+/** Push @p item, which must not be NULL; owner only.  Exits if out of memory */
+void deque_push(struct deque *deque, void *item);
+
+/** Take the item pushed last; owner only.  @return NULL if there is none */
+void *deque_take(struct deque *deque);
+
+/** Steal the item pushed first.  @return NULL if there is none, or another thread got it first */
+void *deque_steal(struct deque *deque);
+
+/** True if @p deque looked empty; only a hint while other threads use it */
+bool deque_empty(struct deque *deque);
+#endif
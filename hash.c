@@ -21,8 +21,35 @@ hash_t hash_string(const char *s, size_t length)
     return hash;
 }
 
+#define FNV64_PRIME 0x100000001b3
+
+uint64_t hash_bytes64(const void *data, size_t length, uint64_t hash)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV64_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * Integers hash to themselves, folded to 32 bits, so runs of integer keys
+ * fill consecutive table slots
+ */
+hash_t hash_int(int64_t i)
+{
+    return (hash_t)((uint64_t)i ^ ((uint64_t)i >> 32));  // NOLINT(readability-magic-numbers)
+}
+
 hash_t hash_double(double d)
 {
+    // Integral doubles compare equal to integers, so they must hash the same
+    int64_t i;
+    if (value_double_to_int(d, &i)) {
+        return hash_int(i);
+    }
+
     union bit_cast {
         double v;
         uint32_t ints[2];
@@ -53,15 +80,17 @@ static hash_t hash_object(struct object *obj)
 // NOLINTBEGIN(readability-magic-numbers)
 hash_t hash_value(value v)
 {
-    switch (v.type) {
+    switch (value_type(v)) {
         case VAL_BOOL:
             return AS_BOOL(v) ? 3 : 5;
         case VAL_NIL:
             return 7;
         case VAL_NUMBER:
             return hash_double(AS_NUMBER(v));
+        case VAL_INT:
+            return hash_int(AS_INT(v));
         case VAL_OBJECT:
-            return hash_object(v.as.object);
+            return hash_object(AS_OBJECT(v));
         case VAL_EMPTY:
             return 0;
         default:
@@ -9,4 +9,15 @@ typedef uint32_t hash_t;
 hash_t hash_string(const char *s, size_t length);
 hash_t hash_value(value v);
 hash_t hash_double(double d);
+hash_t hash_int(int64_t i);
+
+/** Initial value for hash_bytes64() */
+#define HASH64_SEED 0xcbf29ce484222325
+
+/**
+ * 64-bit FNV-1a of @p length bytes, continuing from @p hash
+ *
+ * Wide enough to name files by their contents; pass HASH64_SEED to start.
+ */
+uint64_t hash_bytes64(const void *data, size_t length, uint64_t hash);
 #endif
@@ -0,0 +1,225 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "clone.h"
+#include "isolate.h"
+#include "object.h"
+#include "vm.h"
+
+struct job {
+    struct job *next;
+    char *code;  // the function, written by bytecode_write()
+    size_t size;
+    struct message args;
+    int stack_limit;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;      // a job was queued
+    pthread_cond_t finished;  // nothing is queued or running any more
+    struct job *head;
+    struct job *tail;
+    size_t queued;   // jobs waiting for a worker
+    size_t pending;  // jobs queued or running
+    size_t workers;  // threads started
+    size_t idle;     // threads waiting for a job
+    size_t blocked;  // threads running a job that waits on a channel
+    size_t limit;    // most threads to run jobs at once, 0 for one per CPU
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
+
+static _Thread_local bool on_worker = false;
+
+void isolate_set_workers(size_t workers)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.limit = workers;
+    // Idle workers beyond a lower limit go
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static size_t worker_limit(void)
+{
+    size_t limit = pool.limit;
+    if (limit == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        limit = (cpus > 0) ? (size_t)cpus : 1;
+    }
+    return (limit < ISOLATE_WORKERS_MAX) ? limit : ISOLATE_WORKERS_MAX;
+}
+
+static void job_free(struct job *job)
+{
+    message_free(&job->args);
+    free(job->code);
+    free(job);
+}
+
+/** Call the function in @p job in a VM of its own on this thread */
+static void job_run(struct job *job)
+{
+    struct vm vm;
+    vm_init(&vm);
+    vm.stack_limit = job->stack_limit;
+
+    const char *error;
+    struct object_function *function = bytecode_read(&vm, (const uint8_t *)job->code, job->size, &error);
+    if (function == NULL) {
+        fprintf(stderr, "Invalid isolate bytecode: %s\n", error);
+    } else {
+        *vm.sp++ = OBJECT_VAL(function);
+        struct object_closure *closure = object_closure_new(function);
+        vm.sp[-1] = OBJECT_VAL(closure);
+        vm_call(&vm, clone_read(&vm, &job->args));
+    }
+    vm_free(&vm);
+}
+
+static void *worker(void *arg);
+
+/** Start a worker if the idle ones have too much queued and fewer than the limit are running; pool.lock is held */
+static void start_worker(void)
+{
+    if (pool.queued > pool.idle && pool.workers - pool.blocked < worker_limit()) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, NULL) == 0) {
+            pthread_detach(thread);
+            pool.workers++;
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    (void)arg;
+    on_worker = true;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        // Workers started while others were blocked go once those are back, as do any beyond a lowered limit
+        if (pool.workers - pool.blocked > worker_limit()) {
+            pool.workers--;
+            // The signal that woke this worker may have been meant for a queued job
+            if (pool.head != NULL) {
+                pthread_cond_signal(&pool.work);
+            }
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+        if (pool.head == NULL) {
+            pool.idle++;
+            pthread_cond_wait(&pool.work, &pool.lock);
+            pool.idle--;
+            continue;
+        }
+        struct job *job = pool.head;
+        pool.head = job->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+        pool.queued--;
+        pthread_mutex_unlock(&pool.lock);
+
+        job_run(job);
+        job_free(job);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0) {
+            pthread_cond_broadcast(&pool.finished);
+        }
+    }
+    return NULL;
+}
+
+/** Queue @p job, starting a worker for it if the idle ones have enough to do and fewer than the limit are running */
+static void submit(struct job *job)
+{
+    pthread_mutex_lock(&pool.lock);
+    job->next = NULL;
+    if (pool.tail == NULL) {
+        pool.head = job;
+    } else {
+        pool.tail->next = job;
+    }
+    pool.tail = job;
+    pool.queued++;
+    pool.pending++;
+
+    start_worker();
+    pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+bool isolate_spawn(struct vm *vm, value callee, int arg_count, const value *args)
+{
+    if (!IS_CLOSURE(callee)) {
+        return false;
+    }
+    struct object_function *function = AS_CLOSURE(callee)->function;
+    if (function->nupvalues != 0 || function->arity != arg_count) {
+        return false;
+    }
+
+    struct job *job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        return false;
+    }
+    job->stack_limit = vm->stack_limit;
+    message_init(&job->args);
+    if (!clone_write(&job->args, arg_count, args)) {
+        job_free(job);
+        return false;
+    }
+
+    FILE *f = open_memstream(&job->code, &job->size);
+    if (f == NULL) {
+        job_free(job);
+        return false;
+    }
+    int ret = bytecode_write(vm, function, 0, f);
+    if (fclose(f) != 0 || ret != 0) {
+        job_free(job);
+        return false;
+    }
+
+    submit(job);
+    return true;
+}
+
+void isolate_block(void)
+{
+    if (!on_worker) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.blocked++;
+    // What this isolate waits for may be queued behind it
+    start_worker();
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void isolate_unblock(void)
+{
+    if (!on_worker) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.blocked--;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void isolate_wait(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0) {
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
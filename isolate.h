@@ -0,0 +1,54 @@
+#ifndef DPLANG_ISOLATE_H
+#define DPLANG_ISOLATE_H
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "value.h"
+
+struct vm;
+
+/*
+ * Isolates: functions run on a pool of worker threads, each in a VM of
+ * its own.
+ *
+ * Spawning a function copies it into a job as bytecode, see bytecode.h,
+ * along with a structured clone of its arguments, see clone.h.  A worker
+ * loads the function into a fresh VM and calls it, so it sees the
+ * builtins but none of the spawning script's globals, and shares nothing
+ * with any other VM.  Isolates talk to each other and to the script that
+ * spawned them over channels passed to them as arguments.
+ *
+ * Workers are started as jobs are queued, up to the limit set with
+ * isolate_set_workers() on those running at once, and jobs beyond that
+ * wait for a worker to be free.  An isolate waiting on a channel keeps its
+ * thread but gives up its place under the limit, so a worker can be
+ * started for the isolate that will feed it; the extra worker goes away
+ * after its job once the waiting isolate is running again.
+ */
+
+/** Most worker threads the pool can be given */
+#define ISOLATE_WORKERS_MAX 64
+
+/** Run up to @p workers isolates at once, 0 for one per CPU */
+void isolate_set_workers(size_t workers);
+
+/**
+ * Queue a call of @p callee with the @p arg_count @p args on the worker pool
+ *
+ * @p callee must be a closure that captures no upvalues and takes
+ * @p arg_count arguments, and the arguments must be clonable.
+ *
+ * @return false if they are not
+ */
+bool isolate_spawn(struct vm *vm, value callee, int arg_count, const value *args);
+
+/**
+ * Mark the calling thread, if it is a worker, as waiting on a channel until
+ * isolate_unblock(), letting the pool start another in its place
+ */
+void isolate_block(void);
+void isolate_unblock(void);
+
+/** Wait until every isolate spawned so far, and every one they spawn, has returned */
+void isolate_wait(void);
+#endif
@@ -0,0 +1,288 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "loop.h"
+
+/** Most events taken from the kernel per epoll_wait() */
+#define LOOP_BATCH 64
+
+struct loop_wait {
+    int fd;
+    int watched;  // the descriptor waited on, -1 for a timer
+    bool owned;   // a timerfd or a duplicate that goes with the wait
+    void *data;
+    struct loop_wait *prev;
+    struct loop_wait *next;
+};
+
+struct loop {
+    int epoll;
+    int wake;  // eventfd registered with a NULL pointer
+    struct loop_wait *waits;   // registered with epoll
+    struct loop_wait *closed;  // taken out by loop_closing(), to be handed back first
+    size_t waiting;
+    struct epoll_event ready[LOOP_BATCH];  // taken from the kernel, not yet handed back
+    int nready;
+    int next;
+};
+
+struct loop *loop_new(void)
+{
+    struct loop *loop = malloc(sizeof(*loop));
+    if (loop == NULL) {
+        return NULL;
+    }
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (loop->epoll < 0 || loop->wake < 0 || epoll_ctl(loop->epoll, EPOLL_CTL_ADD, loop->wake, &event) != 0) {
+        if (loop->epoll >= 0) {
+            close(loop->epoll);
+        }
+        if (loop->wake >= 0) {
+            close(loop->wake);
+        }
+        free(loop);
+        return NULL;
+    }
+    loop->waits = NULL;
+    loop->closed = NULL;
+    loop->waiting = 0;
+    loop->nready = 0;
+    loop->next = 0;
+    return loop;
+}
+
+/** Stands in for a wait that is gone in events taken from the kernel but not yet handed back */
+static struct loop_wait gone;
+
+void loop_free(struct loop *loop)
+{
+    struct loop_wait *wait = loop->waits;
+    while (wait != NULL) {
+        struct loop_wait *next = wait->next;
+        if (wait->owned) {
+            close(wait->fd);
+        }
+        free(wait);
+        wait = next;
+    }
+    while (loop->closed != NULL) {
+        wait = loop->closed;
+        loop->closed = wait->next;
+        free(wait);
+    }
+    close(loop->wake);
+    close(loop->epoll);
+    free(loop);
+}
+
+static bool add_wait(struct loop *loop, int fd, int watched, bool owned, uint32_t events, void *data)
+{
+    struct loop_wait *wait = malloc(sizeof(*wait));
+    if (wait == NULL) {
+        return false;
+    }
+    struct epoll_event event = {.events = events | EPOLLONESHOT, .data.ptr = wait};
+    if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+        // epoll keys waits by descriptor, so another wait on this one needs a descriptor of its own
+        int dup = (errno == EEXIST && !owned) ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+        if (dup < 0 || epoll_ctl(loop->epoll, EPOLL_CTL_ADD, dup, &event) != 0) {
+            if (dup >= 0) {
+                close(dup);
+            }
+            free(wait);
+            return false;
+        }
+        fd = dup;
+        owned = true;
+    }
+    wait->fd = fd;
+    wait->watched = watched;
+    wait->owned = owned;
+    wait->data = data;
+    wait->prev = NULL;
+    wait->next = loop->waits;
+    if (loop->waits != NULL) {
+        loop->waits->prev = wait;
+    }
+    loop->waits = wait;
+    loop->waiting++;
+    return true;
+}
+
+/** Take @p wait out of epoll and the list of registered waits */
+static void unregister(struct loop *loop, struct loop_wait *wait)
+{
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, wait->fd, NULL);
+    if (wait->owned) {
+        close(wait->fd);
+    }
+    if (wait->prev != NULL) {
+        wait->prev->next = wait->next;
+    } else {
+        loop->waits = wait->next;
+    }
+    if (wait->next != NULL) {
+        wait->next->prev = wait->prev;
+    }
+    // epoll may already have reported it
+    for (int i = loop->next; i < loop->nready; i++) {
+        if (loop->ready[i].data.ptr == wait) {
+            loop->ready[i].data.ptr = &gone;
+        }
+    }
+}
+
+/** Forget @p wait, which is over, and return its pointer */
+static void *finish_wait(struct loop *loop, struct loop_wait *wait)
+{
+    void *data = wait->data;
+    unregister(loop, wait);
+    loop->waiting--;
+    free(wait);
+    return data;
+}
+
+bool loop_watch(struct loop *loop, int fd, enum loop_event events, void *data)
+{
+    uint32_t mask = ((events & LOOP_READABLE) ? EPOLLIN : 0) | ((events & LOOP_WRITABLE) ? EPOLLOUT : 0);
+    return fd >= 0 && mask != 0 && add_wait(loop, fd, fd, false, mask, data);
+}
+
+bool loop_after(struct loop *loop, int64_t ms, void *data)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    // A zero expiry disarms a timerfd, so the shortest timer is a nanosecond
+    struct itimerspec spec = {0};
+    if (ms > 0) {
+        spec.it_value.tv_sec = ms / 1000;
+        spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+    } else {
+        spec.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(fd, 0, &spec, NULL) != 0 || !add_wait(loop, fd, -1, true, EPOLLIN, data)) {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+bool loop_cancel(struct loop *loop, void *data)
+{
+    bool cancelled = false;
+    struct loop_wait *wait = loop->waits;
+    while (wait != NULL) {
+        struct loop_wait *next = wait->next;
+        if (wait->data == data) {
+            finish_wait(loop, wait);
+            cancelled = true;
+        }
+        wait = next;
+    }
+    struct loop_wait **link = &loop->closed;
+    while (*link != NULL) {
+        wait = *link;
+        if (wait->data == data) {
+            *link = wait->next;
+            loop->waiting--;
+            free(wait);
+            cancelled = true;
+        } else {
+            link = &wait->next;
+        }
+    }
+    return cancelled;
+}
+
+void loop_closing(struct loop *loop, int fd)
+{
+    struct loop_wait *wait = loop->waits;
+    while (wait != NULL) {
+        struct loop_wait *next = wait->next;
+        if (wait->watched == fd) {
+            // A duplicate would keep the file open after the caller closes it
+            unregister(loop, wait);
+            wait->next = loop->closed;
+            loop->closed = wait;
+        }
+        wait = next;
+    }
+}
+
+size_t loop_waiting(const struct loop *loop)
+{
+    return loop->waiting;
+}
+
+int64_t loop_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;  // NOLINT(readability-magic-numbers)
+}
+
+void *loop_next(struct loop *loop, int timeout_ms)
+{
+    return loop_next_until(loop, (timeout_ms < 0) ? -1 : loop_now() + (int64_t)timeout_ms * 1000);  // NOLINT
+}
+
+void *loop_next_until(struct loop *loop, int64_t deadline)
+{
+    if (loop->closed != NULL) {
+        struct loop_wait *wait = loop->closed;
+        void *data = wait->data;
+        loop->closed = wait->next;
+        loop->waiting--;
+        free(wait);
+        return data;
+    }
+    while (1) {
+        if (loop->next < loop->nready) {
+            struct loop_wait *wait = loop->ready[loop->next++].data.ptr;
+            if (wait == &gone) {
+                continue;
+            }
+            if (wait == NULL) {
+                uint64_t count;
+                (void)!read(loop->wake, &count, sizeof(count));
+                return NULL;
+            }
+            return finish_wait(loop, wait);
+        }
+        if (loop->waiting == 0) {
+            return NULL;
+        }
+        int timeout_ms = -1;
+        if (deadline >= 0) {
+            // Rounded up, so a wait never ends before the deadline
+            int64_t left = (deadline - loop_now() + 999) / 1000;  // NOLINT(readability-magic-numbers)
+            timeout_ms = (left <= 0) ? 0 : (left < INT_MAX) ? (int)left : INT_MAX;
+        }
+        int n = epoll_wait(loop->epoll, loop->ready, LOOP_BATCH, timeout_ms);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return NULL;
+        }
+        loop->nready = n;
+        loop->next = 0;
+    }
+}
+
+void loop_wake(struct loop *loop)
+{
+    uint64_t one = 1;
+    (void)!write(loop->wake, &one, sizeof(one));
+}
@@ -0,0 +1,90 @@
+#ifndef DPLANG_LOOP_H
+#define DPLANG_LOOP_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An event loop for waiting on many file descriptors and timers at once,
+ * built on Linux epoll.
+ *
+ * Each wait is one-shot: it is registered with a pointer of the caller's,
+ * and once its descriptor is ready or its timer has fired loop_next()
+ * hands that pointer back and forgets the wait.  Timers are timerfds, so
+ * they are waited on like any other descriptor.  Several waits may be on
+ * the same descriptor, e.g. one for reading and one for writing.
+ *
+ * A loop belongs to one thread, except for loop_wake(), which any thread
+ * may call to make the owner's loop_next() return early through an
+ * eventfd.
+ */
+
+struct loop;
+
+enum loop_event {
+    LOOP_READABLE = 1,
+    LOOP_WRITABLE = 2,
+};
+
+/** @return an empty loop, or NULL if the kernel won't give it descriptors */
+struct loop *loop_new(void);
+
+/** Free @p loop, dropping the waits still registered with it */
+void loop_free(struct loop *loop);
+
+/**
+ * Wait for @p fd to be ready for @p events
+ *
+ * A descriptor that hangs up or fails counts as ready for anything.
+ *
+ * @return false if @p fd can't be waited on
+ */
+bool loop_watch(struct loop *loop, int fd, enum loop_event events, void *data);
+
+/**
+ * Wait for @p ms milliseconds to pass, 0 for the next loop_next()
+ *
+ * @return false if the kernel won't give the timer a descriptor
+ */
+bool loop_after(struct loop *loop, int64_t ms, void *data);
+
+/**
+ * Call off every wait registered with @p data
+ *
+ * @return false if there were none
+ */
+bool loop_cancel(struct loop *loop, void *data);
+
+/**
+ * Make every wait on @p fd over, before the caller closes it
+ *
+ * epoll forgets a descriptor once it is closed, so these waits would
+ * otherwise never end.  loop_next() hands them back before anything else.
+ */
+void loop_closing(struct loop *loop, int fd);
+
+/** Number of waits registered that loop_next() has not yet handed back */
+size_t loop_waiting(const struct loop *loop);
+
+/**
+ * Hand back the pointer of a wait that is over, waiting for one if need be
+ *
+ * @param timeout_ms most milliseconds to wait, -1 for as long as it takes
+ * @return NULL if nothing was ready in time, nothing is registered or
+ *         loop_wake() was called
+ */
+void *loop_next(struct loop *loop, int timeout_ms);
+
+/** Microseconds on a clock that never jumps, for loop_next_until() deadlines */
+int64_t loop_now(void);
+
+/**
+ * loop_next() until @p deadline in loop_now() microseconds, -1 for none
+ *
+ * For callers that take several waits from one time budget.
+ */
+void *loop_next_until(struct loop *loop, int64_t deadline);
+
+/** Make the thread in, or next to call, loop_next() on @p loop return NULL */
+void loop_wake(struct loop *loop);
+#endif
@@ -1,8 +1,18 @@
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sysexits.h>
+#include <unistd.h>
 
+#include "bytecode.h"
+#include "cache.h"
+#include "compiler.h"
+#include "isolate.h"
+#include "memory.h"
 #include "vm.h"
 
 #define LINE_BUFFER_SIZE 1024
@@ -21,7 +31,7 @@ static void repl(struct vm *vm)
     }
 }
 
-static char *readfile(const char *path)
+static char *readfile(const char *path, size_t *size_out)
 {
     FILE *file = fopen(path, "rb");
     if (file == NULL) {
@@ -43,34 +53,245 @@ static char *readfile(const char *path)
     }
     buffer[bytes_read] = '\0';
     fclose(file);
+    *size_out = bytes_read;
     return buffer;
 }
 
-static int runfile(struct vm *vm, const char *path)
+/** True if the file at @p path starts like a bytecode file */
+static bool is_bytecode_file(const char *path)
 {
-    char *source = readfile(path);
-    int ret = vm_interpret(vm, source);
+    uint8_t magic[sizeof(uint32_t)];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    size_t size = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+    return bytecode_is_bytecode(magic, size);
+}
+
+/** Run a script or bytecode file, compiling through the cache in @p cache_dir unless it is NULL */
+static int runfile(struct vm *vm, const char *path, const char *cache_dir)
+{
+    if (is_bytecode_file(path)) {
+        return vm_interpret_bytecode_file(vm, path);
+    }
+
+    size_t size;
+    char *source = readfile(path, &size);
+    int ret;
+    if (cache_dir != NULL) {
+        struct object_function *function = cache_compile(vm, cache_dir, source, size);
+        ret = (function == NULL) ? -1 : vm_interpret_function(vm, function);
+    } else {
+        ret = vm_interpret(vm, source);
+    }
     free(source);
     return ret;
 }
 
+/** Compile the script at @p path into a bytecode file instead of running it */
+static int compilefile(struct vm *vm, const char *path, const char *output)
+{
+    size_t size;
+    char *source = readfile(path, &size);
+    struct object_function *function = compile(vm, source, vm->compile_flags);
+    free(source);
+    if (function == NULL) {
+        return -1;
+    }
+
+    // A process running the old file reads its code from the mapping, so the file is replaced, never rewritten
+    char temp[PATH_MAX];
+    int n = snprintf(temp, sizeof(temp), "%s.XXXXXX", output);
+    int fd = (n < 0 || (size_t)n >= sizeof(temp)) ? -1 : mkstemp(temp);
+    FILE *file = (fd < 0) ? NULL : fdopen(fd, "wb");
+    if (file == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp);
+        }
+        fprintf(stderr, "Could not open file %s\n", output);
+        exit(EX_CANTCREAT);
+    }
+    // mkstemp() makes the file private; give it the mode fopen() would have
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);  // NOLINT(readability-magic-numbers)
+    int ret = bytecode_write(vm, function, 0, file);
+    if (fclose(file) != 0 || ret != 0 || rename(temp, output) != 0) {
+        unlink(temp);
+        fprintf(stderr, "Could not write file %s\n", output);
+        exit(EX_IOERR);
+    }
+    return 0;
+}
+
+static void print_generation_stats(const char *name, const struct gc_generation_stats *generation)
+{
+    fprintf(stderr, "gc %-5s %8zu collections %10zu objects %12zu bytes %10zu freed %10.6f s\n", name,
+            generation->collections, generation->objects, generation->bytes, generation->freed, generation->seconds);
+}
+
+static void print_gc_stats(void)
+{
+    struct gc_stats stats;
+    gc_get_stats(&stats);
+    print_generation_stats("young", &stats.young);
+    print_generation_stats("old", &stats.old);
+    fprintf(stderr, "gc %zu promoted, %zu remembered, %zu incremental steps, %zu parallel marks\n", stats.promoted,
+            stats.remembered, stats.steps, stats.parallel_marks);
+    fprintf(stderr, "gc %zu heap pages, %zu released, %zu swept by allocation, %zu in the background\n", stats.pages,
+            stats.released, stats.swept_lazily, stats.swept_background);
+    fprintf(stderr, "gc pauses, longest %.6f s\n", stats.max_pause);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (stats.pauses[i] > 0) {
+            fprintf(stderr, "gc %s%8zu us %10zu\n", (i == GC_PAUSE_BUCKETS - 1) ? ">=" : " <", (size_t)1 << i,
+                    stats.pauses[i]);
+        }
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: dplang [--no-fuse] [--stack-limit=VALUES] [--compile=OUTPUT] [--no-cache] [--clear-cache] [--ic-stats] [--gc-stats] [--gc-budget=OBJECTS] [--gc-lazy-sweep] [--gc-background-sweep] [--gc-mark-threads=THREADS] [--isolate-workers=THREADS] [path]\n");
+    exit(EX_USAGE);
+}
+
 int main(int argc, char **argv)
 {
+    static const struct option options[] = {
+        {"no-fuse",             no_argument,       NULL, 'F'},
+        {"stack-limit",         required_argument, NULL, 'S'},
+        {"compile",             required_argument, NULL, 'c'},
+        {"no-cache",            no_argument,       NULL, 'N'},
+        {"clear-cache",         no_argument,       NULL, 'C'},
+        {"ic-stats",            no_argument,       NULL, 'P'},
+        {"gc-stats",            no_argument,       NULL, 'G'},
+        {"gc-budget",           required_argument, NULL, 'B'},
+        {"gc-lazy-sweep",       no_argument,       NULL, 'L'},
+        {"gc-background-sweep", no_argument,       NULL, 'W'},
+        {"gc-mark-threads",     required_argument, NULL, 'M'},
+        {"isolate-workers",     required_argument, NULL, 'I'},
+        {NULL,                  0,                 NULL, 0  },
+    };
+    int compile_flags = COMPILE_DEFAULT;
+    long stack_limit = STACK_LIMIT_DEFAULT;
+    const char *output = NULL;
+    const char *cache_dir = cache_default_dir();
+    bool clear_cache = false;
+    bool ic_stats = false;
+    bool gc_stats = false;
+    long gc_budget = 0;
+    bool gc_lazy_sweep = false;
+    bool gc_background_sweep = false;
+    long gc_mark_threads = 0;
+    long isolate_workers = 0;
+    char *end;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'F':
+                compile_flags |= COMPILE_NO_FUSION;
+                break;
+            case 'S':
+                stack_limit = strtol(optarg, &end, 10);  // NOLINT(readability-magic-numbers)
+                if (*end != '\0' || stack_limit < STACK_INITIAL || stack_limit > INT_MAX) {
+                    fprintf(stderr, "Stack limit must be between %d and %d values\n", STACK_INITIAL, INT_MAX);
+                    exit(EX_USAGE);
+                }
+                break;
+            case 'c':
+                output = optarg;
+                break;
+            case 'N':
+                cache_dir = NULL;
+                break;
+            case 'C':
+                clear_cache = true;
+                break;
+            case 'P':
+                ic_stats = true;
+                break;
+            case 'G':
+                gc_stats = true;
+                break;
+            case 'B':
+                gc_budget = strtol(optarg, &end, 10);  // NOLINT(readability-magic-numbers)
+                if (*end != '\0' || gc_budget < 0) {
+                    fprintf(stderr, "GC budget must be a number of objects, 0 to collect all at once\n");
+                    exit(EX_USAGE);
+                }
+                break;
+            case 'L':
+                gc_lazy_sweep = true;
+                break;
+            case 'W':
+                gc_background_sweep = true;
+                break;
+            case 'M':
+                gc_mark_threads = strtol(optarg, &end, 10);  // NOLINT(readability-magic-numbers)
+                if (*end != '\0' || gc_mark_threads < 0) {
+                    fprintf(stderr, "GC mark threads must be a number, 0 for one per CPU\n");
+                    exit(EX_USAGE);
+                }
+                break;
+            case 'I':
+                isolate_workers = strtol(optarg, &end, 10);  // NOLINT(readability-magic-numbers)
+                if (*end != '\0' || isolate_workers < 0 || isolate_workers > ISOLATE_WORKERS_MAX) {
+                    fprintf(stderr, "Isolate workers must be a number up to %d, 0 for one per CPU\n",
+                            ISOLATE_WORKERS_MAX);
+                    exit(EX_USAGE);
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (clear_cache) {
+        const char *dir = cache_default_dir();
+        if (dir != NULL && cache_clear(dir) < 0) {
+            fprintf(stderr, "Could not clear cache %s\n", dir);
+        }
+        if (optind == argc) {
+            return EX_OK;
+        }
+    }
+
     struct vm vm;
     int ret = vm_init(&vm);
     if (ret != 0) {
         fprintf(stderr, "Could not initialize vm: %d", ret);
     }
+    vm.compile_flags = compile_flags;
+    vm.stack_limit = (int)stack_limit;
+    vm.ic_stats = ic_stats;
+    gc_set_budget((size_t)gc_budget);
+    gc_set_lazy_sweep(gc_lazy_sweep);
+    gc_set_background_sweep(gc_background_sweep);
+    gc_set_mark_threads((size_t)gc_mark_threads);
+    isolate_set_workers((size_t)isolate_workers);
 
-    if (argc == 1) {
+    if (output != NULL) {
+        if (optind != argc - 1) {
+            usage();
+        }
+        ret = compilefile(&vm, argv[optind], output);
+    } else if (optind == argc) {
         repl(&vm);
-    } else if (argc == 2) {
-        ret = runfile(&vm, argv[1]);
+    } else if (optind == argc - 1) {
+        ret = runfile(&vm, argv[optind], cache_dir);
     } else {
-        fprintf(stderr, "Usage: dplang [path]\n");
-        exit(EX_USAGE);
+        usage();
     }
+    // Isolates only reach the script through channels, so the script may finish before they do
+    isolate_wait();
 
+    if (gc_stats) {
+        print_gc_stats();
+    }
     if (vm_free(&vm) != 0) {
         fprintf(stderr, "Could not shut down vm: %d", ret);
     }
@@ -3,8 +3,18 @@
 #include "value.h"
 #include "vm.h"
 #include "compiler.h"
+#include "bytecode.h"
+#include "page.h"
+#include "slab.h"
+#include "deque.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <stdio.h>
 #include <stddef.h>
@@ -13,31 +23,242 @@
 #define GRAY_LIST_MIN_SIZE      8
 #define GRAY_LIST_GROWTH_FACTOR 2
 
+#define REMEMBERED_MIN_SIZE 8
+
+/** Under DEBUG_STRESS_GC, every this many collections is a full one */
+#define GC_STRESS_FULL_INTERVAL 8
+
 // #define DEBUG_LOG_GC
 // #define DEBUG_STRESS_GC
 
-static bool enabled = false;
-static size_t total_allocated = 0;
-static size_t next_gc = GC_INITIAL_TRIGGER_BYTES;
+/*
+ * Full collections are either done all at once or, with a budget, spread
+ * over steps run as the program allocates.  While one is in progress
+ * minor collections wait, objects are allocated black and the write
+ * barrier shades whatever is stored into a marked object.
+ *
+ * With lazy sweeping the collection ends once marking does, and the
+ * allocator sweeps pages of the size class it is asked for until one has
+ * room, so garbage is reused while it is still in the cache.  Whatever is
+ * left is swept before the next collection of either kind.
+ */
+enum gc_phase {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+};
+
+/*
+ * A parallel mark deals the gray objects out to a deque per thread.  Each
+ * thread blackens what it takes from its own deque and steals from the
+ * others when that runs dry; marking is done once every thread has run
+ * out.  Objects are claimed by setting their mark bit atomically, so each
+ * is scanned once, and the objects a scan would remember are kept per
+ * thread and added to the remembered set afterwards.
+ */
+struct marker {
+    struct heap *heap;
+    struct deque gray;
+    struct object **remember;  // objects for the remembered set
+    size_t remember_count;
+    size_t remember_capacity;
+    size_t index;
+};
 
-static size_t gray_capacity = 0;
-static size_t gray_count = 0;
-static struct object **gray_stack = NULL;
+/** Everything one VM allocates from, and the state of its collector */
+struct heap {
+    struct vm *vm;  // whose roots are traced
+    bool enabled;
+#ifdef DPLANG_SLAB_ALLOCATOR
+    struct slab_allocator slab;
+#endif
+    size_t total_allocated;
+    size_t next_gc;
+    size_t young_allocated;  // bytes of objects tracked since the last collection
+#ifdef DEBUG_STRESS_GC
+    unsigned int stress_count;
+#endif
 
-struct object *gc_objects = NULL;
+    size_t gray_capacity;
+    size_t gray_count;
+    struct object **gray_stack;
+
+    /* Old objects that may point at young ones */
+    size_t remembered_capacity;
+    size_t remembered_count;
+    struct object **remembered;
+
+    bool minor;                     // the collection in progress only sweeps the nursery
+    struct page_allocator pages;
+    struct heap_page *young_pages;  // pages holding young objects, linked through next_young
+
+    enum gc_phase phase;
+    size_t budget;                            // objects marked or swept per step, 0 to collect all at once
+    size_t next_step;                         // total_allocated at which the next step runs
+    bool lazy_sweep;                          // leave the sweep to gc_allocate_object()
+    struct heap_page *unswept[PAGE_CLASSES];  // pages left to sweep by size class, linked through next_sweep
+    size_t unswept_count;
+
+    /*
+     * With background sweeping the pages holding dead objects are withheld
+     * from the allocator and swept by a thread started when marking ends.  It
+     * keeps its own counts and free lists, which the mutator takes over when
+     * it joins it, so the two threads share nothing but the withheld pages.
+     * Young survivors are aged before the thread starts, since the write
+     * barrier reads their old flags.
+     */
+    bool background_sweep;
+    bool sweeper_running;                // the sweeper's results are still to be taken over
+    bool sweeper_joinable;               // ... and it ran on a thread of its own
+    pthread_t sweeper;
+    atomic_bool sweeper_done;
+    struct heap_page *background_pages;  // withheld for the sweeper, linked through next_sweep
+    struct gc_stats swept;               // the sweeper's counts; objects and bytes wrap below zero
+    size_t swept_bytes;
+#ifdef DPLANG_SLAB_ALLOCATOR
+    struct slab_allocator swept_slab;    // collects the sweeper's heap_free()s
+#endif
 
-struct vm *gc_vm = NULL;
+    size_t mark_threads;  // 0 for one per CPU
+    struct marker markers[GC_MARK_THREADS_MAX];
+    size_t nmarkers;
+    atomic_size_t idle_markers;
+
+    struct gc_stats stats;
+};
+
+/*
+ * Objects allocated with no VM bound come from here, and are never
+ * collected.  It is zeroed, so ready without initialising it.
+ */
+static struct heap unbound;
+
+static _Thread_local struct heap *heap = &unbound;  // the heap this thread allocates from and collects
+static _Thread_local bool saw_young = false;        // the object being blackened refers to an object that stays young
+static _Thread_local bool on_sweeper = false;
+static _Thread_local struct marker *marker = NULL;  // this thread's, during a parallel mark
+
+_Thread_local bool gc_marking = false;
+_Thread_local struct vm *gc_vm = NULL;
 
 void gc_init(struct vm *vm)
 {
-    gray_capacity = GRAY_LIST_MIN_SIZE;
-    gray_count = 0;
-    // TODO: Handle realloc failure
-    gray_stack = (struct object **)realloc(gray_stack, sizeof(struct object *) * gray_capacity);
+    struct heap *h = (struct heap *)calloc(1, sizeof(*h));
+    if (h == NULL) {
+        exit(1);
+    }
+    h->vm = vm;
+    h->gray_capacity = GRAY_LIST_MIN_SIZE;
+    h->gray_stack = (struct object **)malloc(sizeof(struct object *) * h->gray_capacity);
+    if (h->gray_stack == NULL) {
+        exit(1);
+    }
+    h->next_gc = GC_INITIAL_TRIGGER_BYTES;
+    h->phase = GC_IDLE;
+    atomic_init(&h->sweeper_done, false);
+    atomic_init(&h->idle_markers, 0);
+    h->enabled = true;
+    vm->heap = h;
+    gc_bind(vm);
+}
+
+void gc_bind(struct vm *vm)
+{
+    heap = (vm != NULL) ? vm->heap : &unbound;
     gc_vm = vm;
-    // total_allocated = 0;
-    next_gc = GC_INITIAL_TRIGGER_BYTES;
-    enabled = true;
+    gc_marking = heap->phase == GC_MARK;
+}
+
+static void gc_scan(struct object *object);
+
+void gc_track(struct object *object)
+{
+    struct heap_page *page = page_of(object);
+    size_t bit = page_bit(object);
+    page_set(page->live, bit);
+    page_set(page->nursery, bit);
+    if (!page->young) {
+        page->young = true;
+        page->next_young = heap->young_pages;
+        heap->young_pages = page;
+    }
+    size_t size = object_size(object);
+    heap->young_allocated += size;
+    heap->stats.young.objects++;
+    heap->stats.young.bytes += size;
+
+    if (heap->phase == GC_IDLE) {
+        page_clear(page->marks, bit);
+    } else {
+        // Allocate black, so the sweep keeps it; shading what the constructor
+        // stored keeps the mark phase to the objects it started with
+        page_set(page->marks, bit);
+        if (gc_marking) {
+            gc_scan(object);
+        }
+    }
+}
+
+void gc_untrack(struct object *object)
+{
+    // Only sweeps look at the live bits, so none may be half done
+    gc_finish();
+    struct heap_page *page = page_of(object);
+    size_t bit = page_bit(object);
+    if (page_test(page->live, bit)) {
+        struct gc_generation_stats *generation = object->old ? &heap->stats.old : &heap->stats.young;
+        generation->objects--;
+        generation->bytes -= object_size(object);
+        page_clear(page->live, bit);
+        page_clear(page->nursery, bit);
+    }
+    for (size_t i = 0; object->remembered && i < heap->remembered_count; i++) {
+        if (heap->remembered[i] == object) {
+            heap->remembered[i] = heap->remembered[--heap->remembered_count];
+            object->remembered = false;
+        }
+    }
+}
+
+static void remember(struct object *object)
+{
+    if (object->remembered) {
+        return;
+    }
+    if (heap->remembered_capacity < heap->remembered_count + 1) {
+        heap->remembered_capacity = (heap->remembered_capacity < REMEMBERED_MIN_SIZE)
+                                        ? REMEMBERED_MIN_SIZE
+                                        : heap->remembered_capacity * GRAY_LIST_GROWTH_FACTOR;
+        heap->remembered =
+            (struct object **)realloc(heap->remembered, sizeof(struct object *) * heap->remembered_capacity);
+        if (heap->remembered == NULL) {
+            exit(1);
+        }
+    }
+    object->remembered = true;
+    heap->remembered[heap->remembered_count++] = object;
+}
+
+void gc_remember(struct object *object)
+{
+    if (object->old) {
+        remember(object);
+    }
+}
+
+void gc_rescan(struct object *object)
+{
+    gc_remember(object);
+    if (gc_marking && gc_is_marked(object)) {
+        gc_scan(object);
+    }
+}
+
+void gc_get_stats(struct gc_stats *out)
+{
+    *out = heap->stats;
+    out->remembered = heap->remembered_count;
+    out->pages = heap->pages.npages;
 }
 
 void gc_mark_object(struct object *object)
@@ -45,7 +266,22 @@ void gc_mark_object(struct object *object)
     if (object == NULL) {
         return;
     }
-    if (object->marked) {
+    if (!object->old) {
+        // Objects old enough are promoted by this collection's sweep
+        saw_young |= object->age + 1 < GC_PROMOTION_AGE;
+    } else if (heap->minor) {
+        // Minor collections treat the old generation as live
+        return;
+    }
+    struct heap_page *page = page_of(object);
+    size_t bit = page_bit(object);
+    if (marker != NULL) {
+        if (page_claim(page->marks, bit)) {
+            deque_push(&marker->gray, object);
+        }
+        return;
+    }
+    if (page_test(page->marks, bit)) {
         return;
     }
 
@@ -55,17 +291,17 @@ void gc_mark_object(struct object *object)
     printf("\n");
 #endif
 
-    object->marked = true;
+    page_set(page->marks, bit);
 
-    if (gray_capacity < gray_count + 1) {
-        gray_capacity =
-            (gray_count < GRAY_LIST_MIN_SIZE) ? GRAY_LIST_MIN_SIZE : gray_capacity * GRAY_LIST_GROWTH_FACTOR;
-        gray_stack = (struct object **)realloc(gray_stack, sizeof(struct object *) * gray_capacity);
-        if (gray_stack == NULL) {
+    if (heap->gray_capacity < heap->gray_count + 1) {
+        heap->gray_capacity = (heap->gray_count < GRAY_LIST_MIN_SIZE) ? GRAY_LIST_MIN_SIZE
+                                                                      : heap->gray_capacity * GRAY_LIST_GROWTH_FACTOR;
+        heap->gray_stack = (struct object **)realloc(heap->gray_stack, sizeof(struct object *) * heap->gray_capacity);
+        if (heap->gray_stack == NULL) {
             exit(1);
         }
     }
-    gray_stack[gray_count++] = object;
+    heap->gray_stack[heap->gray_count++] = object;
 }
 
 void gc_mark_value(value value)
@@ -89,6 +325,17 @@ void gc_mark_table(struct table *table)
     }
 }
 
+static void gc_mark_caches(struct chunk *chunk)
+{
+    for (int i = 0; i < chunk->ncaches; i++) {
+        struct inline_cache *cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count; j++) {
+            gc_mark_object((struct object *)cache->entries[j].klass);
+            gc_mark_object((struct object *)cache->entries[j].method);
+        }
+    }
+}
+
 static void gc_blacken_object(struct object *object)
 {
 #ifdef DEBUG_LOG_GC
@@ -107,21 +354,43 @@ static void gc_blacken_object(struct object *object)
             struct object_class *klass = (struct object_class *)object;
             gc_mark_object((struct object *)klass->name);
             gc_mark_table(&klass->methods);
+            shape_mark_tree(klass->root_shape);
             break;
         }
         case OBJECT_INSTANCE: {
             struct object_instance *instance = (struct object_instance *)object;
             gc_mark_object((struct object *)instance->klass);
-            gc_mark_table(&instance->fields);
+            if (instance->shape != NULL) {
+                for (int i = 0; i < instance->shape->count; i++) { gc_mark_value(instance->fields[i]); }
+            }
+            gc_mark_table(&instance->dictionary);
+            break;
+        }
+        case OBJECT_UPVALUE: {
+            struct object_upvalue *upvalue = (struct object_upvalue *)object;
+            gc_mark_value(upvalue->closed);
+            // An open upvalue points into its coroutine's stack, which must outlive it
+            gc_mark_object((struct object *)upvalue->coroutine);
             break;
         }
-        case OBJECT_UPVALUE:
-            gc_mark_value(((struct object_upvalue *)object)->closed);
+        case OBJECT_COROUTINE: {
+            struct object_coroutine *coroutine = (struct object_coroutine *)object;
+            gc_mark_object((struct object *)coroutine->closure);
+            gc_mark_object((struct object *)coroutine->caller);
+            for (value *slot = coroutine->stack; slot < coroutine->sp; slot++) { gc_mark_value(*slot); }
+            for (int i = 0; i < coroutine->frame_count; i++) {
+                gc_mark_object((struct object *)coroutine->frames[i].closure);
+            }
+            for (struct object_upvalue *upvalue = coroutine->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+                gc_mark_object((struct object *)upvalue);
+            }
             break;
+        }
         case OBJECT_FUNCTION: {
             struct object_function *function = (struct object_function *)object;
             gc_mark_object((struct object *)function->name);
             gc_mark_varray(&function->chunk.constants);
+            gc_mark_caches(&function->chunk);
             break;
         }
         case OBJECT_CLOSURE: {
@@ -135,17 +404,52 @@ static void gc_blacken_object(struct object *object)
             gc_mark_table(&table->table);
             break;
         }
+        case OBJECT_CHANNEL:
         case OBJECT_NATIVE:
         case OBJECT_STRING:
             break;
     }
 }
 
+/**
+ * Blacken @p object and keep it in the remembered set if it is or is
+ * about to be old and refers to objects that stay young
+ */
+static void gc_scan(struct object *object)
+{
+    saw_young = false;
+    gc_blacken_object(object);
+    if (saw_young && (object->old || object->age + 1 >= GC_PROMOTION_AGE)) {
+        if (marker != NULL) {
+            if (marker->remember_capacity < marker->remember_count + 1) {
+                marker->remember_capacity = (marker->remember_capacity < REMEMBERED_MIN_SIZE)
+                                                ? REMEMBERED_MIN_SIZE
+                                                : marker->remember_capacity * 2;
+                marker->remember = (struct object **)realloc(marker->remember,
+                                                             sizeof(struct object *) * marker->remember_capacity);
+                if (marker->remember == NULL) {
+                    exit(1);
+                }
+            }
+            marker->remember[marker->remember_count++] = object;
+        } else {
+            remember(object);
+        }
+    }
+}
+
+static bool gc_is_white(struct object *object)
+{
+    return !gc_is_marked(object) && !(heap->minor && object->old);
+}
+
+/** Drop the entries of a weak table whose key or value is about to be freed */
 void gc_table_remove_white(struct table *table)
 {
     for (int i = 0; i < table->capacity; i++) {
         struct entry *entry = &table->entries[i];
-        if (!IS_EMPTY(entry->key) && IS_OBJECT(entry->key) && !AS_OBJECT(entry->key)->marked) {
+        if (!IS_EMPTY(entry->key) && ((IS_OBJECT(entry->key) && gc_is_white(AS_OBJECT(entry->key))) ||
+                                      (IS_OBJECT(entry->value) && gc_is_white(AS_OBJECT(entry->value))))) {
             table_delete(table, entry->key);
         }
     }
@@ -160,60 +464,602 @@ static void gc_mark_roots(struct vm *vm)
     for (struct object_upvalue *upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
         gc_mark_object((struct object *)upvalue);
     }
+    // The running coroutine holds the frames and stack of whatever resumed it, and so on down
+    gc_mark_object((struct object *)vm->coroutine);
+    gc_mark_table(&vm->waiting);
 
     gc_mark_table(&vm->globals);
-    gc_mark_table(&vm->strings);
+    gc_mark_varray(&vm->global_values);
+    gc_mark_varray(&vm->global_names);
+    // vm->strings and vm->channels are weak; unmarked entries are dropped from them before the sweep
 
-    compiler_gc_roots();
+    compiler_gc_roots(vm);
+    bytecode_gc_roots(vm);
 
     gc_mark_object((struct object *)vm->init_string);
 }
 
+/**
+ * Empty the remembered set, for the scans of this collection to rebuild
+ *
+ * @return how many objects were in it; they are still at the start of the array
+ */
+static size_t gc_forget_remembered(void)
+{
+    size_t count = heap->remembered_count;
+    for (size_t i = 0; i < count; i++) { heap->remembered[i]->remembered = false; }
+    heap->remembered_count = 0;
+    return count;
+}
+
+static void gc_trace_remembered(void)
+{
+    // Rescanning only ever re-adds an object at or before the one being read
+    size_t count = gc_forget_remembered();
+    for (size_t i = 0; i < count; i++) { gc_scan(heap->remembered[i]); }
+}
+
+/** Blacken up to @p limit gray objects */
+static void gc_trace_step(size_t limit)
+{
+    for (size_t work = 0; heap->gray_count > 0 && work < limit; work++) {
+        gc_scan(heap->gray_stack[--heap->gray_count]);
+    }
+}
+
+/** True once every marker has run out of work; false if one of them has some again */
+static bool gc_markers_done(void)
+{
+    atomic_fetch_add(&heap->idle_markers, 1);
+    for (;;) {
+        if (atomic_load(&heap->idle_markers) == heap->nmarkers) {
+            return true;
+        }
+        for (size_t i = 0; i < heap->nmarkers; i++) {
+            if (!deque_empty(&heap->markers[i].gray)) {
+                atomic_fetch_sub(&heap->idle_markers, 1);
+                return false;
+            }
+        }
+        sched_yield();
+    }
+}
+
+static void *gc_mark_worker(void *arg)
+{
+    marker = (struct marker *)arg;
+    heap = marker->heap;
+    for (;;) {
+        struct object *object = deque_take(&marker->gray);
+        for (size_t i = 1; object == NULL && i < heap->nmarkers; i++) {
+            object = deque_steal(&heap->markers[(marker->index + i) % heap->nmarkers].gray);
+        }
+        if (object != NULL) {
+            gc_scan(object);
+        } else if (gc_markers_done()) {
+            break;
+        }
+    }
+    marker = NULL;
+    return NULL;
+}
+
+/** How many threads to mark the heap with */
+static size_t gc_mark_thread_count(void)
+{
+    if (heap->minor || heap->total_allocated < GC_PARALLEL_MARK_BYTES) {
+        return 1;
+    }
+    size_t threads = heap->mark_threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (size_t)cpus : 1;
+    }
+    return (threads < GC_MARK_THREADS_MAX) ? threads : GC_MARK_THREADS_MAX;
+}
+
+/** Blacken every gray object on @p n threads */
+static void gc_trace_parallel(size_t n)
+{
+    heap->nmarkers = 0;
+    while (heap->nmarkers < n && deque_init(&heap->markers[heap->nmarkers].gray) == 0) {
+        heap->markers[heap->nmarkers].heap = heap;
+        heap->markers[heap->nmarkers].index = heap->nmarkers;
+        heap->nmarkers++;
+    }
+    if (heap->nmarkers == 0) {
+        gc_trace_step(SIZE_MAX);
+        return;
+    }
+    for (size_t i = 0; i < heap->gray_count; i++) {
+        deque_push(&heap->markers[i % heap->nmarkers].gray, heap->gray_stack[i]);
+    }
+    heap->gray_count = 0;
+
+    // Markers whose thread fails to start count as idle; the others steal their work
+    pthread_t threads[GC_MARK_THREADS_MAX];
+    bool started[GC_MARK_THREADS_MAX] = {false};
+    atomic_store(&heap->idle_markers, 0);
+    for (size_t i = 1; i < heap->nmarkers; i++) {
+        started[i] = pthread_create(&threads[i], NULL, gc_mark_worker, &heap->markers[i]) == 0;
+        if (!started[i]) {
+            atomic_fetch_add(&heap->idle_markers, 1);
+        }
+    }
+    gc_mark_worker(&heap->markers[0]);
+
+    for (size_t i = 0; i < heap->nmarkers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        for (size_t j = 0; j < heap->markers[i].remember_count; j++) { remember(heap->markers[i].remember[j]); }
+        heap->markers[i].remember_count = 0;
+        deque_free(&heap->markers[i].gray);
+    }
+    heap->nmarkers = 0;
+    heap->stats.parallel_marks++;
+}
+
 static void gc_trace_references(void)
 {
-    while (gray_count > 0) {
-        struct object *object = gray_stack[--gray_count];
-        gc_blacken_object(object);
+    size_t n = gc_mark_thread_count();
+    if (n > 1 && heap->gray_count > 0) {
+        gc_trace_parallel(n);
+    } else {
+        gc_trace_step(SIZE_MAX);
     }
 }
 
-static void gc_sweep(void)
+/**
+ * Drop remembered objects that are about to be freed
+ *
+ * An object can be written to, and remembered, before it becomes garbage.
+ */
+static void gc_prune_remembered(void)
 {
-    struct object *previous = NULL;
-    struct object *object = gc_objects;
-    while (object != NULL) {
-        if (object->marked) {
-            object->marked = false;
-            previous = object;
-            object = object->next;
+    size_t kept = 0;
+    for (size_t i = 0; i < heap->remembered_count; i++) {
+        if (gc_is_marked(heap->remembered[i])) {
+            heap->remembered[kept++] = heap->remembered[i];
         } else {
-            struct object *unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                gc_objects = object;
+            heap->remembered[i]->remembered = false;
+        }
+    }
+    heap->remembered_count = kept;
+}
+
+static void gc_free(struct object *object)
+{
+    struct gc_stats *counts = on_sweeper ? &heap->swept : &heap->stats;
+    struct gc_generation_stats *generation = object->old ? &counts->old : &counts->young;
+    generation->objects--;
+    generation->bytes -= object_size(object);
+    generation->freed++;
+    object_free(object);
+}
+
+static void gc_promote(struct heap_page *page, struct object *object)
+{
+    size_t size = object_size(object);
+    object->old = true;
+    page_clear(page->nursery, page_bit(object));
+    heap->stats.young.objects--;
+    heap->stats.young.bytes -= size;
+    heap->stats.old.objects++;
+    heap->stats.old.bytes += size;
+    heap->stats.promoted++;
+}
+
+/** Free the objects in @p dead, a subset of bitmap word @p w of @p page; @return how many there were */
+static size_t gc_free_dead(struct heap_page *page, size_t w, uint64_t dead)
+{
+    size_t freed = 0;
+    for (; dead != 0; dead &= dead - 1) {
+        gc_free(page_cell(page, w * 64 + __builtin_ctzll(dead)));  // NOLINT
+        freed++;
+    }
+    return freed;
+}
+
+/** Age the young survivors in @p young, a subset of bitmap word @p w of @p page, promoting those old enough */
+static void gc_age_young(struct heap_page *page, size_t w, uint64_t young)
+{
+    for (; young != 0; young &= young - 1) {
+        struct object *object = page_cell(page, w * 64 + __builtin_ctzll(young));  // NOLINT
+        if (++object->age >= GC_PROMOTION_AGE) {
+            gc_promote(page, object);
+        }
+    }
+}
+
+/**
+ * Sweep the objects in @p cells, a subset of bitmap word @p w of @p page:
+ * free the unmarked ones, and age the young survivors
+ *
+ * @return how many objects were freed
+ */
+static size_t gc_sweep_word(struct heap_page *page, size_t w, uint64_t cells)
+{
+    uint64_t young = cells & page->marks[w] & page->nursery[w];
+    size_t freed = gc_free_dead(page, w, cells & ~page->marks[w]);
+    gc_age_young(page, w, young);
+    return freed;
+}
+
+static bool has_young(struct heap_page *page)
+{
+    for (size_t w = 0; w < page_words(page); w++) {
+        if (page->nursery[w] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Sweep the young objects of every page on the young list, dropping pages left without any */
+static void gc_sweep_young(void)
+{
+    struct heap_page **link = &heap->young_pages;
+    while (*link != NULL) {
+        struct heap_page *page = *link;
+        bool young = false;
+        for (size_t w = 0; w < page_words(page); w++) {
+            if (page->nursery[w] != 0) {
+                gc_sweep_word(page, w, page->nursery[w]);
+                young |= page->nursery[w] != 0;
             }
-            object_free(unreached);
+        }
+        if (young) {
+            link = &page->next_young;
+        } else {
+            page->young = false;
+            *link = page->next_young;
         }
     }
 }
 
-void *reallocate(void *p, size_t prev_size, size_t new_size)
+/**
+ * Sweep every object on @p page
+ *
+ * @return the work done: one per bitmap word read, plus the objects freed
+ */
+static size_t gc_sweep_page(struct heap_page *page)
 {
-    if ((p == NULL) && (new_size == 0)) {
-        return NULL;
+    size_t work = 0;
+    for (size_t w = 0; w < page_words(page); w++) {
+        uint64_t cells = page->live[w];
+        work += 1 + ((cells != 0) ? gc_sweep_word(page, w, cells) : 0);
     }
-    total_allocated += new_size - prev_size;
+    return work;
+}
+
+/** Take the next page of size class @p c off the unswept lists */
+static struct heap_page *next_unswept(size_t c)
+{
+    struct heap_page *page = heap->unswept[c];
+    heap->unswept[c] = page->next_sweep;
+    heap->unswept_count--;
+    return page;
+}
+
+/** Sweep whole pages until about @p limit work is done, see gc_sweep_page() */
+static void gc_sweep_step(size_t limit)
+{
+    size_t work = 0;
+    for (size_t c = 0; c < PAGE_CLASSES && work < limit; c++) {
+        while (heap->unswept[c] != NULL && work < limit) {
+            work += gc_sweep_page(next_unswept(c));
+        }
+    }
+}
+
+static void gc_finish_sweeping(void)
+{
+    heap->stats.released += page_release_empty(&heap->pages);
+    heap->young_pages = NULL;
+    for (struct heap_page *page = heap->pages.pages; page != NULL; page = page->next) {
+        page->young = has_young(page);
+        if (page->young) {
+            page->next_young = heap->young_pages;
+            heap->young_pages = page;
+        }
+    }
+
+    heap->phase = GC_IDLE;
+    heap->next_gc = heap->total_allocated * 2;
+    heap->stats.old.collections++;
+}
+
+static void gc_start_marking(void)
+{
+    for (struct heap_page *page = heap->pages.pages; page != NULL; page = page->next) {
+        memset(page->marks, 0, page_words(page) * sizeof(page->marks[0]));
+    }
+    // Every live object is scanned, so the remembered set is rebuilt from scratch
+    gc_forget_remembered();
+    gc_marking = true;
+    heap->phase = GC_MARK;
+    gc_mark_roots(heap->vm);
+}
+
+static void *gc_sweeper(void *arg)
+{
+    heap = (struct heap *)arg;
+    on_sweeper = true;
+    for (struct heap_page *page = heap->background_pages; page != NULL; page = page->next_sweep) {
+        for (size_t w = 0; w < page_words(page); w++) {
+            uint64_t dead = page->live[w] & ~page->marks[w];
+            if (dead != 0) {
+                gc_free_dead(page, w, dead);
+            }
+        }
+        heap->swept.swept_background++;
+    }
+    on_sweeper = false;
+    atomic_store_explicit(&heap->sweeper_done, true, memory_order_release);
+    return NULL;
+}
+
+/** Age the young survivors, then withhold the pages with dead objects and start the sweeper on them */
+static void gc_start_sweeper(void)
+{
+    heap->background_pages = NULL;
+    for (struct heap_page *page = heap->pages.pages; page != NULL; page = page->next) {
+        bool dead = false;
+        for (size_t w = 0; w < page_words(page); w++) {
+            uint64_t marked = page->live[w] & page->marks[w];
+            dead |= marked != page->live[w];
+            gc_age_young(page, w, marked & page->nursery[w]);
+        }
+        if (dead) {
+            page->withheld = true;
+            page->next_sweep = heap->background_pages;
+            heap->background_pages = page;
+        }
+    }
+    page_relist(&heap->pages);
+
+    atomic_store_explicit(&heap->sweeper_done, false, memory_order_relaxed);
+    heap->sweeper_running = true;
+    heap->sweeper_joinable = pthread_create(&heap->sweeper, NULL, gc_sweeper, heap) == 0;
+    if (!heap->sweeper_joinable) {
+        // Sweep here instead; the results are taken over all the same
+        gc_sweeper(heap);
+    }
+}
+
+/** Wait for the sweeper, then take over what it freed and hand its pages back to the allocator */
+static void gc_join_sweeper(void)
+{
+    if (heap->sweeper_joinable) {
+        pthread_join(heap->sweeper, NULL);
+        heap->sweeper_joinable = false;
+    }
+    heap->total_allocated -= heap->swept_bytes;
+    heap->swept_bytes = 0;
+    heap->stats.young.objects += heap->swept.young.objects;
+    heap->stats.young.bytes += heap->swept.young.bytes;
+    heap->stats.young.freed += heap->swept.young.freed;
+    heap->stats.old.objects += heap->swept.old.objects;
+    heap->stats.old.bytes += heap->swept.old.bytes;
+    heap->stats.old.freed += heap->swept.old.freed;
+    heap->stats.swept_background += heap->swept.swept_background;
+    memset(&heap->swept, 0, sizeof(heap->swept));
+#ifdef DPLANG_SLAB_ALLOCATOR
+    slab_merge(&heap->slab, &heap->swept_slab);
+#endif
+    for (struct heap_page *page = heap->background_pages; page != NULL; page = page->next_sweep) {
+        page->withheld = false;
+    }
+    heap->background_pages = NULL;
+    heap->sweeper_running = false;
+}
+
+static void gc_finish_marking(void)
+{
+    // Stores into the roots skip the write barrier, so they are marked again before anything is freed
+    gc_mark_roots(heap->vm);
+    gc_trace_references();
+    gc_table_remove_white(&heap->vm->strings);
+    gc_table_remove_white(&heap->vm->channels);
+    gc_prune_remembered();
+    gc_marking = false;
+
+    // Pages mapped from here on hold only objects allocated black, so the sweep can skip them
+    memset(heap->unswept, 0, sizeof(heap->unswept));
+    heap->unswept_count = 0;
+    if (heap->background_sweep) {
+        gc_start_sweeper();
+    }
+    for (struct heap_page *page = heap->pages.pages; page != NULL && !heap->sweeper_running; page = page->next) {
+        size_t c = page_size_class(page->cell_size);
+        page->next_sweep = heap->unswept[c];
+        heap->unswept[c] = page;
+        heap->unswept_count++;
+    }
+    heap->phase = GC_SWEEP;
+    heap->young_allocated = 0;
+    if (heap->lazy_sweep || heap->sweeper_running) {
+        // Dead objects still count until they are swept, so this errs towards a later collection
+        heap->next_gc = heap->total_allocated * 2;
+    }
+}
+
+static bool sweeping_lazily(void)
+{
+    return heap->phase == GC_SWEEP && heap->lazy_sweep && !heap->sweeper_running;
+}
+
+/** True while the sweep is left to allocation or to the sweeper thread */
+static bool sweep_deferred(void)
+{
+    return heap->phase == GC_SWEEP && (heap->lazy_sweep || heap->sweeper_running);
+}
+
+/** Do up to @p limit objects' worth of work on the collection in progress */
+static void gc_advance(size_t limit)
+{
+    switch (heap->phase) {
+        case GC_IDLE:
+            break;
+        case GC_MARK:
+            if (limit == SIZE_MAX) {
+                gc_trace_references();
+            } else {
+                gc_trace_step(limit);
+            }
+            if (heap->gray_count == 0) {
+                gc_finish_marking();
+            }
+            break;
+        case GC_SWEEP:
+            if (heap->sweeper_running) {
+                gc_join_sweeper();
+            }
+            gc_sweep_step(limit);
+            if (heap->unswept_count == 0) {
+                gc_finish_sweeping();
+            }
+            break;
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;  // NOLINT(readability-magic-numbers)
+}
+
+static void gc_record_pause(struct gc_generation_stats *generation, double start)
+{
+    double seconds = now() - start;
+    generation->seconds += seconds;
+    if (seconds > heap->stats.max_pause) {
+        heap->stats.max_pause = seconds;
+    }
+
+    int bucket = 0;
+    for (double limit = 1e-6; seconds >= limit && bucket < GC_PAUSE_BUCKETS - 1; limit *= 2) {  // NOLINT
+        bucket++;
+    }
+    heap->stats.pauses[bucket]++;
+}
+
+bool gc_step(void)
+{
+    if (heap->phase == GC_IDLE) {
+        return false;
+    }
+    double start = now();
+    gc_advance((heap->budget > 0) ? heap->budget : SIZE_MAX);
+    heap->next_step = heap->total_allocated + GC_STEP_BYTES;
+    heap->stats.steps++;
+    gc_record_pause(&heap->stats.old, start);
+    return heap->phase != GC_IDLE;
+}
+
+void gc_start_incremental(void)
+{
+    if (!heap->enabled || (heap->phase != GC_IDLE && !sweep_deferred())) {
+        return;
+    }
+    gc_finish();
+    double start = now();
+#ifdef DEBUG_LOG_GC
+    printf("--- incremental gc begin\n");
+#endif
+    gc_start_marking();
+    heap->next_step = heap->total_allocated + GC_STEP_BYTES;
+    gc_record_pause(&heap->stats.old, start);
+}
+
+void gc_set_budget(size_t objects)
+{
+    heap->budget = objects;
+}
+
+void gc_set_lazy_sweep(bool lazy)
+{
+    gc_finish();
+    heap->lazy_sweep = lazy;
+}
+
+void gc_set_background_sweep(bool background)
+{
+    gc_finish();
+    heap->background_sweep = background;
+}
+
+void gc_set_mark_threads(size_t threads)
+{
+    heap->mark_threads = threads;
+}
+
+void gc_finish(void)
+{
+    if (heap->phase == GC_IDLE) {
+        return;
+    }
+    double start = now();
+    while (heap->phase != GC_IDLE) { gc_advance(SIZE_MAX); }
+    gc_record_pause(&heap->stats.old, start);
+}
+
+/** Account for an allocation changing from @p prev_size to @p new_size bytes, collecting if it is due */
+static void gc_allocated(size_t prev_size, size_t new_size)
+{
+    if (unlikely(on_sweeper)) {
+        // Only frees happen there
+        heap->swept_bytes += prev_size - new_size;
+        return;
+    }
+    heap->total_allocated += new_size - prev_size;
 #ifdef DEBUG_STRESS_GC
     if (new_size > prev_size) {
-        gc_collect();
+        if (sweep_deferred()) {
+            // Let allocation or the sweeper do the sweeping for a while
+            if (++heap->stress_count % GC_STRESS_FULL_INTERVAL == 0) {
+                gc_collect();
+            }
+        } else if (heap->phase != GC_IDLE) {
+            gc_step();
+        } else if (++heap->stress_count % GC_STRESS_FULL_INTERVAL != 0) {
+            gc_collect_minor();
+        } else if (heap->budget > 0) {
+            gc_start_incremental();
+        } else {
+            gc_collect();
+        }
     }
 #endif
 
-    if (new_size > prev_size && total_allocated > next_gc) {
-        gc_collect();
+    if (new_size > prev_size) {
+        if (heap->sweeper_running && atomic_load_explicit(&heap->sweeper_done, memory_order_acquire)) {
+            gc_finish();
+        }
+        if (heap->phase != GC_IDLE && !sweep_deferred()) {
+            if (heap->total_allocated > heap->next_step) {
+                gc_step();
+            }
+        } else if (heap->total_allocated > heap->next_gc) {
+            if (heap->budget > 0) {
+                gc_start_incremental();
+            } else {
+                gc_collect();
+            }
+        } else if (heap->young_allocated > GC_NURSERY_BYTES) {
+            gc_collect_minor();
+        }
+    }
+}
+
+void *reallocate(void *p, size_t prev_size, size_t new_size)
+{
+    if ((p == NULL) && (new_size == 0)) {
+        return NULL;
     }
+    gc_allocated(prev_size, new_size);
 
     if (new_size == 0) {
 #ifdef DEBUG_LOG_GC
@@ -239,29 +1085,139 @@ void *reallocate(void *p, size_t prev_size, size_t new_size)
     return p;
 }
 
+void *heap_allocate(size_t size)
+{
+    if (size == 0) {
+        return NULL;
+    }
+    gc_allocated(0, size);
+#ifdef DPLANG_SLAB_ALLOCATOR
+    return slab_allocate(&heap->slab, size);
+#else
+    return malloc(size);
+#endif
+}
+
+/** Sweep pages of the size class for @p size bytes until the allocator has a cell of it to hand out */
+static void gc_sweep_for(size_t size)
+{
+    size_t c = page_size_class(size);
+    while (heap->unswept[c] != NULL && !page_has_room(heap->pages.available[c])) {
+        gc_sweep_page(next_unswept(c));
+        heap->stats.swept_lazily++;
+    }
+    if (heap->unswept_count == 0) {
+        gc_finish_sweeping();
+    }
+}
+
+void *gc_allocate_object(size_t size)
+{
+    gc_allocated(0, size);
+    if (sweeping_lazily()) {
+        gc_sweep_for(size);
+    }
+    return page_allocate(&heap->pages, size);
+}
+
+void gc_free_object(struct object *object, size_t size)
+{
+    gc_allocated(size, 0);
+    page_free(&heap->pages, object);
+}
+
+void heap_free(void *p, size_t size)
+{
+    if (p == NULL) {
+        return;
+    }
+    gc_allocated(size, 0);
+#ifdef DPLANG_SLAB_ALLOCATOR
+    slab_free(on_sweeper ? &heap->swept_slab : &heap->slab, p, size);
+#else
+    free(p);
+#endif
+}
+
+void gc_collect_minor(void)
+{
+    if (!heap->enabled) {
+        return;
+    }
+    // The nursery is swept by the collection in progress
+    gc_finish();
+
+    double start = now();
+#ifdef DEBUG_LOG_GC
+    printf("--- minor gc begin\n");
+    size_t before = heap->total_allocated;
+#endif
+    heap->minor = true;
+    for (struct heap_page *page = heap->young_pages; page != NULL; page = page->next_young) {
+        memset(page->marks, 0, page_words(page) * sizeof(page->marks[0]));
+    }
+    gc_mark_roots(heap->vm);
+    gc_trace_remembered();
+    gc_trace_references();
+    gc_table_remove_white(&heap->vm->strings);
+    gc_table_remove_white(&heap->vm->channels);
+    gc_sweep_young();
+    heap->minor = false;
+
+    heap->young_allocated = 0;
+    heap->stats.young.collections++;
+    gc_record_pause(&heap->stats.young, start);
+#ifdef DEBUG_LOG_GC
+    printf("--- minor gc end [ %zu bytes => %zu bytes; %zu remembered ]\n", before, heap->total_allocated,
+           heap->remembered_count);
+#endif
+}
+
 void gc_collect(void)
 {
-    if (!enabled) {
+    if (!heap->enabled) {
 #ifdef DEBUG_LOG_GC
         printf("Skipping GC collection\n");
 #endif
         return;
     }
+    // Objects that died since an incremental cycle started may have been kept by it
+    gc_finish();
 
+    double start = now();
 #ifdef DEBUG_LOG_GC
-    clock_t start = clock();
     printf("--- gc begin\n");
-    size_t before = total_allocated;
+    size_t before = heap->total_allocated;
 #endif
-    gc_mark_roots(gc_vm);
-    gc_trace_references();
-    gc_table_remove_white(&gc_vm->strings);
-    gc_sweep();
-
-    next_gc = total_allocated * 2;
+    gc_start_marking();
+    while (heap->phase != GC_IDLE && !sweep_deferred()) { gc_advance(SIZE_MAX); }
+    gc_record_pause(&heap->stats.old, start);
 #ifdef DEBUG_LOG_GC
-    double duration = ((double)(clock() - start)) / CLOCKS_PER_SEC;
     printf("--- gc end [ %zu bytes => %zu bytes; %zu bytes collected in %6.6f s; next at %zu]\n", before,
-           total_allocated, before - total_allocated, duration, next_gc);
+           heap->total_allocated, before - heap->total_allocated, now() - start, heap->next_gc);
+#endif
+}
+
+void gc_free_heap(struct vm *vm)
+{
+    gc_bind(vm);
+    gc_finish();
+    heap->enabled = false;
+    for (struct heap_page *page = heap->pages.pages; page != NULL; page = page->next) {
+        for (size_t w = 0; w < page_words(page); w++) {
+            if (page->live[w] != 0) {
+                gc_free_dead(page, w, page->live[w]);
+            }
+        }
+    }
+    page_destroy(&heap->pages);
+#ifdef DPLANG_SLAB_ALLOCATOR
+    slab_destroy(&heap->slab);
 #endif
+    for (size_t i = 0; i < GC_MARK_THREADS_MAX; i++) { free(heap->markers[i].remember); }
+    free(heap->gray_stack);
+    free(heap->remembered);
+    free(heap);
+    vm->heap = NULL;
+    gc_bind(NULL);
 }
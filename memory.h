@@ -1,13 +1,211 @@
 #ifndef DPLANG_MEMORY_H
 #define DPLANG_MEMORY_H
 #include <stddef.h>
+#include "page.h"
+#include "util.h"
 #include "vm.h"
 
+/*
+ * The heap has two generations.  New objects go in the nursery, which
+ * minor collections sweep on their own, tracing from the roots and from
+ * the remembered set of old objects that point at young ones.  Objects
+ * that survive GC_PROMOTION_AGE collections move to the old generation,
+ * which only full collections sweep.  Objects never move: they live in
+ * heap pages, see page.h, and the collector keeps its mark bits and the
+ * set of objects it tracks in the pages' bitmaps.
+ *
+ * Full collections can be made incremental with gc_set_budget(): marking
+ * and sweeping then run in short steps between allocations, and the write
+ * barrier keeps marked objects from hiding white ones while they do.
+ * With gc_set_lazy_sweep() they only mark, and the allocator sweeps pages
+ * as it needs cells from them; with gc_set_background_sweep() another
+ * thread sweeps them.
+ *
+ * Each VM has a heap of its own, and every function here works on the
+ * heap bound to the calling thread with gc_bind().  VMs on different
+ * threads share nothing, so they can run in parallel; a VM's objects must
+ * not be handed to another VM.  Allocations made with no VM bound come
+ * from a heap that is never collected.
+ */
+
+/** Collections an object survives before it is promoted */
+#define GC_PROMOTION_AGE 2
+
+/** Bytes of new objects that trigger a minor collection */
+#define GC_NURSERY_BYTES (256 * 1024)
+
+/** Heap size from which full collections mark on several threads, see gc_set_mark_threads() */
+#define GC_PARALLEL_MARK_BYTES (8 * 1024 * 1024)
+
+/** Most threads a parallel mark uses */
+#define GC_MARK_THREADS_MAX 8
+
+/** Bytes allocated between steps of an incremental collection */
+#define GC_STEP_BYTES (32 * 1024)
+
+/** Pause histogram buckets, see gc_stats */
+#define GC_PAUSE_BUCKETS 20
+
+/** Counters for one generation */
+struct gc_generation_stats {
+    size_t collections;  // minor collections for the nursery, full ones for the old generation
+    size_t objects;      // objects in the generation now
+    size_t bytes;        // their size, see object_size()
+    size_t freed;        // objects freed from it so far
+    double seconds;      // time spent in its collections
+};
+
+struct gc_stats {
+    struct gc_generation_stats young;
+    struct gc_generation_stats old;
+    size_t promoted;          // objects moved from the nursery to the old generation
+    size_t remembered;        // old objects in the remembered set now
+    size_t pages;             // heap pages mapped now
+    size_t released;          // empty heap pages returned to the OS so far
+    size_t steps;             // incremental steps run
+    size_t swept_lazily;      // heap pages swept by the allocator
+    size_t swept_background;  // heap pages swept on the sweeper thread
+    size_t parallel_marks;    // mark phases run on several threads
+    double max_pause;         // longest collection or step, in seconds
+    // Collections and steps by length: bucket 0 is under 1 us, bucket i under 2^i us, the last holds the rest
+    size_t pauses[GC_PAUSE_BUCKETS];
+};
+
+/** True while an incremental collection of this thread's heap is marking */
+extern _Thread_local bool gc_marking;
+
+/** The VM whose heap is bound to this thread, see gc_bind(); natives reach their VM through it */
+extern _Thread_local struct vm *gc_vm;
+
+static inline bool gc_is_marked(struct object *object)
+{
+    return page_test(page_of(object)->marks, page_bit(object));
+}
+
 void *reallocate(void *p, size_t prev_size, size_t new_size);
+
+/**
+ * Allocate @p size bytes for a string's characters or another small array an object owns
+ *
+ * With DPLANG_SLAB_ALLOCATOR small sizes come from size-class free lists,
+ * see slab.h; otherwise this is malloc().  Free the memory with
+ * heap_free() and the same size, never with reallocate().
+ */
+void *heap_allocate(size_t size);
+
+void heap_free(void *p, size_t size);
+
+/** Allocate a heap page cell for an object of @p size bytes, see page.h */
+void *gc_allocate_object(size_t size);
+
+/** Free what gc_allocate_object() returned for @p size bytes */
+void gc_free_object(struct object *object, size_t size);
+
+/** Collect the whole heap */
 void gc_collect(void);
 
+/** Collect only the nursery */
+void gc_collect_minor(void);
+
+/**
+ * Mark or sweep at most @p objects objects per incremental step
+ *
+ * 0, the default, collects the whole heap at once.
+ */
+void gc_set_budget(size_t objects);
+
+/**
+ * Leave sweeping to allocation if @p lazy
+ *
+ * Off by default.  Completes the collection in progress first.
+ */
+void gc_set_lazy_sweep(bool lazy);
+
+/**
+ * Sweep on a thread of its own if @p background, while the program runs on
+ *
+ * Off by default; takes precedence over lazy sweeping.  Completes the
+ * collection in progress first.
+ */
+void gc_set_background_sweep(bool background);
+
+/**
+ * Mark on up to @p threads threads, the calling one included, once the
+ * heap reaches GC_PARALLEL_MARK_BYTES
+ *
+ * 0, the default, uses one per CPU.  1 always marks on the calling thread.
+ * At most GC_MARK_THREADS_MAX are used.  Incremental steps and minor
+ * collections always mark on the calling thread.
+ */
+void gc_set_mark_threads(size_t threads);
+
+/** Start an incremental collection of the whole heap, unless one is in progress */
+void gc_start_incremental(void);
+
+/**
+ * Run one step of the incremental collection in progress
+ *
+ * @return true while there is more of it to do
+ */
+bool gc_step(void);
+
+/** Complete the incremental collection in progress, if any */
+void gc_finish(void);
+
+/** Give @p vm a heap of its own, and bind it to the calling thread */
 void gc_init(struct vm *vm);
+
+/**
+ * Allocate from and collect @p vm's heap on the calling thread, NULL for none
+ *
+ * A heap may be bound to one thread at a time.  Call this before using a
+ * VM on a thread other than the one that created it, or after switching
+ * between VMs on one thread.
+ */
+void gc_bind(struct vm *vm);
+
+/** Free every object in @p vm's heap, then the heap; the calling thread is left with none bound */
+void gc_free_heap(struct vm *vm);
+
 void gc_mark_object(struct object *object);
 void gc_mark_varray(struct value_array *varray);
 void gc_mark_value(value v);
+
+/** Start collecting @p object, which goes in the nursery */
+void gc_track(struct object *object);
+
+/** Stop collecting @p object */
+void gc_untrack(struct object *object);
+
+/** Add @p object to the remembered set if it is old */
+void gc_remember(struct object *object);
+
+/**
+ * Record that @p object may refer to anything at all now, without a write
+ * barrier for each store
+ *
+ * For objects whose contents are swapped wholesale, such as a coroutine's
+ * stack when it is resumed or suspended.
+ */
+void gc_rescan(struct object *object);
+
+void gc_get_stats(struct gc_stats *stats);
+
+/**
+ * Record that @p v was stored in @p owner
+ *
+ * Every store into an object that is already tracked needs this before
+ * anything else is allocated, or a minor collection can free a young
+ * object that only an old one refers to, and an incremental collection
+ * can free one that only a marked object refers to.
+ */
+static inline void gc_write_barrier(struct object *owner, value v)
+{
+    if (unlikely(owner->old) && IS_OBJECT(v) && !AS_OBJECT(v)->old) {
+        gc_remember(owner);
+    }
+    if (unlikely(gc_marking) && gc_is_marked(owner) && IS_OBJECT(v)) {
+        gc_mark_object(AS_OBJECT(v));
+    }
+}
 #endif
@@ -1,25 +1,31 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include "channel.h"
 #include "object.h"
 #include "memory.h"
 
 // #define DEBUG_LOG_GC
 
-extern struct object *gc_objects;
-
 #define ALLOCATE_OBJECT(type, id) (type *)object_allocate(sizeof(type), id)
 
+#define FIELDS_MIN_CAPACITY  4
+#define FIELDS_GROWTH_FACTOR 2
+
 #ifdef DEBUG_LOG_GC
 static inline const char *object_type_name(enum object_type type)
 {
     switch (type) {
         case OBJECT_BOUND_METHOD:
             return "BOUND_METHOD";
+        case OBJECT_CHANNEL:
+            return "CHANNEL";
         case OBJECT_CLASS:
             return "CLASS";
         case OBJECT_CLOSURE:
             return "CLOSURE";
+        case OBJECT_COROUTINE:
+            return "COROUTINE";
         case OBJECT_FUNCTION:
             return "FUNCTION";
         case OBJECT_INSTANCE:
@@ -43,8 +49,7 @@ void object_enable_gc(struct object *obj)
 #ifdef DEBUG_LOG_GC
     printf("%p Enable gc\n", obj);
 #endif
-    obj->next = gc_objects;
-    gc_objects = obj;
+    gc_track(obj);
 }
 
 void object_disable_gc(struct object *obj)
@@ -52,27 +57,17 @@ void object_disable_gc(struct object *obj)
 #ifdef DEBUG_LOG_GC
     printf("%p Disable gc\n", obj);
 #endif
-    if (gc_objects == obj) {
-        gc_objects = gc_objects->next;
-        return;
-    }
-
-    struct object *next = gc_objects;
-
-    while (next->next != NULL) {
-        if (next->next == obj) {
-            next->next = obj->next;
-        }
-        next = next->next;
-    }
+    gc_untrack(obj);
 }
 
 // NOLINTBEGIN(bugprone-easily-swappable-parameters)
 static struct object *object_allocate(size_t size, enum object_type type)
 {
-    struct object *object = (struct object *)reallocate(NULL, 0, size);
+    struct object *object = (struct object *)gc_allocate_object(size);
     object->type = type;
-    object->marked = false;
+    object->old = false;
+    object->remembered = false;
+    object->age = 0;
 
 #ifdef DEBUG_LOG_GC
     printf("%p object allocate %s [%zu bytes]\n", (void *)object, object_type_name(type), size);
@@ -81,20 +76,45 @@ static struct object *object_allocate(size_t size, enum object_type type)
 }
 // NOLINTEND(bugprone-easily-swappable-parameters)
 
+/**
+ * Create a string object that owns @p s, which must have been allocated
+ * with room for @p length characters plus a terminator
+ *
+ * Strings are interned in the VM's string table, so two strings with the
+ * same contents are always the same object and can be compared by
+ * pointer.  If an equal string already exists @p s is freed and the
+ * existing object returned.
+ */
 struct object_string *object_string_take(const char *s, size_t length)
 {
+    hash_t hash = hash_string(s, length);
+    if (gc_vm != NULL) {
+        struct object_string *interned = table_find_string(&gc_vm->strings, s, length, hash);
+        if (interned != NULL) {
+            heap_free((char *)s, length + 1);
+            return interned;
+        }
+    }
+
     struct object_string *string = ALLOCATE_OBJECT(struct object_string, OBJECT_STRING);
     string->length = length;
     string->data = (char *)s;
-    string->hash = hash_string(s, length);
+    string->hash = hash;
 
     object_enable_gc((struct object *)string);
+
+    if (gc_vm != NULL) {
+        // Keep the new string reachable while the table may grow and collect
+        *gc_vm->sp++ = OBJECT_VAL(string);
+        table_set(&gc_vm->strings, OBJECT_VAL(string), NIL_VAL);
+        gc_vm->sp--;
+    }
     return string;
 }
 
 struct object_string *object_string_allocate(const char *s, size_t length)
 {
-    char *data = (char *)reallocate(NULL, 0, length + 1);
+    char *data = (char *)heap_allocate(length + 1);
     memcpy(data, s, length);
     data[length] = '\0';
     return object_string_take(data, length);
@@ -109,9 +129,9 @@ struct object_string *object_string_vformat(const char *fmt, va_list ap)
         va_end(aq);
         return NULL;
     }
-    size_t length = count + 1;
-    char *s = (char *)reallocate(NULL, 0, length);
-    vsnprintf(s, length, fmt, aq);
+    size_t length = count;
+    char *s = (char *)heap_allocate(length + 1);
+    vsnprintf(s, length + 1, fmt, aq);
 
     struct object_string *obj = object_string_take(s, length);
     va_end(aq);
@@ -131,6 +151,8 @@ struct object_class *object_class_new(struct object_string *name)
     struct object_class *klass = ALLOCATE_OBJECT(struct object_class, OBJECT_CLASS);
     klass->name = name;
     table_init(&klass->methods);
+    klass->root_shape = shape_new_root();
+    klass->shape_budget = SHAPE_MAX_PER_CLASS;
     object_enable_gc((struct object *)klass);
     return klass;
 }
@@ -158,6 +180,7 @@ struct object_upvalue *object_upvalue_new(value *slot)
     upvalue->next = NULL;
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
+    upvalue->coroutine = (gc_vm != NULL) ? gc_vm->coroutine : NULL;
     object_enable_gc((struct object *)upvalue);
     return upvalue;
 }
@@ -167,7 +190,11 @@ struct object_function *object_function_new(struct object_string *name)
     struct object_function *func = ALLOCATE_OBJECT(struct object_function, OBJECT_FUNCTION);
     func->arity = 0;
     func->nupvalues = 0;
+    func->max_stack = 0;
     func->name = name;
+    func->image = NULL;
+    func->unloaded = NULL;
+    func->unloaded_size = 0;
     chunk_init(&func->chunk);
     object_enable_gc((struct object *)func);
     return func;
@@ -177,14 +204,77 @@ struct object_instance *object_instance_new(struct object_class *klass)
 {
     struct object_instance *instance = ALLOCATE_OBJECT(struct object_instance, OBJECT_INSTANCE);
     instance->klass = klass;
-    table_init(&instance->fields);
+    instance->shape = klass->root_shape;
+    instance->fields = NULL;
+    instance->capacity = 0;
+    table_init(&instance->dictionary);
     object_enable_gc((struct object *)instance);
     return instance;
 }
 
+bool object_instance_get_field(struct object_instance *instance, struct object_string *name, value *out)
+{
+    if (instance->shape == NULL) {
+        return table_get(&instance->dictionary, OBJECT_VAL(name), out);
+    }
+    int slot = shape_lookup(instance->shape, name);
+    if (slot < 0) {
+        return false;
+    }
+    *out = instance->fields[slot];
+    return true;
+}
+
+static void instance_to_dictionary(struct object_instance *instance)
+{
+    // The slots stay reachable for the GC until the shape is dropped, so
+    // table growth may collect safely while the fields are copied over
+    struct shape *shape = instance->shape;
+    for (int i = 0; i < shape->count; i++) {
+        table_set(&instance->dictionary, OBJECT_VAL(shape->names[i]), instance->fields[i]);
+        gc_write_barrier(&instance->object, OBJECT_VAL(shape->names[i]));
+    }
+    instance->shape = NULL;
+    instance->fields = reallocate(instance->fields, instance->capacity * sizeof(value), 0);
+    instance->capacity = 0;
+}
+
+void object_instance_set_field(struct object_instance *instance, struct object_string *name, value val)
+{
+    if (instance->shape != NULL) {
+        int slot = shape_lookup(instance->shape, name);
+        if (slot >= 0) {
+            instance->fields[slot] = val;
+            gc_write_barrier(&instance->object, val);
+            return;
+        }
+
+        struct shape *next = shape_transition(instance->shape, name, &instance->klass->shape_budget);
+        if (next != NULL) {
+            // The class's shape tree now refers to the name
+            gc_write_barrier(&instance->klass->object, OBJECT_VAL(name));
+            if (instance->capacity < next->count) {
+                int capacity = (instance->capacity < FIELDS_MIN_CAPACITY) ? FIELDS_MIN_CAPACITY
+                                                                          : instance->capacity * FIELDS_GROWTH_FACTOR;
+                instance->fields = (value *)reallocate(instance->fields, instance->capacity * sizeof(value),
+                                                       capacity * sizeof(value));
+                instance->capacity = capacity;
+            }
+            instance->fields[next->count - 1] = val;
+            instance->shape = next;
+            gc_write_barrier(&instance->object, val);
+            return;
+        }
+        instance_to_dictionary(instance);
+    }
+    table_set(&instance->dictionary, OBJECT_VAL(name), val);
+    gc_write_barrier(&instance->object, OBJECT_VAL(name));
+    gc_write_barrier(&instance->object, val);
+}
+
 struct object_closure *object_closure_new(struct object_function *function)
 {
-    struct object_upvalue **upvalues = reallocate(NULL, 0, function->nupvalues * sizeof(struct object_upvalue *));
+    struct object_upvalue **upvalues = heap_allocate(function->nupvalues * sizeof(struct object_upvalue *));
     for (int i = 0; i < function->nupvalues; i++) { upvalues[i] = NULL; }
     struct object_closure *closure = ALLOCATE_OBJECT(struct object_closure, OBJECT_CLOSURE);
 
@@ -195,6 +285,50 @@ struct object_closure *object_closure_new(struct object_function *function)
     return closure;
 }
 
+struct object_coroutine *object_coroutine_new(struct object_closure *closure)
+{
+    struct call_frame *frames = reallocate(NULL, 0, COROUTINE_FRAMES_INITIAL * sizeof(struct call_frame));
+    value *stack = reallocate(NULL, 0, COROUTINE_STACK_INITIAL * sizeof(value));
+    struct object_coroutine *coroutine = ALLOCATE_OBJECT(struct object_coroutine, OBJECT_COROUTINE);
+
+    coroutine->state = COROUTINE_SUSPENDED;
+    coroutine->closure = closure;
+    coroutine->caller = NULL;
+    coroutine->frames = frames;
+    coroutine->frame_capacity = COROUTINE_FRAMES_INITIAL;
+    coroutine->frame_count = 0;
+    // The closure sits in slot 0 like any callee, ready for the first resume to call it
+    coroutine->stack = stack;
+    coroutine->stack_capacity = COROUTINE_STACK_INITIAL;
+    coroutine->stack[0] = OBJECT_VAL(closure);
+    coroutine->sp = coroutine->stack + 1;
+    coroutine->open_upvalues = NULL;
+    object_enable_gc((struct object *)coroutine);
+    return coroutine;
+}
+
+struct object_channel *object_channel_new(struct channel *channel)
+{
+    value key = INT_VAL(channel_id(channel));
+    value handle;
+    if (gc_vm != NULL && table_get(&gc_vm->channels, key, &handle)) {
+        return (struct object_channel *)AS_OBJECT(handle);
+    }
+
+    struct object_channel *object = ALLOCATE_OBJECT(struct object_channel, OBJECT_CHANNEL);
+    channel_retain(channel);
+    object->channel = channel;
+    object_enable_gc((struct object *)object);
+
+    if (gc_vm != NULL) {
+        // Keep the new handle reachable while the table may grow and collect
+        *gc_vm->sp++ = OBJECT_VAL(object);
+        table_set(&gc_vm->channels, key, OBJECT_VAL(object));
+        gc_vm->sp--;
+    }
+    return object;
+}
+
 struct object_native *object_native_new(native_function function)
 {
     struct object_native *native = ALLOCATE_OBJECT(struct object_native, OBJECT_NATIVE);
@@ -217,6 +351,9 @@ int object_format(char *s, size_t maxlen, struct object *obj)
             return function_format(s, maxlen, bound->method->function);
             break;
         }
+        case OBJECT_CHANNEL: {
+            return snprintf(s, maxlen, "<channel %p>", (void *)((struct object_channel *)obj)->channel);
+        }
         case OBJECT_CLASS: {
             struct object_class *klass = (struct object_class *)obj;
             return snprintf(s, maxlen, "class %s", klass->name->data);
@@ -237,6 +374,9 @@ int object_format(char *s, size_t maxlen, struct object *obj)
             struct object_closure *closure = (struct object_closure *)obj;
             return function_format(s, maxlen, closure->function);
         }
+        case OBJECT_COROUTINE: {
+            return snprintf(s, maxlen, "<coroutine %p>", (void *)obj);
+        }
         case OBJECT_UPVALUE: {
             return snprintf(s, maxlen, "<upvalue %p>", (void *)obj);
         }
@@ -273,8 +413,6 @@ bool object_equal(struct object *a, struct object *b)
             return (s1->length == s2->length) && memcmp(s1->data, s2->data, s1->length) == 0;
 
         }
-
-        break;
         default:
             return false;
     }
@@ -285,57 +423,101 @@ void object_free(struct object *obj)
     switch (obj->type) {
         case OBJECT_BOUND_METHOD: {
             struct object_bound_method *bound = (struct object_bound_method *)obj;
-            reallocate(obj, sizeof(*bound), 0);
+            gc_free_object(obj, sizeof(*bound));
+            break;
+        }
+        case OBJECT_CHANNEL: {
+            channel_release(((struct object_channel *)obj)->channel);
+            gc_free_object(obj, sizeof(struct object_channel));
             break;
         }
         case OBJECT_CLASS: {
             struct object_class *klass = (struct object_class *)obj;
             table_free(&klass->methods);
-            reallocate(obj, sizeof(*klass), 0);
+            shape_free_tree(klass->root_shape);
+            gc_free_object(obj, sizeof(*klass));
             break;
         }
         case OBJECT_CLOSURE: {
             struct object_closure *closure = (struct object_closure *)obj;
-            closure->upvalues = reallocate(closure->upvalues, closure->nupvalues * sizeof(struct object_closure *), 0);
+            heap_free(closure->upvalues, closure->nupvalues * sizeof(struct object_upvalue *));
             /* Don't free the function here, other closures may reference
              * the same function
              */
-            reallocate(obj, sizeof(*closure), 0);
+            gc_free_object(obj, sizeof(*closure));
+            break;
+        }
+        case OBJECT_COROUTINE: {
+            struct object_coroutine *coroutine = (struct object_coroutine *)obj;
+            reallocate(coroutine->stack, coroutine->stack_capacity * sizeof(value), 0);
+            reallocate(coroutine->frames, coroutine->frame_capacity * sizeof(struct call_frame), 0);
+            gc_free_object(obj, sizeof(*coroutine));
             break;
         }
         case OBJECT_FUNCTION: {
             struct object_function *func = (struct object_function *)obj;
             chunk_free(&func->chunk);
-            reallocate(func, sizeof(*func), 0);
+            gc_free_object(obj, sizeof(*func));
             break;
         }
         case OBJECT_INSTANCE: {
             struct object_instance *instance = (struct object_instance *)obj;
-            table_free(&instance->fields);
-            reallocate(obj, sizeof(*instance), 0);
+            reallocate(instance->fields, instance->capacity * sizeof(value), 0);
+            table_free(&instance->dictionary);
+            gc_free_object(obj, sizeof(*instance));
             break;
         }
         case OBJECT_NATIVE: {
             struct object_native *native = (struct object_native *)obj;
-            reallocate(obj, sizeof(*native), 0);
+            gc_free_object(obj, sizeof(*native));
             break;
         }
         case OBJECT_STRING: {
             struct object_string *str = (struct object_string *)obj;
-            str->data = reallocate(str->data, str->length + 1, 0);
-            reallocate(str, sizeof(*str), 0);
+            heap_free(str->data, str->length + 1);
+            gc_free_object(obj, sizeof(*str));
             break;
         }
         case OBJECT_TABLE: {
             struct object_table *table = (struct object_table *)obj;
             table_free(&table->table);
-            reallocate(table, sizeof(*table), 0);
+            gc_free_object(obj, sizeof(*table));
             break;
         }
         case OBJECT_UPVALUE: {
             struct object_upvalue *upvalue = (struct object_upvalue *)obj;
-            reallocate(obj, sizeof(*upvalue), 0);
+            gc_free_object(obj, sizeof(*upvalue));
             break;
         }
     }
 }
+
+size_t object_size(struct object *obj)
+{
+    switch (obj->type) {
+        case OBJECT_BOUND_METHOD:
+            return sizeof(struct object_bound_method);
+        case OBJECT_CHANNEL:
+            return sizeof(struct object_channel);
+        case OBJECT_CLASS:
+            return sizeof(struct object_class);
+        case OBJECT_CLOSURE:
+            return sizeof(struct object_closure) +
+                   ((struct object_closure *)obj)->nupvalues * sizeof(struct object_upvalue *);
+        case OBJECT_COROUTINE:
+            return sizeof(struct object_coroutine);
+        case OBJECT_FUNCTION:
+            return sizeof(struct object_function);
+        case OBJECT_INSTANCE:
+            return sizeof(struct object_instance);
+        case OBJECT_NATIVE:
+            return sizeof(struct object_native);
+        case OBJECT_STRING:
+            return sizeof(struct object_string) + ((struct object_string *)obj)->length + 1;
+        case OBJECT_TABLE:
+            return sizeof(struct object_table);
+        case OBJECT_UPVALUE:
+            return sizeof(struct object_upvalue);
+    }
+    return 0;
+}
@@ -5,16 +5,22 @@
 #include "value.h"
 #include "hash.h"
 #include "table.h"
+#include "shape.h"
 #include <stdarg.h>
 #include <stdint.h>
 #include <stddef.h>
 
 typedef value (*native_function)(int arg_count, value *args);
 
+struct channel;
+struct call_frame;
+
 enum object_type {
     OBJECT_BOUND_METHOD,
+    OBJECT_CHANNEL,
     OBJECT_CLASS,
     OBJECT_CLOSURE,
+    OBJECT_COROUTINE,
     OBJECT_FUNCTION,
     OBJECT_INSTANCE,
     OBJECT_NATIVE,
@@ -24,21 +30,33 @@ enum object_type {
 };
 
 struct object {
-    struct object *next;
     enum object_type type;
-    bool marked;
+    bool old;         // promoted out of the nursery
+    bool remembered;  // in the remembered set
+    uint8_t age;      // collections survived in the nursery
+};
+
+/** A VM's handle on a channel, which every VM holding it shares; see channel.h */
+struct object_channel {
+    struct object object;
+    struct channel *channel;
 };
 
 struct object_class {
     struct object object;
     struct object_string *name;
     struct table methods;
+    struct shape *root_shape;
+    int shape_budget;  // shapes this class may still create
 };
 
 struct object_instance {
     struct object object;
     struct object_class *klass;
-    struct table fields;
+    struct shape *shape;  // NULL once the instance is in dictionary mode
+    value *fields;        // fields[slot], indexed through shape
+    int capacity;
+    struct table dictionary;
 };
 
 struct object_bound_method {
@@ -54,12 +72,50 @@ struct object_closure {
     int nupvalues;
 };
 
+enum coroutine_state {
+    COROUTINE_SUSPENDED,  // not started yet, or stopped at a yield
+    COROUTINE_RUNNING,    // running, or waiting for a coroutine it resumed
+    COROUTINE_DONE,       // returned, or stopped by a runtime error
+};
+
+/**
+ * A function with a call stack of its own, which can stop part way through
+ * with yield and carry on where it left off when it is next resumed
+ *
+ * A suspended coroutine keeps its frames, value stack and open upvalues
+ * here.  While it runs they are the VM's, and these fields hold those of
+ * whatever resumed it instead: switching is an exchange of the two, see
+ * vm_op_resume().  The stack grows like the VM's; a coroutine that is done
+ * frees it.
+ */
+struct object_coroutine {
+    struct object object;
+    enum coroutine_state state;
+    struct object_closure *closure;
+    struct object_coroutine *caller;  // the coroutine that resumed this one while it runs, NULL for the script
+    struct call_frame *frames;
+    int frame_capacity;
+    int frame_count;
+    value *stack;
+    int stack_capacity;
+    value *sp;
+    struct object_upvalue *open_upvalues;
+};
+
 struct object_function {
     struct object object;
     struct object_string *name;
     struct chunk chunk;
     int arity;
     int nupvalues;
+    int max_stack;  // stack slots a call needs, including the callee and its arguments
+
+    /* A function loaded from a bytecode image only has its name, arity and
+     * upvalue count until it is first used; see bytecode_materialize().
+     */
+    struct bytecode_image *image;
+    const uint8_t *unloaded;  // body in the image, NULL once loaded
+    size_t unloaded_size;
 };
 
 struct object_native {
@@ -84,17 +140,30 @@ struct object_upvalue {
     value *location;
     value closed;
     struct object_upvalue *next;
+    struct object_coroutine *coroutine;  // whose stack location is in while open, NULL for the VM's own
 };
 
 struct object_bound_method *object_bound_method_new(value receiver, struct object_closure *method);
+/**
+ * The VM's handle on @p channel, made with a reference of its own the first time
+ *
+ * A VM has one handle per channel however often it is sent, so handles
+ * compare by identity like interned strings.
+ */
+struct object_channel *object_channel_new(struct channel *channel);
 struct object_class *object_class_new(struct object_string *name);
 struct object_closure *object_closure_new(struct object_function *function);
+/** A suspended coroutine that will call @p closure, which takes at most one argument, when first resumed */
+struct object_coroutine *object_coroutine_new(struct object_closure *closure);
 struct object_instance *object_instance_new(struct object_class *klass);
 struct object_function *object_function_new(struct object_string *name);
 struct object_native *object_native_new(native_function function);
 struct object_table *object_table_new(void);
 struct object_upvalue *object_upvalue_new(value *slot);
 
+bool object_instance_get_field(struct object_instance *instance, struct object_string *name, value *out);
+void object_instance_set_field(struct object_instance *instance, struct object_string *name, value val);
+
 #define OBJECT_TYPE(value) (AS_OBJECT(value)->type)
 
 __attribute__((__unused__)) static inline bool is_object_type(value val, enum object_type type)
@@ -103,8 +172,10 @@ __attribute__((__unused__)) static inline bool is_object_type(value val, enum ob
 }
 
 #define IS_BOUND_METHOD(val) is_object_type(val, OBJECT_BOUND_METHOD)
+#define IS_CHANNEL(val)      is_object_type(val, OBJECT_CHANNEL)
 #define IS_CLASS(val)        is_object_type(val, OBJECT_CLASS)
 #define IS_CLOSURE(val)      is_object_type(val, OBJECT_CLOSURE)
+#define IS_COROUTINE(val)    is_object_type(val, OBJECT_COROUTINE)
 #define IS_FUNCTION(val)     is_object_type(val, OBJECT_FUNCTION)
 #define IS_INSTANCE(val)     is_object_type(val, OBJECT_INSTANCE)
 #define IS_NATIVE(val)       is_object_type(val, OBJECT_NATIVE)
@@ -113,8 +184,10 @@ __attribute__((__unused__)) static inline bool is_object_type(value val, enum ob
 #define IS_UPVALUE(val)      is_object_type(val, OBJECT_UPVALUE)
 
 #define AS_BOUND_METHOD(val) ((struct object_bound_method *)AS_OBJECT(val))
+#define AS_CHANNEL(val)      (((struct object_channel *)AS_OBJECT(val))->channel)
 #define AS_CLASS(val)        ((struct object_class *)AS_OBJECT(val))
 #define AS_CLOSURE(val)      ((struct object_closure *)AS_OBJECT(val))
+#define AS_COROUTINE(val)    ((struct object_coroutine *)AS_OBJECT(val))
 #define AS_FUNCTION(val)     ((struct object_function *)AS_OBJECT(val))
 #define AS_INSTANCE(val)     ((struct object_instance *)AS_OBJECT(val))
 #define AS_CSTRING(val)      (((struct object_string *)AS_OBJECT(val))->data)
@@ -136,4 +209,7 @@ bool object_equal(struct object *a, struct object *b);
 void object_enable_gc(struct object *obj);
 void object_disable_gc(struct object *obj);
 
+/** Bytes the object itself takes up, not counting tables and arrays it owns */
+size_t object_size(struct object *obj);
+
 #endif
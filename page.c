@@ -0,0 +1,203 @@
+#include <string.h>
+#include <sys/mman.h>
+
+#include "page.h"
+#include "util.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/lsan_interface.h>
+#define POISON(p, size)   ASAN_POISON_MEMORY_REGION((p), (size))
+#define UNPOISON(p, size) ASAN_UNPOISON_MEMORY_REGION((p), (size))
+// Objects hold the only pointers to their strings and arrays, so LeakSanitizer has to look inside pages
+#define REGISTER(page)   __lsan_register_root_region((page), PAGE_BYTES)
+#define UNREGISTER(page) __lsan_unregister_root_region((page), PAGE_BYTES)
+#else
+#define POISON(p, size)   ((void)(p), (void)(size))
+#define UNPOISON(p, size) ((void)(p), (void)(size))
+#define REGISTER(page)    ((void)(page))
+#define UNREGISTER(page)  ((void)(page))
+#endif
+
+/* Cells start after the header, on a granule boundary */
+#define PAGE_FIRST_CELL ((sizeof(struct heap_page) + PAGE_GRANULE - 1) / PAGE_GRANULE * PAGE_GRANULE)
+
+void page_init(struct page_allocator *allocator)
+{
+    allocator->pages = NULL;
+    for (int i = 0; i < PAGE_CLASSES; i++) { allocator->available[i] = NULL; }
+    allocator->spare = NULL;
+    allocator->npages = 0;
+    allocator->nspare = 0;
+}
+
+/** Map PAGE_BYTES aligned to PAGE_BYTES, by mapping twice that and trimming */
+static struct heap_page *map_page(void)
+{
+    size_t size = 2 * PAGE_BYTES;
+    char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    char *page = (char *)page_of(p + PAGE_BYTES - 1);
+    if (page > p) {
+        munmap(p, page - p);
+    }
+    if (page + PAGE_BYTES < p + size) {
+        munmap(page + PAGE_BYTES, p + size - (page + PAGE_BYTES));
+    }
+    REGISTER(page);
+    return (struct heap_page *)page;
+}
+
+static struct heap_page *new_page(struct page_allocator *allocator, size_t c)
+{
+    struct heap_page *page = allocator->spare;
+    if (page != NULL) {
+        allocator->spare = page->next;
+        allocator->nspare--;
+        memset(page, 0, sizeof(*page));
+    } else {
+        // Fresh mappings are zeroed, so every bitmap starts out clear
+        page = map_page();
+        if (page == NULL) {
+            return NULL;
+        }
+        allocator->npages++;
+    }
+    page->cell_size = (c + 1) * PAGE_GRANULE;
+    page->unused = (char *)page + PAGE_FIRST_CELL;
+    page->next = allocator->pages;
+    allocator->pages = page;
+    page->listed = true;
+    page->next_free = allocator->available[c];
+    allocator->available[c] = page;
+    return page;
+}
+
+/** Take a cell from @p page, NULL if it is full */
+static void *take_cell(struct heap_page *page)
+{
+    void *cell = page->free;
+    if (cell != NULL) {
+        UNPOISON(cell, page->cell_size);
+        page->free = *(void **)cell;
+    } else if ((size_t)((char *)page + PAGE_BYTES - page->unused) >= page->cell_size) {
+        cell = page->unused;
+        page->unused += page->cell_size;
+    } else {
+        return NULL;
+    }
+    page->ncells++;
+    return cell;
+}
+
+void *page_allocate(struct page_allocator *allocator, size_t size)
+{
+    if (unlikely(size > PAGE_MAX_CELL)) {
+        return NULL;
+    }
+    size_t c = page_size_class(size);
+    for (;;) {
+        struct heap_page *page = allocator->available[c];
+        if (page == NULL) {
+            page = new_page(allocator, c);
+            if (page == NULL) {
+                return NULL;
+            }
+        }
+        void *cell = take_cell(page);
+        if (likely(cell != NULL)) {
+            return cell;
+        }
+        allocator->available[c] = page->next_free;
+        page->listed = false;
+    }
+}
+
+void page_free(struct page_allocator *allocator, void *p)
+{
+    struct heap_page *page = page_of(p);
+    size_t bit = page_bit(p);
+    page_clear(page->live, bit);
+    page_clear(page->nursery, bit);
+    page_clear(page->marks, bit);
+
+    *(void **)p = page->free;
+    page->free = p;
+    // The link stays readable; the rest of the cell is off limits until it is handed out again
+    POISON((char *)p + sizeof(void *), page->cell_size - sizeof(void *));
+    page->ncells--;
+    if (!page->listed && !page->withheld) {
+        size_t c = page_size_class(page->cell_size);
+        page->listed = true;
+        page->next_free = allocator->available[c];
+        allocator->available[c] = page;
+    }
+}
+
+/** Put @p page back on its class's list if it has room */
+static void relist(struct page_allocator *allocator, struct heap_page *page)
+{
+    // Rebuilding the lists drops pages that only looked like they had room
+    page->listed = !page->withheld && page_has_room(page);
+    if (page->listed) {
+        size_t c = page_size_class(page->cell_size);
+        page->next_free = allocator->available[c];
+        allocator->available[c] = page;
+    }
+}
+
+void page_relist(struct page_allocator *allocator)
+{
+    for (int i = 0; i < PAGE_CLASSES; i++) { allocator->available[i] = NULL; }
+    for (struct heap_page *page = allocator->pages; page != NULL; page = page->next) { relist(allocator, page); }
+}
+
+/** Unmap @p page and the pages linked after it through next */
+static void unmap_pages(struct heap_page *page)
+{
+    while (page != NULL) {
+        struct heap_page *next = page->next;
+        UNPOISON(page, PAGE_BYTES);
+        UNREGISTER(page);
+        munmap(page, PAGE_BYTES);
+        page = next;
+    }
+}
+
+void page_destroy(struct page_allocator *allocator)
+{
+    unmap_pages(allocator->pages);
+    unmap_pages(allocator->spare);
+    page_init(allocator);
+}
+
+size_t page_release_empty(struct page_allocator *allocator)
+{
+    for (int i = 0; i < PAGE_CLASSES; i++) { allocator->available[i] = NULL; }
+
+    size_t released = 0;
+    struct heap_page **link = &allocator->pages;
+    while (*link != NULL) {
+        struct heap_page *page = *link;
+        if (page->ncells == 0 && !page->withheld) {
+            *link = page->next;
+            UNPOISON(page, PAGE_BYTES);
+            if (allocator->nspare < PAGE_SPARE) {
+                page->next = allocator->spare;
+                allocator->spare = page;
+                allocator->nspare++;
+            } else {
+                UNREGISTER(page);
+                munmap(page, PAGE_BYTES);
+                released++;
+            }
+            continue;
+        }
+        relist(allocator, page);
+        link = &page->next;
+    }
+    allocator->npages -= released;
+    return released;
+}
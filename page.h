@@ -0,0 +1,143 @@
+#ifndef DPLANG_PAGE_H
+#define DPLANG_PAGE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Heap pages for objects.
+ *
+ * Objects live in PAGE_BYTES pages mapped straight from the OS and
+ * aligned to their size, so the page holding an object is found by
+ * masking its address.  Each page holds cells of one size class, a
+ * multiple of PAGE_GRANULE.  The collector's per-object bits live in
+ * bitmaps in the page header, one bit per granule, rather than in the
+ * objects: sweeping reads a few words per page instead of every object,
+ * and marking does not write to the objects it visits.
+ */
+
+#define PAGE_BYTES        (64 * 1024)
+#define PAGE_GRANULE      16
+#define PAGE_MAX_CELL     256
+#define PAGE_CLASSES      (PAGE_MAX_CELL / PAGE_GRANULE)
+#define PAGE_BITMAP_WORDS (PAGE_BYTES / PAGE_GRANULE / 64)
+
+/** Empty pages kept mapped for reuse, so a heap that shrinks and grows again does not churn mappings */
+#define PAGE_SPARE 4
+
+struct heap_page {
+    struct heap_page *next;       // every page of the allocator
+    struct heap_page *next_free;  // pages of the same class with room, see page_allocator
+    struct heap_page *next_young; // for the collector's list of pages holding young objects
+    struct heap_page *next_sweep; // for the collector's lists of pages left to sweep
+    void *free;                   // freed cells, linked through their first word
+    char *unused;                 // cells from here to the end of the page were never handed out
+    uint32_t cell_size;
+    uint32_t ncells;  // cells handed out and not freed
+    bool listed;      // on its class's list of pages with room
+    bool young;       // on the collector's young list
+    bool withheld;    // kept off the lists while another thread sweeps it, see page_relist()
+    uint64_t live[PAGE_BITMAP_WORDS];     // cells holding tracked objects
+    uint64_t nursery[PAGE_BITMAP_WORDS];  // cells holding young objects
+    uint64_t marks[PAGE_BITMAP_WORDS];
+};
+
+struct page_allocator {
+    struct heap_page *pages;
+    struct heap_page *available[PAGE_CLASSES];  // pages that may have room, linked through next_free
+    struct heap_page *spare;                    // empty pages of no class, linked through next
+    size_t npages;                              // pages mapped, spares included
+    size_t nspare;
+};
+
+static inline struct heap_page *page_of(const void *p)
+{
+    return (struct heap_page *)((uintptr_t)p & ~(uintptr_t)(PAGE_BYTES - 1));
+}
+
+/** Bitmap index of the cell at @p p */
+static inline size_t page_bit(const void *p)
+{
+    return ((uintptr_t)p & (PAGE_BYTES - 1)) / PAGE_GRANULE;
+}
+
+/** The cell at bitmap index @p bit of @p page */
+static inline void *page_cell(struct heap_page *page, size_t bit)
+{
+    return (char *)page + bit * PAGE_GRANULE;
+}
+
+/** Index into page_allocator.available for cells of @p size bytes */
+static inline size_t page_size_class(size_t size)
+{
+    return (size == 0) ? 0 : (size - 1) / PAGE_GRANULE;
+}
+
+/** True if @p page can hand out another cell */
+static inline bool page_has_room(const struct heap_page *page)
+{
+    return page != NULL &&
+           (page->free != NULL || (size_t)((const char *)page + PAGE_BYTES - page->unused) >= page->cell_size);
+}
+
+/** Bitmap words that cover every cell of @p page ever handed out; the rest are zero */
+static inline size_t page_words(const struct heap_page *page)
+{
+    size_t bits = (size_t)(page->unused - (const char *)page) / PAGE_GRANULE;
+    return (bits + 63) / 64;  // NOLINT(readability-magic-numbers)
+}
+
+static inline bool page_test(const uint64_t *bitmap, size_t bit)
+{
+    return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void page_set(uint64_t *bitmap, size_t bit)
+{
+    bitmap[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static inline void page_clear(uint64_t *bitmap, size_t bit)
+{
+    bitmap[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+/** Set @p bit atomically; @return true if this call set it, false if it was already set */
+static inline bool page_claim(uint64_t *bitmap, size_t bit)
+{
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    return (__atomic_fetch_or(&bitmap[bit / 64], mask, __ATOMIC_RELAXED) & mask) == 0;
+}
+
+void page_init(struct page_allocator *allocator);
+
+/** @return a cell of at least @p size bytes, NULL if @p size is over PAGE_MAX_CELL or out of memory */
+void *page_allocate(struct page_allocator *allocator, size_t size);
+
+/**
+ * Free the cell at @p p and clear its bits
+ *
+ * Only touches the cell's page if it is withheld, so another thread may
+ * free cells in withheld pages while this one allocates from the rest.
+ */
+void page_free(struct page_allocator *allocator, void *p);
+
+/**
+ * Rebuild the lists of pages with room, leaving out withheld pages
+ *
+ * Withhold pages by setting their withheld flag and calling this; clear
+ * it and call this, or page_release_empty(), to hand them out again.
+ */
+void page_relist(struct page_allocator *allocator);
+
+/**
+ * Unmap every page with no cells in use, bar up to PAGE_SPARE kept for reuse,
+ * and rebuild the lists as page_relist() does
+ *
+ * @return the number of pages unmapped
+ */
+size_t page_release_empty(struct page_allocator *allocator);
+
+/** Unmap every page, spares included, whatever is still in them; @p allocator is left empty */
+void page_destroy(struct page_allocator *allocator);
+#endif
@@ -0,0 +1,167 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "peephole.h"
+#include "memory.h"
+
+struct fusion {
+    enum opcode first;
+    enum opcode second;
+    enum opcode fused;
+};
+
+/*
+ * The pairs executed most often by the benchmark scripts, as reported by
+ * the opcode-pair profile (DEBUG_OPCODE_PROFILE in vm.c).  Arithmetic is
+ * deliberately not fused into the second half of a pair: quickening
+ * rewrites the byte in front of an instruction's operands, which only
+ * works when that byte is the instruction's own opcode.
+ */
+static const struct fusion fusions[] = {
+    {OP_GET_LOCAL,       OP_GET_LOCAL,      OP_GET_LOCAL_LOCAL    },
+    {OP_GET_LOCAL,       OP_CONSTANT,       OP_GET_LOCAL_CONSTANT },
+    {OP_GET_LOCAL,       OP_GET_PROPERTY,   OP_GET_LOCAL_PROPERTY },
+    {OP_SET_LOCAL,       OP_POP,            OP_SET_LOCAL_POP      },
+    {OP_SET_GLOBAL_SLOT, OP_POP,            OP_SET_GLOBAL_SLOT_POP},
+    {OP_LESS,            OP_JUMP_IF_FALSE,  OP_LESS_JUMP_IF_FALSE },
+    {OP_POP,             OP_LOOP,           OP_POP_LOOP           },
+};
+
+#define NFUSIONS (sizeof(fusions) / sizeof(fusions[0]))
+
+static int fused_opcode(uint8_t first, uint8_t second)
+{
+    for (size_t i = 0; i < NFUSIONS; i++) {
+        if (fusions[i].first == first && fusions[i].second == second) {
+            return fusions[i].fused;
+        }
+    }
+    return -1;
+}
+
+static inline int read_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);  // NOLINT(readability-magic-numbers)
+}
+
+static inline void write_u16(uint8_t *p, int v)
+{
+    p[0] = (uint8_t)(v & 0xFF);  // NOLINT(readability-magic-numbers)
+    p[1] = (uint8_t)(v >> 8);    // NOLINT(readability-magic-numbers)
+}
+
+/**
+ * Whether the instruction at offset and the one after it should be fused
+ *
+ * @return the superinstruction, or -1
+ */
+static int fusion_at(struct chunk *chunk, const bool *targets, int offset, int next)
+{
+    if (next >= chunk->count || targets[next]) {
+        return -1;
+    }
+    return fused_opcode(chunk->code[offset], chunk->code[next]);
+}
+
+int peephole_fuse(struct chunk *chunk)
+{
+    int count = chunk->count;
+    bool *targets = reallocate(NULL, 0, (count + 1) * sizeof(bool));
+    int *moved = reallocate(NULL, 0, (count + 1) * sizeof(int));  // old offset -> new offset, -1 mid-instruction
+    int fused = 0;
+
+    memset(targets, 0, (count + 1) * sizeof(bool));
+    for (int i = 0; i <= count; i++) {
+        moved[i] = -1;
+    }
+
+    for (int offset = 0; offset < count;) {
+        int end = offset + (int)instruction_length(chunk, offset);
+        if (end > count) {
+            fused = -1;
+            goto done;
+        }
+        int direction = instruction_jump_direction(chunk->code[offset]);
+        if (direction != 0) {
+            int target = end + direction * read_u16(&chunk->code[end - 2]);
+            if (target < 0 || target > count) {
+                fused = -1;
+                goto done;
+            }
+            targets[target] = true;
+        }
+        offset = end;
+    }
+
+    /* Work out where every instruction ends up before moving anything, so
+     * forward jumps can be rewritten as they are reached.
+     */
+    int new_count = 0;
+    for (int offset = 0; offset < count;) {
+        int next = offset + (int)instruction_length(chunk, offset);
+        moved[offset] = new_count;
+        if (fusion_at(chunk, targets, offset, next) >= 0) {
+            int end = next + (int)instruction_length(chunk, next);
+            moved[next] = new_count;
+            new_count += end - offset - 1;
+            offset = end;
+        } else {
+            new_count += next - offset;
+            offset = next;
+        }
+    }
+    moved[count] = new_count;
+
+    for (int i = 0; i <= count; i++) {
+        if (targets[i] && moved[i] < 0) {
+            // jump into the middle of an instruction
+            fused = -1;
+            goto done;
+        }
+    }
+
+    /* Rewrite in place.  Instructions only ever move towards the start of
+     * the chunk, so nothing is overwritten before it has been read.
+     */
+    for (int offset = 0; offset < count;) {
+        int length = (int)instruction_length(chunk, offset);
+        int next = offset + length;
+        int to = moved[offset];
+        int op = fusion_at(chunk, targets, offset, next);
+        int end;
+        int new_length;
+
+        memmove(&chunk->code[to], &chunk->code[offset], length);
+        memmove(&chunk->lines[to], &chunk->lines[offset], length * sizeof(int));
+        if (op >= 0) {
+            int next_length = (int)instruction_length(chunk, next);
+            chunk->code[to] = (uint8_t)op;
+            memmove(&chunk->code[to + length], &chunk->code[next + 1], next_length - 1);
+            memmove(&chunk->lines[to + length], &chunk->lines[next + 1], (next_length - 1) * sizeof(int));
+            end = next + next_length;
+            new_length = length + next_length - 1;
+            fused++;
+        } else {
+            end = next;
+            new_length = length;
+        }
+
+        int direction = instruction_jump_direction(chunk->code[to]);
+        if (direction != 0) {
+            uint8_t *operand = &chunk->code[to + new_length - 2];
+            int target = end + direction * read_u16(operand);
+            write_u16(operand, direction * (moved[target] - (to + new_length)));
+        }
+        offset = end;
+    }
+
+    for (int i = 0; i < chunk->ncaches; i++) {
+        chunk->caches[i].offset = moved[chunk->caches[i].offset];
+    }
+    chunk->count = new_count;
+
+done:
+    targets = reallocate(targets, (count + 1) * sizeof(bool), 0);
+    moved = reallocate(moved, (count + 1) * sizeof(int), 0);
+    return fused;
+}
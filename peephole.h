@@ -0,0 +1,26 @@
+#ifndef DPLANG_PEEPHOLE_H
+#define DPLANG_PEEPHOLE_H
+
+#include "chunk.h"
+
+/*
+ * Superinstruction fusion.
+ *
+ * Runs over a finished chunk and replaces adjacent instruction pairs that
+ * are common in practice with a single instruction doing the work of both,
+ * saving one dispatch each time it executes.  A fused instruction keeps the
+ * operands of both originals in order, so it is always one byte shorter;
+ * jump offsets, line numbers and inline cache offsets are rewritten to match.
+ *
+ * A pair is never fused when the second instruction is a jump target.
+ */
+
+/**
+ * Fuse instruction pairs in chunk in place
+ *
+ * @return number of pairs fused, or -1 if the chunk's jumps could not be
+ *         followed (the chunk is left untouched)
+ */
+int peephole_fuse(struct chunk *chunk);
+
+#endif
@@ -193,7 +193,15 @@ static enum token_type identifier_type(struct scanner *scanner)
         case 'p':
             return check_keyword(scanner, 1, 4, "rint", TOKEN_PRINT);
         case 'r':
-            return check_keyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+            if (scanner->current - scanner->start > 2 && scanner->start[1] == 'e') {
+                switch (scanner->start[2]) {
+                    case 's':
+                        return check_keyword(scanner, 3, 3, "ume", TOKEN_RESUME);
+                    case 't':
+                        return check_keyword(scanner, 3, 3, "urn", TOKEN_RETURN);
+                }
+            }
+            break;
         case 's':
             return check_keyword(scanner, 1, 4, "uper", TOKEN_SUPER);
         case 't':
@@ -210,6 +218,8 @@ static enum token_type identifier_type(struct scanner *scanner)
             return check_keyword(scanner, 1, 2, "ar", TOKEN_VAR);
         case 'w':
             return check_keyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+        case 'y':
+            return check_keyword(scanner, 1, 4, "ield", TOKEN_YIELD);
     }
     return TOKEN_IDENTIFIER;
 }
@@ -341,6 +351,10 @@ struct token scanner_scan_token(struct scanner *scanner)
             return make_token(scanner, TOKEN_CARET);
         case '~':
             return make_token(scanner, TOKEN_TILDE);
+        case '&':
+            return make_token(scanner, TOKEN_AMPERSAND);
+        case '|':
+            return make_token(scanner, TOKEN_PIPE);
         case '!':
             return make_token(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=':
@@ -42,6 +42,8 @@ enum token_type {
     TOKEN_AND,
     TOKEN_CARET,
     TOKEN_TILDE,
+    TOKEN_AMPERSAND,
+    TOKEN_PIPE,
     TOKEN_CLASS,
     TOKEN_ELSE,
     TOKEN_FALSE,
@@ -54,12 +56,14 @@ enum token_type {
     TOKEN_OR,
 
     TOKEN_PRINT,
+    TOKEN_RESUME,
     TOKEN_RETURN,
     TOKEN_SUPER,
     TOKEN_THIS,
     TOKEN_TRUE,
     TOKEN_VAR,
     TOKEN_WHILE,
+    TOKEN_YIELD,
     TOKEN_ERROR,
     TOKEN_EOF
 };
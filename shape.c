@@ -0,0 +1,131 @@
+#include <string.h>
+
+#include "shape.h"
+#include "memory.h"
+#include "object.h"
+#include "util.h"
+
+#define TRANSITIONS_MIN_CAPACITY  2
+#define TRANSITIONS_GROWTH_FACTOR 2
+
+static inline bool shape_name_equal(struct object_string *a, struct object_string *b)
+{
+    if (a == b) {
+        return true;
+    }
+    return a->hash == b->hash && a->length == b->length && memcmp(a->data, b->data, a->length) == 0;
+}
+
+static struct shape *shape_allocate(struct shape *parent, struct object_string *name)
+{
+    int count = (parent == NULL) ? 0 : parent->count + 1;
+    struct object_string **names = NULL;
+    if (count > 0) {
+        names = (struct object_string **)reallocate(NULL, 0, count * sizeof(struct object_string *));
+        if (parent->count > 0) {
+            memcpy(names, parent->names, parent->count * sizeof(struct object_string *));
+        }
+        names[count - 1] = name;
+    }
+
+    struct shape *shape = (struct shape *)reallocate(NULL, 0, sizeof(struct shape));
+    shape->parent = parent;
+    shape->names = names;
+    shape->count = count;
+    shape->transitions = NULL;
+    shape->ntransitions = 0;
+    shape->transition_capacity = 0;
+    return shape;
+}
+
+struct shape *shape_new_root(void)
+{
+    return shape_allocate(NULL, NULL);
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+void shape_free_tree(struct shape *root)
+{
+    if (root == NULL) {
+        return;
+    }
+    for (int i = 0; i < root->ntransitions; i++) { shape_free_tree(root->transitions[i].shape); }
+    reallocate(root->transitions, root->transition_capacity * sizeof(struct shape_transition), 0);
+    reallocate(root->names, root->count * sizeof(struct object_string *), 0);
+    reallocate(root, sizeof(struct shape), 0);
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+int shape_count_tree(struct shape *root)
+{
+    if (root == NULL) {
+        return 0;
+    }
+    int count = 1;
+    for (int i = 0; i < root->ntransitions; i++) { count += shape_count_tree(root->transitions[i].shape); }
+    return count;
+}
+
+int shape_lookup(struct shape *shape, struct object_string *name)
+{
+    // Fields are usually found by identity; only fall back to comparing contents if that fails
+    for (int i = 0; i < shape->count; i++) {
+        if (shape->names[i] == name) {
+            return i;
+        }
+    }
+    for (int i = 0; i < shape->count; i++) {
+        if (shape_name_equal(shape->names[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Find or create the shape reached by adding @p name to @p shape
+ *
+ * @p shape_budget is the number of shapes the owning class may still
+ * create; it is decremented when a new shape is made.  Returns NULL when
+ * the instance should switch to dictionary mode instead.
+ */
+struct shape *shape_transition(struct shape *shape, struct object_string *name, int *shape_budget)
+{
+    for (int i = 0; i < shape->ntransitions; i++) {
+        if (shape_name_equal(shape->transitions[i].name, name)) {
+            return shape->transitions[i].shape;
+        }
+    }
+
+    if (shape->count >= SHAPE_MAX_FIELDS || *shape_budget <= 0) {
+        return NULL;
+    }
+
+    if (shape->transition_capacity < shape->ntransitions + 1) {
+        int prev_cap = shape->transition_capacity;
+        int capacity = (prev_cap < TRANSITIONS_MIN_CAPACITY) ? TRANSITIONS_MIN_CAPACITY
+                                                              : prev_cap * TRANSITIONS_GROWTH_FACTOR;
+        shape->transitions = (struct shape_transition *)reallocate(
+            shape->transitions, prev_cap * sizeof(struct shape_transition), capacity * sizeof(struct shape_transition));
+        shape->transition_capacity = capacity;
+    }
+
+    struct shape *next = shape_allocate(shape, name);
+    shape->transitions[shape->ntransitions].name = name;
+    shape->transitions[shape->ntransitions].shape = next;
+    shape->ntransitions++;
+    (*shape_budget)--;
+    return next;
+}
+
+// NOLINTNEXTLINE(misc-no-recursion)
+void shape_mark_tree(struct shape *root)
+{
+    if (root == NULL) {
+        return;
+    }
+    for (int i = 0; i < root->ntransitions; i++) {
+        gc_mark_object((struct object *)root->transitions[i].name);
+        shape_mark_tree(root->transitions[i].shape);
+    }
+}
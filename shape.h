@@ -0,0 +1,45 @@
+#ifndef DPLANG_SHAPE_H
+#define DPLANG_SHAPE_H
+
+#include <stdbool.h>
+
+struct object_string;
+
+/*
+ * Hidden classes for instance fields.
+ *
+ * A shape records which field lives in which slot of an instance.  All
+ * shapes belonging to a class form a transition tree rooted at an empty
+ * shape: adding a field moves an instance to the child shape for that
+ * name, so instances that get their fields assigned in the same order
+ * share one shape and store their values in a plain array.
+ */
+
+/** Most fields an instance can hold before it switches to dictionary mode */
+#define SHAPE_MAX_FIELDS 64
+
+/** Most shapes one class may create before new fields fall back to dictionary mode */
+#define SHAPE_MAX_PER_CLASS 256
+
+struct shape_transition {
+    struct object_string *name;
+    struct shape *shape;
+};
+
+struct shape {
+    struct shape *parent;
+    struct object_string **names;  // names[slot] for every field of this shape
+    int count;
+    struct shape_transition *transitions;
+    int ntransitions;
+    int transition_capacity;
+};
+
+struct shape *shape_new_root(void);
+void shape_free_tree(struct shape *root);
+int shape_count_tree(struct shape *root);
+int shape_lookup(struct shape *shape, struct object_string *name);
+struct shape *shape_transition(struct shape *shape, struct object_string *name, int *shape_budget);
+void shape_mark_tree(struct shape *root);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "slab.h"
+#include "util.h"
+
+/* Blocks start with this header, padded so chunks stay aligned */
+struct slab_block {
+    struct slab_block *next;
+};
+
+#define SLAB_HEADER_BYTES SLAB_GRANULE
+
+static size_t size_class(size_t size)
+{
+    return (size == 0) ? 0 : (size - 1) / SLAB_GRANULE;
+}
+
+void slab_init(struct slab_allocator *slab)
+{
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        slab->free[i] = NULL;
+        slab->next[i] = NULL;
+        slab->end[i] = NULL;
+    }
+    slab->blocks = NULL;
+    slab->nblocks = 0;
+}
+
+void slab_destroy(struct slab_allocator *slab)
+{
+    struct slab_block *block = slab->blocks;
+    while (block != NULL) {
+        struct slab_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    slab_init(slab);
+}
+
+/** Give class @p c a fresh block to carve chunks from */
+static bool slab_refill(struct slab_allocator *slab, size_t c)
+{
+    struct slab_block *block = malloc(SLAB_BLOCK_BYTES);
+    if (block == NULL) {
+        return false;
+    }
+    block->next = slab->blocks;
+    slab->blocks = block;
+    slab->nblocks++;
+    slab->next[c] = (char *)block + SLAB_HEADER_BYTES;
+    slab->end[c] = (char *)block + SLAB_BLOCK_BYTES;
+    return true;
+}
+
+void *slab_allocate(struct slab_allocator *slab, size_t size)
+{
+    if (unlikely(size > SLAB_MAX_SIZE)) {
+        return malloc(size);
+    }
+
+    size_t c = size_class(size);
+    void *p = slab->free[c];
+    if (likely(p != NULL)) {
+        slab->free[c] = *(void **)p;
+        return p;
+    }
+
+    size_t chunk = (c + 1) * SLAB_GRANULE;
+    // The tail of a block too short for another chunk is left unused
+    if ((slab->next[c] == NULL || (size_t)(slab->end[c] - slab->next[c]) < chunk) && !slab_refill(slab, c)) {
+        return NULL;
+    }
+    p = slab->next[c];
+    slab->next[c] += chunk;
+    return p;
+}
+
+void slab_free(struct slab_allocator *slab, void *p, size_t size)
+{
+    if (p == NULL) {
+        return;
+    }
+    if (unlikely(size > SLAB_MAX_SIZE)) {
+        free(p);
+        return;
+    }
+    size_t c = size_class(size);
+    *(void **)p = slab->free[c];
+    slab->free[c] = p;
+}
+
+void slab_merge(struct slab_allocator *slab, struct slab_allocator *from)
+{
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        void *head = from->free[c];
+        if (head == NULL) {
+            continue;
+        }
+        void **tail = (void **)head;
+        while (*tail != NULL) { tail = (void **)*tail; }
+        *tail = slab->free[c];
+        slab->free[c] = head;
+        from->free[c] = NULL;
+    }
+}
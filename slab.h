@@ -0,0 +1,48 @@
+#ifndef DPLANG_SLAB_H
+#define DPLANG_SLAB_H
+#include <stddef.h>
+
+/*
+ * Size-class allocator for objects and short strings.
+ *
+ * Requests of up to SLAB_MAX_SIZE bytes are rounded up to a multiple of
+ * SLAB_GRANULE and served from a free list for that size class.  An empty
+ * free list is refilled by carving up a SLAB_BLOCK_BYTES block from
+ * malloc().  Freed memory goes back on its class's free list, and blocks
+ * are only returned by slab_destroy().  Larger requests go to malloc().
+ */
+
+#define SLAB_GRANULE     16
+#define SLAB_MAX_SIZE    256
+#define SLAB_CLASSES     (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_BLOCK_BYTES (64 * 1024)
+
+struct slab_block;
+
+struct slab_allocator {
+    void *free[SLAB_CLASSES];  // freed chunks, linked through their first word
+    char *next[SLAB_CLASSES];  // unused part of the class's newest block
+    char *end[SLAB_CLASSES];
+    struct slab_block *blocks;
+    size_t nblocks;
+};
+
+void slab_init(struct slab_allocator *slab);
+
+/** Free every block, and with them everything allocated from @p slab */
+void slab_destroy(struct slab_allocator *slab);
+
+/** @return @p size bytes aligned to SLAB_GRANULE, NULL if out of memory */
+void *slab_allocate(struct slab_allocator *slab, size_t size);
+
+/** Free @p p, which slab_allocate() returned for the same @p size */
+void slab_free(struct slab_allocator *slab, void *p, size_t size);
+
+/**
+ * Move the chunks freed into @p from onto @p slab's free lists
+ *
+ * @p from must not have allocated anything; it only collects frees, e.g.
+ * from another thread, so they can be handed back later.
+ */
+void slab_merge(struct slab_allocator *slab, struct slab_allocator *from);
+#endif
@@ -18,12 +18,24 @@ static inline int table_load(struct table *table)
     if (table->capacity == 0) {
         return TABLE_MAX_LOAD + 1;
     }
-    return 100 * table->count / table->capacity;  // NOLINT(readability-magic-numbers)
+    return 100 * (table->count + table->tombstones) / table->capacity;  // NOLINT(readability-magic-numbers)
 }
 
+/**
+ * Capacity to rehash into once the load is too high
+ *
+ * Sized from the live entries alone, so that the smallest capacity they
+ * fill to at most half the maximum load is used.  When tombstones caused
+ * the overflow that is no bigger than the current capacity, and churn of
+ * short-lived keys can't grow the table without bound.
+ */
 static inline int table_next_size(struct table *table)
 {
-    return (table->capacity < TABLE_MIN_CAPACITY) ? TABLE_MIN_CAPACITY : table->capacity * TABLE_GROWTH_FACTOR;
+    int capacity = TABLE_MIN_CAPACITY;
+    while (100 * ((int64_t)table->count + 1) > (int64_t)capacity * TABLE_MAX_LOAD / 2) {  // NOLINT(readability-magic-numbers)
+        capacity *= TABLE_GROWTH_FACTOR;
+    }
+    return capacity;
 }
 
 int table_init(struct table *table)
@@ -32,6 +44,7 @@ int table_init(struct table *table)
         return -1;
     }
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
     return 0;
@@ -45,6 +58,7 @@ void table_free(struct table *table)
     table->entries = (struct entry *)reallocate(table->entries, table->capacity * sizeof(struct entry), 0);
     table->capacity = 0;
     table->count = 0;
+    table->tombstones = 0;
 }
 
 static struct entry *find_entry(struct entry *entries, int capacity, value key)
@@ -61,7 +75,9 @@ static struct entry *find_entry(struct entry *entries, int capacity, value key)
                     tombstone = entry;
                 }
             }
-        } else if (value_equal(key, entry->key)) {
+        } else if (IS_OBJECT(key) ? (IS_OBJECT(entry->key) && AS_OBJECT(key) == AS_OBJECT(entry->key))
+                                  : value_equal(key, entry->key)) {
+            // Strings are interned, so object keys only ever match themselves
             return entry;
         }
         index = (index + 1) & (capacity - 1);
@@ -94,6 +110,7 @@ static void adjust_capacity(struct table *table)
 
     table->entries = entries;
     table->capacity = capacity;
+    table->tombstones = 0;
 }
 
 // NOLINTBEGIN(bugprone-easily-swappable-parameters)
@@ -122,12 +139,16 @@ struct object_string *table_find_string(struct table *table, const char *chars,
 
     while (1) {
         struct entry *entry = &table->entries[index];
-        if (IS_EMPTY(entry->key) || !is_object_type(entry->key, OBJECT_STRING)) {
-            return NULL;
-        }
-        struct object_string *string = AS_STRING(entry->key);
-        if (string->length == length && memcmp(string->data, chars, length) == 0) {
-            return string;
+        if (IS_EMPTY(entry->key)) {
+            // Keep probing past tombstones, only a truly empty slot ends the search
+            if (IS_NIL(entry->value)) {
+                return NULL;
+            }
+        } else if (is_object_type(entry->key, OBJECT_STRING)) {
+            struct object_string *string = AS_STRING(entry->key);
+            if (string->hash == hash && string->length == length && memcmp(string->data, chars, length) == 0) {
+                return string;
+            }
         }
 
         index = (index + 1) & (table->capacity - 1);
@@ -149,6 +170,9 @@ bool table_set(struct table *table, value key, value value)
     struct entry *entry = find_entry(table->entries, table->capacity, key);
     // It's a new key if there's no entry there, or if it's a tombstone
     bool is_new_key = IS_EMPTY(entry->key);
+    if (is_new_key && !IS_NIL(entry->value)) {
+        table->tombstones--;
+    }
 
     entry->key = key;
     entry->value = value;
@@ -189,6 +213,7 @@ bool table_delete(struct table *table, value key)
     }
 
     table->count--;
+    table->tombstones++;
 
     // Tombstone sentinel value
     entry->key = EMPTY_VAL;
@@ -11,6 +11,7 @@ struct entry {
 
 struct table {
     int count;
+    int tombstones;  // deleted entries still occupying a slot
     int capacity;
     struct entry *entries;
 };
@@ -0,0 +1,42 @@
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+# The second build is configured with -DSLAB_ALLOCATOR=OFF, so every object goes to malloc
+SLAB = "../build/dplang"
+MALLOC = "../build-malloc/dplang"
+RUNS = 5
+
+LOOP = "for (var i = 0; i < 1000000; i = i + 1) {{ {body} }}\n"
+
+SCRIPTS = {
+    "bound methods": "class P { get() { return 1; } }\nvar p = P();\nvar s = 0;\n"
+    + LOOP.format(body="var m = p.get; s = s + m();"),
+    "closures": "func make(n) { func f() { return n; } return f; }\nvar s = 0;\n"
+    + LOOP.format(body="s = s + make(i)();"),
+    "short strings": 'var s = "";\n' + LOOP.format(body='s = s + "x"; if (i - (i / 16) * 16 == 0) { s = ""; }'),
+    "instances": "class P { init(x) { this.x = x; } }\nvar s = 0;\n" + LOOP.format(body="s = s + P(i).x;"),
+}
+
+
+def run(dplang, script):
+    start = time.perf_counter()
+    subprocess.run([dplang, "--no-cache", script], check=True, stdout=subprocess.DEVNULL)
+    return time.perf_counter() - start
+
+
+if len(sys.argv) == 3:
+    SLAB, MALLOC = sys.argv[1:]
+
+with tempfile.TemporaryDirectory() as tmp:
+    print(f"median of {RUNS} runs")
+    print(f"  {'':16}{'slab':>10}{'malloc':>10}")
+    for name, source in SCRIPTS.items():
+        script = Path(tmp) / "alloc.dpl"
+        script.write_text(source, encoding="utf-8")
+        slab = statistics.median(run(SLAB, script) for _ in range(RUNS))
+        malloc = statistics.median(run(MALLOC, script) for _ in range(RUNS))
+        print(f"  {name:16}{slab * 1000:8.1f}ms{malloc * 1000:8.1f}ms")
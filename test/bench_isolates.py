@@ -0,0 +1,61 @@
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+DPLANG = "../build/dplang"
+RUNS = 3
+RECORDS = 512
+JOBS = 16
+
+# Each job checksums a batch of records and sends the total back; the script
+# queues every job before it waits, so the pool can run as many at once as it has workers
+SCRIPT = f"""
+func work(out, first, count) {{
+    func checksum(r) {{
+        var record = table();
+        var sum = 0;
+        for (var i = 0; i < 2000; i = i + 1) {{ record[i] = r * i; }}
+        for (var i = 0; i < 2000; i = i + 1) {{ sum = sum + record[i] * 3 - i; }}
+        return sum;
+    }}
+    var total = 0;
+    for (var r = first; r < first + count; r = r + 1) {{ total = total + checksum(r); }}
+    send(out, total);
+}}
+var out = channel({JOBS});
+var per_job = {RECORDS // JOBS};
+for (var j = 0; j < {JOBS}; j = j + 1) {{ spawn(work, out, j * per_job, per_job); }}
+var total = 0;
+for (var j = 0; j < {JOBS}; j = j + 1) {{ total = total + recv(out); }}
+print total;
+"""
+
+
+def run(script, workers):
+    start = time.perf_counter()
+    subprocess.run([DPLANG, "--no-cache", f"--isolate-workers={workers}", script], check=True, stdout=subprocess.DEVNULL)
+    return time.perf_counter() - start
+
+
+if len(sys.argv) == 2:
+    DPLANG = sys.argv[1]
+
+cpus = os.cpu_count() or 1
+workers = [1]
+while workers[-1] * 2 <= min(cpus, JOBS):
+    workers.append(workers[-1] * 2)
+
+with tempfile.TemporaryDirectory() as tmp:
+    script = Path(tmp) / "isolates.dpl"
+    script.write_text(SCRIPT, encoding="utf-8")
+    print(f"median of {RUNS} runs, {RECORDS} records in {JOBS} jobs, {cpus} CPUs")
+    print(f"  {'workers':>8}{'time':>10}{'records/s':>12}{'speedup':>9}")
+    base = None
+    for n in workers:
+        seconds = statistics.median(run(script, n) for _ in range(RUNS))
+        base = base or seconds
+        print(f"  {n:8}{seconds * 1000:8.1f}ms{RECORDS / seconds:12.1f}{base / seconds:8.2f}x")
@@ -0,0 +1,49 @@
+import os
+import statistics
+import subprocess
+import tempfile
+import time
+from pathlib import Path
+
+DPLANG = "../build/dplang"
+RUNS = 10
+
+
+def make_script(path, modules=60, functions=100):
+    """A script that defines many functions but does almost no work, so its run time is startup"""
+    with open(path, "w", encoding="utf-8") as f:
+        for m in range(modules):
+            f.write(f"func mod{m}() {{\n")
+            for i in range(functions):
+                f.write(f"    func f{i}(a, b) {{\n")
+                f.write(f"        var t = a + b * {i};\n")
+                f.write(f'        if (t > {i}) {{ return "big {i}" + "x"; }}\n')
+                f.write("        for (var j = 0; j < 3; j = j + 1) { t = t + j; }\n")
+                f.write("        return t;\n")
+                f.write("    }\n")
+            f.write("    return f1;\n}\n")
+        f.write("print mod1()(1, 2);\n")
+
+
+def run(args, env):
+    start = time.perf_counter()
+    subprocess.run([DPLANG, *args], env=env, check=True, stdout=subprocess.DEVNULL)
+    return time.perf_counter() - start
+
+
+with tempfile.TemporaryDirectory() as tmp:
+    script = Path(tmp) / "startup.dpl"
+    make_script(script)
+    env = dict(os.environ, DPLANG_CACHE_DIR=str(Path(tmp) / "cache"))
+
+    uncached = [run(["--no-cache", script], env) for _ in range(RUNS)]
+    cold = []
+    for _ in range(RUNS):
+        run(["--clear-cache"], env)
+        cold.append(run([script], env))
+    warm = [run([script], env) for _ in range(RUNS)]
+
+    print(f"script: {script.stat().st_size} bytes, median of {RUNS} runs")
+    print(f"  no cache    {statistics.median(uncached) * 1000:8.1f} ms")
+    print(f"  cold cache  {statistics.median(cold) * 1000:8.1f} ms")
+    print(f"  warm cache  {statistics.median(warm) * 1000:8.1f} ms")
@@ -0,0 +1,96 @@
+import statistics
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+DPLANG = "../build/dplang"
+RUNS = 5
+
+# String-keyed lookups: indexing a table with keys built at runtime, and
+# method calls at a site that sees too many receiver classes for the
+# inline cache, so every call searches a class method table by name
+SCRIPT = """\
+func make_keys(t, keys, n) {
+    var k = "key_";
+    for (var i = 0; i < n; i = i + 1) {
+        k = k + "x";
+        keys[i] = k;
+        t[k] = i;
+    }
+}
+
+func lookup_all(t, keys, n) {
+    var sum = 0;
+    for (var i = 0; i < n; i = i + 1) {
+        sum = sum + t[keys[i]];
+    }
+    return sum;
+}
+
+func bench_tables() {
+    var t = table();
+    var keys = table();
+    make_keys(t, keys, 64);
+    var start = clock();
+    for (var n = 0; n < 40000; n = n + 1) {
+        lookup_all(t, keys, 64);
+    }
+    return clock() - start;
+}
+
+class P1 { init() { this.value = 1; } get() { return this.value; } }
+class P2 { init() { this.value = 1; } get() { return this.value; } }
+class P3 { init() { this.value = 1; } get() { return this.value; } }
+class P4 { init() { this.value = 1; } get() { return this.value; } }
+class P5 { init() { this.value = 1; } get() { return this.value; } }
+class P6 { init() { this.value = 1; } get() { return this.value; } }
+
+func call_all(objs) {
+    var sum = 0;
+    for (var i = 0; i < 6; i = i + 1) {
+        sum = sum + objs[i].get();
+    }
+    return sum;
+}
+
+func bench_properties() {
+    var objs = table();
+    objs[0] = P1();
+    objs[1] = P2();
+    objs[2] = P3();
+    objs[3] = P4();
+    objs[4] = P5();
+    objs[5] = P6();
+    var start = clock();
+    for (var n = 0; n < 500000; n = n + 1) {
+        call_all(objs);
+    }
+    return clock() - start;
+}
+
+print "table lookups";
+print bench_tables();
+print "property access";
+print bench_properties();
+"""
+
+
+def run(script):
+    """The timings the script prints, by name"""
+    lines = subprocess.run(
+        [DPLANG, "--no-cache", script], check=True, capture_output=True, text=True
+    ).stdout.splitlines()
+    return {name: float(seconds) for name, seconds in zip(lines[::2], lines[1::2])}
+
+
+if len(sys.argv) == 2:
+    DPLANG = sys.argv[1]
+
+with tempfile.TemporaryDirectory() as tmp:
+    script = Path(tmp) / "strings.dpl"
+    script.write_text(SCRIPT, encoding="utf-8")
+    runs = [run(script) for _ in range(RUNS)]
+    print(f"median of {RUNS} runs")
+    for name in runs[0]:
+        print(f"  {name:16}{statistics.median(r[name] for r in runs) * 1000:8.1f} ms")
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include "unity.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "object.h"
+#include "vm.h"
+
+#define BUFFER_SIZE 65536
+
+static struct vm vm;
+static uint8_t buffer[BUFFER_SIZE];
+
+void setUp(void)
+{
+    vm_init(&vm);
+}
+
+void tearDown(void)
+{
+    vm_free(&vm);
+}
+
+/** Compile source and serialize it into buffer, returning the size */
+static size_t compile_to_buffer(const char *source)
+{
+    struct object_function *function = compile(&vm, source, COMPILE_DEFAULT);
+    TEST_ASSERT_NOT_NULL(function);
+
+    FILE *f = tmpfile();
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(0, bytecode_write(&vm, function, 0, f));
+    rewind(f);
+    size_t size = fread(buffer, 1, sizeof(buffer), f);
+    fclose(f);
+    TEST_ASSERT_LESS_THAN(sizeof(buffer), size);
+    return size;
+}
+
+/** Load buffer into a VM that has never seen the source */
+static void reload(size_t size)
+{
+    vm_free(&vm);
+    vm_init(&vm);
+    // Give the new VM different global slots from the one that compiled the script
+    vm_global_slot(&vm, "unrelated", strlen("unrelated"));
+    TEST_ASSERT_EQUAL(0, vm_interpret_bytecode(&vm, buffer, size));
+}
+
+static value global(const char *name)
+{
+    return vm.global_values.values[vm_global_slot(&vm, name, strlen(name))];
+}
+
+void test_is_bytecode(void)
+{
+    size_t size = compile_to_buffer("print 1;");
+    TEST_ASSERT_TRUE(bytecode_is_bytecode(buffer, size));
+    TEST_ASSERT_FALSE(bytecode_is_bytecode((const uint8_t *)"print 1;", strlen("print 1;")));
+    TEST_ASSERT_FALSE(bytecode_is_bytecode(buffer, 2));
+}
+
+void test_round_trip_constants(void)
+{
+    reload(compile_to_buffer("var answer = 6 * 7; var half = 0.5; var yes = true; var nothing = nil;"
+                             "var greeting = \"hello\";"));
+    TEST_ASSERT_EQUAL(42, AS_INT(global("answer")));
+    TEST_ASSERT_EQUAL_DOUBLE(0.5, AS_NUMBER(global("half")));
+    TEST_ASSERT_TRUE(AS_BOOL(global("yes")));
+    TEST_ASSERT_TRUE(IS_NIL(global("nothing")));
+    TEST_ASSERT_EQUAL_STRING("hello", AS_CSTRING(global("greeting")));
+    // loaded strings are interned like compiled ones
+    TEST_ASSERT_EQUAL_PTR(AS_STRING(global("greeting")), object_string_allocate("hello", strlen("hello")));
+}
+
+void test_round_trip_functions(void)
+{
+    reload(compile_to_buffer("func make() { var n = 0; func inc() { n = n + 1; return n; } return inc; }"
+                             "var counter = make(); counter(); var count = counter();"
+                             "class Point { init(x) { this.x = x; } get() { return this.x; } }"
+                             "var x = Point(3).get();"));
+    TEST_ASSERT_EQUAL(2, AS_INT(global("count")));
+    TEST_ASSERT_EQUAL(3, AS_INT(global("x")));
+}
+
+void test_round_trip_natives(void)
+{
+    reload(compile_to_buffer("var root = sqrt(16);"));
+    TEST_ASSERT_EQUAL_DOUBLE(4, AS_DOUBLE(global("root")));
+}
+
+void test_rejects_truncated(void)
+{
+    size_t size = compile_to_buffer("func f(a) { return a + \"!\"; } print f(\"x\");");
+    for (size_t i = 0; i < size; i++) { TEST_ASSERT_NULL(bytecode_read(&vm, buffer, i, NULL)); }
+    TEST_ASSERT_NOT_NULL(bytecode_read(&vm, buffer, size, NULL));
+}
+
+void test_rejects_other_version(void)
+{
+    size_t size = compile_to_buffer("print 1;");
+    buffer[4] = BYTECODE_VERSION_MAJOR + 1;
+    TEST_ASSERT_NULL(bytecode_read(&vm, buffer, size, NULL));
+}
+
+void test_rejects_bad_opcode(void)
+{
+    size_t size = compile_to_buffer("print 1;");
+    uint8_t code[] = {OP_PRINT, OP_NIL, OP_RETURN};
+    uint8_t *op = memmem(buffer, size, code, sizeof(code));
+    TEST_ASSERT_NOT_NULL(op);
+    *op = OP_COUNT;
+    TEST_ASSERT_NULL(bytecode_read(&vm, buffer, size, NULL));
+}
+
+void test_rejects_unbalanced_loop(void)
+{
+    size_t size = compile_to_buffer("while (true) { 7; }");
+    uint8_t code[] = {OP_CONSTANT, 0, OP_POP_LOOP};
+    uint8_t *op = memmem(buffer, size, code, sizeof(code));
+    TEST_ASSERT_NOT_NULL(op);
+    TEST_ASSERT_NOT_NULL(bytecode_read(&vm, buffer, size, NULL));
+
+    // Loop without the pop: each pass would leave another 7 on the stack
+    op[2] = OP_LOOP;
+    TEST_ASSERT_NULL(bytecode_read(&vm, buffer, size, NULL));
+}
+
+void test_nan_constant_stays_a_number(void)
+{
+    size_t size = compile_to_buffer("var half = 1.5;");
+    double d = 1.5;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(d));
+    uint8_t le[sizeof(bits)];
+    for (size_t i = 0; i < sizeof(bits); i++) {
+        le[i] = (uint8_t)(bits >> (8 * i));
+    }
+    uint8_t *constant = memmem(buffer, size, le, sizeof(le));
+    TEST_ASSERT_NOT_NULL(constant);
+
+    // A quiet NaN with the sign bit set, which NaN boxing would read as an object
+    bits = 0xFFFC000000000010;
+    for (size_t i = 0; i < sizeof(bits); i++) {
+        constant[i] = (uint8_t)(bits >> (8 * i));
+    }
+    reload(size);
+    TEST_ASSERT_TRUE(IS_NUMBER(global("half")));
+    TEST_ASSERT_TRUE(isnan(AS_NUMBER(global("half"))));
+}
+
+void test_loads_functions_on_first_use(void)
+{
+    const char *path = "test_bytecode.dpc";
+    struct object_function *script =
+        compile(&vm, "func outer() {\n func inner() { return 2; }\n return inner;\n}", COMPILE_DEFAULT);
+    TEST_ASSERT_NOT_NULL(script);
+    FILE *f = fopen(path, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(0, bytecode_write(&vm, script, 0, f));
+    fclose(f);
+
+    vm_free(&vm);
+    vm_init(&vm);
+    TEST_ASSERT_EQUAL(0, vm_interpret_bytecode_file(&vm, path));
+    remove(path);
+
+    // defining outer loaded it, but nothing has made a closure of inner yet
+    struct object_function *outer = AS_CLOSURE(global("outer"))->function;
+    struct object_function *inner = AS_FUNCTION(outer->chunk.constants.values[0]);
+    TEST_ASSERT_NULL(outer->unloaded);
+    TEST_ASSERT_TRUE(outer->chunk.borrowed);
+    TEST_ASSERT_NOT_NULL(inner->unloaded);
+    TEST_ASSERT_EQUAL_STRING("inner", inner->name->data);
+
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "var two = outer()();"));
+    TEST_ASSERT_NULL(inner->unloaded);
+    TEST_ASSERT_EQUAL(2, AS_INT(global("two")));
+    TEST_ASSERT_EQUAL(2, chunk_line(&inner->chunk, 0));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_is_bytecode);
+    RUN_TEST(test_round_trip_constants);
+    RUN_TEST(test_round_trip_functions);
+    RUN_TEST(test_round_trip_natives);
+    RUN_TEST(test_rejects_truncated);
+    RUN_TEST(test_rejects_other_version);
+    RUN_TEST(test_rejects_bad_opcode);
+    RUN_TEST(test_rejects_unbalanced_loop);
+    RUN_TEST(test_nan_constant_stays_a_number);
+    RUN_TEST(test_loads_functions_on_first_use);
+
+    return UNITY_END();
+}
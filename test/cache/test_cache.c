@@ -0,0 +1,131 @@
+#include "unity.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "cache.h"
+#include "vm.h"
+
+#define SOURCE "var answer = 6 * 7;"
+
+static struct vm vm;
+static char dir[] = "/tmp/dplang-cache-XXXXXX";
+
+void setUp(void)
+{
+    vm_init(&vm);
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+}
+
+void tearDown(void)
+{
+    cache_clear(dir);
+    rmdir(dir);
+    strcpy(dir, "/tmp/dplang-cache-XXXXXX");
+    vm_free(&vm);
+}
+
+/** Path of the only entry in the cache, or NULL if it does not have exactly one */
+static const char *only_entry(void)
+{
+    static char path[512];
+    int count = 0;
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            count++;
+        }
+    }
+    closedir(d);
+    return (count == 1) ? path : NULL;
+}
+
+static int run(const char *source)
+{
+    struct object_function *function = cache_compile(&vm, dir, source, strlen(source));
+    return (function == NULL) ? -1 : vm_interpret_function(&vm, function);
+}
+
+static value global(const char *name)
+{
+    return vm.global_values.values[vm_global_slot(&vm, name, strlen(name))];
+}
+
+void test_miss_writes_entry(void)
+{
+    TEST_ASSERT_EQUAL(0, run(SOURCE));
+    TEST_ASSERT_EQUAL(42, AS_INT(global("answer")));
+    TEST_ASSERT_NOT_NULL(only_entry());
+}
+
+void test_hit_loads_entry(void)
+{
+    TEST_ASSERT_EQUAL(0, run(SOURCE));
+    vm_free(&vm);
+    vm_init(&vm);
+    TEST_ASSERT_EQUAL(0, run(SOURCE));
+    TEST_ASSERT_EQUAL(42, AS_INT(global("answer")));
+    TEST_ASSERT_NOT_NULL(only_entry());
+}
+
+void test_edited_source_misses(void)
+{
+    TEST_ASSERT_EQUAL(0, run(SOURCE));
+    TEST_ASSERT_EQUAL(0, run("var answer = 41;"));
+    TEST_ASSERT_EQUAL(41, AS_INT(global("answer")));
+    TEST_ASSERT_NULL(only_entry());
+}
+
+void test_stale_entry_replaced(void)
+{
+    TEST_ASSERT_EQUAL(0, run(SOURCE));
+    const char *path = only_entry();
+    TEST_ASSERT_NOT_NULL(path);
+    FILE *f = fopen(path, "wb");
+    fputs("not bytecode", f);
+    fclose(f);
+
+    TEST_ASSERT_EQUAL(0, run(SOURCE));
+    TEST_ASSERT_EQUAL(42, AS_INT(global("answer")));
+
+    uint8_t data[4096];
+    f = fopen(only_entry(), "rb");
+    size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    TEST_ASSERT_TRUE(bytecode_is_bytecode(data, size));
+    TEST_ASSERT_NOT_EQUAL(0, bytecode_source_hash(data, size));
+}
+
+void test_compile_error_not_cached(void)
+{
+    TEST_ASSERT_EQUAL(-1, run("var = ;"));
+    TEST_ASSERT_EQUAL(0, cache_clear(dir));
+}
+
+void test_clear(void)
+{
+    TEST_ASSERT_EQUAL(0, run(SOURCE));
+    TEST_ASSERT_EQUAL(0, run("var other = 1;"));
+    TEST_ASSERT_EQUAL(2, cache_clear(dir));
+    TEST_ASSERT_EQUAL(0, cache_clear(dir));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_miss_writes_entry);
+    RUN_TEST(test_hit_loads_entry);
+    RUN_TEST(test_edited_source_misses);
+    RUN_TEST(test_stale_entry_replaced);
+    RUN_TEST(test_compile_error_not_cached);
+    RUN_TEST(test_clear);
+
+    return UNITY_END();
+}
@@ -0,0 +1,116 @@
+#include "unity.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "channel.h"
+
+#define PRODUCED 1000
+
+static struct channel *channel;
+
+void setUp(void)
+{
+    channel = channel_new(2);
+    TEST_ASSERT_NOT_NULL(channel);
+}
+
+void tearDown(void)
+{
+    channel_release(channel);
+}
+
+/** A message whose payload is just @p n */
+static struct message numbered(uint8_t n)
+{
+    struct message message;
+    message_init(&message);
+    message.data = malloc(1);
+    message.data[0] = n;
+    message.size = message.capacity = 1;
+    return message;
+}
+
+static uint8_t number(struct message *message)
+{
+    uint8_t n = message->data[0];
+    message_free(message);
+    return n;
+}
+
+void test_messages_arrive_in_order(void)
+{
+    struct message a = numbered(1);
+    struct message b = numbered(2);
+    TEST_ASSERT_TRUE(channel_send(channel, &a));
+    TEST_ASSERT_TRUE(channel_send(channel, &b));
+
+    struct message got;
+    TEST_ASSERT_TRUE(channel_recv(channel, &got));
+    TEST_ASSERT_EQUAL(1, number(&got));
+    TEST_ASSERT_TRUE(channel_recv(channel, &got));
+    TEST_ASSERT_EQUAL(2, number(&got));
+}
+
+void test_closed_channel_drains_then_fails(void)
+{
+    struct message a = numbered(1);
+    TEST_ASSERT_TRUE(channel_send(channel, &a));
+    channel_close(channel);
+
+    struct message b = numbered(2);
+    TEST_ASSERT_FALSE(channel_send(channel, &b));
+    message_free(&b);
+
+    struct message got;
+    TEST_ASSERT_TRUE(channel_recv(channel, &got));
+    TEST_ASSERT_EQUAL(1, number(&got));
+    TEST_ASSERT_FALSE(channel_recv(channel, &got));
+}
+
+void test_release_frees_queued_messages(void)
+{
+    struct channel *other = channel_new(1);
+    struct message a = numbered(1);
+    TEST_ASSERT_TRUE(channel_send(other, &a));
+    channel_release(other);
+}
+
+static void *produce(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < PRODUCED; i++) {
+        struct message message = numbered((uint8_t)i);
+        TEST_ASSERT_TRUE(channel_send(channel, &message));
+    }
+    channel_close(channel);
+    return NULL;
+}
+
+void test_full_channel_holds_back_the_producer(void)
+{
+    pthread_t producer;
+    pthread_create(&producer, NULL, produce, NULL);
+
+    int received = 0;
+    struct message got;
+    while (channel_recv(channel, &got)) {
+        TEST_ASSERT_EQUAL((uint8_t)received, number(&got));
+        received++;
+    }
+    pthread_join(producer, NULL);
+    TEST_ASSERT_EQUAL(PRODUCED, received);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_messages_arrive_in_order);
+    RUN_TEST(test_closed_channel_drains_then_fails);
+    RUN_TEST(test_release_frees_queued_messages);
+    RUN_TEST(test_full_channel_holds_back_the_producer);
+
+    return UNITY_END();
+}
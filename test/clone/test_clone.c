@@ -0,0 +1,116 @@
+#include "unity.h"
+
+#include <string.h>
+
+#include "channel.h"
+#include "clone.h"
+#include "memory.h"
+#include "vm.h"
+
+static struct vm source;
+static struct vm dest;
+static struct message message;
+
+void setUp(void)
+{
+    vm_init(&dest);
+    vm_init(&source);
+    message_init(&message);
+}
+
+void tearDown(void)
+{
+    message_free(&message);
+    vm_free(&source);
+    vm_free(&dest);
+}
+
+static value global(struct vm *vm, const char *name)
+{
+    return vm->global_values.values[vm_global_slot(vm, name, strlen(name))];
+}
+
+/** Clone @p v from the source VM onto the destination VM's stack, and bind the destination */
+static value round_trip(value v)
+{
+    TEST_ASSERT_TRUE(clone_write(&message, 1, &v));
+    gc_bind(&dest);
+    TEST_ASSERT_EQUAL(1, clone_read(&dest, &message));
+    return dest.sp[-1];
+}
+
+static value get(value table, const char *key)
+{
+    value v = NIL_VAL;
+    value k = OBJECT_VAL(object_string_allocate(key, strlen(key)));
+    TEST_ASSERT_TRUE(table_get(&AS_TABLE(table), k, &v));
+    return v;
+}
+
+void test_scalars_round_trip(void)
+{
+    value values[] = {NIL_VAL, BOOL_VAL(true), BOOL_VAL(false), INT_VAL(-42), NUMBER_VAL(2.5)};
+    TEST_ASSERT_TRUE(clone_write(&message, 5, values));
+    gc_bind(&dest);
+    TEST_ASSERT_EQUAL(5, clone_read(&dest, &message));
+    for (int i = 0; i < 5; i++) { TEST_ASSERT_TRUE(value_equal(values[i], dest.stack[i])); }
+}
+
+void test_string_is_copied_into_the_receiving_heap(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&source, "var s = \"hello\";"));
+    value s = global(&source, "s");
+    value copy = round_trip(s);
+    TEST_ASSERT_TRUE(IS_STRING(copy));
+    TEST_ASSERT_NOT_EQUAL(AS_OBJECT(s), AS_OBJECT(copy));
+    TEST_ASSERT_EQUAL_STRING("hello", AS_CSTRING(copy));
+}
+
+void test_table_keeps_sharing_and_cycles(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&source, "var t = table(); var inner = table();"
+                                               "t[\"a\"] = inner; t[\"b\"] = inner; t[\"self\"] = t;"
+                                               "inner[\"x\"] = 1.5;"));
+    value copy = round_trip(global(&source, "t"));
+
+    TEST_ASSERT_TRUE(IS_TABLE(copy));
+    TEST_ASSERT_EQUAL(3, AS_TABLE(copy).count);
+    value inner = get(copy, "a");
+    TEST_ASSERT_TRUE(IS_TABLE(inner));
+    TEST_ASSERT_EQUAL_PTR(AS_OBJECT(inner), AS_OBJECT(get(copy, "b")));
+    TEST_ASSERT_EQUAL_PTR(AS_OBJECT(copy), AS_OBJECT(get(copy, "self")));
+    TEST_ASSERT_EQUAL_DOUBLE(1.5, AS_NUMBER(get(inner, "x")));
+}
+
+void test_functions_cannot_be_cloned(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&source, "func f() {} var t = table(); t[0] = f;"));
+    value f = global(&source, "f");
+    TEST_ASSERT_FALSE(clone_write(&message, 1, &f));
+    message_free(&message);
+    value t = global(&source, "t");
+    TEST_ASSERT_FALSE(clone_write(&message, 1, &t));
+}
+
+void test_channel_is_shared_not_copied(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&source, "var c = channel(1);"));
+    value handle = global(&source, "c");
+    value copy = round_trip(handle);
+    TEST_ASSERT_TRUE(IS_CHANNEL(copy));
+    TEST_ASSERT_NOT_EQUAL(AS_OBJECT(handle), AS_OBJECT(copy));
+    TEST_ASSERT_EQUAL_PTR(AS_CHANNEL(handle), AS_CHANNEL(copy));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_scalars_round_trip);
+    RUN_TEST(test_string_is_copied_into_the_receiving_heap);
+    RUN_TEST(test_table_keeps_sharing_and_cycles);
+    RUN_TEST(test_functions_cannot_be_cloned);
+    RUN_TEST(test_channel_is_shared_not_copied);
+
+    return UNITY_END();
+}
@@ -0,0 +1,109 @@
+#include "unity.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "deque.h"
+
+static struct deque deque;
+
+void setUp(void)
+{
+    TEST_ASSERT_EQUAL(0, deque_init(&deque));
+}
+
+void tearDown(void)
+{
+    deque_free(&deque);
+}
+
+static void *item(uintptr_t i)
+{
+    return (void *)(i + 1);
+}
+
+void test_owner_takes_newest(void)
+{
+    TEST_ASSERT_TRUE(deque_empty(&deque));
+    deque_push(&deque, item(1));
+    deque_push(&deque, item(2));
+    TEST_ASSERT_FALSE(deque_empty(&deque));
+    TEST_ASSERT_EQUAL_PTR(item(2), deque_take(&deque));
+    TEST_ASSERT_EQUAL_PTR(item(1), deque_take(&deque));
+    TEST_ASSERT_NULL(deque_take(&deque));
+    TEST_ASSERT_TRUE(deque_empty(&deque));
+}
+
+void test_thieves_steal_oldest(void)
+{
+    deque_push(&deque, item(1));
+    deque_push(&deque, item(2));
+    TEST_ASSERT_EQUAL_PTR(item(1), deque_steal(&deque));
+    TEST_ASSERT_EQUAL_PTR(item(2), deque_take(&deque));
+    TEST_ASSERT_NULL(deque_steal(&deque));
+}
+
+void test_grows_past_initial_capacity(void)
+{
+    uintptr_t n = DEQUE_INITIAL_CAPACITY * 3;
+    for (uintptr_t i = 0; i < n; i++) { deque_push(&deque, item(i)); }
+    TEST_ASSERT_EQUAL_PTR(item(0), deque_steal(&deque));
+    for (uintptr_t i = n - 1; i > 0; i--) { TEST_ASSERT_EQUAL_PTR(item(i), deque_take(&deque)); }
+    TEST_ASSERT_NULL(deque_take(&deque));
+}
+
+#define RACE_ITEMS 100000
+
+static unsigned char seen[RACE_ITEMS];
+
+static void *thief(void *arg)
+{
+    size_t *stolen = arg;
+    while (*stolen < RACE_ITEMS / 4) {
+        uintptr_t i = (uintptr_t)deque_steal(&deque);
+        if (i != 0) {
+            seen[i - 1]++;
+            ++*stolen;
+        }
+    }
+    return NULL;
+}
+
+void test_every_item_taken_once_under_stealing(void)
+{
+    size_t stolen = 0;
+    pthread_t thread;
+    TEST_ASSERT_EQUAL(0, pthread_create(&thread, NULL, thief, &stolen));
+    size_t taken = 0;
+    for (uintptr_t i = 0; i < RACE_ITEMS; i++) {
+        deque_push(&deque, item(i));
+        // Take every other item, so the deque grows while the thief works on it
+        if (i % 2 == 0) {
+            uintptr_t got = (uintptr_t)deque_take(&deque);
+            if (got != 0) {
+                seen[got - 1]++;
+                taken++;
+            }
+        }
+    }
+    pthread_join(thread, NULL);
+    for (uintptr_t got; (got = (uintptr_t)deque_take(&deque)) != 0;) {
+        seen[got - 1]++;
+        taken++;
+    }
+
+    TEST_ASSERT_EQUAL(RACE_ITEMS, taken + stolen);
+    for (size_t i = 0; i < RACE_ITEMS; i++) { TEST_ASSERT_EQUAL(1, seen[i]); }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_owner_takes_newest);
+    RUN_TEST(test_thieves_steal_oldest);
+    RUN_TEST(test_grows_past_initial_capacity);
+    RUN_TEST(test_every_item_taken_once_under_stealing);
+
+    return UNITY_END();
+}
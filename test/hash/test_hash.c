@@ -20,6 +20,15 @@ void test_string_hello(void)
     TEST_ASSERT_EQUAL(0xed90f094, hash_string("Hello, world!", 13));
 }
 
+void test_bytes64(void)
+{
+    TEST_ASSERT_EQUAL_UINT64(HASH64_SEED, hash_bytes64("", 0, HASH64_SEED));
+    TEST_ASSERT_EQUAL_UINT64(0x38d1334144987bf4, hash_bytes64("Hello, world!", 13, HASH64_SEED));
+    // hashing in pieces gives the same result as hashing at once
+    TEST_ASSERT_EQUAL_UINT64(hash_bytes64("Hello, world!", 13, HASH64_SEED),
+                             hash_bytes64(", world!", 8, hash_bytes64("Hello", 5, HASH64_SEED)));
+}
+
 void test_double(void)
 {
     TEST_ASSERT_EQUAL(0xadf048f2, hash_double(1234.5678));
@@ -31,6 +40,19 @@ void test_value_number(void)
     TEST_ASSERT_EQUAL(hash_double(1234.5678), hash_value(NUMBER_VAL(1234.5678)));
 }
 
+void test_int(void)
+{
+    TEST_ASSERT_EQUAL(hash_int(42), hash_value(INT_VAL(42)));
+    TEST_ASSERT_NOT_EQUAL(hash_int(1), hash_int(2));
+}
+
+void test_integral_double_hashes_like_int(void)
+{
+    // 1 == 1.0, so they must land in the same table slot
+    TEST_ASSERT_EQUAL(hash_value(INT_VAL(1)), hash_value(NUMBER_VAL(1.0)));
+    TEST_ASSERT_EQUAL(hash_value(INT_VAL(-7)), hash_value(NUMBER_VAL(-7.0)));
+}
+
 void test_bool_false(void)
 {
     TEST_ASSERT_EQUAL(5, hash_value(BOOL_VAL(false)));
@@ -51,6 +73,7 @@ void test_empty(void)
     TEST_ASSERT_EQUAL(0, hash_value(EMPTY_VAL));
 }
 
+#ifndef DPLANG_NAN_BOXING
 void test_invalid(void)
 {
     value v = {
@@ -60,10 +83,11 @@ void test_invalid(void)
 
     TEST_ASSERT_EQUAL(-1U, hash_value(v));
 }
+#endif
 
 void test_object(void)
 {
-    struct object obj = {.type = OBJECT_CLASS, .next = NULL, .marked = false};
+    struct object obj = {.type = OBJECT_CLASS};
     value v = OBJECT_VAL(&obj);
 
     TEST_ASSERT_EQUAL((hash_t)(uintptr_t)(void *)&obj, hash_value(v));
@@ -77,8 +101,6 @@ void test_object_string(void)
         .object =
             {
                      .type = OBJECT_STRING,
-                     .next = NULL,
-                     .marked = false,
                      },
         .data = "abc123",
         .hash = 0xDEADBEEF,
@@ -94,13 +116,18 @@ int main(void)
 
     RUN_TEST(test_string_empty);
     RUN_TEST(test_string_hello);
+    RUN_TEST(test_bytes64);
     RUN_TEST(test_double);
     RUN_TEST(test_value_number);
+    RUN_TEST(test_int);
+    RUN_TEST(test_integral_double_hashes_like_int);
     RUN_TEST(test_bool_false);
     RUN_TEST(test_bool_true);
     RUN_TEST(test_empty);
     RUN_TEST(test_nil);
+#ifndef DPLANG_NAN_BOXING
     RUN_TEST(test_invalid);
+#endif
     RUN_TEST(test_object);
     RUN_TEST(test_object_string);
 
@@ -0,0 +1,94 @@
+#include "unity.h"
+
+#include <string.h>
+
+#include "isolate.h"
+#include "vm.h"
+
+#define JOBS 8
+
+static struct vm vm;
+
+void setUp(void)
+{
+    vm_init(&vm);
+    isolate_set_workers(4);
+}
+
+void tearDown(void)
+{
+    isolate_wait();
+    vm_free(&vm);
+    isolate_set_workers(0);
+}
+
+static value global(const char *name)
+{
+    return vm.global_values.values[vm_global_slot(&vm, name, strlen(name))];
+}
+
+void test_isolate_replies_over_channel(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "func double(out, t) { t[\"n\"] = t[\"n\"] * 2; send(out, t); }"
+                                           "var out = channel(1); var t = table(); t[\"n\"] = 21;"
+                                           "var spawned = spawn(double, out, t);"
+                                           "var reply = recv(out);"));
+    TEST_ASSERT_TRUE(AS_BOOL(global("spawned")));
+    value t = global("t");
+    value reply = global("reply");
+    TEST_ASSERT_TRUE(IS_TABLE(reply));
+    TEST_ASSERT_NOT_EQUAL(AS_OBJECT(t), AS_OBJECT(reply));
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "var before = t[\"n\"]; var after = reply[\"n\"];"));
+    TEST_ASSERT_EQUAL(21, AS_INT(global("before")));
+    TEST_ASSERT_EQUAL(42, AS_INT(global("after")));
+}
+
+void test_spawn_rejects_what_it_cannot_run(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "func one(a) {}"
+                                           "func outer() { var x = 1; func captures() { return x; } return captures; }"
+                                           "var wrong_arity = spawn(one, 1, 2);"
+                                           "var closure = spawn(outer());"
+                                           "var native = spawn(clock);"
+                                           "var unclonable = spawn(one, one);"));
+    TEST_ASSERT_FALSE(AS_BOOL(global("wrong_arity")));
+    TEST_ASSERT_FALSE(AS_BOOL(global("closure")));
+    TEST_ASSERT_FALSE(AS_BOOL(global("native")));
+    TEST_ASSERT_FALSE(AS_BOOL(global("unclonable")));
+}
+
+void test_wait_returns_once_every_isolate_has(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "func work(out, i) { send(out, i); }"
+                                           "var out = channel(8);"
+                                           "for (var i = 0; i < 8; i = i + 1) { spawn(work, out, i); }"));
+    isolate_wait();
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "close(out); var sum = 0; var v = recv(out);"
+                                           "while (v != nil) { sum = sum + v; v = recv(out); }"));
+    TEST_ASSERT_EQUAL(JOBS * (JOBS - 1) / 2, AS_INT(global("sum")));
+}
+
+void test_pipeline_runs_on_one_worker(void)
+{
+    // The consumer is spawned first and waits for a producer queued behind it
+    isolate_set_workers(1);
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "func consumer(in, out) { send(out, recv(in) * 2); }"
+                                           "func producer(out) { send(out, 21); }"
+                                           "var a = channel(1); var b = channel(1);"
+                                           "spawn(consumer, a, b); spawn(producer, a);"
+                                           "var result = recv(b);"));
+    TEST_ASSERT_EQUAL(42, AS_INT(global("result")));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    // First, so that no workers are left over from other tests
+    RUN_TEST(test_pipeline_runs_on_one_worker);
+    RUN_TEST(test_isolate_replies_over_channel);
+    RUN_TEST(test_spawn_rejects_what_it_cannot_run);
+    RUN_TEST(test_wait_returns_once_every_isolate_has);
+
+    return UNITY_END();
+}
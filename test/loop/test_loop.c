@@ -0,0 +1,291 @@
+#include "unity.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "loop.h"
+
+#define PIPES 400
+
+static struct loop *loop;
+
+void setUp(void)
+{
+    loop = loop_new();
+    TEST_ASSERT_NOT_NULL(loop);
+}
+
+void tearDown(void)
+{
+    loop_free(loop);
+}
+
+static double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+void test_empty_loop_returns_at_once(void)
+{
+    TEST_ASSERT_NULL(loop_next(loop, -1));
+}
+
+void test_pipe_is_ready_once_written(void)
+{
+    int fds[2];
+    TEST_ASSERT_EQUAL(0, pipe(fds));
+    int data;
+
+    TEST_ASSERT_TRUE(loop_watch(loop, fds[0], LOOP_READABLE, &data));
+    TEST_ASSERT_EQUAL(1, loop_waiting(loop));
+    TEST_ASSERT_NULL(loop_next(loop, 0));
+
+    TEST_ASSERT_EQUAL(1, write(fds[1], "x", 1));
+    TEST_ASSERT_EQUAL_PTR(&data, loop_next(loop, -1));
+    TEST_ASSERT_EQUAL(0, loop_waiting(loop));
+
+    // The wait is over, so the descriptor can be waited on again
+    TEST_ASSERT_TRUE(loop_watch(loop, fds[0], LOOP_READABLE, &data));
+    TEST_ASSERT_EQUAL_PTR(&data, loop_next(loop, -1));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_socket_waited_on_for_reading_and_writing(void)
+{
+    int fds[2];
+    TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    int reader;
+    int writer;
+
+    TEST_ASSERT_TRUE(loop_watch(loop, fds[0], LOOP_READABLE, &reader));
+    TEST_ASSERT_TRUE(loop_watch(loop, fds[0], LOOP_WRITABLE, &writer));
+    TEST_ASSERT_EQUAL_PTR(&writer, loop_next(loop, -1));
+    TEST_ASSERT_NULL(loop_next(loop, 0));
+
+    TEST_ASSERT_EQUAL(1, write(fds[1], "x", 1));
+    TEST_ASSERT_EQUAL_PTR(&reader, loop_next(loop, -1));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_hang_up_counts_as_ready(void)
+{
+    int fds[2];
+    TEST_ASSERT_EQUAL(0, pipe(fds));
+    int data;
+
+    TEST_ASSERT_TRUE(loop_watch(loop, fds[0], LOOP_READABLE, &data));
+    close(fds[1]);
+    TEST_ASSERT_EQUAL_PTR(&data, loop_next(loop, -1));
+    close(fds[0]);
+}
+
+void test_bad_descriptor_cannot_be_watched(void)
+{
+    int data;
+    TEST_ASSERT_FALSE(loop_watch(loop, -1, LOOP_READABLE, &data));
+    TEST_ASSERT_FALSE(loop_watch(loop, 1000000, LOOP_READABLE, &data));
+    TEST_ASSERT_EQUAL(0, loop_waiting(loop));
+}
+
+void test_timers_fire_in_order(void)
+{
+    int slow;
+    int fast;
+    int now;
+    double start = now_ms();
+
+    TEST_ASSERT_TRUE(loop_after(loop, 40, &slow));
+    TEST_ASSERT_TRUE(loop_after(loop, 10, &fast));
+    TEST_ASSERT_TRUE(loop_after(loop, 0, &now));
+    TEST_ASSERT_EQUAL_PTR(&now, loop_next(loop, -1));
+    TEST_ASSERT_EQUAL_PTR(&fast, loop_next(loop, -1));
+    TEST_ASSERT_TRUE(now_ms() - start >= 10);
+    TEST_ASSERT_EQUAL_PTR(&slow, loop_next(loop, -1));
+    TEST_ASSERT_TRUE(now_ms() - start >= 40);
+}
+
+void test_timeout(void)
+{
+    int data;
+    TEST_ASSERT_TRUE(loop_after(loop, 1000, &data));
+    double start = now_ms();
+    TEST_ASSERT_NULL(loop_next(loop, 10));
+    TEST_ASSERT_TRUE(now_ms() - start >= 10);
+    TEST_ASSERT_EQUAL(1, loop_waiting(loop));
+}
+
+static void ignore(int signal)
+{
+    (void)signal;
+}
+
+static void *interrupt(void *arg)
+{
+    usleep(10000);
+    pthread_kill(*(pthread_t *)arg, SIGUSR1);
+    return NULL;
+}
+
+void test_timeout_outlasts_signals(void)
+{
+    // Without SA_RESTART, so the signal interrupts epoll_wait()
+    struct sigaction action = {.sa_handler = ignore};
+    sigaction(SIGUSR1, &action, NULL);
+    int data;
+    TEST_ASSERT_TRUE(loop_after(loop, 1000, &data));
+    pthread_t self = pthread_self();
+    pthread_t interrupter;
+    pthread_create(&interrupter, NULL, interrupt, &self);
+    double start = now_ms();
+    TEST_ASSERT_NULL(loop_next(loop, 50));
+    TEST_ASSERT_TRUE(now_ms() - start >= 50);
+    pthread_join(interrupter, NULL);
+}
+
+void test_deadline_spans_calls(void)
+{
+    int first;
+    int second;
+    TEST_ASSERT_TRUE(loop_after(loop, 0, &first));
+    TEST_ASSERT_TRUE(loop_after(loop, 1000, &second));
+    double start = now_ms();
+    int64_t deadline = loop_now() + 30000;
+    TEST_ASSERT_EQUAL_PTR(&first, loop_next_until(loop, deadline));
+    TEST_ASSERT_NULL(loop_next_until(loop, deadline));
+    TEST_ASSERT_TRUE(now_ms() - start >= 30);
+    TEST_ASSERT_TRUE(now_ms() - start < 500);
+}
+
+static void *wake(void *arg)
+{
+    (void)arg;
+    usleep(10000);
+    loop_wake(loop);
+    return NULL;
+}
+
+void test_wake_from_another_thread(void)
+{
+    int data;
+    TEST_ASSERT_TRUE(loop_after(loop, 10000, &data));
+    pthread_t waker;
+    pthread_create(&waker, NULL, wake, NULL);
+    TEST_ASSERT_NULL(loop_next(loop, -1));
+    pthread_join(waker, NULL);
+    TEST_ASSERT_EQUAL(1, loop_waiting(loop));
+}
+
+void test_many_waits(void)
+{
+    static int fds[PIPES][2];
+    static bool seen[PIPES];
+    for (int i = 0; i < PIPES; i++) {
+        TEST_ASSERT_EQUAL(0, pipe(fds[i]));
+        TEST_ASSERT_TRUE(loop_watch(loop, fds[i][0], LOOP_READABLE, &seen[i]));
+    }
+    TEST_ASSERT_EQUAL(PIPES, loop_waiting(loop));
+
+    for (int i = PIPES - 1; i >= 0; i--) {
+        TEST_ASSERT_EQUAL(1, write(fds[i][1], "x", 1));
+    }
+    for (int i = 0; i < PIPES; i++) {
+        bool *ready = loop_next(loop, -1);
+        TEST_ASSERT_NOT_NULL(ready);
+        TEST_ASSERT_FALSE(*ready);
+        *ready = true;
+    }
+    TEST_ASSERT_EQUAL(0, loop_waiting(loop));
+    for (int i = 0; i < PIPES; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+
+void test_cancel(void)
+{
+    int fds[2];
+    TEST_ASSERT_EQUAL(0, pipe(fds));
+    int data;
+    int other;
+
+    TEST_ASSERT_TRUE(loop_after(loop, 0, &data));
+    TEST_ASSERT_TRUE(loop_watch(loop, fds[0], LOOP_READABLE, &data));
+    TEST_ASSERT_TRUE(loop_after(loop, 0, &other));
+    TEST_ASSERT_TRUE(loop_cancel(loop, &data));
+    TEST_ASSERT_FALSE(loop_cancel(loop, &data));
+    TEST_ASSERT_EQUAL(1, loop_waiting(loop));
+    TEST_ASSERT_EQUAL(1, write(fds[1], "x", 1));
+    TEST_ASSERT_EQUAL_PTR(&other, loop_next(loop, -1));
+    TEST_ASSERT_NULL(loop_next(loop, 0));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_cancel_after_the_kernel_reported_it(void)
+{
+    int first;
+    int second;
+
+    TEST_ASSERT_TRUE(loop_after(loop, 0, &first));
+    TEST_ASSERT_TRUE(loop_after(loop, 0, &second));
+    usleep(1000);
+    // Both timers come back from one epoll_wait()
+    void *ready = loop_next(loop, -1);
+    TEST_ASSERT_TRUE(loop_cancel(loop, ready == &first ? &second : &first));
+    TEST_ASSERT_EQUAL(0, loop_waiting(loop));
+    TEST_ASSERT_NULL(loop_next(loop, 0));
+}
+
+void test_closing_ends_waits_on_descriptor(void)
+{
+    int fds[2];
+    TEST_ASSERT_EQUAL(0, pipe(fds));
+    int reader;
+    int again;
+    int timer;
+
+    TEST_ASSERT_TRUE(loop_after(loop, 10000, &timer));
+    TEST_ASSERT_TRUE(loop_watch(loop, fds[0], LOOP_READABLE, &reader));
+    TEST_ASSERT_TRUE(loop_watch(loop, fds[0], LOOP_READABLE, &again));
+    loop_closing(loop, fds[0]);
+    close(fds[0]);
+    TEST_ASSERT_EQUAL(3, loop_waiting(loop));
+    void *first = loop_next(loop, -1);
+    void *second = loop_next(loop, -1);
+    TEST_ASSERT_TRUE((first == &reader && second == &again) || (first == &again && second == &reader));
+    TEST_ASSERT_EQUAL(1, loop_waiting(loop));
+
+    // The duplicate for the second wait went too, so the pipe is closed for reading
+    signal(SIGPIPE, SIG_IGN);
+    TEST_ASSERT_EQUAL(-1, write(fds[1], "x", 1));
+    close(fds[1]);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_empty_loop_returns_at_once);
+    RUN_TEST(test_pipe_is_ready_once_written);
+    RUN_TEST(test_socket_waited_on_for_reading_and_writing);
+    RUN_TEST(test_hang_up_counts_as_ready);
+    RUN_TEST(test_bad_descriptor_cannot_be_watched);
+    RUN_TEST(test_timers_fire_in_order);
+    RUN_TEST(test_timeout);
+    RUN_TEST(test_timeout_outlasts_signals);
+    RUN_TEST(test_deadline_spans_calls);
+    RUN_TEST(test_wake_from_another_thread);
+    RUN_TEST(test_many_waits);
+    RUN_TEST(test_cancel);
+    RUN_TEST(test_cancel_after_the_kernel_reported_it);
+    RUN_TEST(test_closing_ends_waits_on_descriptor);
+
+    return UNITY_END();
+}
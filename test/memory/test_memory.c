@@ -0,0 +1,358 @@
+#include "unity.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+static struct vm vm;
+
+void setUp(void)
+{
+    vm_init(&vm);
+    // Promote everything the VM itself holds, so the nursery starts out empty
+    for (int i = 0; i < GC_PROMOTION_AGE; i++) { gc_collect(); }
+}
+
+void tearDown(void)
+{
+    gc_set_budget(0);
+    gc_set_lazy_sweep(false);
+    gc_set_background_sweep(false);
+    gc_set_mark_threads(0);
+    vm_free(&vm);
+}
+
+static bool interned(const char *s)
+{
+    return table_find_string(&vm.strings, s, strlen(s), hash_string(s, strlen(s))) != NULL;
+}
+
+/** Minor collect until @p object is promoted */
+static void promote(struct object *object)
+{
+    for (int i = 0; i < GC_PROMOTION_AGE; i++) {
+        TEST_ASSERT_FALSE(object->old);
+        gc_collect_minor();
+    }
+    TEST_ASSERT_TRUE(object->old);
+}
+
+void test_minor_frees_young_garbage(void)
+{
+    struct gc_stats before;
+    struct gc_stats after;
+    object_string_allocate("garbage", strlen("garbage"));
+    gc_get_stats(&before);
+    gc_collect_minor();
+    gc_get_stats(&after);
+
+    TEST_ASSERT_FALSE(interned("garbage"));
+    TEST_ASSERT_EQUAL(before.young.collections + 1, after.young.collections);
+    TEST_ASSERT_EQUAL(before.young.freed + 1, after.young.freed);
+    TEST_ASSERT_EQUAL(0, after.young.objects);
+    TEST_ASSERT_EQUAL(before.old.collections, after.old.collections);
+}
+
+void test_survivors_promoted(void)
+{
+    struct gc_stats before;
+    struct gc_stats after;
+    struct object_string *s = object_string_allocate("survivor", strlen("survivor"));
+    *vm.sp++ = OBJECT_VAL(s);
+    gc_get_stats(&before);
+    promote(&s->object);
+    gc_get_stats(&after);
+
+    TEST_ASSERT_EQUAL(before.promoted + 1, after.promoted);
+    TEST_ASSERT_EQUAL(before.old.objects + 1, after.old.objects);
+    TEST_ASSERT_EQUAL(before.old.bytes + object_size(&s->object), after.old.bytes);
+}
+
+void test_minor_keeps_old_objects(void)
+{
+    struct object_string *s = object_string_allocate("old", strlen("old"));
+    *vm.sp++ = OBJECT_VAL(s);
+    promote(&s->object);
+    vm.sp--;
+
+    // Only a full collection looks at the old generation
+    gc_collect_minor();
+    TEST_ASSERT_TRUE(interned("old"));
+    gc_collect();
+    TEST_ASSERT_FALSE(interned("old"));
+}
+
+void test_barrier_remembers_old_to_young(void)
+{
+    struct object_table *t = object_table_new();
+    *vm.sp++ = OBJECT_VAL(t);
+    promote(&t->object);
+
+    value key = INT_VAL(1);
+    value young = OBJECT_VAL(object_string_allocate("young", strlen("young")));
+    *vm.sp++ = young;
+    table_set(&t->table, key, young);
+    gc_write_barrier(&t->object, young);
+    vm.sp--;
+
+    struct gc_stats stats;
+    gc_get_stats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.remembered);
+
+    gc_collect_minor();
+    TEST_ASSERT_TRUE(interned("young"));
+    value found;
+    TEST_ASSERT_TRUE(table_get(&t->table, key, &found));
+    TEST_ASSERT_EQUAL_STRING("young", AS_CSTRING(found));
+
+    // Once the string is promoted too the table drops out of the remembered set
+    gc_collect_minor();
+    gc_get_stats(&stats);
+    TEST_ASSERT_TRUE(AS_OBJECT(found)->old);
+    TEST_ASSERT_EQUAL(0, stats.remembered);
+}
+
+void test_script_survives_minor_collections(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "var t = table(); var s = \"\";"
+                                           "for (var i = 0; i < 2000; i = i + 1) { s = s + \"x\"; t[i] = s; }"
+                                           "var n = 0; for (var i = 0; i < 2000; i = i + 1) { n = n + 1; }"));
+    struct gc_stats stats;
+    gc_get_stats(&stats);
+    TEST_ASSERT_GREATER_THAN(0, stats.young.collections);
+    int slot = vm_global_slot(&vm, "t", strlen("t"));
+    value last;
+    TEST_ASSERT_TRUE(table_get(&AS_TABLE(vm.global_values.values[slot]), INT_VAL(1999), &last));
+    TEST_ASSERT_EQUAL(2000, AS_STRING(last)->length);
+}
+
+void test_incremental_collection_takes_steps(void)
+{
+    struct object_string *kept = object_string_allocate("kept", strlen("kept"));
+    *vm.sp++ = OBJECT_VAL(kept);
+    object_string_allocate("garbage", strlen("garbage"));
+
+    gc_set_budget(1);
+    gc_start_incremental();
+    int steps = 0;
+    while (gc_step()) { steps++; }
+
+    TEST_ASSERT_GREATER_THAN(1, steps);
+    TEST_ASSERT_FALSE(gc_marking);
+    TEST_ASSERT_TRUE(interned("kept"));
+    TEST_ASSERT_FALSE(interned("garbage"));
+}
+
+void test_barrier_shades_stores_while_marking(void)
+{
+    struct object_table *t = object_table_new();
+    *vm.sp++ = OBJECT_VAL(t);
+    // Make room for the entry now, so storing it later does not allocate
+    value key = INT_VAL(1);
+    table_set(&t->table, key, NIL_VAL);
+    struct object_string *s = object_string_allocate("stored", strlen("stored"));
+
+    gc_set_budget(1);
+    gc_start_incremental();
+    TEST_ASSERT_TRUE(gc_marking);
+    TEST_ASSERT_TRUE(gc_is_marked(&t->object));
+    TEST_ASSERT_FALSE(gc_is_marked(&s->object));
+
+    table_set(&t->table, key, OBJECT_VAL(s));
+    gc_write_barrier(&t->object, OBJECT_VAL(s));
+    TEST_ASSERT_TRUE(gc_is_marked(&s->object));
+    gc_finish();
+    TEST_ASSERT_TRUE(interned("stored"));
+}
+
+void test_pauses_recorded(void)
+{
+    struct gc_stats before;
+    struct gc_stats after;
+    gc_get_stats(&before);
+    gc_collect();
+    gc_get_stats(&after);
+
+    size_t pauses = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) { pauses += after.pauses[i] - before.pauses[i]; }
+    TEST_ASSERT_EQUAL(1, pauses);
+    TEST_ASSERT_TRUE(after.max_pause > 0);
+}
+
+void test_empty_pages_released(void)
+{
+    struct object_table *t = object_table_new();
+    *vm.sp++ = OBJECT_VAL(t);
+    for (int i = 0; i < 20000; i++) {
+        value s = OBJECT_VAL(object_string_format("string %d", i));
+        *vm.sp++ = s;
+        table_set(&t->table, INT_VAL(i), s);
+        gc_write_barrier(&t->object, s);
+        vm.sp--;
+    }
+    struct gc_stats full;
+    gc_get_stats(&full);
+    vm.sp--;
+
+    gc_collect();
+    struct gc_stats after;
+    gc_get_stats(&after);
+    TEST_ASSERT_LESS_THAN(full.pages, after.pages);
+    TEST_ASSERT_EQUAL(full.pages - after.pages, after.released - full.released);
+}
+
+void test_lazy_sweep_left_to_allocation(void)
+{
+    // Fill a page with garbage, so the allocator has to sweep to find room in it
+    char last[32];
+    struct object_string *s;
+    int i = 0;
+    do {
+        snprintf(last, sizeof(last), "garbage %d", i++);
+        s = object_string_allocate(last, strlen(last));
+    } while (page_has_room(page_of(s)) && i < PAGE_BYTES / PAGE_GRANULE);
+    gc_set_lazy_sweep(true);
+    struct gc_stats before;
+    struct gc_stats after;
+    gc_get_stats(&before);
+    gc_collect();
+    gc_get_stats(&after);
+
+    // The strings are dropped from the table when marking ends, but freed later
+    TEST_ASSERT_FALSE(interned(last));
+    TEST_ASSERT_EQUAL(before.young.freed, after.young.freed);
+    TEST_ASSERT_EQUAL(before.old.collections, after.old.collections);
+
+    // Allocating in the page's size class sweeps it rather than growing the heap
+    static void *cells[PAGE_BYTES / sizeof(struct object_string)];
+    size_t n = 0;
+    while (n < sizeof(cells) / sizeof(cells[0]) && after.young.freed == before.young.freed) {
+        cells[n++] = gc_allocate_object(sizeof(struct object_string));
+        gc_get_stats(&after);
+    }
+    TEST_ASSERT_GREATER_THAN(before.young.freed, after.young.freed);
+    TEST_ASSERT_LESS_OR_EQUAL(before.pages, after.pages);
+    while (n > 0) { gc_free_object(cells[--n], sizeof(struct object_string)); }
+}
+
+void test_background_sweep(void)
+{
+    struct object_table *t = object_table_new();
+    *vm.sp++ = OBJECT_VAL(t);
+    for (int i = 0; i < 1000; i++) {
+        value s = OBJECT_VAL(object_string_format("dropped %d", i));
+        *vm.sp++ = s;
+        table_set(&t->table, INT_VAL(i), s);
+        gc_write_barrier(&t->object, s);
+        vm.sp--;
+    }
+    vm.sp--;
+
+    gc_set_background_sweep(true);
+    struct gc_stats before;
+    struct gc_stats after;
+    gc_get_stats(&before);
+    gc_collect();
+    TEST_ASSERT_FALSE(interned("dropped 999"));
+
+    // The program allocates on while the pages being swept are withheld
+    struct object_string *s = object_string_allocate("allocated", strlen("allocated"));
+    TEST_ASSERT_FALSE(page_of(s)->withheld);
+
+    gc_finish();
+    gc_get_stats(&after);
+    TEST_ASSERT_GREATER_THAN(before.swept_background, after.swept_background);
+    TEST_ASSERT_GREATER_OR_EQUAL(before.young.freed + before.old.freed + 1001, after.young.freed + after.old.freed);
+}
+
+void test_large_heap_marked_in_parallel(void)
+{
+    struct object_table *t = object_table_new();
+    *vm.sp++ = OBJECT_VAL(t);
+    struct gc_stats stats;
+    int n = 0;
+    do {
+        value s = OBJECT_VAL(object_string_format("%0200d", n));
+        *vm.sp++ = s;
+        table_set(&t->table, INT_VAL(n++), s);
+        gc_write_barrier(&t->object, s);
+        vm.sp--;
+        gc_get_stats(&stats);
+    } while (stats.young.bytes + stats.old.bytes < GC_PARALLEL_MARK_BYTES);
+
+    gc_set_mark_threads(3);
+    struct gc_stats before;
+    gc_get_stats(&before);
+    gc_collect();
+    gc_get_stats(&stats);
+    TEST_ASSERT_EQUAL(before.parallel_marks + 1, stats.parallel_marks);
+
+    // Whichever thread reached them, every string is still there
+    for (int i = 0; i < n; i++) {
+        value found;
+        TEST_ASSERT_TRUE(table_get(&t->table, INT_VAL(i), &found));
+        TEST_ASSERT_EQUAL(200, AS_STRING(found)->length);
+    }
+}
+
+static void *run_own_vm(void *arg)
+{
+    struct vm own;
+    vm_init(&own);
+    int ret = vm_interpret(&own, "var t = table(); for (var i = 0; i < 20000; i = i + 1) { t[i % 100] = \"x\" + \"y\"; }");
+    gc_collect();
+    struct gc_stats stats;
+    gc_get_stats(&stats);
+    vm_free(&own);
+    *(size_t *)arg = (ret == 0) ? stats.young.collections + stats.old.collections : 0;
+    return NULL;
+}
+
+void test_vms_on_threads_share_nothing(void)
+{
+    struct object_string *s = object_string_allocate("main thread", strlen("main thread"));
+    *vm.sp++ = OBJECT_VAL(s);
+    struct gc_stats before;
+    gc_get_stats(&before);
+
+    pthread_t threads[2];
+    size_t collections[2] = {0, 0};
+    for (int i = 0; i < 2; i++) { TEST_ASSERT_EQUAL(0, pthread_create(&threads[i], NULL, run_own_vm, &collections[i])); }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_GREATER_THAN(0, collections[i]);
+    }
+
+    // Their collections ran on their own heaps
+    struct gc_stats after;
+    gc_get_stats(&after);
+    TEST_ASSERT_EQUAL(before.young.collections, after.young.collections);
+    TEST_ASSERT_EQUAL(before.old.collections, after.old.collections);
+    gc_collect();
+    TEST_ASSERT_TRUE(interned("main thread"));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_minor_frees_young_garbage);
+    RUN_TEST(test_survivors_promoted);
+    RUN_TEST(test_minor_keeps_old_objects);
+    RUN_TEST(test_barrier_remembers_old_to_young);
+    RUN_TEST(test_script_survives_minor_collections);
+    RUN_TEST(test_incremental_collection_takes_steps);
+    RUN_TEST(test_barrier_shades_stores_while_marking);
+    RUN_TEST(test_pauses_recorded);
+    RUN_TEST(test_empty_pages_released);
+    RUN_TEST(test_lazy_sweep_left_to_allocation);
+    RUN_TEST(test_background_sweep);
+    RUN_TEST(test_large_heap_marked_in_parallel);
+    RUN_TEST(test_vms_on_threads_share_nothing);
+
+    return UNITY_END();
+}
@@ -0,0 +1,161 @@
+#include "unity.h"
+
+#include <stdint.h>
+
+#include "page.h"
+
+static struct page_allocator pages;
+
+void setUp(void)
+{
+    page_init(&pages);
+}
+
+void tearDown(void)
+{
+    page_release_empty(&pages);
+}
+
+void test_cells_aligned_within_their_page(void)
+{
+    char *a = page_allocate(&pages, 40);
+    char *b = page_allocate(&pages, 40);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)a % PAGE_GRANULE);
+    TEST_ASSERT_EQUAL_PTR(page_of(a), page_of(b));
+    TEST_ASSERT_EQUAL(48, page_of(a)->cell_size);
+    TEST_ASSERT_EQUAL(3, page_bit(b) - page_bit(a));
+    TEST_ASSERT_EQUAL_PTR(b, page_cell(page_of(a), page_bit(b)));
+    page_free(&pages, a);
+    page_free(&pages, b);
+}
+
+void test_free_clears_bits_and_reuses_cell(void)
+{
+    void *a = page_allocate(&pages, 32);
+    struct heap_page *page = page_of(a);
+    page_set(page->live, page_bit(a));
+    page_set(page->marks, page_bit(a));
+    page_free(&pages, a);
+
+    TEST_ASSERT_FALSE(page_test(page->live, page_bit(a)));
+    TEST_ASSERT_FALSE(page_test(page->marks, page_bit(a)));
+    TEST_ASSERT_EQUAL(0, page->ncells);
+    TEST_ASSERT_EQUAL_PTR(a, page_allocate(&pages, 32));
+    page_free(&pages, a);
+}
+
+void test_classes_get_their_own_pages(void)
+{
+    void *small = page_allocate(&pages, 16);
+    void *large = page_allocate(&pages, 160);
+    TEST_ASSERT_NOT_EQUAL(page_of(small), page_of(large));
+    TEST_ASSERT_EQUAL(2, pages.npages);
+    page_free(&pages, small);
+    page_free(&pages, large);
+}
+
+void test_empty_pages_kept_as_spares(void)
+{
+    void *kept = page_allocate(&pages, 64);
+    void *dropped = page_allocate(&pages, 128);
+    struct heap_page *spare = page_of(dropped);
+    page_free(&pages, dropped);
+
+    TEST_ASSERT_EQUAL(0, page_release_empty(&pages));
+    TEST_ASSERT_EQUAL(1, pages.nspare);
+    TEST_ASSERT_EQUAL(2, pages.npages);
+    TEST_ASSERT_EQUAL_PTR(page_of(kept), pages.pages);
+
+    // Any class can take a spare
+    void *reused = page_allocate(&pages, 16);
+    TEST_ASSERT_EQUAL_PTR(spare, page_of(reused));
+    TEST_ASSERT_EQUAL(16, spare->cell_size);
+    TEST_ASSERT_EQUAL(0, pages.nspare);
+    TEST_ASSERT_EQUAL(2, pages.npages);
+    page_free(&pages, kept);
+    page_free(&pages, reused);
+}
+
+void test_empty_pages_past_spares_unmapped(void)
+{
+    void *cells[PAGE_SPARE + 2];
+    // One page per size class
+    for (int i = 0; i < PAGE_SPARE + 2; i++) { cells[i] = page_allocate(&pages, (i + 1) * PAGE_GRANULE); }
+    for (int i = 0; i < PAGE_SPARE + 2; i++) { page_free(&pages, cells[i]); }
+
+    TEST_ASSERT_EQUAL(2, page_release_empty(&pages));
+    TEST_ASSERT_EQUAL(PAGE_SPARE, pages.npages);
+    TEST_ASSERT_EQUAL(PAGE_SPARE, pages.nspare);
+    TEST_ASSERT_NULL(pages.pages);
+}
+
+void test_full_page_replaced(void)
+{
+    void *first = page_allocate(&pages, PAGE_MAX_CELL);
+    void *p = first;
+    while (page_of(p) == page_of(first)) { p = page_allocate(&pages, PAGE_MAX_CELL); }
+    TEST_ASSERT_EQUAL(2, pages.npages);
+
+    // Freeing a cell gives the full page room again
+    page_free(&pages, first);
+    TEST_ASSERT_EQUAL_PTR(first, page_allocate(&pages, PAGE_MAX_CELL));
+}
+
+void test_oversized_refused(void)
+{
+    TEST_ASSERT_NULL(page_allocate(&pages, PAGE_MAX_CELL + 1));
+}
+
+void test_withheld_page_left_alone(void)
+{
+    void *a = page_allocate(&pages, 48);
+    void *b = page_allocate(&pages, 48);
+    struct heap_page *page = page_of(a);
+    page->withheld = true;
+    page_relist(&pages);
+
+    // Cells freed in it stay on its own free list until it is handed back
+    page_free(&pages, a);
+    void *c = page_allocate(&pages, 48);
+    TEST_ASSERT_NOT_EQUAL(page, page_of(c));
+
+    page->withheld = false;
+    page_relist(&pages);
+    TEST_ASSERT_EQUAL_PTR(a, page_allocate(&pages, 48));
+    page_free(&pages, a);
+    page_free(&pages, b);
+    page_free(&pages, c);
+}
+
+void test_destroy_unmaps_every_page(void)
+{
+    // Cells still in use go with their pages
+    page_allocate(&pages, 32);
+    page_free(&pages, page_allocate(&pages, 64));
+    page_release_empty(&pages);
+    TEST_ASSERT_GREATER_THAN(0, pages.nspare);
+
+    page_destroy(&pages);
+    TEST_ASSERT_NULL(pages.pages);
+    TEST_ASSERT_NULL(pages.spare);
+    TEST_ASSERT_EQUAL(0, pages.npages);
+    TEST_ASSERT_NOT_NULL(page_allocate(&pages, 32));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_cells_aligned_within_their_page);
+    RUN_TEST(test_free_clears_bits_and_reuses_cell);
+    RUN_TEST(test_classes_get_their_own_pages);
+    RUN_TEST(test_empty_pages_kept_as_spares);
+    RUN_TEST(test_empty_pages_past_spares_unmapped);
+    RUN_TEST(test_full_page_replaced);
+    RUN_TEST(test_oversized_refused);
+    RUN_TEST(test_withheld_page_left_alone);
+    RUN_TEST(test_destroy_unmaps_every_page);
+
+    return UNITY_END();
+}
@@ -0,0 +1,115 @@
+#include "unity.h"
+
+#include "chunk.h"
+#include "peephole.h"
+
+static struct chunk chunk;
+
+static void emit(enum opcode op, uint8_t a, uint8_t b, size_t noperands, int line)
+{
+    uint8_t operands[] = {a, b};
+    chunk_write_opcode(&chunk, op, operands, noperands, line);
+}
+
+void setUp(void)
+{
+    chunk_init(&chunk);
+}
+
+void tearDown(void)
+{
+    chunk_free(&chunk);
+}
+
+void test_fuse_get_local_pair(void)
+{
+    emit(OP_GET_LOCAL, 1, 0, 1, 1);
+    emit(OP_GET_LOCAL, 2, 0, 1, 2);
+    emit(OP_ADD, 0, 0, 0, 2);
+
+    TEST_ASSERT_EQUAL(1, peephole_fuse(&chunk));
+    uint8_t expected[] = {OP_GET_LOCAL_LOCAL, 1, 2, OP_ADD};
+    TEST_ASSERT_EQUAL(sizeof(expected), chunk.count);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, chunk.code, sizeof(expected));
+    TEST_ASSERT_EQUAL(1, chunk.lines[0]);
+    TEST_ASSERT_EQUAL(2, chunk.lines[2]);
+    TEST_ASSERT_EQUAL(2, chunk.lines[3]);
+}
+
+void test_no_fusion_into_jump_target(void)
+{
+    emit(OP_JUMP, 2, 0, 2, 1);
+    emit(OP_GET_LOCAL, 0, 0, 1, 1);
+    emit(OP_GET_LOCAL, 1, 0, 1, 1);  // target of the jump
+    emit(OP_RETURN, 0, 0, 0, 1);
+
+    TEST_ASSERT_EQUAL(0, peephole_fuse(&chunk));
+    TEST_ASSERT_EQUAL(8, chunk.count);
+    TEST_ASSERT_EQUAL(OP_GET_LOCAL, chunk.code[3]);
+}
+
+void test_forward_jump_fixed_up(void)
+{
+    emit(OP_JUMP_IF_FALSE, 4, 0, 2, 1);
+    emit(OP_GET_LOCAL, 0, 0, 1, 1);
+    emit(OP_GET_LOCAL, 1, 0, 1, 1);
+    emit(OP_POP, 0, 0, 0, 1);  // target of the jump
+    emit(OP_RETURN, 0, 0, 0, 1);
+
+    TEST_ASSERT_EQUAL(1, peephole_fuse(&chunk));
+    uint8_t expected[] = {OP_JUMP_IF_FALSE, 3, 0, OP_GET_LOCAL_LOCAL, 0, 1, OP_POP, OP_RETURN};
+    TEST_ASSERT_EQUAL(sizeof(expected), chunk.count);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, chunk.code, sizeof(expected));
+}
+
+void test_backward_jump_fixed_up(void)
+{
+    emit(OP_GET_LOCAL, 0, 0, 1, 1);
+    emit(OP_GET_LOCAL, 1, 0, 1, 1);
+    emit(OP_POP, 0, 0, 0, 1);
+    emit(OP_LOOP, 8, 0, 2, 1);
+
+    TEST_ASSERT_EQUAL(2, peephole_fuse(&chunk));
+    uint8_t expected[] = {OP_GET_LOCAL_LOCAL, 0, 1, OP_POP_LOOP, 6, 0};
+    TEST_ASSERT_EQUAL(sizeof(expected), chunk.count);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, chunk.code, sizeof(expected));
+}
+
+void test_cache_offset_follows_fusion(void)
+{
+    emit(OP_NIL, 0, 0, 0, 1);
+    emit(OP_GET_LOCAL, 1, 0, 1, 1);
+    int cache = chunk_add_cache(&chunk);
+    uint8_t operands[] = {0, (uint8_t)cache, 0};
+    chunk_write_opcode(&chunk, OP_GET_PROPERTY, operands, sizeof(operands), 1);
+
+    TEST_ASSERT_EQUAL(3, chunk.caches[cache].offset);
+    TEST_ASSERT_EQUAL(1, peephole_fuse(&chunk));
+    TEST_ASSERT_EQUAL(1, chunk.caches[cache].offset);
+    TEST_ASSERT_EQUAL(OP_GET_LOCAL_PROPERTY, chunk.code[1]);
+}
+
+void test_jump_into_instruction_left_alone(void)
+{
+    emit(OP_JUMP, 1, 0, 2, 1);
+    emit(OP_GET_LOCAL, 0, 0, 1, 1);  // jump lands on the operand
+    emit(OP_GET_LOCAL, 1, 0, 1, 1);
+
+    TEST_ASSERT_EQUAL(-1, peephole_fuse(&chunk));
+    TEST_ASSERT_EQUAL(7, chunk.count);
+    TEST_ASSERT_EQUAL(OP_GET_LOCAL, chunk.code[3]);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_fuse_get_local_pair);
+    RUN_TEST(test_no_fusion_into_jump_target);
+    RUN_TEST(test_forward_jump_fixed_up);
+    RUN_TEST(test_backward_jump_fixed_up);
+    RUN_TEST(test_cache_offset_follows_fusion);
+    RUN_TEST(test_jump_into_instruction_left_alone);
+
+    return UNITY_END();
+}
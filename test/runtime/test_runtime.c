@@ -1,11 +1,24 @@
 #include "unity.h"
 
+#include <string.h>
+
+#include "vm.h"
+
+static struct vm vm;
+
 void setUp(void)
 {
+    vm_init(&vm);
 }
 
 void tearDown(void)
 {
+    vm_free(&vm);
+}
+
+static value global(const char *name)
+{
+    return vm.global_values.values[vm_global_slot(&vm, name, strlen(name))];
 }
 
 void test_basic(void)
@@ -13,11 +26,128 @@ void test_basic(void)
     TEST_ASSERT(1);
 }
 
+void test_global_slot_native(void)
+{
+    int slot = vm_global_slot(&vm, "clock", strlen("clock"));
+    TEST_ASSERT_GREATER_OR_EQUAL(0, slot);
+    TEST_ASSERT_TRUE(IS_NATIVE(vm.global_values.values[slot]));
+}
+
+void test_global_slot_stable(void)
+{
+    int slot = vm_global_slot(&vm, "answer", strlen("answer"));
+    TEST_ASSERT_EQUAL(slot, vm_global_slot(&vm, "answer", strlen("answer")));
+    TEST_ASSERT_NOT_EQUAL(slot, vm_global_slot(&vm, "question", strlen("question")));
+}
+
+void test_global_slot_undefined(void)
+{
+    int slot = vm_global_slot(&vm, "nothing", strlen("nothing"));
+    TEST_ASSERT_TRUE(IS_EMPTY(vm.global_values.values[slot]));
+}
+
+void test_global_defined_by_script(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "var answer = 42;"));
+    int slot = vm_global_slot(&vm, "answer", strlen("answer"));
+    TEST_ASSERT_EQUAL(42, AS_INT(vm.global_values.values[slot]));
+}
+
+void test_stack_grows_for_deep_recursion(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "func f(n) { if (n == 0) { return 0; } return 1 + f(n - 1); }"
+                                           "var depth = f(10000);"));
+    int slot = vm_global_slot(&vm, "depth", strlen("depth"));
+    TEST_ASSERT_EQUAL(10000, AS_INT(vm.global_values.values[slot]));
+    TEST_ASSERT_GREATER_THAN(STACK_INITIAL, vm.stack_capacity);
+    TEST_ASSERT_GREATER_THAN(FRAMES_INITIAL, vm.frame_capacity);
+}
+
+void test_stack_limit(void)
+{
+    vm.stack_limit = STACK_INITIAL * 4;
+    TEST_ASSERT_NOT_EQUAL(0, vm_interpret(&vm, "func f() { return 1 + f(); } f();"));
+    TEST_ASSERT_LESS_OR_EQUAL(STACK_INITIAL * 4, vm.stack_capacity);
+}
+
+void test_strings_interned(void)
+{
+    struct object_string *a = object_string_allocate("interned", strlen("interned"));
+    struct object_string *b = object_string_allocate("interned", strlen("interned"));
+    struct object_string *c = object_string_format("%s", "interned");
+    TEST_ASSERT_EQUAL_PTR(a, b);
+    TEST_ASSERT_EQUAL_PTR(a, c);
+    TEST_ASSERT_EQUAL(strlen("interned"), c->length);
+    TEST_ASSERT_TRUE(value_equal(OBJECT_VAL(a), OBJECT_VAL(c)));
+}
+
+void test_coroutine_pipeline_runs_in_constant_space(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "func numbers() { var i = 0; while (true) { yield i; i = i + 1; } }"
+                                           "func evens(source) {"
+                                           "    func body() { while (true) { var n = resume(source); if (n % 2 == 0) { yield n; } } }"
+                                           "    return coroutine(body);"
+                                           "}"
+                                           "var source = coroutine(numbers); var pipeline = evens(source);"
+                                           "func take(n) { var sum = 0; for (var i = 0; i < n; i = i + 1) { sum = sum + resume(pipeline); } return sum; }"
+                                           "var sum = take(10000);"));
+    TEST_ASSERT_EQUAL(10000 * 9999, AS_INT(global("sum")));
+    TEST_ASSERT_NULL(vm.coroutine);
+    TEST_ASSERT_EQUAL(COROUTINE_STACK_INITIAL, AS_COROUTINE(global("source"))->stack_capacity);
+    TEST_ASSERT_EQUAL(COROUTINE_STACK_INITIAL, AS_COROUTINE(global("pipeline"))->stack_capacity);
+}
+
+void test_coroutine_grows_its_own_stack(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "func f(n) { if (n == 0) { return yield 0; } return 1 + f(n - 1); }"
+                                           "func deep() { return f(10000); }"
+                                           "var co = coroutine(deep); var first = resume(co); var last = resume(co, 5);"));
+    TEST_ASSERT_EQUAL(0, AS_INT(global("first")));
+    TEST_ASSERT_EQUAL(10005, AS_INT(global("last")));
+    TEST_ASSERT_EQUAL(STACK_INITIAL, vm.stack_capacity);
+    TEST_ASSERT_EQUAL(FRAMES_INITIAL, vm.frame_capacity);
+    // Its stack went when it returned
+    TEST_ASSERT_NULL(AS_COROUTINE(global("co"))->stack);
+}
+
+void test_error_in_coroutine_finishes_it(void)
+{
+    TEST_ASSERT_NOT_EQUAL(0, vm_interpret(&vm, "func fail() { yield 1; return nil + 1; }"
+                                               "var co = coroutine(fail); resume(co); resume(co);"));
+    TEST_ASSERT_NULL(vm.coroutine);
+    TEST_ASSERT_EQUAL(COROUTINE_DONE, AS_COROUTINE(global("co"))->state);
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "var after = done(co);"));
+    TEST_ASSERT_TRUE(AS_BOOL(global("after")));
+}
+
+void test_coroutines_wait_on_the_event_loop(void)
+{
+    TEST_ASSERT_EQUAL(0, vm_interpret(&vm, "func napper(ms) { sleep(ms); return ms; }"
+                                           "for (var i = 0; i < 1000; i = i + 1) { resume(coroutine(napper), i % 10); }"
+                                           "var total = 0;"
+                                           "for (var co = wait(); co != nil; co = wait()) {"
+                                           "    total = total + resume(co);"
+                                           "}"));
+    TEST_ASSERT_EQUAL(4500, AS_INT(global("total")));
+    TEST_ASSERT_EQUAL(0, vm.waiting.count);
+}
+
 int main(void)
 {
     UNITY_BEGIN();
 
     RUN_TEST(test_basic);
+    RUN_TEST(test_global_slot_native);
+    RUN_TEST(test_global_slot_stable);
+    RUN_TEST(test_global_slot_undefined);
+    RUN_TEST(test_global_defined_by_script);
+    RUN_TEST(test_stack_grows_for_deep_recursion);
+    RUN_TEST(test_stack_limit);
+    RUN_TEST(test_strings_interned);
+    RUN_TEST(test_coroutine_pipeline_runs_in_constant_space);
+    RUN_TEST(test_coroutine_grows_its_own_stack);
+    RUN_TEST(test_error_in_coroutine_finishes_it);
+    RUN_TEST(test_coroutines_wait_on_the_event_loop);
 
     return UNITY_END();
 }
@@ -294,6 +294,20 @@ void test_scan_token_tilde(void)
     TEST_ASSERT_EQUAL(TOKEN_TILDE, t.type);
 }
 
+void test_scan_token_ampersand(void)
+{
+    scanner_init(&s, "&");
+    struct token t = scanner_scan_token(&s);
+    TEST_ASSERT_EQUAL(TOKEN_AMPERSAND, t.type);
+}
+
+void test_scan_token_pipe(void)
+{
+    scanner_init(&s, "|");
+    struct token t = scanner_scan_token(&s);
+    TEST_ASSERT_EQUAL(TOKEN_PIPE, t.type);
+}
+
 void test_scan_token_bang(void)
 {
     scanner_init(&s, "!");
@@ -629,6 +643,25 @@ void test_scan_token_keyword_print(void)
     TEST_ASSERT_EQUAL(TOKEN_IDENTIFIER, t.type);
 }
 
+void test_scan_token_keyword_resume(void)
+{
+    scanner_init(&s, "resume");
+    struct token t = scanner_scan_token(&s);
+    TEST_ASSERT_EQUAL(TOKEN_RESUME, t.type);
+
+    scanner_init(&s, "resumed");
+    t = scanner_scan_token(&s);
+    TEST_ASSERT_EQUAL(TOKEN_IDENTIFIER, t.type);
+
+    scanner_init(&s, "res");
+    t = scanner_scan_token(&s);
+    TEST_ASSERT_EQUAL(TOKEN_IDENTIFIER, t.type);
+
+    scanner_init(&s, "re");
+    t = scanner_scan_token(&s);
+    TEST_ASSERT_EQUAL(TOKEN_IDENTIFIER, t.type);
+}
+
 void test_scan_token_keyword_return(void)
 {
     scanner_init(&s, "return");
@@ -743,6 +776,21 @@ void test_scan_token_keyword_while(void)
     TEST_ASSERT_EQUAL(TOKEN_IDENTIFIER, t.type);
 }
 
+void test_scan_token_keyword_yield(void)
+{
+    scanner_init(&s, "yield");
+    struct token t = scanner_scan_token(&s);
+    TEST_ASSERT_EQUAL(TOKEN_YIELD, t.type);
+
+    scanner_init(&s, "yields");
+    t = scanner_scan_token(&s);
+    TEST_ASSERT_EQUAL(TOKEN_IDENTIFIER, t.type);
+
+    scanner_init(&s, "y");
+    t = scanner_scan_token(&s);
+    TEST_ASSERT_EQUAL(TOKEN_IDENTIFIER, t.type);
+}
+
 void test_scan_token_multiline(void)
 {
     char *multiline = "a\n123\n";
@@ -791,6 +839,8 @@ int main(void)
     RUN_TEST(test_scan_token_percent);
     RUN_TEST(test_scan_token_caret);
     RUN_TEST(test_scan_token_tilde);
+    RUN_TEST(test_scan_token_ampersand);
+    RUN_TEST(test_scan_token_pipe);
     RUN_TEST(test_scan_token_bang_equal);
     RUN_TEST(test_scan_token_bang);
     RUN_TEST(test_scan_token_equal_equal);
@@ -814,12 +864,14 @@ int main(void)
     RUN_TEST(test_scan_token_keyword_nil);
     RUN_TEST(test_scan_token_keyword_or);
     RUN_TEST(test_scan_token_keyword_print);
+    RUN_TEST(test_scan_token_keyword_resume);
     RUN_TEST(test_scan_token_keyword_return);
     RUN_TEST(test_scan_token_keyword_super);
     RUN_TEST(test_scan_token_keyword_this);
     RUN_TEST(test_scan_token_keyword_true);
     RUN_TEST(test_scan_token_keyword_var);
     RUN_TEST(test_scan_token_keyword_while);
+    RUN_TEST(test_scan_token_keyword_yield);
     RUN_TEST(test_scan_token_string);
     RUN_TEST(test_scan_token_string_multiline);
     RUN_TEST(test_scan_token_string_unterminated);
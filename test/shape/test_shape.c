@@ -0,0 +1,129 @@
+#include "unity.h"
+
+#include "object.h"
+#include "shape.h"
+
+static struct object_string *name(const char *s)
+{
+    return object_string_allocate(s, strlen(s));
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_root_is_empty(void)
+{
+    struct shape *root = shape_new_root();
+    TEST_ASSERT_EQUAL(0, root->count);
+    TEST_ASSERT_NULL(root->parent);
+    TEST_ASSERT_EQUAL(-1, shape_lookup(root, name("x")));
+    shape_free_tree(root);
+}
+
+void test_transition_adds_slot(void)
+{
+    int budget = 8;
+    struct object_string *x = name("x");
+    struct object_string *y = name("y");
+    struct shape *root = shape_new_root();
+
+    struct shape *sx = shape_transition(root, x, &budget);
+    struct shape *sxy = shape_transition(sx, y, &budget);
+
+    TEST_ASSERT_EQUAL(1, sx->count);
+    TEST_ASSERT_EQUAL(2, sxy->count);
+    TEST_ASSERT_EQUAL_PTR(sx, sxy->parent);
+    TEST_ASSERT_EQUAL(0, shape_lookup(sxy, x));
+    TEST_ASSERT_EQUAL(1, shape_lookup(sxy, y));
+    TEST_ASSERT_EQUAL(6, budget);
+    TEST_ASSERT_EQUAL(3, shape_count_tree(root));
+    shape_free_tree(root);
+}
+
+void test_transition_is_shared(void)
+{
+    int budget = 8;
+    struct shape *root = shape_new_root();
+
+    // Equal names from different string objects reach the same shape
+    struct shape *a = shape_transition(root, name("x"), &budget);
+    struct shape *b = shape_transition(root, name("x"), &budget);
+
+    TEST_ASSERT_EQUAL_PTR(a, b);
+    TEST_ASSERT_EQUAL(7, budget);
+    shape_free_tree(root);
+}
+
+void test_transition_budget_exhausted(void)
+{
+    int budget = 1;
+    struct shape *root = shape_new_root();
+
+    TEST_ASSERT_NOT_NULL(shape_transition(root, name("x"), &budget));
+    TEST_ASSERT_NULL(shape_transition(root, name("y"), &budget));
+    // Existing transitions are still found
+    TEST_ASSERT_NOT_NULL(shape_transition(root, name("x"), &budget));
+    shape_free_tree(root);
+}
+
+void test_instance_fields(void)
+{
+    struct object_class *klass = object_class_new(name("Point"));
+    struct object_instance *p1 = object_instance_new(klass);
+    struct object_instance *p2 = object_instance_new(klass);
+    struct object_string *x = name("x");
+    struct object_string *y = name("y");
+
+    object_instance_set_field(p1, x, NUMBER_VAL(1));
+    object_instance_set_field(p1, y, NUMBER_VAL(2));
+    object_instance_set_field(p2, x, NUMBER_VAL(3));
+    object_instance_set_field(p2, y, NUMBER_VAL(4));
+    object_instance_set_field(p2, x, NUMBER_VAL(5));
+
+    TEST_ASSERT_EQUAL_PTR(p1->shape, p2->shape);
+
+    value v;
+    TEST_ASSERT_TRUE(object_instance_get_field(p1, y, &v));
+    TEST_ASSERT_EQUAL(2, AS_NUMBER(v));
+    TEST_ASSERT_TRUE(object_instance_get_field(p2, x, &v));
+    TEST_ASSERT_EQUAL(5, AS_NUMBER(v));
+    TEST_ASSERT_FALSE(object_instance_get_field(p1, name("z"), &v));
+}
+
+void test_instance_dictionary_mode(void)
+{
+    struct object_class *klass = object_class_new(name("Bag"));
+    struct object_instance *bag = object_instance_new(klass);
+    struct object_string *names[SHAPE_MAX_FIELDS + 1];
+
+    for (int i = 0; i <= SHAPE_MAX_FIELDS; i++) {
+        names[i] = object_string_format("f%d", i);
+        object_instance_set_field(bag, names[i], NUMBER_VAL(i));
+    }
+
+    TEST_ASSERT_NULL(bag->shape);
+    for (int i = 0; i <= SHAPE_MAX_FIELDS; i++) {
+        value v;
+        TEST_ASSERT_TRUE(object_instance_get_field(bag, names[i], &v));
+        TEST_ASSERT_EQUAL(i, AS_NUMBER(v));
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_root_is_empty);
+    RUN_TEST(test_transition_adds_slot);
+    RUN_TEST(test_transition_is_shared);
+    RUN_TEST(test_transition_budget_exhausted);
+    RUN_TEST(test_instance_fields);
+    RUN_TEST(test_instance_dictionary_mode);
+
+    return UNITY_END();
+}
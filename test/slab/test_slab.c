@@ -0,0 +1,91 @@
+#include "unity.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "slab.h"
+
+static struct slab_allocator slab;
+
+void setUp(void)
+{
+    slab_init(&slab);
+}
+
+void tearDown(void)
+{
+    slab_destroy(&slab);
+}
+
+void test_chunks_aligned_and_distinct(void)
+{
+    char *a = slab_allocate(&slab, 40);
+    char *b = slab_allocate(&slab, 40);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(b);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)a % SLAB_GRANULE);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)b % SLAB_GRANULE);
+    TEST_ASSERT_GREATER_OR_EQUAL(48, b > a ? b - a : a - b);
+    memset(a, 'a', 40);
+    memset(b, 'b', 40);
+    TEST_ASSERT_EQUAL('a', a[39]);
+}
+
+void test_free_list_reused(void)
+{
+    void *a = slab_allocate(&slab, 24);
+    slab_free(&slab, a, 24);
+    // Any size in the same class gets the chunk back
+    TEST_ASSERT_EQUAL_PTR(a, slab_allocate(&slab, 32));
+    TEST_ASSERT_NOT_EQUAL(a, slab_allocate(&slab, 32));
+}
+
+void test_classes_kept_apart(void)
+{
+    void *small = slab_allocate(&slab, 16);
+    slab_free(&slab, small, 16);
+    TEST_ASSERT_NOT_EQUAL(small, slab_allocate(&slab, 64));
+}
+
+void test_blocks_added_as_needed(void)
+{
+    size_t per_block = SLAB_BLOCK_BYTES / SLAB_MAX_SIZE;
+    for (size_t i = 0; i <= per_block; i++) { TEST_ASSERT_NOT_NULL(slab_allocate(&slab, SLAB_MAX_SIZE)); }
+    TEST_ASSERT_EQUAL(2, slab.nblocks);
+}
+
+void test_large_sizes_use_malloc(void)
+{
+    void *p = slab_allocate(&slab, SLAB_MAX_SIZE + 1);
+    TEST_ASSERT_NOT_NULL(p);
+    TEST_ASSERT_EQUAL(0, slab.nblocks);
+    slab_free(&slab, p, SLAB_MAX_SIZE + 1);
+}
+
+void test_merge_hands_back_frees(void)
+{
+    struct slab_allocator frees;
+    slab_init(&frees);
+    void *a = slab_allocate(&slab, 24);
+    slab_free(&frees, a, 24);
+    TEST_ASSERT_NOT_EQUAL(a, slab_allocate(&slab, 24));
+
+    slab_merge(&slab, &frees);
+    TEST_ASSERT_NULL(frees.free[0]);
+    TEST_ASSERT_NULL(frees.free[1]);
+    TEST_ASSERT_EQUAL_PTR(a, slab_allocate(&slab, 24));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_chunks_aligned_and_distinct);
+    RUN_TEST(test_free_list_reused);
+    RUN_TEST(test_classes_kept_apart);
+    RUN_TEST(test_blocks_added_as_needed);
+    RUN_TEST(test_large_sizes_use_malloc);
+    RUN_TEST(test_merge_hands_back_frees);
+
+    return UNITY_END();
+}
@@ -85,7 +85,7 @@ void test_table_get(void)
 
     value val;
     TEST_ASSERT_TRUE(table_get(&t, NUMBER_VAL(123), &val));
-    TEST_ASSERT_EQUAL(8675309, val.as.number);
+    TEST_ASSERT_EQUAL(8675309, AS_NUMBER(val));
 
     table_free(&t);
 }
@@ -110,6 +110,7 @@ void test_table_get_null(void)
     TEST_ASSERT_FALSE(table_get(&t, NUMBER_VAL(1), NULL));
 }
 
+#ifndef DPLANG_NAN_BOXING
 void test_table_get_empty(void)
 {
     struct table t;
@@ -122,6 +123,7 @@ void test_table_get_empty(void)
 
     table_free(&t);
 }
+#endif
 
 void test_table_get_deleted(void)
 {
@@ -134,7 +136,7 @@ void test_table_get_deleted(void)
 
     value val = NUMBER_VAL(0);
     TEST_ASSERT_FALSE(table_get(&t, NUMBER_VAL(1), &val));
-    TEST_ASSERT_EQUAL(0, val.as.number);
+    TEST_ASSERT_EQUAL(0, AS_NUMBER(val));
     table_free(&t);
 }
 
@@ -229,7 +231,7 @@ void test_table_find_string(void)
         .data = key,
         .hash = 0x12345678,
         .length = 3,
-        .object = {.marked = false, .next = false, .type = OBJECT_STRING},
+        .object = {.type = OBJECT_STRING},
     };
     struct table t;
     table_init(&t);
@@ -248,19 +250,17 @@ void test_table_find_string_many(void)
         .data = key,
         .hash = 0x12345678,
         .length = 3,
-        .object = {.marked = false, .next = false, .type = OBJECT_STRING},
+        .object = {.type = OBJECT_STRING},
     };
     char *abc = "abc";
     struct object_string obj_abc = {
         .data = abc,
         .hash = 0x87654321,
         .length = 3,
-        .object = {.marked = false, .next = false, .type = OBJECT_STRING},
+        .object = {.type = OBJECT_STRING},
     };
 
     struct object obj_plain = {
-        .marked = false,
-        .next = NULL,
         .type = -1,
     };
     struct table t;
@@ -284,7 +284,7 @@ void test_table_find_string_no_such_key(void)
         .data = key,
         .hash = 0x12345678,
         .length = 3,
-        .object = {.marked = false, .next = false, .type = OBJECT_STRING},
+        .object = {.type = OBJECT_STRING},
     };
     struct table t;
     table_init(&t);
@@ -320,7 +320,7 @@ void test_table_find_string_removed(void)
         .data = key,
         .hash = 0x12345678,
         .length = 3,
-        .object = {.marked = false, .next = false, .type = OBJECT_STRING},
+        .object = {.type = OBJECT_STRING},
     };
     struct table t;
     table_init(&t);
@@ -333,6 +333,61 @@ void test_table_find_string_removed(void)
     table_free(&t);
 }
 
+void test_table_find_string_past_tombstone(void)
+{
+    // Both keys hash to the same slot, so "def" is stored after "abc"
+    struct object_string abc = {
+        .data = "abc",
+        .hash = 0x12345678,
+        .length = 3,
+        .object = {.type = OBJECT_STRING},
+    };
+    struct object_string def = {
+        .data = "def",
+        .hash = 0x12345678,
+        .length = 3,
+        .object = {.type = OBJECT_STRING},
+    };
+    struct table t;
+    table_init(&t);
+    table_set(&t, OBJECT_VAL(&abc), BOOL_VAL(true));
+    table_set(&t, OBJECT_VAL(&def), BOOL_VAL(true));
+    table_delete(&t, OBJECT_VAL(&abc));
+
+    TEST_ASSERT_EQUAL_PTR(&def, table_find_string(&t, "def", 3, 0x12345678));
+
+    table_free(&t);
+}
+
+void test_table_tombstones_reused(void)
+{
+    struct table t;
+    table_init(&t);
+    // Without counting tombstones towards the load, this would eventually
+    // leave no empty slot to end a probe sequence
+    for (int i = 0; i < 1000; i++) {
+        table_set(&t, NUMBER_VAL(i), NUMBER_VAL(i));
+        table_delete(&t, NUMBER_VAL(i));
+    }
+    value val;
+    TEST_ASSERT_FALSE(table_get(&t, NUMBER_VAL(-1), &val));
+    TEST_ASSERT_EQUAL(0, t.count);
+    // Rehashing drops the tombstones rather than growing the table, which stays the smallest size
+    TEST_ASSERT_EQUAL(8, t.capacity);
+
+    // The same holds with live entries alongside the churn
+    for (int i = 0; i < 100; i++) { table_set(&t, NUMBER_VAL(-i - 1), NUMBER_VAL(i)); }
+    int capacity = t.capacity;
+    for (int i = 0; i < 100000; i++) {
+        table_set(&t, NUMBER_VAL(i), NUMBER_VAL(i));
+        table_delete(&t, NUMBER_VAL(i));
+    }
+    TEST_ASSERT_EQUAL(100, t.count);
+    TEST_ASSERT_EQUAL(capacity, t.capacity);
+    TEST_ASSERT_TRUE(table_get(&t, NUMBER_VAL(-100), &val));
+    table_free(&t);
+}
+
 int main(void)
 {
     UNITY_BEGIN();
@@ -352,7 +407,9 @@ int main(void)
     RUN_TEST(test_table_delete_from_empty);
     RUN_TEST(test_table_delete_no_such_key);
     RUN_TEST(test_table_get_deleted);
+#ifndef DPLANG_NAN_BOXING
     RUN_TEST(test_table_get_empty);
+#endif
     RUN_TEST(test_table_grow);
     RUN_TEST(test_table_copy);
     RUN_TEST(test_table_copy_from_null);
@@ -364,6 +421,8 @@ int main(void)
     RUN_TEST(test_table_find_string_empty);
     RUN_TEST(test_table_find_string_no_such_key);
     RUN_TEST(test_table_find_string_removed);
+    RUN_TEST(test_table_find_string_past_tombstone);
+    RUN_TEST(test_table_tombstones_reused);
 
     return UNITY_END();
 }
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "unity.h"
@@ -43,6 +44,7 @@ void test_object_equal(void)
     TEST_ASSERT_FALSE(value_equal(OBJECT_VAL(&o1), OBJECT_VAL(&o2)));
 }
 
+#ifndef DPLANG_NAN_BOXING
 void test_unknown_equal(void)
 {
     value v1 = {
@@ -57,6 +59,7 @@ void test_unknown_equal(void)
 
     TEST_ASSERT_FALSE(value_equal(v1, v2));
 }
+#endif
 
 void test_bool_equal(void)
 {
@@ -70,6 +73,17 @@ void test_different_types_equal(void)
     TEST_ASSERT_FALSE(value_equal(BOOL_VAL(true), NIL_VAL));
 }
 
+void test_int_equal(void)
+{
+    TEST_ASSERT(value_equal(INT_VAL(3), INT_VAL(3)));
+    TEST_ASSERT_FALSE(value_equal(INT_VAL(3), INT_VAL(4)));
+    TEST_ASSERT(value_equal(INT_VAL(3), NUMBER_VAL(3.0)));
+    TEST_ASSERT(value_equal(NUMBER_VAL(-3.0), INT_VAL(-3)));
+    TEST_ASSERT_FALSE(value_equal(INT_VAL(3), NUMBER_VAL(3.5)));
+    TEST_ASSERT_FALSE(value_equal(INT_VAL(0), NUMBER_VAL(0.0 / 0.0)));
+    TEST_ASSERT_FALSE(value_equal(INT_VAL(1), BOOL_VAL(true)));
+}
+
 #define FMT_BUFFER_NUM_CHARS 64
 char buf[FMT_BUFFER_NUM_CHARS];
 void test_format_bool(void)
@@ -105,13 +119,33 @@ void test_format_number(void)
     TEST_ASSERT_EQUAL_STRING("-1.23456e-05", buf);
 }
 
+void test_format_int(void)
+{
+    int len = value_format(buf, sizeof(buf), INT_VAL(-42));
+    TEST_ASSERT_EQUAL(3, len);
+    TEST_ASSERT_EQUAL_STRING("-42", buf);
+
+    len = value_format(buf, sizeof(buf), INT_VAL(INT_VALUE_MAX));
+    TEST_ASSERT_TRUE(len > 0);
+    TEST_ASSERT_EQUAL_INT64(INT_VALUE_MAX, strtoll(buf, NULL, 10));
+}
+
+void test_int_roundtrip(void)
+{
+    TEST_ASSERT_TRUE(IS_INT(INT_VAL(0)));
+    TEST_ASSERT_FALSE(IS_NUMBER(INT_VAL(0)));
+    TEST_ASSERT_FALSE(IS_INT(NUMBER_VAL(0.0)));
+    TEST_ASSERT_FALSE(IS_INT(NIL_VAL));
+    TEST_ASSERT_EQUAL_INT64(-1, AS_INT(INT_VAL(-1)));
+    TEST_ASSERT_EQUAL_INT64(INT_VALUE_MIN, AS_INT(INT_VAL(INT_VALUE_MIN)));
+    TEST_ASSERT_EQUAL_INT64(INT_VALUE_MAX, AS_INT(INT_VAL(INT_VALUE_MAX)));
+}
+
 void test_format_object(void)
 {
     // Objects do their own formatting that is validated separately.
     // Here we just verify *something* gets returned that looks valid.
     struct object o = {
-        .marked = false,
-        .next = NULL,
         .type = OBJECT_STRING,
     };
     struct object_string s = {
@@ -119,8 +153,6 @@ void test_format_object(void)
         .hash = 123,
         .length = strlen("Hello, world!"),
         .object = {
-                   .marked = false,
-                   .next = NULL,
                    .type = OBJECT_STRING,
                    }
     };
@@ -130,6 +162,7 @@ void test_format_object(void)
     TEST_ASSERT(strlen(buf) > 0);
 }
 
+#ifndef DPLANG_NAN_BOXING
 void test_format_unknown(void)
 {
     value v = {.type = 123, .as.object = NULL};
@@ -137,6 +170,7 @@ void test_format_unknown(void)
     TEST_ASSERT_EQUAL(22, len);
     TEST_ASSERT_EQUAL_STRING("unrecognized type: 123", buf);
 }
+#endif
 
 void test_format_empty(void)
 {
@@ -145,6 +179,46 @@ void test_format_empty(void)
     TEST_ASSERT_EQUAL_STRING("<empty>", buf);
 }
 
+void test_number_roundtrip(void)
+{
+    TEST_ASSERT_TRUE(IS_NUMBER(NUMBER_VAL(-0.0)));
+    TEST_ASSERT_EQUAL_DOUBLE(1234.5678, AS_NUMBER(NUMBER_VAL(1234.5678)));
+    TEST_ASSERT_TRUE(IS_NUMBER(NUMBER_VAL(0.0 / 0.0)));
+    TEST_ASSERT_FALSE(IS_NUMBER(NIL_VAL));
+    TEST_ASSERT_FALSE(IS_NUMBER(BOOL_VAL(true)));
+    TEST_ASSERT_FALSE(IS_NUMBER(EMPTY_VAL));
+}
+
+void test_object_roundtrip(void)
+{
+    struct object o = {
+        .type = OBJECT_STRING,
+    };
+    value v = OBJECT_VAL(&o);
+    TEST_ASSERT_TRUE(IS_OBJECT(v));
+    TEST_ASSERT_FALSE(IS_NUMBER(v));
+    TEST_ASSERT_EQUAL_PTR(&o, AS_OBJECT(v));
+}
+
+void test_type_predicates_distinct(void)
+{
+    TEST_ASSERT_TRUE(IS_NIL(NIL_VAL));
+    TEST_ASSERT_FALSE(IS_BOOL(NIL_VAL));
+    TEST_ASSERT_TRUE(IS_BOOL(BOOL_VAL(false)));
+    TEST_ASSERT_FALSE(IS_NIL(BOOL_VAL(false)));
+    TEST_ASSERT_TRUE(IS_EMPTY(EMPTY_VAL));
+    TEST_ASSERT_FALSE(IS_NIL(EMPTY_VAL));
+    TEST_ASSERT_FALSE(AS_BOOL(BOOL_VAL(false)));
+    TEST_ASSERT_TRUE(AS_BOOL(BOOL_VAL(true)));
+}
+
+#ifdef DPLANG_NAN_BOXING
+void test_nan_boxed_size(void)
+{
+    TEST_ASSERT_EQUAL(8, sizeof(value));
+}
+#endif
+
 void test_array_null_fails(void)
 {
     TEST_ASSERT(value_array_init(NULL) < 0);
@@ -205,18 +279,32 @@ int main(void)
 
     RUN_TEST(test_number_equal);
     RUN_TEST(test_nil_equal);
+#ifndef DPLANG_NAN_BOXING
     RUN_TEST(test_unknown_equal);
+#endif
     RUN_TEST(test_object_equal);
     RUN_TEST(test_empty_equal);
     RUN_TEST(test_different_types_equal);
     RUN_TEST(test_bool_equal);
+    RUN_TEST(test_int_equal);
 
     RUN_TEST(test_format_bool);
     RUN_TEST(test_format_nil);
     RUN_TEST(test_format_number);
+    RUN_TEST(test_format_int);
     RUN_TEST(test_format_object);
     RUN_TEST(test_format_empty);
+#ifndef DPLANG_NAN_BOXING
     RUN_TEST(test_format_unknown);
+#endif
+
+    RUN_TEST(test_number_roundtrip);
+    RUN_TEST(test_object_roundtrip);
+    RUN_TEST(test_int_roundtrip);
+    RUN_TEST(test_type_predicates_distinct);
+#ifdef DPLANG_NAN_BOXING
+    RUN_TEST(test_nan_boxed_size);
+#endif
 
     // RUN_TEST(test_array_alloc_fail);
     RUN_TEST(test_array_null_fails);
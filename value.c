@@ -3,6 +3,7 @@
 #include "object.h"
 #include "util.h"
 
+#include <inttypes.h>
 #include <math.h>
 #include <stdint.h>
 #include <string.h>
@@ -60,6 +61,10 @@ int value_array_free(struct value_array *varray)
 }
 
 #define VALUE_FORMAT_MAX_CHARS 64
+
+/** Integral doubles below this are printed without an exponent */
+#define DOUBLE_INTEGRAL_MAX 1e16
+
 int value_format(char *s, size_t maxlen, value val)
 {
     // Some of these cases use "%s" as a format string even though it
@@ -67,25 +72,27 @@ int value_format(char *s, size_t maxlen, value val)
     // characters in a user-controlled string aren't interpretted as
     // format specifiers.
 
-    switch (val.type) {
+    switch (value_type(val)) {
         case VAL_BOOL:
             return snprintf(s, maxlen, "%s", AS_BOOL(val) ? "true" : "false");
         case VAL_NIL:
             return snprintf(s, maxlen, "%s", "nil");
         case VAL_NUMBER: {
             double intpart;
-            if (modf(AS_NUMBER(val), &intpart) == 0) {
-                return snprintf(s, maxlen, "%d", (int)intpart);
+            if (modf(AS_NUMBER(val), &intpart) == 0 && fabs(intpart) < DOUBLE_INTEGRAL_MAX) {
+                return snprintf(s, maxlen, "%.0f", intpart);
             } else {
                 return snprintf(s, maxlen, "%g", AS_NUMBER(val));
             }
         }
+        case VAL_INT:
+            return snprintf(s, maxlen, "%" PRId64, AS_INT(val));
         case VAL_OBJECT:
             return object_format(s, maxlen, AS_OBJECT(val));
         case VAL_EMPTY:
             return snprintf(s, maxlen, "%s", "<empty>");
         default:
-            return snprintf(s, maxlen, "unrecognized type: %d", val.type);
+            return snprintf(s, maxlen, "unrecognized type: %d", value_type(val));
     }
 }
 
@@ -98,20 +105,51 @@ int value_print(value val)
     return 0;
 }
 
+/**
+ * Convert d to an integer if it holds one exactly
+ *
+ * @return false if d has a fractional part or is out of int64_t range
+ */
+bool value_double_to_int(double d, int64_t *out)
+{
+    // -2^63 and 2^63 are exact as doubles; the range check also rejects NaN
+    if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0)) {  // NOLINT(readability-magic-numbers)
+        return false;
+    }
+    *out = (int64_t)d;
+    return (double)*out == d;
+}
+
+static bool int_equals_double(int64_t i, double d)
+{
+    int64_t di;
+    return value_double_to_int(d, &di) && di == i;
+}
+
 bool value_equal(value a, value b)
 {
-    if (a.type != b.type) {
+    if (value_type(a) != value_type(b)) {
+        // 1 == 1.0, so integral doubles also hash like integers
+        if (IS_INT(a) && IS_NUMBER(b)) {
+            return int_equals_double(AS_INT(a), AS_NUMBER(b));
+        }
+        if (IS_NUMBER(a) && IS_INT(b)) {
+            return int_equals_double(AS_INT(b), AS_NUMBER(a));
+        }
         return false;
     }
-    switch (a.type) {
+    switch (value_type(a)) {
         case VAL_BOOL:
             return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_INT:
+            return AS_INT(a) == AS_INT(b);
         case VAL_OBJECT:
-            return object_equal(AS_OBJECT(a), AS_OBJECT(b));
+            // Strings are interned, so no two distinct objects compare equal
+            return AS_OBJECT(a) == AS_OBJECT(b);
         case VAL_EMPTY:
             return true;
         default:
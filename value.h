@@ -2,6 +2,8 @@
 #define DPLANG_VALUE_H
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 enum value_type {
     VAL_BOOL,
@@ -9,13 +11,105 @@ enum value_type {
     VAL_NUMBER,
     VAL_OBJECT,
     VAL_EMPTY,
+    VAL_INT,
 };
 
+#ifdef DPLANG_NAN_BOXING
+
+/*
+ * NaN-boxed representation
+ *
+ * Every value is a single 64-bit word.  Doubles are stored as-is.  All
+ * other types live in the payload of a quiet NaN that the FPU never
+ * produces on its own:
+ *
+ *   object:  sign bit set, low 48 bits hold the pointer
+ *   integer: sign bit clear, bit 48 set, low 48 bits hold the integer
+ *   others:  sign bit clear, low bits hold a small tag
+ */
+typedef uint64_t value;
+
+#define NANBOX_SIGN_BIT ((uint64_t)0x8000000000000000)
+#define NANBOX_QNAN     ((uint64_t)0x7ffc000000000000)
+#define NANBOX_INT_TAG  ((uint64_t)0x0001000000000000)
+#define NANBOX_INT_MASK ((uint64_t)0x0000ffffffffffff)
+
+/** Integers are 48 bits wide; results outside this range become doubles */
+#define INT_VALUE_MAX ((int64_t)0x00007fffffffffff)
+#define INT_VALUE_MIN (-INT_VALUE_MAX - 1)
+
+#define NANBOX_TAG_NIL   1
+#define NANBOX_TAG_FALSE 2
+#define NANBOX_TAG_TRUE  3
+#define NANBOX_TAG_EMPTY 4
+
+/* Casts use uint64_t rather than the typedef, since plenty of code names
+ * its locals "value".
+ */
+#define NIL_VAL   ((uint64_t)(NANBOX_QNAN | NANBOX_TAG_NIL))
+#define FALSE_VAL ((uint64_t)(NANBOX_QNAN | NANBOX_TAG_FALSE))
+#define TRUE_VAL  ((uint64_t)(NANBOX_QNAN | NANBOX_TAG_TRUE))
+#define EMPTY_VAL ((uint64_t)(NANBOX_QNAN | NANBOX_TAG_EMPTY))
+
+static inline value value_from_double(double d)
+{
+    value v;
+    memcpy(&v, &d, sizeof(d));
+    return v;
+}
+
+static inline double value_to_double(value v)
+{
+    double d;
+    memcpy(&d, &v, sizeof(v));
+    return d;
+}
+
+#define IS_BOOL(v)   (((v) | 1) == TRUE_VAL)
+#define IS_NIL(v)    ((v) == NIL_VAL)
+#define IS_NUMBER(v) (((v) & NANBOX_QNAN) != NANBOX_QNAN)
+#define IS_OBJECT(v) (((v) & (NANBOX_QNAN | NANBOX_SIGN_BIT)) == (NANBOX_QNAN | NANBOX_SIGN_BIT))
+#define IS_EMPTY(v)  ((v) == EMPTY_VAL)
+#define IS_INT(v)    (((v) & (NANBOX_SIGN_BIT | NANBOX_QNAN | NANBOX_INT_TAG)) == (NANBOX_QNAN | NANBOX_INT_TAG))
+
+#define AS_BOOL(v)   ((v) == TRUE_VAL)
+#define AS_NUMBER(v) value_to_double(v)
+#define AS_OBJECT(v) ((struct object *)(uintptr_t)((v) & ~(NANBOX_SIGN_BIT | NANBOX_QNAN)))
+#define AS_INT(v)    (((int64_t)((v) << 16)) >> 16)  // sign-extend the 48-bit payload
+
+#define BOOL_VAL(b)   ((b) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_VAL(n) value_from_double(n)
+#define OBJECT_VAL(o) ((uint64_t)(NANBOX_SIGN_BIT | NANBOX_QNAN | (uint64_t)(uintptr_t)(o)))
+#define INT_VAL(i)    ((uint64_t)(NANBOX_QNAN | NANBOX_INT_TAG | ((uint64_t)(int64_t)(i) & NANBOX_INT_MASK)))
+
+static inline enum value_type value_type(value v)
+{
+    if (IS_NUMBER(v)) {
+        return VAL_NUMBER;
+    }
+    if (IS_OBJECT(v)) {
+        return VAL_OBJECT;
+    }
+    if (IS_INT(v)) {
+        return VAL_INT;
+    }
+    if (IS_BOOL(v)) {
+        return VAL_BOOL;
+    }
+    if (IS_NIL(v)) {
+        return VAL_NIL;
+    }
+    return VAL_EMPTY;
+}
+
+#else
+
 struct _value {
     enum value_type type;
     union {
         bool boolean;
         double number;
+        int64_t integer;
         struct object *object;
     } as;
 };
@@ -28,16 +122,42 @@ typedef struct _value value;
 #define IS_NUMBER(v)  IS_TYPE(v, VAL_NUMBER)
 #define IS_OBJECT(v)  IS_TYPE(v, VAL_OBJECT)
 #define IS_EMPTY(v)   IS_TYPE(v, VAL_EMPTY)
+#define IS_INT(v)     IS_TYPE(v, VAL_INT)
 
 #define AS_BOOL(v)   ((v).as.boolean)
 #define AS_NUMBER(v) ((v).as.number)
 #define AS_OBJECT(v) ((v).as.object)
+#define AS_INT(v)    ((v).as.integer)
 
 #define BOOL_VAL(v)   ((value){.type = VAL_BOOL, .as = {.boolean = v}})
 #define NIL_VAL       ((value){.type = VAL_NIL, .as = {.number = 0}})
 #define NUMBER_VAL(v) ((value){.type = VAL_NUMBER, .as = {.number = v}})
 #define OBJECT_VAL(v) ((value){.type = VAL_OBJECT, .as = {.object = (struct object *)v}})
 #define EMPTY_VAL     ((value){.type = VAL_EMPTY, .as = {.number = 0}})
+#define INT_VAL(v)    ((value){.type = VAL_INT, .as = {.integer = v}})
+
+#define INT_VALUE_MAX INT64_MAX
+#define INT_VALUE_MIN INT64_MIN
+
+static inline enum value_type value_type(value v)
+{
+    return v.type;
+}
+
+#endif
+
+/*
+ * Integers and doubles are both numbers.  Arithmetic on two integers stays
+ * integral until the result leaves [INT_VALUE_MIN, INT_VALUE_MAX], and
+ * then becomes a double; anything involving a double is done in double.
+ */
+#define IS_NUMERIC(v) (IS_INT(v) || IS_NUMBER(v))
+#define AS_DOUBLE(v)  (IS_INT(v) ? (double)AS_INT(v) : AS_NUMBER(v))
+
+static inline bool int_fits(int64_t i)
+{
+    return i >= INT_VALUE_MIN && i <= INT_VALUE_MAX;
+}
 
 struct value_array {
     int capacity;
@@ -53,4 +173,5 @@ int value_print(value val);
 int value_format(char *s, size_t maxlen, value val);
 
 bool value_equal(value a, value b);
+bool value_double_to_int(double d, int64_t *out);
 #endif
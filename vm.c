@@ -6,25 +6,17 @@
 #include "table.h"
 #include "memory.h"
 #include "builtins.h"
+#include "bytecode.h"
+#include "loop.h"
+#include "util.h"
 #include <math.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
-#include <time.h>
 
-#define BYTECODE_MAGIC 0xDEADBEEF
 
 // #define DEBUG_TRACE_EXEC
-
-static inline double fshl(double a, double b)
-{
-    return (int)a << (int)b;
-}
-
-static inline double fshr(double a, double b)
-{
-    return (int)a >> (int)b;
-}
+// #define DEBUG_OPCODE_PROFILE
 
 static int stack_reset(struct vm *vm)
 {
@@ -62,6 +54,9 @@ static void vm_dump_stack(struct vm *vm)
     printf("\n");
 }
 
+static void coroutine_yield(struct vm *vm);
+static void coroutine_finish(struct vm *vm);
+
 static void vm_backtrace(struct vm *vm)
 {
     printf("========= BACKTRACE ===========\n");
@@ -73,16 +68,23 @@ static void vm_backtrace(struct vm *vm)
     struct object_string *msg = AS_STRING(stack_peek(vm, 0));
     fprintf(stderr, "%s\n", msg->data);
 
-    for (int i = vm->frame_count - 1; i >= 0; i--) {
-        struct call_frame *frame = &vm->frames[i];
-        struct object_function *function = frame->closure->function;
+    while (1) {
+        for (int i = vm->frame_count - 1; i >= 0; i--) {
+            struct call_frame *frame = &vm->frames[i];
+            struct object_function *function = frame->closure->function;
 
-        size_t instruction = frame->ip - function->chunk.code - 1;
+            size_t instruction = frame->ip - function->chunk.code - 1;
 
-        bool named = function->name != NULL;
+            bool named = function->name != NULL;
 
-        fprintf(stderr, "[line %d] in %s%s\n", function->chunk.lines[instruction],
-                named ? function->name->data : "script", named ? "()" : "");
+            fprintf(stderr, "[line %d] in %s%s\n", chunk_line(&function->chunk, (int)instruction),
+                    named ? function->name->data : "script", named ? "()" : "");
+        }
+        if (vm->coroutine == NULL) {
+            break;
+        }
+        // Nothing catches errors, so every coroutine the error passed through is done too
+        coroutine_finish(vm);
     }
 
     stack_reset(vm);
@@ -97,16 +99,123 @@ static void vm_runtime_error(struct vm *vm, const char *format, ...)
     stack_push(vm, OBJECT_VAL(s));
 }
 
+/**
+ * Find the global slot for @p name, creating an undefined one if needed
+ *
+ * @p name must be reachable by the garbage collector.
+ */
+static int global_slot(struct vm *vm, struct object_string *name)
+{
+    value slot;
+    if (table_get(&vm->globals, OBJECT_VAL(name), &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    int index = vm->global_values.count;
+    value_array_write(&vm->global_values, EMPTY_VAL);
+    value_array_write(&vm->global_names, OBJECT_VAL(name));
+    table_set(&vm->globals, OBJECT_VAL(name), NUMBER_VAL(index));
+    return index;
+}
+
+/**
+ * Resolve a global variable name to its slot in vm->global_values
+ *
+ * Used by the compiler so that global accesses index the slot array
+ * directly instead of hashing the name every time they execute.
+ */
+int vm_global_slot(struct vm *vm, const char *name, size_t length)
+{
+    struct object_string *s = table_find_string(&vm->globals, name, length, hash_string(name, length));
+    if (s != NULL) {
+        return global_slot(vm, s);
+    }
+
+    stack_push(vm, OBJECT_VAL(object_string_allocate(name, length)));
+    int slot = global_slot(vm, AS_STRING(stack_peek(vm, 0)));
+    stack_pop(vm);
+    return slot;
+}
+
 static void define_native(struct vm *vm, const char *name, native_function function)
 {
     struct object_string *s = object_string_allocate(name, strlen(name));
     stack_push(vm, OBJECT_VAL(s));
     stack_push(vm, OBJECT_VAL(object_native_new(function)));
-    table_set(&vm->globals, vm->stack[0], vm->stack[1]);
+    int slot = global_slot(vm, s);
+    vm->global_values.values[slot] = vm->stack[1];
     stack_pop(vm);
     stack_pop(vm);
 }
 
+/**
+ * Move the value stack to a larger allocation of at least @p needed values
+ *
+ * Every pointer into the stack moves with it: the stack pointer, the slots
+ * of each frame and the location of each open upvalue.  Callers holding
+ * their own copies (the threaded core's locals) must reload them.
+ */
+static bool stack_grow(struct vm *vm, size_t needed)
+{
+    if (needed > (size_t)vm->stack_limit) {
+        vm_runtime_error(vm, "Stack overflow");
+        return false;
+    }
+    size_t capacity = (size_t)vm->stack_capacity * 2;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    if (capacity > (size_t)vm->stack_limit) {
+        capacity = vm->stack_limit;
+    }
+
+    /* Copy rather than realloc, so the old stack is still valid for the
+     * garbage collector and for the relocation below.
+     */
+    value *stack = reallocate(NULL, 0, capacity * sizeof(value));
+    memcpy(stack, vm->stack, (vm->sp - vm->stack) * sizeof(value));
+    for (int i = 0; i < vm->frame_count; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    for (struct object_upvalue *upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+    vm->sp = stack + (vm->sp - vm->stack);
+    reallocate(vm->stack, vm->stack_capacity * sizeof(value), 0);
+    vm->stack = stack;
+    vm->stack_capacity = (int)capacity;
+    return true;
+}
+
+static void frames_grow(struct vm *vm)
+{
+    int capacity = vm->frame_capacity * 2;
+    vm->frames = reallocate(vm->frames, vm->frame_capacity * sizeof(struct call_frame),
+                            capacity * sizeof(struct call_frame));
+    vm->frame_capacity = capacity;
+    vm->frame = vm->frame_count > 0 ? &vm->frames[vm->frame_count - 1] : NULL;
+}
+
+/* Slots kept free above the deepest point a function can reach, for the
+ * handful of values the VM itself pushes (runtime error messages, natives)
+ */
+#define STACK_HEADROOM 8
+
+/**
+ * Make room for a call to @p function whose slots start at @p slots
+ *
+ * The compiler knows how deep each function's stack gets, so this is the
+ * only overflow check: nothing is bounds checked while the function runs.
+ */
+static inline bool stack_reserve(struct vm *vm, value *slots, struct object_function *function)
+{
+    size_t needed = (slots - vm->stack) + function->max_stack + STACK_HEADROOM;
+    if (unlikely(needed > (size_t)vm->stack_capacity)) {
+        return stack_grow(vm, needed);
+    }
+    return true;
+}
+
 static bool call(struct vm *vm, struct object_closure *closure, int arg_count)
 {
     if (arg_count != closure->function->arity) {
@@ -114,10 +223,12 @@ static bool call(struct vm *vm, struct object_closure *closure, int arg_count)
         return false;
     }
 
-    if (vm->frame_count == FRAMES_MAX) {
-        vm_runtime_error(vm, "Stack overflow");
+    if (!stack_reserve(vm, vm->sp - arg_count - 1, closure->function)) {
         return false;
     }
+    if (unlikely(vm->frame_count == vm->frame_capacity)) {
+        frames_grow(vm);
+    }
 
     struct call_frame *frame = &vm->frames[vm->frame_count++];
     frame->closure = closure;
@@ -152,6 +263,10 @@ static bool call_value(struct vm *vm, value callee, int arg_count)
                 value result = native(arg_count, vm->sp - arg_count);
                 vm->sp -= arg_count + 1;
                 stack_push(vm, result);
+                if (vm->suspending) {
+                    vm->suspending = false;
+                    coroutine_yield(vm);
+                }
                 return true;
             }
             case OBJECT_CLOSURE:
@@ -175,7 +290,67 @@ static bool invoke_from_class(struct vm *vm, struct object_class *klass, struct
     return call(vm, AS_CLOSURE(method), arg_count);
 }
 
-static bool invoke(struct vm *vm, struct object_string *name, int arg_count)
+/** Add @p entry to a cache in the running function */
+static void ic_remember(struct vm *vm, struct inline_cache *cache, const struct inline_cache_entry *entry)
+{
+    if (cache->megamorphic) {
+        return;
+    }
+    if (cache->count == IC_MAX_ENTRIES) {
+        // Too many receivers to be worth probing; leave the site to the generic lookups
+        cache->megamorphic = true;
+        cache->count = 0;
+        return;
+    }
+    cache->entries[cache->count++] = *entry;
+    struct object *function = &vm->frame->closure->function->object;
+    gc_write_barrier(function, OBJECT_VAL(entry->klass));
+    if (entry->method != NULL) {
+        gc_write_barrier(function, OBJECT_VAL(entry->method));
+    }
+}
+
+/**
+ * Resolve @p name on @p instance through the site's inline cache
+ *
+ * On a miss the name is looked up in the instance's shape and then in its
+ * class, and the result is added to the cache.  Returns false if the
+ * instance is in dictionary mode or has neither a field nor a method
+ * called @p name; the caller then takes the generic path.
+ */
+static bool ic_lookup_property(struct vm *vm, struct inline_cache *cache, struct object_instance *instance,
+                               struct object_string *name, struct inline_cache_entry *entry)
+{
+    struct shape *shape = instance->shape;
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) {
+            cache->hits++;
+            *entry = cache->entries[i];
+            return true;
+        }
+    }
+    cache->misses++;
+    if (shape == NULL) {
+        return false;
+    }
+
+    entry->klass = instance->klass;
+    entry->shape = shape;
+    entry->transition = NULL;
+    entry->method = NULL;
+    entry->slot = shape_lookup(shape, name);
+    if (entry->slot < 0) {
+        value method;
+        if (!table_get(&instance->klass->methods, OBJECT_VAL(name), &method)) {
+            return false;
+        }
+        entry->method = AS_CLOSURE(method);
+    }
+    ic_remember(vm, cache, entry);
+    return true;
+}
+
+static bool invoke(struct vm *vm, struct object_string *name, int arg_count, struct inline_cache *cache)
 {
     value receiver = stack_peek(vm, arg_count);
 
@@ -186,9 +361,17 @@ static bool invoke(struct vm *vm, struct object_string *name, int arg_count)
 
     struct object_instance *instance = AS_INSTANCE(receiver);
 
-    value k = OBJECT_VAL(name);
+    struct inline_cache_entry entry;
+    if (ic_lookup_property(vm, cache, instance, name, &entry)) {
+        if (entry.method != NULL) {
+            return call(vm, entry.method, arg_count);
+        }
+        vm->sp[-arg_count - 1] = instance->fields[entry.slot];
+        return call_value(vm, instance->fields[entry.slot], arg_count);
+    }
+
     value value;
-    if (table_get(&instance->fields, k, &value)) {
+    if (object_instance_get_field(instance, name, &value)) {
         vm->sp[-arg_count - 1] = value;
         return call_value(vm, value, arg_count);
     }
@@ -240,42 +423,128 @@ static void close_upvalues(struct vm *vm, value *last)
         struct object_upvalue *upvalue = vm->open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        upvalue->coroutine = NULL;
+        gc_write_barrier(&upvalue->object, upvalue->closed);
         vm->open_upvalues = upvalue->next;
     }
 }
 
+/**
+ * Exchange the VM's frames, stack and open upvalues with those kept in @p coroutine
+ *
+ * This is the whole of a switch between coroutines: nothing is copied, so
+ * it costs about as much as a call.
+ */
+static void coroutine_swap(struct vm *vm, struct object_coroutine *coroutine)
+{
+    struct call_frame *frames = vm->frames;
+    int frame_capacity = vm->frame_capacity;
+    int frame_count = vm->frame_count;
+    value *stack = vm->stack;
+    int stack_capacity = vm->stack_capacity;
+    value *sp = vm->sp;
+    struct object_upvalue *open_upvalues = vm->open_upvalues;
+
+    vm->frames = coroutine->frames;
+    vm->frame_capacity = coroutine->frame_capacity;
+    vm->frame_count = coroutine->frame_count;
+    vm->stack = coroutine->stack;
+    vm->stack_capacity = coroutine->stack_capacity;
+    vm->sp = coroutine->sp;
+    vm->open_upvalues = coroutine->open_upvalues;
+    vm->frame = (vm->frame_count > 0) ? &vm->frames[vm->frame_count - 1] : NULL;
+
+    coroutine->frames = frames;
+    coroutine->frame_capacity = frame_capacity;
+    coroutine->frame_count = frame_count;
+    coroutine->stack = stack;
+    coroutine->stack_capacity = stack_capacity;
+    coroutine->sp = sp;
+    coroutine->open_upvalues = open_upvalues;
+    gc_rescan(&coroutine->object);
+}
+
+/** Switch from the running coroutine back to whatever resumed it, leaving it in @p state */
+static struct object_coroutine *coroutine_leave(struct vm *vm, enum coroutine_state state)
+{
+    struct object_coroutine *coroutine = vm->coroutine;
+    coroutine_swap(vm, coroutine);
+    vm->coroutine = coroutine->caller;
+    coroutine->caller = NULL;
+    coroutine->state = state;
+    return coroutine;
+}
+
+/** Suspend the running coroutine, handing the value on its stack to whatever resumed it */
+static void coroutine_yield(struct vm *vm)
+{
+    value v = stack_pop(vm);
+    coroutine_leave(vm, COROUTINE_SUSPENDED);
+    stack_push(vm, v);
+}
+
+void vm_suspend(struct vm *vm)
+{
+    vm->suspending = true;
+}
+
+/** Leave the running coroutine for good, and free its stack */
+static void coroutine_finish(struct vm *vm)
+{
+    // Closures it made may outlive it
+    close_upvalues(vm, vm->stack);
+    struct object_coroutine *coroutine = coroutine_leave(vm, COROUTINE_DONE);
+    coroutine->stack = reallocate(coroutine->stack, coroutine->stack_capacity * sizeof(value), 0);
+    coroutine->frames = reallocate(coroutine->frames, coroutine->frame_capacity * sizeof(struct call_frame), 0);
+    coroutine->stack_capacity = coroutine->frame_capacity = coroutine->frame_count = 0;
+    coroutine->sp = NULL;
+}
+
 static void define_method(struct vm *vm, struct object_string *name)
 {
     value method = stack_peek(vm, 0);
     struct object_class *klass = AS_CLASS(stack_peek(vm, 1));
     value k = OBJECT_VAL(name);
     table_set(&klass->methods, k, method);
+    gc_write_barrier(&klass->object, k);
+    gc_write_barrier(&klass->object, method);
     stack_pop(vm);
 }
 
+/**
+ * Intern a string, taking ownership of @p s
+ *
+ * Every string object is interned in vm->strings when it is created, so
+ * this is the same as object_string_take.
+ */
 struct object_string *vm_intern_string(struct vm *vm, const char *s, size_t len)
 {
-    uint32_t hash = hash_string(s, len);
-    struct object_string *interned = table_find_string(&vm->strings, s, len, hash);
-    if (interned != NULL) {
-        printf("found already interned string at %p\n", (void *)interned);
-        return interned;
-    }
-    struct object_string *obj = object_string_take(s, len);
-    value k = OBJECT_VAL(obj);
-    table_set(&vm->strings, k, NIL_VAL);
-    return obj;
+    (void)vm;
+    return object_string_take(s, len);
 }
 
 int vm_init(struct vm *vm)
 {
+    // Everything the collector treats as a root must be valid before the first allocation
+    memset(vm, 0, sizeof(*vm));
+    vm->stack_limit = STACK_LIMIT_DEFAULT;
+    vm->loading = NIL_VAL;
     gc_init(vm);
-    stack_reset(vm);
     vm->objects = NULL;
     table_init(&vm->strings);
+    table_init(&vm->channels);
     table_init(&vm->globals);
+    table_init(&vm->waiting);
+    value_array_init(&vm->global_values);
+    value_array_init(&vm->global_names);
+    vm->stack = reallocate(NULL, 0, STACK_INITIAL * sizeof(value));
+    vm->stack_capacity = STACK_INITIAL;
+    vm->frames = reallocate(NULL, 0, FRAMES_INITIAL * sizeof(struct call_frame));
+    vm->frame_capacity = FRAMES_INITIAL;
+    stack_reset(vm);
+    vm->compile_flags = COMPILE_DEFAULT;
+    vm->ic_stats = false;
 
-    vm->init_string = NULL;
     vm->init_string = object_string_allocate("init", 4);
 
     for (struct builtin_function_info *builtin = builtins; builtin->function != NULL; builtin++) {
@@ -292,10 +561,23 @@ static bool is_falsey(value val)
 
 int vm_free(struct vm *vm)
 {
+    gc_finish();
     table_free(&vm->globals);
+    table_free(&vm->waiting);
+    if (vm->loop != NULL) {
+        loop_free(vm->loop);
+        vm->loop = NULL;
+    }
+    value_array_free(&vm->global_values);
+    value_array_free(&vm->global_names);
     table_free(&vm->strings);
+    table_free(&vm->channels);
+    vm->stack = reallocate(vm->stack, vm->stack_capacity * sizeof(value), 0);
+    vm->frames = reallocate(vm->frames, vm->frame_capacity * sizeof(struct call_frame), 0);
+    vm->stack_capacity = vm->frame_capacity = 0;
     vm->init_string = NULL;
-    // TODO: free_objects();
+    gc_free_heap(vm);
+    bytecode_free_images(vm);
     return 0;
 }
 
@@ -304,29 +586,133 @@ int vm_free(struct vm *vm)
 #define READ_U16(vm)      ((vm)->frame->ip += 2, (uint16_t)(((vm)->frame->ip[-1] << 8) | (vm)->frame->ip[-2]))
 #define READ_OPCODE(vm)   ((enum opcode)READ_U8(vm))
 #define READ_STRING(vm)   AS_STRING(READ_CONSTANT(vm))
+#define READ_CACHE(vm)    (&(vm)->frame->closure->function->chunk.caches[READ_U16(vm)])
+
+/* Rewrite the instruction being executed; its opcode is the byte just
+ * before the operands, and ip is only ever past the opcode when this is used.
+ */
+#define QUICKEN(vm, op) ((vm)->frame->ip[-1] = (uint8_t)(op))
+
+/* Integer results outside [INT_VALUE_MIN, INT_VALUE_MAX] become doubles */
+static inline value int_or_double(int64_t i)
+{
+    return int_fits(i) ? INT_VAL(i) : NUMBER_VAL((double)i);
+}
+
+static inline value int_add(int64_t a, int64_t b)
+{
+    int64_t r;
+    if (__builtin_add_overflow(a, b, &r)) {
+        return NUMBER_VAL((double)a + (double)b);
+    }
+    return int_or_double(r);
+}
+
+static inline value int_subtract(int64_t a, int64_t b)
+{
+    int64_t r;
+    if (__builtin_sub_overflow(a, b, &r)) {
+        return NUMBER_VAL((double)a - (double)b);
+    }
+    return int_or_double(r);
+}
+
+static inline value int_multiply(int64_t a, int64_t b)
+{
+    int64_t r;
+    if (__builtin_mul_overflow(a, b, &r)) {
+        return NUMBER_VAL((double)a * (double)b);
+    }
+    return int_or_double(r);
+}
+
+static inline value int_greater(int64_t a, int64_t b)
+{
+    return BOOL_VAL(a > b);
+}
+
+static inline value int_less(int64_t a, int64_t b)
+{
+    return BOOL_VAL(a < b);
+}
 
-#define BINARY_OP(valtype, op)                                                \
-    do {                                                                      \
-        if (!IS_NUMBER(stack_peek(vm, 0)) || !IS_NUMBER(stack_peek(vm, 1))) { \
-            vm_runtime_error(vm, "Operands must be numbers");                 \
-            return false;                                                     \
-        }                                                                     \
-        double b = AS_NUMBER(stack_pop(vm));                                  \
-        double a = AS_NUMBER(stack_pop(vm));                                  \
-        stack_push(vm, valtype(a op b));                                      \
+/* Generic arithmetic and comparison.  Two integers go through int_func;
+ * any other pair of numbers is done in double.  The instruction quickens
+ * to its integer or double form when both operands have the same type.
+ */
+#define BINARY_OP(valtype, op, int_func, quick_int, quick_num)                   \
+    do {                                                                         \
+        value b = stack_peek(vm, 0);                                             \
+        value a = stack_peek(vm, 1);                                             \
+        if (IS_INT(a) && IS_INT(b)) {                                            \
+            QUICKEN(vm, quick_int);                                              \
+            vm->sp--;                                                            \
+            vm->sp[-1] = int_func(AS_INT(a), AS_INT(b));                         \
+        } else if (IS_NUMERIC(a) && IS_NUMERIC(b)) {                             \
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {                                  \
+                QUICKEN(vm, quick_num);                                          \
+            }                                                                    \
+            vm->sp--;                                                            \
+            vm->sp[-1] = valtype(AS_DOUBLE(a) op AS_DOUBLE(b));                  \
+        } else {                                                                 \
+            vm_runtime_error(vm, "Operands must be numbers");                    \
+            return false;                                                        \
+        }                                                                        \
     } while (0)
 
-#define BINARY_FUNC(valtype, func)                                            \
-    do {                                                                      \
-        if (!IS_NUMBER(stack_peek(vm, 0)) || !IS_NUMBER(stack_peek(vm, 1))) { \
-            vm_runtime_error(vm, "Operands must be numbers");                 \
-            return false;                                                     \
-        }                                                                     \
-        double b = AS_NUMBER(stack_pop(vm));                                  \
-        double a = AS_NUMBER(stack_pop(vm));                                  \
-        stack_push(vm, valtype(func(a, b)));                                  \
+/* Body of a quickened numeric instruction: deoptimize to the generic
+ * handler when the type guard fails.
+ */
+#define NUMBER_OP(valtype, op, generic, generic_handler)                  \
+    do {                                                                  \
+        if (unlikely(!IS_NUMBER(vm->sp[-1]) || !IS_NUMBER(vm->sp[-2]))) { \
+            QUICKEN(vm, generic);                                         \
+            return generic_handler(vm);                                   \
+        }                                                                 \
+        double b = AS_NUMBER(vm->sp[-1]);                                 \
+        double a = AS_NUMBER(vm->sp[-2]);                                 \
+        vm->sp--;                                                         \
+        vm->sp[-1] = valtype(a op b);                                     \
     } while (0)
 
+/* Body of a quickened integer instruction */
+#define INT_OP(int_func, generic, generic_handler)                  \
+    do {                                                            \
+        if (unlikely(!IS_INT(vm->sp[-1]) || !IS_INT(vm->sp[-2]))) { \
+            QUICKEN(vm, generic);                                   \
+            return generic_handler(vm);                             \
+        }                                                           \
+        int64_t b = AS_INT(vm->sp[-1]);                             \
+        int64_t a = AS_INT(vm->sp[-2]);                             \
+        vm->sp--;                                                   \
+        vm->sp[-1] = int_func(a, b);                                \
+    } while (0)
+
+/**
+ * Read v as an integer for a bitwise operator
+ *
+ * Doubles are accepted if they hold an integer exactly.
+ */
+static bool int_operand(value v, int64_t *out)
+{
+    if (IS_INT(v)) {
+        *out = AS_INT(v);
+        return true;
+    }
+    return IS_NUMBER(v) && value_double_to_int(AS_NUMBER(v), out);
+}
+
+/** Pop the two integer operands of a binary bitwise operator */
+static bool int_operands(struct vm *vm, int64_t *a, int64_t *b)
+{
+    if (!int_operand(stack_peek(vm, 1), a) || !int_operand(stack_peek(vm, 0), b)) {
+        vm_runtime_error(vm, "Operands must be integers");
+        return false;
+    }
+    vm->sp -= 2;
+    return true;
+}
+
 bool vm_op_constant(struct vm *vm)
 {
     value constant = READ_CONSTANT(vm);
@@ -371,24 +757,29 @@ bool vm_op_set_local(struct vm *vm)
     return true;
 }
 
+/*
+ * Globals are normally resolved to slots by the compiler.  The by-name
+ * instructions remain for code compiled without a VM and for functions
+ * with more globals than a slot operand can address.
+ */
 bool vm_op_get_global(struct vm *vm)
 {
     struct object_string *name = READ_STRING(vm);
-    value key = OBJECT_VAL(name);
-    value value;
-    if (!table_get(&vm->globals, key, &value)) {
+    value slot;
+    if (!table_get(&vm->globals, OBJECT_VAL(name), &slot) ||
+        IS_EMPTY(vm->global_values.values[(int)AS_NUMBER(slot)])) {
         vm_runtime_error(vm, "Undefined variable '%s'", name->data);
         return false;
     }
-    stack_push(vm, value);
+    stack_push(vm, vm->global_values.values[(int)AS_NUMBER(slot)]);
     return true;
 }
 
 bool vm_op_define_global(struct vm *vm)
 {
     struct object_string *name = READ_STRING(vm);
-    value key = OBJECT_VAL(name);
-    table_set(&vm->globals, key, stack_peek(vm, 0));
+    int slot = global_slot(vm, name);
+    vm->global_values.values[slot] = stack_peek(vm, 0);
     stack_pop(vm);
     return true;
 }
@@ -396,12 +787,43 @@ bool vm_op_define_global(struct vm *vm)
 bool vm_op_set_global(struct vm *vm)
 {
     struct object_string *name = READ_STRING(vm);
-    value key = OBJECT_VAL(name);
-    if (table_set(&vm->globals, key, stack_peek(vm, 0))) {
-        table_delete(&vm->globals, key);
-        vm_runtime_error(vm, "Undefined variable '%s'", AS_STRING(key)->data);
+    value slot;
+    if (!table_get(&vm->globals, OBJECT_VAL(name), &slot) ||
+        IS_EMPTY(vm->global_values.values[(int)AS_NUMBER(slot)])) {
+        vm_runtime_error(vm, "Undefined variable '%s'", name->data);
+        return false;
+    }
+    vm->global_values.values[(int)AS_NUMBER(slot)] = stack_peek(vm, 0);
+    return true;
+}
+
+bool vm_op_get_global_slot(struct vm *vm)
+{
+    uint16_t slot = READ_U16(vm);
+    value value = vm->global_values.values[slot];
+    if (IS_EMPTY(value)) {
+        vm_runtime_error(vm, "Undefined variable '%s'", AS_CSTRING(vm->global_names.values[slot]));
+        return false;
+    }
+    stack_push(vm, value);
+    return true;
+}
+
+bool vm_op_define_global_slot(struct vm *vm)
+{
+    uint16_t slot = READ_U16(vm);
+    vm->global_values.values[slot] = stack_pop(vm);
+    return true;
+}
+
+bool vm_op_set_global_slot(struct vm *vm)
+{
+    uint16_t slot = READ_U16(vm);
+    if (IS_EMPTY(vm->global_values.values[slot])) {
+        vm_runtime_error(vm, "Undefined variable '%s'", AS_CSTRING(vm->global_names.values[slot]));
         return false;
     }
+    vm->global_values.values[slot] = stack_peek(vm, 0);
     return true;
 }
 
@@ -439,6 +861,8 @@ bool vm_op_table_set(struct vm *vm)
         table_delete(&AS_TABLE(t), k);
     } else {
         table_set(&AS_TABLE(t), k, v);
+        gc_write_barrier(AS_OBJECT(t), k);
+        gc_write_barrier(AS_OBJECT(t), v);
     }
     stack_pop(vm);
     stack_pop(vm);
@@ -458,7 +882,9 @@ bool vm_op_get_upvalue(struct vm *vm)
 bool vm_op_set_upvalue(struct vm *vm)
 {
     uint8_t slot = READ_U8(vm);
-    *vm->frame->closure->upvalues[slot]->location = stack_peek(vm, 0);
+    struct object_upvalue *upvalue = vm->frame->closure->upvalues[slot];
+    *upvalue->location = stack_peek(vm, 0);
+    gc_write_barrier(&upvalue->object, stack_peek(vm, 0));
     return true;
 }
 
@@ -475,34 +901,93 @@ bool vm_op_get_super(struct vm *vm)
 
 bool vm_op_get_property(struct vm *vm)
 {
+    struct object_string *name = READ_STRING(vm);
+    struct inline_cache *cache = READ_CACHE(vm);
     if (!IS_INSTANCE(stack_peek(vm, 0))) {
         vm_runtime_error(vm, "Only instances have properties");
         return false;
     }
     struct object_instance *instance = AS_INSTANCE(stack_peek(vm, 0));
-    struct object_string *name = READ_STRING(vm);
-    value key = OBJECT_VAL(name);
+
+    struct inline_cache_entry entry;
+    if (ic_lookup_property(vm, cache, instance, name, &entry)) {
+        if (entry.method != NULL) {
+            struct object_bound_method *bound = object_bound_method_new(stack_peek(vm, 0), entry.method);
+            stack_pop(vm);  // instance
+            stack_push(vm, OBJECT_VAL(bound));
+        } else {
+            stack_pop(vm);  // instance
+            stack_push(vm, instance->fields[entry.slot]);
+        }
+        return true;
+    }
+
     value value;
-    if (table_get(&instance->fields, key, &value)) {
+    if (object_instance_get_field(instance, name, &value)) {
         stack_pop(vm);  // instance
         stack_push(vm, value);
         return true;
     }
-    if (!bind_method(vm, instance->klass, name)) {
-        return false;
+    return bind_method(vm, instance->klass, name);
+}
+
+static void ic_set_property(struct vm *vm, struct inline_cache *cache, struct object_instance *instance,
+                            struct object_string *name, value val)
+{
+    struct shape *shape = instance->shape;
+    for (int i = 0; shape != NULL && i < cache->count; i++) {
+        struct inline_cache_entry *entry = &cache->entries[i];
+        if (entry->shape != shape) {
+            continue;
+        }
+        if (entry->transition == NULL) {
+            cache->hits++;
+            instance->fields[entry->slot] = val;
+            gc_write_barrier(&instance->object, val);
+            return;
+        }
+        if (entry->slot < instance->capacity) {
+            cache->hits++;
+            instance->fields[entry->slot] = val;
+            instance->shape = entry->transition;
+            gc_write_barrier(&instance->object, val);
+            return;
+        }
+        break;  // the field array has to grow first
     }
-    return false;
+    cache->misses++;
+
+    int slot = (shape == NULL) ? -1 : shape_lookup(shape, name);
+    object_instance_set_field(instance, name, val);
+    if (shape == NULL || instance->shape == NULL) {
+        return;
+    }
+
+    struct inline_cache_entry entry = {
+        .klass = instance->klass,
+        .shape = shape,
+        .transition = (slot < 0) ? instance->shape : NULL,
+        .slot = (slot < 0) ? instance->shape->count - 1 : slot,
+        .method = NULL,
+    };
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) {
+            return;  // already known, only the field array was too small
+        }
+    }
+    ic_remember(vm, cache, &entry);
 }
 
 bool vm_op_set_property(struct vm *vm)
 {
+    struct object_string *name = READ_STRING(vm);
+    struct inline_cache *cache = READ_CACHE(vm);
     if (!IS_INSTANCE(stack_peek(vm, 1))) {
         vm_runtime_error(vm, "Only instances have fields");
         return false;
     }
     struct object_instance *instance = AS_INSTANCE(stack_peek(vm, 1));
-    struct object_string *name = READ_STRING(vm);
-    table_set(&instance->fields, OBJECT_VAL(name), stack_peek(vm, 0));
+    ic_set_property(vm, cache, instance, name, stack_peek(vm, 0));
     value value = stack_pop(vm);
     stack_pop(vm);
     stack_push(vm, value);
@@ -519,162 +1004,412 @@ bool vm_op_equal(struct vm *vm)
 
 bool vm_op_greater(struct vm *vm)
 {
-    BINARY_OP(BOOL_VAL, >);
+    BINARY_OP(BOOL_VAL, >, int_greater, OP_GREATER_INT, OP_GREATER_NUM);
+    return true;
+}
+
+bool vm_op_greater_num(struct vm *vm)
+{
+    NUMBER_OP(BOOL_VAL, >, OP_GREATER, vm_op_greater);
+    return true;
+}
+
+bool vm_op_greater_int(struct vm *vm)
+{
+    INT_OP(int_greater, OP_GREATER, vm_op_greater);
     return true;
 }
 
 bool vm_op_less(struct vm *vm)
 {
-    BINARY_OP(BOOL_VAL, <);
+    BINARY_OP(BOOL_VAL, <, int_less, OP_LESS_INT, OP_LESS_NUM);
+    return true;
+}
+
+bool vm_op_less_num(struct vm *vm)
+{
+    NUMBER_OP(BOOL_VAL, <, OP_LESS, vm_op_less);
+    return true;
+}
+
+bool vm_op_less_int(struct vm *vm)
+{
+    INT_OP(int_less, OP_LESS, vm_op_less);
+    return true;
+}
+
+static bool concatenate(struct vm *vm)
+{
+    /* keep s1 and s2 on the stack until s3 is added
+     * This helps avoid gc-related issues
+     */
+    struct object_string *s2 = AS_STRING(stack_peek(vm, 0));
+    struct object_string *s1 = AS_STRING(stack_peek(vm, 1));
+    size_t new_length = s2->length + s1->length;
+    char *data = heap_allocate(new_length + 1);
+    memcpy(data, s1->data, s1->length);
+    memcpy(&data[s1->length], s2->data, s2->length);
+    data[new_length] = '\0';
+    struct object_string *s3 = vm_intern_string(vm, data, new_length);
+    stack_pop(vm);
+    stack_pop(vm);
+    stack_push(vm, OBJECT_VAL(s3));
     return true;
 }
 
 bool vm_op_add(struct vm *vm)
 {
     if (IS_STRING(stack_peek(vm, 0)) && IS_STRING(stack_peek(vm, 1))) {
-        /* keep s1 and s2 on the stack until s3 is added
-         * This helps avoid gc-related issues
-         */
-        struct object_string *s2 = AS_STRING(stack_peek(vm, 0));
-        struct object_string *s1 = AS_STRING(stack_peek(vm, 1));
-        size_t new_length = s2->length + s1->length;
-        char *data = reallocate(NULL, 0, new_length + 1);
-        memcpy(data, s1->data, s1->length);
-        memcpy(&data[s1->length], s2->data, s2->length);
-        data[new_length] = '\0';
-        struct object_string *s3 = vm_intern_string(vm, data, new_length);
-        stack_pop(vm);
-        stack_pop(vm);
-        stack_push(vm, OBJECT_VAL(s3));
-    } else if (IS_NUMBER(stack_peek(vm, 0)) && IS_NUMBER(stack_peek(vm, 1))) {
-        double b = AS_NUMBER(stack_pop(vm));
-        double a = AS_NUMBER(stack_pop(vm));
-        stack_push(vm, NUMBER_VAL(a + b));
-    } else {
+        QUICKEN(vm, OP_ADD_STR_STR);
+        return concatenate(vm);
+    }
+    if (!IS_NUMERIC(stack_peek(vm, 0)) || !IS_NUMERIC(stack_peek(vm, 1))) {
         vm_runtime_error(vm, "Operands must be two numbers or two strings");
         return false;
     }
+    BINARY_OP(NUMBER_VAL, +, int_add, OP_ADD_INT_INT, OP_ADD_NUM_NUM);
     return true;
 }
 
-bool vm_op_subtract(struct vm *vm)
+bool vm_op_add_num_num(struct vm *vm)
 {
-    BINARY_OP(NUMBER_VAL, -);
+    NUMBER_OP(NUMBER_VAL, +, OP_ADD, vm_op_add);
     return true;
 }
 
-bool vm_op_multiply(struct vm *vm)
+bool vm_op_add_int_int(struct vm *vm)
 {
-    BINARY_OP(NUMBER_VAL, *);
+    INT_OP(int_add, OP_ADD, vm_op_add);
     return true;
 }
 
-bool vm_op_divide(struct vm *vm)
+bool vm_op_add_str_str(struct vm *vm)
 {
-    BINARY_OP(NUMBER_VAL, /);
-    return true;
+    if (unlikely(!IS_STRING(vm->sp[-1]) || !IS_STRING(vm->sp[-2]))) {
+        QUICKEN(vm, OP_ADD);
+        return vm_op_add(vm);
+    }
+    return concatenate(vm);
 }
 
-bool vm_op_mod(struct vm *vm)
+bool vm_op_subtract(struct vm *vm)
 {
-    BINARY_FUNC(NUMBER_VAL, fmod);
+    BINARY_OP(NUMBER_VAL, -, int_subtract, OP_SUBTRACT_INT, OP_SUBTRACT_NUM);
     return true;
 }
 
-bool vm_op_shl(struct vm *vm)
+bool vm_op_subtract_num(struct vm *vm)
 {
-    BINARY_FUNC(NUMBER_VAL, fshl);
+    NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT, vm_op_subtract);
     return true;
 }
 
-bool vm_op_shr(struct vm *vm)
+bool vm_op_subtract_int(struct vm *vm)
 {
-    BINARY_FUNC(NUMBER_VAL, fshr);
+    INT_OP(int_subtract, OP_SUBTRACT, vm_op_subtract);
     return true;
 }
 
-bool vm_op_not(struct vm *vm)
+bool vm_op_multiply(struct vm *vm)
 {
-    stack_push(vm, BOOL_VAL(is_falsey(stack_pop(vm))));
+    BINARY_OP(NUMBER_VAL, *, int_multiply, OP_MULTIPLY_INT, OP_MULTIPLY_NUM);
     return true;
 }
 
-bool vm_op_print(struct vm *vm)
+bool vm_op_multiply_num(struct vm *vm)
 {
-    value_print(stack_pop(vm));
-    printf("\n");
+    NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY, vm_op_multiply);
     return true;
 }
 
-bool vm_op_jump(struct vm *vm)
+bool vm_op_multiply_int(struct vm *vm)
 {
-    uint16_t offset = READ_U16(vm);
-    vm->frame->ip += offset;
+    INT_OP(int_multiply, OP_MULTIPLY, vm_op_multiply);
     return true;
 }
 
-bool vm_op_jump_if_false(struct vm *vm)
+bool vm_op_divide(struct vm *vm)
 {
-    uint16_t offset = READ_U16(vm);
-    if (is_falsey(stack_peek(vm, 0))) {
-        vm->frame->ip += offset;
+    // Division always produces a double, even for two integers
+    value b = stack_peek(vm, 0);
+    value a = stack_peek(vm, 1);
+    if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+        vm_runtime_error(vm, "Operands must be numbers");
+        return false;
     }
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        QUICKEN(vm, OP_DIVIDE_NUM);
+    }
+    vm->sp--;
+    vm->sp[-1] = NUMBER_VAL(AS_DOUBLE(a) / AS_DOUBLE(b));
     return true;
 }
 
-bool vm_op_jump_if_true(struct vm *vm)
+bool vm_op_divide_num(struct vm *vm)
 {
-    uint16_t offset = READ_U16(vm);
-    if (!is_falsey(stack_peek(vm, 0))) {
-        vm->frame->ip += offset;
+    NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE, vm_op_divide);
+    return true;
+}
+
+bool vm_op_mod(struct vm *vm)
+{
+    value b = stack_peek(vm, 0);
+    value a = stack_peek(vm, 1);
+    if (IS_INT(a) && IS_INT(b)) {
+        // Truncating, like C; INT64_MIN % -1 overflows in C but is just 0
+        if (AS_INT(b) == 0) {
+            vm_runtime_error(vm, "Integer modulo by zero");
+            return false;
+        }
+        vm->sp--;
+        vm->sp[-1] = INT_VAL(AS_INT(b) == -1 ? 0 : AS_INT(a) % AS_INT(b));
+        return true;
+    }
+    if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+        vm_runtime_error(vm, "Operands must be numbers");
+        return false;
     }
+    vm->sp--;
+    vm->sp[-1] = NUMBER_VAL(fmod(AS_DOUBLE(a), AS_DOUBLE(b)));
     return true;
 }
 
-bool vm_op_loop(struct vm *vm)
+bool vm_op_shl(struct vm *vm)
 {
-    uint16_t offset = READ_U16(vm);
-    vm->frame->ip -= offset;
+    int64_t a;
+    int64_t b;
+    if (!int_operands(vm, &a, &b)) {
+        return false;
+    }
+    if (b < 0 || b > 63) {  // NOLINT(readability-magic-numbers)
+        vm_runtime_error(vm, "Shift count out of range");
+        return false;
+    }
+    int64_t r = (int64_t)((uint64_t)a << b);
+    if ((r >> b) != a) {
+        // bits were shifted out, so the result is only representable as a double
+        stack_push(vm, NUMBER_VAL(ldexp((double)a, (int)b)));
+    } else {
+        stack_push(vm, int_or_double(r));
+    }
     return true;
 }
 
-bool vm_op_call(struct vm *vm)
+bool vm_op_shr(struct vm *vm)
 {
-    int arg_count = READ_U8(vm);
-    if (!call_value(vm, stack_peek(vm, arg_count), arg_count)) {
+    int64_t a;
+    int64_t b;
+    if (!int_operands(vm, &a, &b)) {
         return false;
     }
-    vm->frame = &vm->frames[vm->frame_count - 1];
+    if (b < 0 || b > 63) {  // NOLINT(readability-magic-numbers)
+        vm_runtime_error(vm, "Shift count out of range");
+        return false;
+    }
+    stack_push(vm, int_or_double(a >> b));  // arithmetic shift
     return true;
 }
 
-bool vm_op_invoke(struct vm *vm)
+bool vm_op_bit_and(struct vm *vm)
 {
-    struct object_string *method = READ_STRING(vm);
-    int arg_count = READ_U8(vm);
-    if (!invoke(vm, method, arg_count)) {
+    int64_t a;
+    int64_t b;
+    if (!int_operands(vm, &a, &b)) {
         return false;
     }
-    vm->frame = &vm->frames[vm->frame_count - 1];
+    stack_push(vm, int_or_double(a & b));
     return true;
 }
 
-bool vm_op_super_invoke(struct vm *vm)
+bool vm_op_bit_or(struct vm *vm)
 {
-    struct object_string *method = READ_STRING(vm);
-    int arg_count = READ_U8(vm);
-    struct object_class *superclass = AS_CLASS(stack_pop(vm));
-    if (!invoke_from_class(vm, superclass, method, arg_count)) {
+    int64_t a;
+    int64_t b;
+    if (!int_operands(vm, &a, &b)) {
         return false;
     }
-    vm->frame = &vm->frames[vm->frame_count - 1];
+    stack_push(vm, int_or_double(a | b));
     return true;
 }
 
-bool vm_op_closure(struct vm *vm)
+bool vm_op_bit_xor(struct vm *vm)
 {
-    struct object_function *function = AS_FUNCTION(READ_CONSTANT(vm));
-    struct object_closure *closure = object_closure_new(function);
+    int64_t a;
+    int64_t b;
+    if (!int_operands(vm, &a, &b)) {
+        return false;
+    }
+    stack_push(vm, int_or_double(a ^ b));
+    return true;
+}
+
+bool vm_op_bit_not(struct vm *vm)
+{
+    int64_t a;
+    if (!int_operand(stack_peek(vm, 0), &a)) {
+        vm_runtime_error(vm, "Operand must be an integer");
+        return false;
+    }
+    vm->sp[-1] = int_or_double(~a);
+    return true;
+}
+
+bool vm_op_not(struct vm *vm)
+{
+    stack_push(vm, BOOL_VAL(is_falsey(stack_pop(vm))));
+    return true;
+}
+
+bool vm_op_print(struct vm *vm)
+{
+    value_print(stack_pop(vm));
+    printf("\n");
+    return true;
+}
+
+bool vm_op_jump(struct vm *vm)
+{
+    uint16_t offset = READ_U16(vm);
+    vm->frame->ip += offset;
+    return true;
+}
+
+bool vm_op_jump_if_false(struct vm *vm)
+{
+    uint16_t offset = READ_U16(vm);
+    if (is_falsey(stack_peek(vm, 0))) {
+        vm->frame->ip += offset;
+    }
+    return true;
+}
+
+bool vm_op_jump_if_true(struct vm *vm)
+{
+    uint16_t offset = READ_U16(vm);
+    if (!is_falsey(stack_peek(vm, 0))) {
+        vm->frame->ip += offset;
+    }
+    return true;
+}
+
+bool vm_op_loop(struct vm *vm)
+{
+    uint16_t offset = READ_U16(vm);
+    vm->frame->ip -= offset;
+    return true;
+}
+
+bool vm_op_call(struct vm *vm)
+{
+    int arg_count = READ_U8(vm);
+    if (!call_value(vm, stack_peek(vm, arg_count), arg_count)) {
+        return false;
+    }
+    vm->frame = &vm->frames[vm->frame_count - 1];
+    return true;
+}
+
+/**
+ * Call the callee below the arguments in place of the current frame
+ *
+ * Only closures (and methods bound to one) replace the frame; anything else
+ * is called normally and the OP_RETURN after the tail call returns its result.
+ */
+bool vm_op_tail_call(struct vm *vm)
+{
+    int arg_count = READ_U8(vm);
+    value callee = stack_peek(vm, arg_count);
+    struct object_closure *closure = NULL;
+
+    if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+    } else if (IS_BOUND_METHOD(callee)) {
+        closure = AS_BOUND_METHOD(callee)->method;
+    }
+    if (closure == NULL || closure->function->arity != arg_count) {
+        if (!call_value(vm, callee, arg_count)) {
+            return false;
+        }
+        vm->frame = &vm->frames[vm->frame_count - 1];
+        return true;
+    }
+
+    if (IS_BOUND_METHOD(callee)) {
+        vm->sp[-arg_count - 1] = AS_BOUND_METHOD(callee)->receiver;  // set 'this' to bound instance
+    }
+
+    // Nothing of the current frame survives, so its captured locals must be closed first
+    struct call_frame *frame = vm->frame;
+    close_upvalues(vm, frame->slots);
+    memmove(frame->slots, vm->sp - arg_count - 1, (arg_count + 1) * sizeof(value));
+    vm->sp = frame->slots + arg_count + 1;
+    if (!stack_reserve(vm, frame->slots, closure->function)) {
+        return false;
+    }
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
+}
+
+bool vm_op_invoke(struct vm *vm)
+{
+    struct object_string *method = READ_STRING(vm);
+    int arg_count = READ_U8(vm);
+    struct inline_cache *cache = READ_CACHE(vm);
+    if (!invoke(vm, method, arg_count, cache)) {
+        return false;
+    }
+    vm->frame = &vm->frames[vm->frame_count - 1];
+    return true;
+}
+
+bool vm_op_super_invoke(struct vm *vm)
+{
+    struct object_string *method = READ_STRING(vm);
+    int arg_count = READ_U8(vm);
+    struct inline_cache *cache = READ_CACHE(vm);
+    struct object_class *superclass = AS_CLASS(stack_pop(vm));
+
+    // The superclass is fixed for the site, so the cache is keyed on it alone
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].klass == superclass) {
+            cache->hits++;
+            if (!call(vm, cache->entries[i].method, arg_count)) {
+                return false;
+            }
+            vm->frame = &vm->frames[vm->frame_count - 1];
+            return true;
+        }
+    }
+    cache->misses++;
+
+    value closure;
+    if (table_get(&superclass->methods, OBJECT_VAL(method), &closure)) {
+        struct inline_cache_entry entry = {
+            .klass = superclass,
+            .shape = NULL,
+            .transition = NULL,
+            .slot = -1,
+            .method = AS_CLOSURE(closure),
+        };
+        ic_remember(vm, cache, &entry);
+    }
+    if (!invoke_from_class(vm, superclass, method, arg_count)) {
+        return false;
+    }
+    vm->frame = &vm->frames[vm->frame_count - 1];
+    return true;
+}
+
+bool vm_op_closure(struct vm *vm)
+{
+    struct object_function *function = AS_FUNCTION(READ_CONSTANT(vm));
+    const char *error;
+    if (unlikely(function->unloaded != NULL) && !bytecode_materialize(vm, function, &error)) {
+        vm_runtime_error(vm, "Invalid bytecode: %s", error);
+        return false;
+    }
+    struct object_closure *closure = object_closure_new(function);
     stack_push(vm, OBJECT_VAL(closure));
     for (int i = 0; i < closure->nupvalues; i++) {
         uint8_t is_local = READ_U8(vm);
@@ -685,6 +1420,7 @@ bool vm_op_closure(struct vm *vm)
         } else {
             closure->upvalues[i] = vm->frame->closure->upvalues[index];
         }
+        gc_write_barrier(&closure->object, OBJECT_VAL(closure->upvalues[i]));
     }
     return true;
 }
@@ -702,8 +1438,15 @@ bool vm_op_return(struct vm *vm)
     close_upvalues(vm, vm->frame->slots);
     vm->frame_count--;
     if (vm->frame_count == 0) {
-        stack_pop(vm);
-        return false;
+        // Drop the callee and its arguments too, for a function started by vm_call()
+        vm->sp = vm->frame->slots;
+        if (vm->coroutine == NULL) {
+            return false;
+        }
+        // A coroutine's function returned: it is done, and resume evaluates to the result
+        coroutine_finish(vm);
+        stack_push(vm, result);
+        return true;
     }
     vm->sp = vm->frame->slots;
     stack_push(vm, result);
@@ -711,9 +1454,79 @@ bool vm_op_return(struct vm *vm)
     return true;
 }
 
+/**
+ * Suspend the running coroutine, and hand the value on the stack to whatever resumed it
+ */
+bool vm_op_yield(struct vm *vm)
+{
+    if (vm->coroutine == NULL) {
+        vm_runtime_error(vm, "Can only yield inside a coroutine");
+        return false;
+    }
+    coroutine_yield(vm);
+    return true;
+}
+
+/**
+ * Run the coroutine below the value on the stack until it yields or returns
+ *
+ * The first resume calls the coroutine's function, with the value as its
+ * argument if it takes one; later ones make the yield it stopped at
+ * evaluate to the value.  Either way the coroutine and the value are
+ * replaced by what it yields or returns, once it does.
+ */
+bool vm_op_resume(struct vm *vm)
+{
+    value target = stack_peek(vm, 1);
+    if (!IS_COROUTINE(target)) {
+        vm_runtime_error(vm, "Can only resume coroutines");
+        return false;
+    }
+    struct object_coroutine *coroutine = AS_COROUTINE(target);
+    if (coroutine->state == COROUTINE_RUNNING) {
+        vm_runtime_error(vm, "Coroutine is already running");
+        return false;
+    }
+    if (coroutine->state == COROUTINE_DONE) {
+        vm_runtime_error(vm, "Can't resume a coroutine that is done");
+        return false;
+    }
+    // Resumed early, a coroutine no longer waits on the loop
+    if (vm->waiting.count > 0 && table_delete(&vm->waiting, target)) {
+        loop_cancel(vm->loop, coroutine);
+    }
+
+    value v = stack_pop(vm);
+    stack_pop(vm);
+    bool started = coroutine->frame_count > 0;
+    coroutine->caller = vm->coroutine;
+    coroutine->state = COROUTINE_RUNNING;
+    vm->coroutine = coroutine;
+    coroutine_swap(vm, coroutine);
+    if (started) {
+        stack_push(vm, v);
+        return true;
+    }
+    int arg_count = coroutine->closure->function->arity;
+    if (arg_count == 1) {
+        stack_push(vm, v);
+    }
+    if (!call(vm, coroutine->closure, arg_count)) {
+        return false;
+    }
+    vm->frame = &vm->frames[vm->frame_count - 1];
+    return true;
+}
+
 bool vm_op_negate(struct vm *vm)
 {
-    if (!IS_NUMBER(stack_peek(vm, 0))) {
+    value v = stack_peek(vm, 0);
+    if (IS_INT(v)) {
+        // -INT_VALUE_MIN is one past INT_VALUE_MAX
+        vm->sp[-1] = AS_INT(v) == INT_VALUE_MIN ? NUMBER_VAL(-(double)AS_INT(v)) : INT_VAL(-AS_INT(v));
+        return true;
+    }
+    if (!IS_NUMBER(v)) {
         vm_runtime_error(vm, "Operand must be a number");
         return false;
     }
@@ -721,6 +1534,63 @@ bool vm_op_negate(struct vm *vm)
     return true;
 }
 
+/*
+ * Superinstructions.  The operands of the second half directly follow
+ * those of the first, so each one runs the two original handlers back
+ * to back.
+ */
+bool vm_op_get_local_local(struct vm *vm)
+{
+    vm_op_get_local(vm);
+    return vm_op_get_local(vm);
+}
+
+bool vm_op_get_local_constant(struct vm *vm)
+{
+    vm_op_get_local(vm);
+    return vm_op_constant(vm);
+}
+
+bool vm_op_get_local_property(struct vm *vm)
+{
+    vm_op_get_local(vm);
+    return vm_op_get_property(vm);
+}
+
+bool vm_op_set_local_pop(struct vm *vm)
+{
+    vm_op_set_local(vm);
+    return vm_op_pop(vm);
+}
+
+bool vm_op_set_global_slot_pop(struct vm *vm)
+{
+    if (!vm_op_set_global_slot(vm)) {
+        return false;
+    }
+    return vm_op_pop(vm);
+}
+
+bool vm_op_less_jump_if_false(struct vm *vm)
+{
+    // Not quickened: the opcode byte here belongs to the fused pair
+    value b = stack_peek(vm, 0);
+    value a = stack_peek(vm, 1);
+    if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+        vm_runtime_error(vm, "Operands must be numbers");
+        return false;
+    }
+    vm->sp--;
+    vm->sp[-1] = BOOL_VAL(IS_INT(a) && IS_INT(b) ? AS_INT(a) < AS_INT(b) : AS_DOUBLE(a) < AS_DOUBLE(b));
+    return vm_op_jump_if_false(vm);
+}
+
+bool vm_op_pop_loop(struct vm *vm)
+{
+    vm_op_pop(vm);
+    return vm_op_loop(vm);
+}
+
 bool vm_op_class(struct vm *vm)
 {
     stack_push(vm, OBJECT_VAL(object_class_new(READ_STRING(vm))));
@@ -742,6 +1612,11 @@ bool vm_op_inherit(struct vm *vm)
     }
     struct object_class *subclass = AS_CLASS(stack_peek(vm, 0));
     table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+    for (int i = 0; i < subclass->methods.capacity; i++) {
+        struct entry *entry = &subclass->methods.entries[i];
+        gc_write_barrier(&subclass->object, entry->key);
+        gc_write_barrier(&subclass->object, entry->value);
+    }
     stack_pop(vm);  // subclass
     return true;
 }
@@ -766,11 +1641,18 @@ static opcode_impl opcode_handlers[UINT8_MAX + 1] = {
     [OP_MOD] = vm_op_mod,
     [OP_SHL] = vm_op_shl,
     [OP_SHR] = vm_op_shr,
+    [OP_BIT_AND] = vm_op_bit_and,
+    [OP_BIT_OR] = vm_op_bit_or,
+    [OP_BIT_XOR] = vm_op_bit_xor,
+    [OP_BIT_NOT] = vm_op_bit_not,
     [OP_NEGATE] = vm_op_negate,
     [OP_NOT] = vm_op_not,
     [OP_DEFINE_GLOBAL] = vm_op_define_global,
     [OP_GET_GLOBAL] = vm_op_get_global,
     [OP_SET_GLOBAL] = vm_op_set_global,
+    [OP_DEFINE_GLOBAL_SLOT] = vm_op_define_global_slot,
+    [OP_GET_GLOBAL_SLOT] = vm_op_get_global_slot,
+    [OP_SET_GLOBAL_SLOT] = vm_op_set_global_slot,
     [OP_GET_LOCAL] = vm_op_get_local,
     [OP_SET_LOCAL] = vm_op_set_local,
     [OP_GET_UPVALUE] = vm_op_get_upvalue,
@@ -781,6 +1663,7 @@ static opcode_impl opcode_handlers[UINT8_MAX + 1] = {
     [OP_LOOP] = vm_op_loop,
     [OP_PRINT] = vm_op_print,
     [OP_CALL] = vm_op_call,
+    [OP_TAIL_CALL] = vm_op_tail_call,
     [OP_CLOSE_UPVALUE] = vm_op_close_upvalue,
     [OP_CLOSURE] = vm_op_closure,
     [OP_RETURN] = vm_op_return,
@@ -791,8 +1674,604 @@ static opcode_impl opcode_handlers[UINT8_MAX + 1] = {
     [OP_INHERIT] = vm_op_inherit,
     [OP_TABLE_GET] = vm_op_table_get,
     [OP_TABLE_SET] = vm_op_table_set,
+    [OP_ADD_NUM_NUM] = vm_op_add_num_num,
+    [OP_ADD_STR_STR] = vm_op_add_str_str,
+    [OP_SUBTRACT_NUM] = vm_op_subtract_num,
+    [OP_MULTIPLY_NUM] = vm_op_multiply_num,
+    [OP_DIVIDE_NUM] = vm_op_divide_num,
+    [OP_GREATER_NUM] = vm_op_greater_num,
+    [OP_LESS_NUM] = vm_op_less_num,
+    [OP_ADD_INT_INT] = vm_op_add_int_int,
+    [OP_SUBTRACT_INT] = vm_op_subtract_int,
+    [OP_MULTIPLY_INT] = vm_op_multiply_int,
+    [OP_GREATER_INT] = vm_op_greater_int,
+    [OP_LESS_INT] = vm_op_less_int,
+    [OP_GET_LOCAL_LOCAL] = vm_op_get_local_local,
+    [OP_GET_LOCAL_CONSTANT] = vm_op_get_local_constant,
+    [OP_GET_LOCAL_PROPERTY] = vm_op_get_local_property,
+    [OP_SET_LOCAL_POP] = vm_op_set_local_pop,
+    [OP_SET_GLOBAL_SLOT_POP] = vm_op_set_global_slot_pop,
+    [OP_LESS_JUMP_IF_FALSE] = vm_op_less_jump_if_false,
+    [OP_POP_LOOP] = vm_op_pop_loop,
+    [OP_YIELD] = vm_op_yield,
+    [OP_RESUME] = vm_op_resume,
 };
 
+#ifdef DPLANG_THREADED_DISPATCH
+
+/*
+ * Direct-threaded interpreter core.
+ *
+ * Instead of an indirect call through opcode_handlers[] for every
+ * instruction, each handler jumps straight to the next one with a
+ * computed goto.  The instruction pointer, stack pointer, slot base and
+ * constant table live in locals and are only written back to the VM
+ * when something outside this function needs to see them: calls,
+ * returns, and any instruction that may allocate (and so may run the
+ * garbage collector).
+ *
+ * Hot instructions have inline implementations below.  Everything else
+ * falls through to op_generic, which syncs the cached state and runs the
+ * same handler the table core uses, so both cores share one definition
+ * of the slow paths.
+ */
+
+#define LOAD_FRAME()                                                  \
+    do {                                                              \
+        frame = vm->frame;                                            \
+        ip = frame->ip;                                               \
+        slots = frame->slots;                                         \
+        constants = frame->closure->function->chunk.constants.values; \
+        caches = frame->closure->function->chunk.caches;              \
+        sp = vm->sp;                                                  \
+    } while (0)
+
+#define STORE_FRAME()   \
+    do {                \
+        frame->ip = ip; \
+        vm->sp = sp;    \
+    } while (0)
+
+#ifdef DEBUG_TRACE_EXEC
+#define DISPATCH()                                                           \
+    do {                                                                     \
+        STORE_FRAME();                                                       \
+        vm_dump_stack(vm);                                                   \
+        struct chunk *trace_chunk = &frame->closure->function->chunk;        \
+        disassemble_instruction(trace_chunk, (int)(ip - trace_chunk->code)); \
+        goto *dispatch[*ip++];                                               \
+    } while (0)
+#else
+#define DISPATCH() goto *dispatch[*ip++]
+#endif
+
+/* The slot of a field cached for instance's shape, NULL on a miss or
+ * when the cached result is a method
+ */
+static inline value *ic_cached_field(struct inline_cache *cache, struct object_instance *instance)
+{
+    for (int i = 0; i < cache->count; i++) {
+        struct inline_cache_entry *entry = &cache->entries[i];
+        if (entry->shape == instance->shape && entry->method == NULL) {
+            cache->hits++;
+            return &instance->fields[entry->slot];
+        }
+    }
+    return NULL;
+}
+
+#define FAST_READ_U8()  (*ip++)
+#define FAST_READ_U16() (ip += 2, (uint16_t)((ip[-1] << 8) | ip[-2]))
+
+/* Operands are checked before anything is consumed, so a type error can
+ * fall back to op_generic with ip still pointing just past the opcode.
+ * A generic instruction that sees two doubles quickens itself into its
+ * numeric form; integers and mixed operands take the generic path, which
+ * quickens to the integer form.  The quickened forms deoptimize by
+ * restoring the generic opcode before going to op_generic, which
+ * dispatches on ip[-1].
+ */
+#define FAST_BINARY_OP(valtype, op, quick)                        \
+    do {                                                          \
+        if (unlikely(!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2]))) { \
+            goto op_generic;                                      \
+        }                                                         \
+        ip[-1] = (quick);                                         \
+        double b = AS_NUMBER(sp[-1]);                             \
+        double a = AS_NUMBER(sp[-2]);                             \
+        sp--;                                                     \
+        sp[-1] = valtype(a op b);                                 \
+        DISPATCH();                                               \
+    } while (0)
+
+#define FAST_NUMBER_OP(valtype, op, generic)                      \
+    do {                                                          \
+        if (unlikely(!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2]))) { \
+            ip[-1] = (generic);                                   \
+            goto op_generic;                                      \
+        }                                                         \
+        double b = AS_NUMBER(sp[-1]);                             \
+        double a = AS_NUMBER(sp[-2]);                             \
+        sp--;                                                     \
+        sp[-1] = valtype(a op b);                                 \
+        DISPATCH();                                               \
+    } while (0)
+
+#define FAST_INT_OP(int_func, generic)                      \
+    do {                                                    \
+        if (unlikely(!IS_INT(sp[-1]) || !IS_INT(sp[-2]))) { \
+            ip[-1] = (generic);                             \
+            goto op_generic;                                \
+        }                                                   \
+        int64_t b = AS_INT(sp[-1]);                         \
+        int64_t a = AS_INT(sp[-2]);                         \
+        sp--;                                               \
+        sp[-1] = int_func(a, b);                            \
+        DISPATCH();                                         \
+    } while (0)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#if defined(__clang__)
+#pragma GCC diagnostic ignored "-Winitializer-overrides"
+#else
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+
+int vm_run(struct vm *vm)
+{
+    static void *const dispatch[UINT8_MAX + 1] = {
+        [0 ... UINT8_MAX] = &&op_generic,
+        [OP_CONSTANT] = &&op_constant,
+        [OP_NIL] = &&op_nil,
+        [OP_TRUE] = &&op_true,
+        [OP_FALSE] = &&op_false,
+        [OP_POP] = &&op_pop,
+        [OP_GET_LOCAL] = &&op_get_local,
+        [OP_SET_LOCAL] = &&op_set_local,
+        [OP_GET_UPVALUE] = &&op_get_upvalue,
+        [OP_SET_UPVALUE] = &&op_set_upvalue,
+        [OP_EQUAL] = &&op_equal,
+        [OP_GREATER] = &&op_greater,
+        [OP_LESS] = &&op_less,
+        [OP_ADD] = &&op_add,
+        [OP_SUBTRACT] = &&op_subtract,
+        [OP_MULTIPLY] = &&op_multiply,
+        [OP_DIVIDE] = &&op_divide,
+        [OP_GREATER_NUM] = &&op_greater_num,
+        [OP_LESS_NUM] = &&op_less_num,
+        [OP_ADD_NUM_NUM] = &&op_add_num_num,
+        [OP_ADD_STR_STR] = &&op_add_str_str,
+        [OP_SUBTRACT_NUM] = &&op_subtract_num,
+        [OP_MULTIPLY_NUM] = &&op_multiply_num,
+        [OP_DIVIDE_NUM] = &&op_divide_num,
+        [OP_ADD_INT_INT] = &&op_add_int_int,
+        [OP_SUBTRACT_INT] = &&op_subtract_int,
+        [OP_MULTIPLY_INT] = &&op_multiply_int,
+        [OP_GREATER_INT] = &&op_greater_int,
+        [OP_LESS_INT] = &&op_less_int,
+        [OP_NOT] = &&op_not,
+        [OP_NEGATE] = &&op_negate,
+        [OP_JUMP] = &&op_jump,
+        [OP_JUMP_IF_FALSE] = &&op_jump_if_false,
+        [OP_JUMP_IF_TRUE] = &&op_jump_if_true,
+        [OP_LOOP] = &&op_loop,
+        [OP_GET_GLOBAL_SLOT] = &&op_get_global_slot,
+        [OP_SET_GLOBAL_SLOT] = &&op_set_global_slot,
+        [OP_GET_PROPERTY] = &&op_get_property,
+        [OP_SET_PROPERTY] = &&op_set_property,
+        [OP_CALL] = &&op_call,
+        [OP_INVOKE] = &&op_invoke,
+        [OP_RETURN] = &&op_return,
+        [OP_GET_LOCAL_LOCAL] = &&op_get_local_local,
+        [OP_GET_LOCAL_CONSTANT] = &&op_get_local_constant,
+        [OP_GET_LOCAL_PROPERTY] = &&op_get_local_property,
+        [OP_SET_LOCAL_POP] = &&op_set_local_pop,
+        [OP_SET_GLOBAL_SLOT_POP] = &&op_set_global_slot_pop,
+        [OP_LESS_JUMP_IF_FALSE] = &&op_less_jump_if_false,
+        [OP_POP_LOOP] = &&op_pop_loop,
+    };
+
+    struct call_frame *frame;
+    uint8_t *ip;
+    value *sp;
+    value *slots;
+    value *constants;
+    struct inline_cache *caches;
+
+    vm->frame = &vm->frames[vm->frame_count - 1];
+#ifdef DEBUG_TRACE_EXEC
+    printf("++++ TRACE ++++\n");
+#endif
+    LOAD_FRAME();
+    DISPATCH();
+
+op_constant:
+    *sp++ = constants[FAST_READ_U8()];
+    DISPATCH();
+
+op_nil:
+    *sp++ = NIL_VAL;
+    DISPATCH();
+
+op_true:
+    *sp++ = BOOL_VAL(true);
+    DISPATCH();
+
+op_false:
+    *sp++ = BOOL_VAL(false);
+    DISPATCH();
+
+op_pop:
+    sp--;
+    DISPATCH();
+
+op_get_local:
+    *sp++ = slots[FAST_READ_U8()];
+    DISPATCH();
+
+op_set_local:
+    slots[FAST_READ_U8()] = sp[-1];
+    DISPATCH();
+
+op_get_upvalue:
+    *sp++ = *frame->closure->upvalues[FAST_READ_U8()]->location;
+    DISPATCH();
+
+op_set_upvalue: {
+    struct object_upvalue *upvalue = frame->closure->upvalues[FAST_READ_U8()];
+    *upvalue->location = sp[-1];
+    gc_write_barrier(&upvalue->object, sp[-1]);
+    DISPATCH();
+}
+
+op_equal:
+    sp--;
+    sp[-1] = BOOL_VAL(value_equal(sp[-1], sp[0]));
+    DISPATCH();
+
+op_greater:
+    FAST_BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+
+op_greater_num:
+    FAST_NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+
+op_greater_int:
+    FAST_INT_OP(int_greater, OP_GREATER);
+
+op_less:
+    FAST_BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+
+op_less_num:
+    FAST_NUMBER_OP(BOOL_VAL, <, OP_LESS);
+
+op_less_int:
+    FAST_INT_OP(int_less, OP_LESS);
+
+op_add:
+    // String concatenation allocates, so it goes through the generic path (which quickens to OP_ADD_STR_STR)
+    FAST_BINARY_OP(NUMBER_VAL, +, OP_ADD_NUM_NUM);
+
+op_add_num_num:
+    FAST_NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+
+op_add_int_int:
+    FAST_INT_OP(int_add, OP_ADD);
+
+op_add_str_str:
+    if (unlikely(!IS_STRING(sp[-1]) || !IS_STRING(sp[-2]))) {
+        ip[-1] = OP_ADD;
+    }
+    goto op_generic;
+
+op_subtract:
+    FAST_BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+
+op_subtract_num:
+    FAST_NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+
+op_subtract_int:
+    FAST_INT_OP(int_subtract, OP_SUBTRACT);
+
+op_multiply:
+    FAST_BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+
+op_multiply_num:
+    FAST_NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+
+op_multiply_int:
+    FAST_INT_OP(int_multiply, OP_MULTIPLY);
+
+op_divide:
+    FAST_BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+
+op_divide_num:
+    FAST_NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+
+op_not:
+    sp[-1] = BOOL_VAL(is_falsey(sp[-1]));
+    DISPATCH();
+
+op_negate:
+    if (IS_INT(sp[-1]) && AS_INT(sp[-1]) != INT_VALUE_MIN) {
+        sp[-1] = INT_VAL(-AS_INT(sp[-1]));
+        DISPATCH();
+    }
+    if (unlikely(!IS_NUMBER(sp[-1]))) {
+        goto op_generic;
+    }
+    sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));
+    DISPATCH();
+
+op_jump: {
+    uint16_t offset = FAST_READ_U16();
+    ip += offset;
+    DISPATCH();
+}
+
+op_jump_if_false: {
+    uint16_t offset = FAST_READ_U16();
+    if (is_falsey(sp[-1])) {
+        ip += offset;
+    }
+    DISPATCH();
+}
+
+op_jump_if_true: {
+    uint16_t offset = FAST_READ_U16();
+    if (!is_falsey(sp[-1])) {
+        ip += offset;
+    }
+    DISPATCH();
+}
+
+op_loop: {
+    uint16_t offset = FAST_READ_U16();
+    ip -= offset;
+    DISPATCH();
+}
+
+op_get_global_slot: {
+    value v = vm->global_values.values[ip[0] | (ip[1] << 8)];
+    if (unlikely(IS_EMPTY(v))) {
+        goto op_generic;  // reports the undefined variable
+    }
+    ip += 2;
+    *sp++ = v;
+    DISPATCH();
+}
+
+op_set_global_slot: {
+    value *slot = &vm->global_values.values[ip[0] | (ip[1] << 8)];
+    if (unlikely(IS_EMPTY(*slot))) {
+        goto op_generic;
+    }
+    ip += 2;
+    *slot = sp[-1];
+    DISPATCH();
+}
+
+op_get_property: {
+    // Fields found in the inline cache are read directly; misses and methods (binding allocates) go generic
+    if (likely(IS_INSTANCE(sp[-1]))) {
+        value *field = ic_cached_field(&caches[ip[1] | (ip[2] << 8)], AS_INSTANCE(sp[-1]));
+        if (likely(field != NULL)) {
+            ip += 3;
+            sp[-1] = *field;
+            DISPATCH();
+        }
+    }
+    goto op_generic;
+}
+
+op_get_local_property: {
+    value receiver = slots[ip[0]];
+    if (likely(IS_INSTANCE(receiver))) {
+        value *field = ic_cached_field(&caches[ip[2] | (ip[3] << 8)], AS_INSTANCE(receiver));
+        if (likely(field != NULL)) {
+            ip += 4;
+            *sp++ = *field;
+            DISPATCH();
+        }
+    }
+    goto op_generic;
+}
+
+op_get_local_local:
+    sp[0] = slots[ip[0]];
+    sp[1] = slots[ip[1]];
+    sp += 2;
+    ip += 2;
+    DISPATCH();
+
+op_get_local_constant:
+    sp[0] = slots[ip[0]];
+    sp[1] = constants[ip[1]];
+    sp += 2;
+    ip += 2;
+    DISPATCH();
+
+op_set_local_pop:
+    slots[FAST_READ_U8()] = *--sp;
+    DISPATCH();
+
+op_set_global_slot_pop: {
+    value *slot = &vm->global_values.values[ip[0] | (ip[1] << 8)];
+    if (unlikely(IS_EMPTY(*slot))) {
+        goto op_generic;
+    }
+    ip += 2;
+    *slot = *--sp;
+    DISPATCH();
+}
+
+op_less_jump_if_false: {
+    bool less;
+    if (IS_INT(sp[-1]) && IS_INT(sp[-2])) {
+        less = AS_INT(sp[-2]) < AS_INT(sp[-1]);
+    } else if (likely(IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2]))) {
+        less = AS_NUMBER(sp[-2]) < AS_NUMBER(sp[-1]);
+    } else {
+        goto op_generic;
+    }
+    sp--;
+    sp[-1] = BOOL_VAL(less);
+    uint16_t offset = FAST_READ_U16();
+    if (!less) {
+        ip += offset;
+    }
+    DISPATCH();
+}
+
+op_pop_loop: {
+    sp--;
+    uint16_t offset = FAST_READ_U16();
+    ip -= offset;
+    DISPATCH();
+}
+
+op_set_property: {
+    // Only stores to existing fields are inlined, adding a field may allocate
+    if (likely(IS_INSTANCE(sp[-2]))) {
+        struct object_instance *instance = AS_INSTANCE(sp[-2]);
+        struct inline_cache *cache = &caches[ip[1] | (ip[2] << 8)];
+        for (int i = 0; i < cache->count; i++) {
+            struct inline_cache_entry *entry = &cache->entries[i];
+            if (entry->shape == instance->shape && entry->transition == NULL) {
+                cache->hits++;
+                ip += 3;
+                instance->fields[entry->slot] = sp[-1];
+                gc_write_barrier(&instance->object, sp[-1]);
+                sp[-2] = sp[-1];
+                sp--;
+                DISPATCH();
+            }
+        }
+    }
+    goto op_generic;
+}
+
+op_invoke: {
+    struct object_string *method = AS_STRING(constants[FAST_READ_U8()]);
+    int arg_count = FAST_READ_U8();
+    struct inline_cache *cache = &caches[FAST_READ_U16()];
+    STORE_FRAME();
+    if (!invoke(vm, method, arg_count, cache)) {
+        goto op_error;
+    }
+    vm->frame = &vm->frames[vm->frame_count - 1];
+    LOAD_FRAME();
+    DISPATCH();
+}
+
+op_call: {
+    int arg_count = FAST_READ_U8();
+    STORE_FRAME();
+    if (!call_value(vm, sp[-1 - arg_count], arg_count)) {
+        goto op_error;
+    }
+    vm->frame = &vm->frames[vm->frame_count - 1];
+    LOAD_FRAME();
+    DISPATCH();
+}
+
+op_return: {
+    value result = *--sp;
+    close_upvalues(vm, slots);
+    vm->frame_count--;
+    if (vm->frame_count == 0) {
+        vm->sp = slots;
+        if (vm->coroutine == NULL) {
+            return 0;
+        }
+        coroutine_finish(vm);
+        stack_push(vm, result);
+        LOAD_FRAME();
+        DISPATCH();
+    }
+    sp = slots;
+    *sp++ = result;
+    vm->frame = &vm->frames[vm->frame_count - 1];
+    frame = vm->frame;
+    ip = frame->ip;
+    slots = frame->slots;
+    constants = frame->closure->function->chunk.constants.values;
+    caches = frame->closure->function->chunk.caches;
+    DISPATCH();
+}
+
+op_generic: {
+    opcode_impl handler = opcode_handlers[ip[-1]];
+    if (handler == NULL) {
+        fprintf(stderr, "Invalid opcode");
+        return -1;
+    }
+    STORE_FRAME();
+    if (!handler(vm)) {
+        goto op_error;
+    }
+    LOAD_FRAME();
+    DISPATCH();
+}
+
+op_error:
+    if (vm->sp == vm->stack) {
+        return 0;
+    }
+    vm_backtrace(vm);
+    return -1;
+}
+
+#pragma GCC diagnostic pop
+
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef DISPATCH
+#undef FAST_READ_U8
+#undef FAST_READ_U16
+#undef FAST_BINARY_OP
+#undef FAST_NUMBER_OP
+#undef FAST_INT_OP
+
+#else
+
+#ifdef DEBUG_OPCODE_PROFILE
+#define OPCODE_PROFILE_TOP 32
+
+static uint64_t opcode_pairs[UINT8_MAX + 1][UINT8_MAX + 1];
+
+/** Print the most frequently executed opcode pairs; this is what the superinstruction set is chosen from */
+static void vm_dump_opcode_profile(void)
+{
+    uint64_t total = 0;
+    for (int a = 0; a <= UINT8_MAX; a++) {
+        for (int b = 0; b <= UINT8_MAX; b++) {
+            total += opcode_pairs[a][b];
+        }
+    }
+    printf("==== OPCODE PAIRS (%llu) ====\n", (unsigned long long)total);
+    for (int n = 0; n < OPCODE_PROFILE_TOP; n++) {
+        int best_a = 0;
+        int best_b = 0;
+        for (int a = 0; a <= UINT8_MAX; a++) {
+            for (int b = 0; b <= UINT8_MAX; b++) {
+                if (opcode_pairs[a][b] > opcode_pairs[best_a][best_b]) {
+                    best_a = a;
+                    best_b = b;
+                }
+            }
+        }
+        if (opcode_pairs[best_a][best_b] == 0) {
+            break;
+        }
+        printf("%12llu %5.2f%% %-20s %s\n", (unsigned long long)opcode_pairs[best_a][best_b],
+               100.0 * (double)opcode_pairs[best_a][best_b] / (double)total, opcode_to_string(best_a),
+               opcode_to_string(best_b));
+        opcode_pairs[best_a][best_b] = 0;
+    }
+}
+#endif
+
 int vm_run(struct vm *vm)
 {
     vm->frame = &vm->frames[vm->frame_count - 1];
@@ -808,6 +2287,11 @@ int vm_run(struct vm *vm)
 
 #endif
         enum opcode inst = READ_OPCODE(vm);
+#ifdef DEBUG_OPCODE_PROFILE
+        static enum opcode previous = OP_RETURN;
+        opcode_pairs[previous][inst]++;
+        previous = inst;
+#endif
         opcode_impl handler = opcode_handlers[inst];
         if (handler == NULL) {
             fprintf(stderr, "Invalid opcode");
@@ -824,74 +2308,22 @@ int vm_run(struct vm *vm)
     return 0;
 }
 
-struct bytecode_header {
-    uint32_t magic;
-    uint8_t vm_ver_major;
-    uint8_t vm_ver_minor;
-    uint16_t header_size;
-    uint64_t timestamp;
-} __attribute__((packed));
+#endif
 
-int vm_dump_bytecode(struct vm *vm, struct object_function *function)
+// NOLINTNEXTLINE(misc-no-recursion)
+static void vm_dump_caches(struct object_function *function)
 {
-    (void)vm;
-    FILE *f = fopen("bytecode.dpc", "wb");
-
-    struct bytecode_header header = {
-        .magic = BYTECODE_MAGIC,
-        .header_size = sizeof(struct bytecode_header),
-        .timestamp = time(NULL),
-        .vm_ver_major = 0,
-        .vm_ver_minor = 1,
-    };
-
-    fwrite(&header, 1, sizeof(header), f);
-
-    fwrite(&function->chunk.count, 1, sizeof(function->chunk.count), f);
-    fwrite(function->chunk.code, 1, function->chunk.count, f);
-
-    fwrite(&function->chunk.constants.count, 1, sizeof(function->chunk.constants.count), f);
+    chunk_dump_caches(&function->chunk, (function->name == NULL) ? "<script>" : function->name->data);
     for (int i = 0; i < function->chunk.constants.count; i++) {
         value v = function->chunk.constants.values[i];
-        uint8_t type = (uint8_t)v.type;
-        void *data = NULL;
-        size_t dsize = 0;
-        switch (v.type) {
-            case VAL_BOOL:
-                data = &v.as.boolean;
-                dsize = sizeof(v.as.boolean);
-                break;
-            case VAL_NIL:
-                data = &v.as.number;
-                dsize = sizeof(v.as.number);
-                break;
-            case VAL_NUMBER:
-                data = &v.as.number;
-                dsize = sizeof(v.as.number);
-                break;
-            case VAL_OBJECT:
-                break;
-            case VAL_EMPTY:
-                break;
-        }
-        fwrite(&type, 1, sizeof(type), f);
-        if (data != NULL) {
-            fwrite(data, 1, dsize, f);
+        if (IS_FUNCTION(v)) {
+            vm_dump_caches(AS_FUNCTION(v));
         }
     }
-    fclose(f);
-    return 0;
 }
 
-int vm_interpret(struct vm *vm, const char *source)
+int vm_interpret_function(struct vm *vm, struct object_function *function)
 {
-    struct object_function *function = compile(source);
-    if (function == NULL) {
-        return -1;
-    }
-
-    vm_dump_bytecode(vm, function);
-
     stack_push(vm, OBJECT_VAL(function));
 
     struct object_closure *closure = object_closure_new(function);
@@ -899,5 +2331,52 @@ int vm_interpret(struct vm *vm, const char *source)
     stack_push(vm, OBJECT_VAL(closure));
     call(vm, closure, 0);
 
+    int ret = vm_run(vm);
+    if (vm->ic_stats) {
+        vm_dump_caches(function);
+    }
+#if defined(DEBUG_OPCODE_PROFILE) && !defined(DPLANG_THREADED_DISPATCH)
+    vm_dump_opcode_profile();
+#endif
+    return ret;
+}
+
+int vm_call(struct vm *vm, int arg_count)
+{
+    if (!call(vm, AS_CLOSURE(stack_peek(vm, arg_count)), arg_count)) {
+        vm_backtrace(vm);
+        return -1;
+    }
     return vm_run(vm);
 }
+
+int vm_interpret(struct vm *vm, const char *source)
+{
+    struct object_function *function = compile(vm, source, vm->compile_flags);
+    if (function == NULL) {
+        return -1;
+    }
+    return vm_interpret_function(vm, function);
+}
+
+int vm_interpret_bytecode(struct vm *vm, const uint8_t *data, size_t size)
+{
+    const char *error;
+    struct object_function *function = bytecode_read(vm, data, size, &error);
+    if (function == NULL) {
+        fprintf(stderr, "Invalid bytecode: %s\n", error);
+        return -1;
+    }
+    return vm_interpret_function(vm, function);
+}
+
+int vm_interpret_bytecode_file(struct vm *vm, const char *path)
+{
+    const char *error;
+    struct object_function *function = bytecode_load_file(vm, path, 0, &error);
+    if (function == NULL) {
+        fprintf(stderr, "Invalid bytecode: %s\n", error);
+        return -1;
+    }
+    return vm_interpret_function(vm, function);
+}
@@ -9,9 +9,21 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
+/* The value stack and the call frames start out this size and grow on
+ * demand, up to stack_limit values.
+ */
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL  256
 
-#define STACK_MAX 256
+/* Coroutines start with much less, so that a program can keep many of them */
+#define COROUTINE_FRAMES_INITIAL 8
+#define COROUTINE_STACK_INITIAL  32
+
+#define STACK_LIMIT_DEFAULT (1 << 20)
+
+struct heap;
+struct compiler;
+struct loop;
 
 struct call_frame {
     struct object_closure *closure;
@@ -20,21 +32,63 @@ struct call_frame {
 };
 
 struct vm {
-    struct call_frame frames[FRAMES_MAX];
+    struct call_frame *frames;
+    int frame_capacity;
     struct call_frame *frame;
     int frame_count;
-    value stack[STACK_MAX];
+    value *stack;
+    int stack_capacity;
+    int stack_limit;  // most values the stack may grow to before a call fails with "Stack overflow"
     value *sp;
-    struct table globals;
+    struct table globals;              // global name -> index into global_values
+    struct value_array global_values;  // EMPTY_VAL until the global is defined
+    struct value_array global_names;
     struct table strings;
+    struct table channels;  // channel id -> this VM's one handle on it, weak like strings
     struct object_upvalue *open_upvalues;
+    struct object_coroutine *coroutine;  // running coroutine, whose frames and stack the ones above are
+    bool suspending;                     // suspend it once the native being called returns, see vm_suspend()
+    struct loop *loop;                   // event loop of the I/O natives, made by the first that waits
+    struct table waiting;                // coroutines waiting on the loop -> true
     struct object *objects;
     struct object_string *init_string;
+    int compile_flags;  // enum compile_flags used by vm_interpret()
+    bool ic_stats;      // print the inline caches of each script once it has run
+    struct bytecode_image *images;  // loaded bytecode, which the code of loaded functions points into
+    struct heap *heap;              // objects and the collector's state, see gc_init()
+    struct compiler *compiler;      // innermost function being compiled, for the collector
+    value loading;                  // top-level function bytecode_load() is reading, for the collector
 };
 
 int vm_init(struct vm *vm);
 int vm_free(struct vm *vm);
 int vm_interpret(struct vm *vm, const char *source);
 
+/** Run the top-level function of a script that is already compiled */
+int vm_interpret_function(struct vm *vm, struct object_function *function);
+
+/**
+ * Call the closure on @p vm's stack below its @p arg_count arguments and run it to completion
+ *
+ * The stack must hold nothing else.  The result is discarded.
+ */
+int vm_call(struct vm *vm, int arg_count);
+
+/**
+ * Suspend the running coroutine once the native being called returns
+ *
+ * The native's result goes to whatever resumed the coroutine, and the call
+ * evaluates to the value the coroutine is next resumed with.  Only for
+ * natives called while vm->coroutine is set.
+ */
+void vm_suspend(struct vm *vm);
+
+/** Run a script compiled by bytecode_write() */
+int vm_interpret_bytecode(struct vm *vm, const uint8_t *data, size_t size);
+
+/** Run the bytecode file at @p path, mapping it rather than reading it */
+int vm_interpret_bytecode_file(struct vm *vm, const char *path);
+
 struct object_string *vm_intern_string(struct vm *vm, const char *s, size_t len);
+int vm_global_slot(struct vm *vm, const char *name, size_t length);
 #endif